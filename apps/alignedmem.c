@@ -23,7 +23,7 @@ efi_status_t efi_allocate_pages_aligned(unsigned long size, unsigned long *addr,
 					unsigned long max, unsigned long align,
 					int memory_type)
 {
-	efi_physical_addr_t alloc_addr;
+	EFI_PHYSICAL_ADDRESS alloc_addr;
 	efi_status_t status;
 	int slack;
 
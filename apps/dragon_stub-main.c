@@ -14,10 +14,6 @@ efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab)
 	/* addr/point and size pairs for memory management*/
 	char *cmdline_ptr = NULL;
 
-	print_dragonstub_banner();
-
-	efi_info("EFI env initialized\n");
-
 	/*
 	 * Get a handle to the loaded image protocol.  This is used to get
 	 * information about the running image, such as size and the command
@@ -27,27 +23,42 @@ efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab)
 			     (void *)&loaded_image);
 
 	if (EFI_ERROR(status)) {
-		efi_err("Could not open loaded image protocol: %d\n", status);
+		efi_err("Could not open loaded image protocol: 0x%lx\n", status);
 		return status;
 	}
 
-	efi_info("Loaded image protocol opened\n");
-
+	boot_ts_begin(DRAGONSTUB_PHASE_CMDLINE);
 	status = efi_handle_cmdline(loaded_image, &cmdline_ptr);
+	boot_ts_end(DRAGONSTUB_PHASE_CMDLINE);
 
 	if (EFI_ERROR(status)) {
-		efi_err("Could not get command line: %d\n", status);
+		efi_err("Could not get command line: 0x%lx\n", status);
 		return status;
 	}
+
+	/*
+	 * 命令行中可能有quiet、loglevel=等选项，因此在处理完命令行之后
+	 * 才输出banner
+	 */
+	boot_ts_begin(DRAGONSTUB_PHASE_BANNER);
+	print_dragonstub_banner();
+	boot_ts_end(DRAGONSTUB_PHASE_BANNER);
+
+	efi_info("EFI env initialized\n");
+	efi_info("Loaded image protocol opened\n");
+
 	if (cmdline_ptr == NULL)
 		efi_warn("Command line is NULL\n");
 	else
 		efi_info("Command line: %s\n", cmdline_ptr);
 
 	struct payload_info payload;
-	status = find_payload(image_handle, loaded_image, &payload);
+	boot_ts_begin(DRAGONSTUB_PHASE_FIND_PAYLOAD);
+	status = find_payload(image_handle, loaded_image, cmdline_ptr,
+			      &payload);
+	boot_ts_end(DRAGONSTUB_PHASE_FIND_PAYLOAD);
 	if (EFI_ERROR(status)) {
-		efi_err("Could not find payload, efi error code: %d\n", status);
+		efi_err("Could not find payload, efi error code: 0x%lx\n", status);
 		return status;
 	}
 	efi_info("Booting DragonOS kernel...\n");
@@ -60,21 +71,24 @@ efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab)
 /// @brief Print thr DragonStub banner
 void print_dragonstub_banner(void)
 {
-	efi_printk(
+	if (!efi_log_enabled(LOGLEVEL_NOTICE))
+		return;
+
+	efi_log(LOGLEVEL_NOTICE,
 		" ____                              ____  _         _     \n");
-	efi_printk(
+	efi_log(LOGLEVEL_NOTICE,
 		"|  _ \\ _ __ __ _  __ _  ___  _ __ / ___|| |_ _   _| |__  \n");
-	efi_printk(
+	efi_log(LOGLEVEL_NOTICE,
 		"| | | | '__/ _` |/ _` |/ _ \\| '_ \\\\___ \\| __| | | | '_ \\ \n");
-	efi_printk(
+	efi_log(LOGLEVEL_NOTICE,
 		"| |_| | | | (_| | (_| | (_) | | | |___) | |_| |_| | |_) |\n");
-	efi_printk(
+	efi_log(LOGLEVEL_NOTICE,
 		"|____/|_|  \\__,_|\\__, |\\___/|_| |_|____/ \\__|\\__,_|_.__/ \n");
-	efi_printk(
+	efi_log(LOGLEVEL_NOTICE,
 		"                 |___/                                   \n");
 
-	efi_printk("\n@Copyright 2022-2023 DragonOS Community.\n");
-	efi_printk(
+	efi_log(LOGLEVEL_NOTICE, "\n@Copyright 2022-2023 DragonOS Community.\n");
+	efi_log(LOGLEVEL_NOTICE,
 		"\nDragonStub official repo: https://github.com/DragonOS-Community/DragonStub\n");
-	efi_printk("\nDragonStub is licensed under GPLv2\n\n");
+	efi_log(LOGLEVEL_NOTICE, "\nDragonStub is licensed under GPLv2\n\n");
 }
@@ -0,0 +1,782 @@
+#include <dragonstub/dragonstub.h>
+#include <dragonstub/linux/math.h>
+#include <dragonstub/linux/sizes.h>
+#include <dragonstub/minmax.h>
+#include <libfdt.h>
+#include <libfdt_internal.h>
+
+/*
+ * 设备树overlay（.dtbo）
+ *
+ * overlay来自编译时嵌入的.dtbo（make DTBO="a.dtbo b.dtbo"）和命令行中的
+ * dtbo=<path>，按这个顺序应用到固件提供的树上。合并之后的树放在新分配的
+ * 内存中，并留出update_fdt()需要的空间，之后可以直接在它上面修改/chosen。
+ *
+ * libfdt的fdt_overlay_apply()每次按phandle找目标节点、按标签找/__symbols__
+ * 中的节点都要从头遍历整棵树，每个overlay还要先遍历一次找最大的phandle。
+ * 这里遍历基础树建立一次索引（phandle到节点的偏移、标签到phandle、
+ * /__symbols__的偏移和最大的phandle），通过fdt_overlay_ops回答这些查找。
+ * 对树的修改也都经过索引，插入字节之后平移后面的偏移，所以一个索引可以
+ * 用于所有的overlay。
+ */
+
+/// @brief 最多应用这么多个overlay（嵌入的和dtbo=的总数）
+#define EFI_DTBO_MAX 64
+
+/// @brief 估算合并之后的树的大小时多留的空间，不够时加倍重试
+#define DTBO_SIZE_SLACK SZ_4K
+
+/// @brief 索引中phandle数组的初始容量，不够时加倍
+#define DTBO_MIN_CAPACITY 64
+
+/// @brief 解析标签时节点路径的最大长度和树的最大深度，超过的节点不解析
+#define DTBO_PATH_MAX 256
+#define DTBO_MAX_DEPTH 32
+
+/// @brief 一个phandle和它所在的节点
+struct dtbo_phandle {
+	u32 phandle;
+	int offset;
+};
+
+/// @brief /__symbols__中的一个标签
+struct dtbo_symbol {
+	/// @brief 标签（属性名）在字符串块中的偏移，字符串块只会在末尾追加
+	int nameoff;
+	/// @brief 0表示没有解析出来，查找时退回libfdt的做法
+	u32 phandle;
+};
+
+/// @brief 基础树的索引，偏移随着树的修改更新
+struct dtbo_index {
+	/// @brief 按phandle排序
+	struct dtbo_phandle *phandles;
+	u32 nr_phandles;
+	u32 cap_phandles;
+	/// @brief 按标签排序
+	struct dtbo_symbol *symbols;
+	u32 nr_symbols;
+	/// @brief /__symbols__的偏移，没有时是-FDT_ERR_NOTFOUND
+	int symbols_node;
+	u32 max_phandle;
+};
+
+/// @brief 一个要应用的overlay
+struct dtbo {
+	const void *data;
+	u32 size;
+	/// @brief 命令行中的路径，嵌入的overlay为NULL
+	char *path;
+	/// @brief 应用失败，重新开始时跳过它
+	bool failed;
+};
+
+/// @brief 把phandle数组的容量加倍（至少DTBO_MIN_CAPACITY项）
+static bool index_grow(struct dtbo_index *idx)
+{
+	u32 cap = max_t(u32, idx->cap_phandles * 2, DTBO_MIN_CAPACITY);
+	struct dtbo_phandle *new;
+
+	if (efi_bs_call(AllocatePool, EfiLoaderData, cap * sizeof(*new),
+			(void **)&new) != EFI_SUCCESS)
+		return false;
+	if (idx->phandles) {
+		memcpy(new, idx->phandles, idx->nr_phandles * sizeof(*new));
+		efi_bs_call(FreePool, idx->phandles);
+	}
+	idx->phandles = new;
+	idx->cap_phandles = cap;
+	return true;
+}
+
+static bool is_phandle_prop(const char *name)
+{
+	return !strcmp(name, "phandle") || !strcmp(name, "linux,phandle");
+}
+
+static int dtbo_phandle_cmp(const void *a, const void *b)
+{
+	const struct dtbo_phandle *l = a, *r = b;
+
+	if (l->phandle != r->phandle)
+		return l->phandle < r->phandle ? -1 : 1;
+	return l->offset - r->offset;
+}
+
+/// @brief 二分查找@phandle，没有找到时返回应该插入的位置的相反数减一
+static int index_find(const struct dtbo_index *idx, u32 phandle)
+{
+	u32 lo = 0, hi = idx->nr_phandles;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (idx->phandles[mid].phandle < phandle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < idx->nr_phandles && idx->phandles[lo].phandle == phandle)
+		return lo;
+	return -(int)lo - 1;
+}
+
+/**
+ * index_scan_phandles() - 遍历一次树，记下所有的phandle和/__symbols__
+ *
+ * 一个节点同时有phandle和linux,phandle，或者（错误地）有多个节点使用同一个
+ * phandle时，只保留树中的第一个，与fdt_node_offset_by_phandle()一致。
+ */
+static int index_scan_phandles(struct dtbo_index *idx, const void *fdt)
+{
+	int offset = 0, next, node = 0, depth = 0;
+	u32 tag, n = 0;
+
+	do {
+		const struct fdt_property *prop;
+		const struct fdt_node_header *nh;
+		const char *name;
+		u32 phandle;
+
+		tag = fdt_next_tag(fdt, offset, &next);
+		switch (tag) {
+		case FDT_BEGIN_NODE:
+			node = offset;
+			nh = fdt_offset_ptr_(fdt, offset);
+			if (++depth == 2 && !strcmp(nh->name, "__symbols__"))
+				idx->symbols_node = offset;
+			break;
+		case FDT_END_NODE:
+			depth--;
+			break;
+		case FDT_PROP:
+			prop = fdt_offset_ptr_(fdt, offset);
+			if (fdt32_to_cpu(prop->len) != sizeof(fdt32_t))
+				break;
+			name = fdt_string(fdt, fdt32_to_cpu(prop->nameoff));
+			if (!name)
+				return -FDT_ERR_BADSTRUCTURE;
+			if (!is_phandle_prop(name))
+				break;
+			phandle = fdt32_ld_((const fdt32_t *)prop->data);
+			if (!phandle || phandle == (u32)-1)
+				break;
+			if (idx->nr_phandles == idx->cap_phandles &&
+			    !index_grow(idx))
+				return -FDT_ERR_NOSPACE;
+			idx->phandles[idx->nr_phandles].phandle = phandle;
+			idx->phandles[idx->nr_phandles++].offset = node;
+			idx->max_phandle = max(idx->max_phandle, phandle);
+			break;
+		case FDT_END:
+			if (next < 0)
+				return next;
+			break;
+		case FDT_NOP:
+			break;
+		default:
+			return next < 0 ? next : -FDT_ERR_BADSTRUCTURE;
+		}
+		offset = next;
+	} while (tag != FDT_END);
+
+	sort(idx->phandles, idx->nr_phandles, sizeof(*idx->phandles),
+	     dtbo_phandle_cmp, NULL);
+	for (u32 i = 0; i < idx->nr_phandles; i++) {
+		if (n &&
+		    idx->phandles[n - 1].phandle == idx->phandles[i].phandle)
+			continue;
+		idx->phandles[n++] = idx->phandles[i];
+	}
+	idx->nr_phandles = n;
+	return 0;
+}
+
+/// @brief 解析标签时使用的/__symbols__中的一项
+struct dtbo_symbol_path {
+	const char *path;
+	u32 symbol;
+};
+
+static int dtbo_symbol_path_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dtbo_symbol_path *)a)->path,
+		      ((const struct dtbo_symbol_path *)b)->path);
+}
+
+/// @brief 从@stack中的各级节点拼出第@depth层节点的路径，太长时返回-1
+static int node_path(const void *fdt, const int *stack, int depth, char *buf)
+{
+	int len = 0;
+
+	for (int i = 1; i < depth; i++) {
+		const struct fdt_node_header *nh =
+			fdt_offset_ptr_(fdt, stack[i]);
+		int n = strlen(nh->name);
+
+		if (len + 1 + n >= DTBO_PATH_MAX)
+			return -1;
+		buf[len++] = '/';
+		memcpy(buf + len, nh->name, n);
+		len += n;
+	}
+	if (!len)
+		buf[len++] = '/';
+	buf[len] = '\0';
+	return len;
+}
+
+/**
+ * index_resolve_symbols() - 找出/__symbols__中每个标签指向的节点的phandle
+ *
+ * 标签按路径排序之后再遍历一次树，只在有phandle的节点上拼出路径并二分查找，
+ * 而不是为每个标签调用fdt_path_offset()从头遍历。
+ */
+static int index_resolve_symbols(struct dtbo_index *idx, const void *fdt,
+				 struct dtbo_symbol_path *paths)
+{
+	int stack[DTBO_MAX_DEPTH];
+	char buf[DTBO_PATH_MAX];
+	int offset = 0, next, depth = 0;
+	u32 tag;
+
+	for (;;) {
+		const struct fdt_property *prop;
+		struct dtbo_symbol_path key = { .path = buf };
+		const char *name;
+		u32 lo, hi;
+
+		tag = fdt_next_tag(fdt, offset, &next);
+		if (tag == FDT_END)
+			return next < 0 ? next : 0;
+		if (tag == FDT_BEGIN_NODE && depth++ < DTBO_MAX_DEPTH)
+			stack[depth - 1] = offset;
+		if (tag == FDT_END_NODE)
+			depth--;
+		prop = fdt_offset_ptr_(fdt, offset);
+		offset = next;
+		if (tag != FDT_PROP || depth > DTBO_MAX_DEPTH ||
+		    fdt32_to_cpu(prop->len) != sizeof(fdt32_t))
+			continue;
+		name = fdt_string(fdt, fdt32_to_cpu(prop->nameoff));
+		if (!name || !is_phandle_prop(name) ||
+		    node_path(fdt, stack, depth, buf) < 0)
+			continue;
+
+		lo = 0;
+		hi = idx->nr_symbols;
+		while (lo < hi) {
+			u32 mid = lo + (hi - lo) / 2;
+
+			if (dtbo_symbol_path_cmp(&paths[mid], &key) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		/* 多个标签可能指向同一个节点 */
+		for (; lo < idx->nr_symbols && !strcmp(paths[lo].path, buf);
+		     lo++)
+			idx->symbols[paths[lo].symbol].phandle =
+				fdt32_ld_((const fdt32_t *)prop->data);
+	}
+}
+
+/// @brief dtbo_symbol_cmp()比较的标签所在的树，sort()的比较函数没有上下文参数
+static const void *symbol_cmp_fdt;
+
+static int dtbo_symbol_cmp(const void *a, const void *b)
+{
+	return strcmp(fdt_string(symbol_cmp_fdt,
+				 ((const struct dtbo_symbol *)a)->nameoff),
+		      fdt_string(symbol_cmp_fdt,
+				 ((const struct dtbo_symbol *)b)->nameoff));
+}
+
+/// @brief 取出/__symbols__中的标签，解析之后按标签排序
+static int index_scan_symbols(struct dtbo_index *idx, const void *fdt)
+{
+	struct dtbo_symbol_path *paths;
+	u32 nr = 0;
+	int offset, err;
+
+	fdt_for_each_property_offset(offset, fdt, idx->symbols_node)
+		nr++;
+	if (!nr)
+		return 0;
+
+	if (efi_bs_call(AllocatePool, EfiLoaderData, nr * sizeof(*idx->symbols),
+			(void **)&idx->symbols) != EFI_SUCCESS)
+		return -FDT_ERR_NOSPACE;
+	if (efi_bs_call(AllocatePool, EfiLoaderData, nr * sizeof(*paths),
+			(void **)&paths) != EFI_SUCCESS)
+		return -FDT_ERR_NOSPACE;
+
+	fdt_for_each_property_offset(offset, fdt, idx->symbols_node) {
+		const struct fdt_property *prop = fdt_offset_ptr_(fdt, offset);
+		int len = fdt32_to_cpu(prop->len);
+
+		/* 有问题的项交给libfdt去报错 */
+		if (!fdt_string(fdt, fdt32_to_cpu(prop->nameoff)) || len < 1 ||
+		    memchr(prop->data, '\0', len) != prop->data + len - 1)
+			continue;
+		idx->symbols[idx->nr_symbols].nameoff =
+			fdt32_to_cpu(prop->nameoff);
+		idx->symbols[idx->nr_symbols].phandle = 0;
+		paths[idx->nr_symbols].path = prop->data;
+		paths[idx->nr_symbols].symbol = idx->nr_symbols;
+		idx->nr_symbols++;
+	}
+
+	sort(paths, idx->nr_symbols, sizeof(*paths), dtbo_symbol_path_cmp,
+	     NULL);
+	err = index_resolve_symbols(idx, fdt, paths);
+	efi_bs_call(FreePool, paths);
+	if (err)
+		return err;
+
+	symbol_cmp_fdt = fdt;
+	sort(idx->symbols, idx->nr_symbols, sizeof(*idx->symbols),
+	     dtbo_symbol_cmp, NULL);
+	return 0;
+}
+
+static void index_free(struct dtbo_index *idx)
+{
+	if (idx->phandles)
+		efi_bs_call(FreePool, idx->phandles);
+	if (idx->symbols)
+		efi_bs_call(FreePool, idx->symbols);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/// @brief 为@fdt建立索引，只遍历一次树，有/__symbols__时再遍历一次
+static int index_build(struct dtbo_index *idx, const void *fdt)
+{
+	int err;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->symbols_node = -FDT_ERR_NOTFOUND;
+
+	err = index_scan_phandles(idx, fdt);
+	if (!err && idx->symbols_node >= 0)
+		err = index_scan_symbols(idx, fdt);
+	if (err)
+		index_free(idx);
+	return err;
+}
+
+/// @brief 在@pos之后插入（@delta为负时是删除）了字节，平移之后的偏移
+static void index_shift(struct dtbo_index *idx, int pos, int delta)
+{
+	if (!delta)
+		return;
+	for (u32 i = 0; i < idx->nr_phandles; i++) {
+		if (idx->phandles[i].offset > pos)
+			idx->phandles[i].offset += delta;
+	}
+	if (idx->symbols_node > pos)
+		idx->symbols_node += delta;
+}
+
+/// @brief 标签的定义被改写了，之后按libfdt的做法查找它
+static void index_forget_symbol(struct dtbo_index *idx, const void *fdt,
+				const char *label)
+{
+	for (u32 i = 0; i < idx->nr_symbols; i++) {
+		if (!strcmp(fdt_string(fdt, idx->symbols[i].nameoff), label))
+			idx->symbols[i].phandle = 0;
+	}
+}
+
+static int index_max_phandle(void *ctx, const void *fdt __always_unused,
+			     uint32_t *phandle)
+{
+	*phandle = ((struct dtbo_index *)ctx)->max_phandle;
+	return 0;
+}
+
+/**
+ * index_node_offset_by_phandle() - 按phandle查找节点
+ *
+ * 前面的overlay合并进来的节点不在索引中，overlay也可能改写已有节点的phandle，
+ * 所以找到的节点要核对它的phandle，对不上时退回fdt_node_offset_by_phandle()，
+ * 并把结果记入索引。
+ */
+static int index_node_offset_by_phandle(void *ctx, const void *fdt,
+					uint32_t phandle)
+{
+	struct dtbo_index *idx = ctx;
+	int i = index_find(idx, phandle);
+	int offset;
+
+	if (i >= 0 &&
+	    fdt_get_phandle(fdt, idx->phandles[i].offset) == phandle)
+		return idx->phandles[i].offset;
+
+	offset = fdt_node_offset_by_phandle(fdt, phandle);
+	if (offset < 0)
+		return offset;
+
+	if (i >= 0) {
+		idx->phandles[i].offset = offset;
+	} else if (idx->nr_phandles < idx->cap_phandles || index_grow(idx)) {
+		i = -i - 1;
+		memmove(&idx->phandles[i + 1], &idx->phandles[i],
+			(idx->nr_phandles - i) * sizeof(*idx->phandles));
+		idx->phandles[i].phandle = phandle;
+		idx->phandles[i].offset = offset;
+		idx->nr_phandles++;
+	}
+	return offset;
+}
+
+static int index_symbols_offset(void *ctx, const void *fdt __always_unused)
+{
+	return ((struct dtbo_index *)ctx)->symbols_node;
+}
+
+static int index_symbol_phandle(void *ctx, const void *fdt, const char *label,
+				uint32_t *phandle)
+{
+	struct dtbo_index *idx = ctx;
+	u32 lo = 0, hi = idx->nr_symbols;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(fdt_string(fdt, idx->symbols[mid].nameoff),
+				 label);
+
+		if (!cmp) {
+			*phandle = idx->symbols[mid].phandle;
+			return *phandle ? 0 : -FDT_ERR_NOTFOUND;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -FDT_ERR_NOTFOUND;
+}
+
+/*
+ * 修改已有的属性时，字节从属性所在的位置开始变化；新增的属性插入在节点名
+ * 之后。两种情况下，位置之后的节点都要平移。
+ */
+static int index_setprop_placeholder(void *ctx, void *fdt, int nodeoffset,
+				     const char *name, int len,
+				     void **prop_data)
+{
+	struct dtbo_index *idx = ctx;
+	int size = fdt_size_dt_struct(fdt);
+	const struct fdt_property *old;
+	int pos = nodeoffset, ret;
+
+	old = fdt_get_property(fdt, nodeoffset, name, NULL);
+	if (old) {
+		pos = (const char *)old -
+		      (const char *)fdt_offset_ptr_(fdt, 0);
+		if (nodeoffset == idx->symbols_node)
+			index_forget_symbol(idx, fdt, name);
+	}
+
+	ret = fdt_setprop_placeholder(fdt, nodeoffset, name, len, prop_data);
+	if (!ret)
+		index_shift(idx, pos, fdt_size_dt_struct(fdt) - size);
+	return ret;
+}
+
+/// @brief 新的子节点插入在父节点的属性之后，原来在这个位置的节点也要平移
+static int index_add_subnode(void *ctx, void *fdt, int parentoffset,
+			     const char *name)
+{
+	struct dtbo_index *idx = ctx;
+	int size = fdt_size_dt_struct(fdt);
+	int ret;
+
+	ret = fdt_add_subnode(fdt, parentoffset, name);
+	if (ret < 0)
+		return ret;
+
+	index_shift(idx, ret - 1, fdt_size_dt_struct(fdt) - size);
+	if (parentoffset == 0 && !strcmp(name, "__symbols__"))
+		idx->symbols_node = ret;
+	return ret;
+}
+
+static const struct fdt_overlay_ops index_ops = {
+	.max_phandle = index_max_phandle,
+	.node_offset_by_phandle = index_node_offset_by_phandle,
+	.symbols_offset = index_symbols_offset,
+	.symbol_phandle = index_symbol_phandle,
+	.setprop_placeholder = index_setprop_placeholder,
+	.add_subnode = index_add_subnode,
+};
+
+/// @brief 读出@data处的FDT头中的totalsize，不要求对齐
+static u32 dtbo_totalsize(const void *data, u64 avail)
+{
+	struct fdt_header hdr;
+
+	if (avail < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (fdt32_to_cpu(hdr.magic) != FDT_MAGIC ||
+	    fdt32_to_cpu(hdr.totalsize) < sizeof(hdr) ||
+	    fdt32_to_cpu(hdr.totalsize) > avail)
+		return 0;
+	return fdt32_to_cpu(hdr.totalsize);
+}
+
+/**
+ * find_embedded_dtbos() - 找出make DTBO=嵌入的overlay
+ *
+ * 它们被直接拼接在一起，每个的大小来自自己的FDT头。
+ */
+static int find_embedded_dtbos(struct dtbo *dtbos)
+{
+	extern __weak void _binary_dtbo_bin_start(void);
+	extern __weak void _binary_dtbo_bin_end(void);
+	const u8 *p = (const u8 *)_binary_dtbo_bin_start;
+	const u8 *end = (const u8 *)_binary_dtbo_bin_end;
+	int nr = 0;
+
+	if (!p || end <= p)
+		return 0;
+
+	while (p < end) {
+		u32 size = dtbo_totalsize(p, end - p);
+
+		if (!size) {
+			efi_err("Invalid embedded device tree overlay at offset 0x%lx\n",
+				p - (const u8 *)_binary_dtbo_bin_start);
+			break;
+		}
+		if (nr == EFI_DTBO_MAX) {
+			efi_err("Too many device tree overlays, at most %d\n",
+				EFI_DTBO_MAX);
+			break;
+		}
+		dtbos[nr].data = p;
+		dtbos[nr].size = size;
+		dtbos[nr].path = NULL;
+		dtbos[nr].failed = false;
+		nr++;
+		p += size;
+	}
+	return nr;
+}
+
+/// @brief 读入启动卷上的@path，失败时返回false
+static bool load_dtbo_file(efi_loaded_image_t *image, char *path,
+			   struct dtbo *dtbo)
+{
+	struct efi_file file;
+	void *buf;
+	u32 size;
+
+	if (efi_open_file(image, path, &file) != EFI_SUCCESS)
+		return false;
+	if (file.size > UINT32_MAX ||
+	    efi_bs_call(AllocatePool, EfiLoaderData, file.size, &buf) !=
+		    EFI_SUCCESS) {
+		efi_err("Failed to allocate %llu bytes for %s\n", file.size,
+			path);
+		efi_file_close(&file);
+		return false;
+	}
+	if (efi_file_read_at(&file, 0, buf, file.size) != EFI_SUCCESS) {
+		efi_err("Failed to read %s\n", path);
+		goto fail;
+	}
+	size = dtbo_totalsize(buf, file.size);
+	if (!size) {
+		efi_err("%s is not a device tree overlay\n", path);
+		goto fail;
+	}
+	efi_file_close(&file);
+
+	dtbo->data = buf;
+	dtbo->size = size;
+	dtbo->path = path;
+	dtbo->failed = false;
+	return true;
+fail:
+	efi_bs_call(FreePool, buf);
+	efi_file_close(&file);
+	return false;
+}
+
+/**
+ * load_dtbo_files() - 读入命令行中dtbo=指定的文件，追加到@dtbos的第@nr项之后
+ *
+ * 与dtb=一样，安全启动时不使用命令行指定的设备树数据。读不出来的文件跳过。
+ */
+static int load_dtbo_files(efi_loaded_image_t *image, const char *cmdline,
+			   struct dtbo *dtbos, int nr)
+{
+	char *path;
+
+	for (int i = 0;; i++) {
+		if (efi_cmdline_get_option(cmdline, "dtbo", i, &path) !=
+		    EFI_SUCCESS)
+			break;
+		if (efi_get_secureboot() != efi_secureboot_mode_disabled) {
+			efi_err("Ignoring device tree overlays from command line.\n");
+			efi_bs_call(FreePool, path);
+			break;
+		}
+		if (nr == EFI_DTBO_MAX) {
+			efi_err("Too many device tree overlays, at most %d\n",
+				EFI_DTBO_MAX);
+			efi_bs_call(FreePool, path);
+			break;
+		}
+		if (load_dtbo_file(image, path, &dtbos[nr]))
+			nr++;
+		else
+			efi_bs_call(FreePool, path);
+	}
+	return nr;
+}
+
+/**
+ * apply_dtbos() - 把@fdt（可以为NULL）复制到@buf中，按顺序应用所有的overlay
+ * @scratch:	应用时使用的overlay的副本，libfdt会修改它
+ *
+ * 应用失败的overlay会破坏树，这时标记它，再从头开始。
+ *
+ * Return:	应用了的overlay数，空间不够时返回-FDT_ERR_NOSPACE
+ */
+static int apply_dtbos(const void *fdt, void *buf, u32 size,
+		       struct dtbo *dtbos, int nr, void *scratch)
+{
+	struct dtbo_index idx;
+	int applied, err, i;
+	bool indexed;
+
+restart:
+	err = fdt ? fdt_open_into(fdt, buf, size) :
+		    fdt_create_empty_tree(buf, size);
+	if (err)
+		return err;
+
+	/* 建不起索引也能应用，只是每次查找都遍历树 */
+	err = index_build(&idx, buf);
+	indexed = !err;
+	if (err)
+		efi_warn("Failed to index the FDT for overlays: %d\n", err);
+
+	for (i = 0, applied = 0; i < nr; i++) {
+		u32 ov_max = 0;
+
+		if (dtbos[i].failed)
+			continue;
+
+		memcpy(scratch, dtbos[i].data, dtbos[i].size);
+		err = fdt_check_header(scratch);
+		if (!err)
+			err = fdt_find_max_phandle(scratch, &ov_max);
+		if (!err)
+			err = fdt_overlay_apply_ops(buf, scratch,
+						    indexed ? &index_ops : NULL,
+						    &idx);
+		if (err == -FDT_ERR_NOSPACE) {
+			index_free(&idx);
+			return err;
+		}
+		if (err) {
+			if (dtbos[i].path)
+				efi_err("Failed to apply device tree overlay %s: %d\n",
+					dtbos[i].path, err);
+			else
+				efi_err("Failed to apply embedded device tree overlay %d: %d\n",
+					i, err);
+			dtbos[i].failed = true;
+			index_free(&idx);
+			goto restart;
+		}
+		/* overlay中的phandle都加上了原来最大的phandle */
+		idx.max_phandle += ov_max;
+		applied++;
+	}
+
+	index_free(&idx);
+	return applied;
+}
+
+efi_status_t efi_fdt_apply_overlays(efi_loaded_image_t *image,
+				    const char *cmdline, unsigned long headroom,
+				    unsigned long *fdt_addr,
+				    unsigned long *fdt_size)
+{
+	struct dtbo dtbos[EFI_DTBO_MAX];
+	const void *fdt = (const void *)*fdt_addr;
+	unsigned long base = 0, size;
+	efi_status_t status;
+	void *scratch = NULL;
+	u32 max_size = 0;
+	int nr, ret = 0;
+
+	nr = find_embedded_dtbos(dtbos);
+	nr = load_dtbo_files(image, cmdline, dtbos, nr);
+	if (!nr)
+		return EFI_NOT_READY;
+
+	size = headroom + DTBO_SIZE_SLACK;
+	if (fdt) {
+		if (fdt_check_header(fdt)) {
+			efi_err("Invalid FDT, not applying device tree overlays\n");
+			status = EFI_LOAD_ERROR;
+			goto free_dtbos;
+		}
+		size += fdt_totalsize(fdt);
+	}
+	for (int i = 0; i < nr; i++) {
+		size += dtbos[i].size;
+		max_size = max(max_size, dtbos[i].size);
+	}
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData, max_size, &scratch);
+	if (status != EFI_SUCCESS)
+		goto free_dtbos;
+
+	for (;;) {
+		size = round_up(size, EFI_PAGE_SIZE);
+		if (size > INT32_MAX) {
+			status = EFI_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = efi_allocate_pages(size, &base, ULONG_MAX);
+		if (status != EFI_SUCCESS)
+			break;
+
+		ret = apply_dtbos(fdt, (void *)base, size, dtbos, nr, scratch);
+		if (ret != -FDT_ERR_NOSPACE)
+			break;
+		efi_free(size, base);
+		size *= 2;
+	}
+
+	if (status == EFI_SUCCESS && ret <= 0) {
+		efi_free(size, base);
+		if (ret < 0)
+			efi_err("Failed to copy the FDT for overlays: %d\n",
+				ret);
+		status = EFI_LOAD_ERROR;
+	}
+	if (status == EFI_SUCCESS) {
+		efi_info("Applied %d device tree overlays\n", ret);
+		*fdt_addr = base;
+		*fdt_size = size;
+	}
+
+	efi_bs_call(FreePool, scratch);
+free_dtbos:
+	for (int i = 0; i < nr; i++) {
+		if (!dtbos[i].path)
+			continue;
+		efi_bs_call(FreePool, (void *)dtbos[i].data);
+		efi_bs_call(FreePool, dtbos[i].path);
+	}
+	return status;
+}
@@ -1,5 +1,4 @@
 #include "elf.h"
-#include "dragonstub/linux-efi.h"
 #include "dragonstub/linux/align.h"
 #include "dragonstub/printk.h"
 #include "dragonstub/riscv64.h"
@@ -11,6 +10,8 @@
 #include <efilib.h>
 #include <dragonstub/dragonstub.h>
 #include <dragonstub/elfloader.h>
+#include <dragonstub/lz4.h>
+#include <dragonstub/sha256.h>
 
 /// @brief 校验ELF文件头
 /// @param buf 缓冲区
@@ -91,20 +92,23 @@ efi_status_t elf_get_header(const void *payload_start, u64 payload_size,
 
 static void print_elf_info(Elf64_Ehdr *ehdr)
 {
-	efi_info("ELF header:\n");
-	efi_printk("  e_type: %d\n", ehdr->e_type);
-	efi_printk("  e_machine: %d\n", ehdr->e_machine);
-	efi_printk("  e_version: %d\n", ehdr->e_version);
-	efi_printk("  e_entry: %p\n", ehdr->e_entry);
-	efi_printk("  e_phoff: %p\n", ehdr->e_phoff);
-	efi_printk("  e_shoff: %p\n", ehdr->e_shoff);
-	efi_printk("  e_flags: %d\n", ehdr->e_flags);
-	efi_printk("  e_ehsize: %d\n", ehdr->e_ehsize);
-	efi_printk("  e_phentsize: %d\n", ehdr->e_phentsize);
-	efi_printk("  e_phnum: %d\n", ehdr->e_phnum);
-	efi_printk("  e_shentsize: %d\n", ehdr->e_shentsize);
-	efi_printk("  e_shnum: %d\n", ehdr->e_shnum);
-	efi_printk("  e_shstrndx: %d\n", ehdr->e_shstrndx);
+	if (!efi_log_enabled(LOGLEVEL_DEBUG))
+		return;
+
+	efi_debug("ELF header:\n");
+	efi_log(LOGLEVEL_DEBUG, "  e_type: %d\n", ehdr->e_type);
+	efi_log(LOGLEVEL_DEBUG, "  e_machine: %d\n", ehdr->e_machine);
+	efi_log(LOGLEVEL_DEBUG, "  e_version: %d\n", ehdr->e_version);
+	efi_log(LOGLEVEL_DEBUG, "  e_entry: 0x%lx\n", ehdr->e_entry);
+	efi_log(LOGLEVEL_DEBUG, "  e_phoff: 0x%lx\n", ehdr->e_phoff);
+	efi_log(LOGLEVEL_DEBUG, "  e_shoff: 0x%lx\n", ehdr->e_shoff);
+	efi_log(LOGLEVEL_DEBUG, "  e_flags: %d\n", ehdr->e_flags);
+	efi_log(LOGLEVEL_DEBUG, "  e_ehsize: %d\n", ehdr->e_ehsize);
+	efi_log(LOGLEVEL_DEBUG, "  e_phentsize: %d\n", ehdr->e_phentsize);
+	efi_log(LOGLEVEL_DEBUG, "  e_phnum: %d\n", ehdr->e_phnum);
+	efi_log(LOGLEVEL_DEBUG, "  e_shentsize: %d\n", ehdr->e_shentsize);
+	efi_log(LOGLEVEL_DEBUG, "  e_shnum: %d\n", ehdr->e_shnum);
+	efi_log(LOGLEVEL_DEBUG, "  e_shstrndx: %d\n", ehdr->e_shstrndx);
 }
 
 static efi_status_t parse_phdrs(const void *payload_start, u64 payload_size,
@@ -116,7 +120,7 @@ static efi_status_t parse_phdrs(const void *payload_start, u64 payload_size,
 		return EFI_INVALID_PARAMETER;
 	}
 	if (ehdr->e_phentsize != sizeof(Elf64_Phdr)) {
-		efi_err("Invalid program header size: %d, expected %d\n",
+		efi_err("Invalid program header size: %d, expected %zu\n",
 			ehdr->e_phentsize, sizeof(Elf64_Phdr));
 		return EFI_INVALID_PARAMETER;
 	}
@@ -165,7 +169,7 @@ static efi_status_t parse_phdrs(const void *payload_start, u64 payload_size,
  * checking that the first and the last byte of the image are covered by the
  * same EFI memory map entry.
  */
-static bool check_image_region(u64 base, u64 size)
+static bool __maybe_unused check_image_region(u64 base, u64 size)
 {
 	struct efi_boot_memmap *map;
 	efi_status_t status;
@@ -191,8 +195,6 @@ static bool check_image_region(u64 base, u64 size)
 		}
 	}
 
-	efi_bs_call(FreePool, map);
-
 	return ret;
 }
 
@@ -234,7 +236,7 @@ void efi_remap_image_all_rwx(unsigned long image_base, unsigned alloc_size)
 		return;
 	}
 
-	efi_debug("Current attributes for image region: 0x%lx\n", attr);
+	efi_debug("Current attributes for image region: 0x%llx\n", attr);
 
 	// If the entire region was already mapped as non-exec, clear the
 	// attribute from the code region. Otherwise, set it on the data
@@ -261,13 +263,48 @@ void efi_remap_image_all_rwx(unsigned long image_base, unsigned alloc_size)
 	}
 }
 
+/// @brief 内核内存的对齐（2MB），这样内核可以用大页映射自己
+#define KERNEL_MEM_ALIGN (1ULL << 21)
+
+/**
+ * allocate_kernel_block() - 为内核分配一块内存，优先放在链接时的物理地址
+ * @link_paddr:	这块内存起始处对应的p_paddr（KERNEL_MEM_ALIGN对齐）
+ * @size:	大小
+ * @ret_paddr:	返回分配到的地址
+ *
+ * 内核被加载到链接时的物理地址时，可以省去早期的自重定位，直接使用固定的
+ * 恒等映射。那里已经被占用（或者根本不是内存）时，再分配任意一块
+ * KERNEL_MEM_ALIGN对齐的内存。
+ */
+static efi_status_t allocate_kernel_block(u64 link_paddr, u64 size,
+					  u64 *ret_paddr)
+{
+	unsigned long paddr;
+	efi_status_t status;
+
+	status = efi_allocate_pages_exact(size, link_paddr);
+	if (status == EFI_SUCCESS) {
+		efi_info("Kernel memory placed at its link-time address 0x%llx\n",
+			 link_paddr);
+		*ret_paddr = link_paddr;
+		return EFI_SUCCESS;
+	}
+
+	efi_info("Link-time address 0x%llx of the kernel is not available (0x%lx), relocating it\n",
+		 link_paddr, status);
+	status = efi_allocate_pages_aligned(size, &paddr, UINT64_MAX,
+					    KERNEL_MEM_ALIGN, EfiLoaderData);
+	if (status == EFI_SUCCESS)
+		*ret_paddr = paddr;
+	return status;
+}
+
 efi_status_t efi_allocate_kernel_memory(const Elf64_Phdr *phdr_start,
 					u32 phdrs_nr, u64 *ret_paddr,
 					u64 *ret_size, u64 *ret_min_paddr,
 					u64 *ret_max_paddr, u64 *ret_min_vaddr)
 {
 	efi_status_t status = EFI_SUCCESS;
-	const u64 KERNEL_MEM_ALIGN = 1 << 21; // 2MB
 
 	const Elf64_Phdr *phdr = phdr_start;
 
@@ -281,7 +318,7 @@ efi_status_t efi_allocate_kernel_memory(const Elf64_Phdr *phdr_start,
 		}
 
 		if (phdr->p_align & !EFI_PAGE_SIZE) {
-			efi_err("ELF segment alignment should be multiple of EFI_PAGE_SIZE(%d), but got %d\n",
+			efi_err("ELF segment alignment should be multiple of EFI_PAGE_SIZE(%d), but got %lu\n",
 				EFI_PAGE_SIZE, phdr->p_align);
 			return EFI_INVALID_PARAMETER;
 		}
@@ -292,18 +329,16 @@ efi_status_t efi_allocate_kernel_memory(const Elf64_Phdr *phdr_start,
 	}
 
 	if (min_paddr & (KERNEL_MEM_ALIGN - 1)) {
-		efi_err("min_paddr should be aligned to KERNEL_MEM_ALIGN(%d), but got %p\n",
+		efi_err("min_paddr should be aligned to KERNEL_MEM_ALIGN(%llu), but got 0x%llx\n",
 			KERNEL_MEM_ALIGN, min_paddr);
 		return EFI_INVALID_PARAMETER;
 	}
 	u64 mem_size = ALIGN_UP(max_paddr - min_paddr, KERNEL_MEM_ALIGN);
 
-	status = efi_allocate_pages_aligned(mem_size, ret_paddr, UINT64_MAX,
-					    KERNEL_MEM_ALIGN, EfiLoaderData);
-	// status = efi_allocate_pages_exact(mem_size, paddr);
+	status = allocate_kernel_block(min_paddr, mem_size, ret_paddr);
 	if (status != EFI_SUCCESS) {
-		efi_err("Failed to allocate pages for ELF segment: status: %d, page_size=%d, min_paddr=%p, max_paddr=%p, mem_size=%d. Maybe an OOM error or section overlaps.\n",
-			status, KERNEL_MEM_ALIGN, ret_paddr, max_paddr,
+		efi_err("Failed to allocate pages for ELF segment: status: 0x%lx, page_size=%llu, min_paddr=0x%llx, max_paddr=0x%llx, mem_size=%llu. Maybe an OOM error or section overlaps.\n",
+			status, KERNEL_MEM_ALIGN, min_paddr, max_paddr,
 			mem_size);
 		return status;
 	}
@@ -312,41 +347,813 @@ efi_status_t efi_allocate_kernel_memory(const Elf64_Phdr *phdr_start,
 	*ret_min_paddr = min_paddr;
 	*ret_max_paddr = max_paddr;
 	*ret_min_vaddr = min_vaddr;
-	efi_info("Allocated kernel memory: paddr=%p, mem_size= %d bytes\n",
+	efi_info("Allocated kernel memory: paddr=0x%llx, mem_size= %llu bytes\n",
 		 *ret_paddr, mem_size);
-	// zeroed the memory
-	memset((void *)(*ret_paddr), 0, mem_size);
+	// 不在这里清零，load_program()只会清零不被段的文件内容覆盖的部分
 
 	efi_remap_image_all_rwx(*ret_paddr, mem_size);
 
 	return EFI_SUCCESS;
 }
 
-static efi_status_t load_program(const void *payload_start, u64 payload_size,
+/// @brief 内核内存中的一块连续区域（稀疏加载时每一簇相邻的段占用一块）
+struct kernel_region {
+	/// @brief 区域起始处对应的p_paddr
+	u64 link_paddr;
+	/// @brief 区域被分配到的物理地址
+	u64 paddr;
+	u64 size;
+};
+
+/**
+ * efi_allocate_kernel_regions() - 为相距较远的各簇段分别分配内存（efi=sparse）
+ * @phdr_start:		程序头表
+ * @phdrs_nr:		程序头的数量
+ * @regions:		至少有@phdrs_nr项，返回分配的各块区域，按p_paddr排序
+ * @ret_nr:		返回区域的数量
+ * @ret_min_vaddr:	返回最小的p_vaddr
+ *
+ * 每个段先扩展到KERNEL_MEM_ALIGN的边界，扩展之后相交或者相邻的段归为一簇，
+ * 分配一块KERNEL_MEM_ALIGN对齐的内存。簇内各段的相对位置、以及段在大页中的
+ * 偏移都与链接时相同；簇之间的空洞（至少KERNEL_MEM_ALIGN）既不分配也不清零。
+ */
+static efi_status_t efi_allocate_kernel_regions(const Elf64_Phdr *phdr_start,
+						u32 phdrs_nr,
+						struct kernel_region *regions,
+						u32 *ret_nr, u64 *ret_min_vaddr)
+{
+	const Elf64_Phdr *phdr = phdr_start;
+	u64 min_vaddr = UINT64_MAX;
+	u32 nr = 0, merged = 0;
+	efi_status_t status;
+
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		min_vaddr = min(min_vaddr, (u64)phdr->p_vaddr);
+		if (phdr->p_memsz == 0)
+			continue;
+
+		u64 start = ALIGN_DOWN(phdr->p_paddr, KERNEL_MEM_ALIGN);
+		u64 end = ALIGN_UP(phdr->p_paddr + phdr->p_memsz,
+				   KERNEL_MEM_ALIGN);
+		// 按起始地址插入排序，段的数量很少
+		u32 j = nr++;
+		for (; j > 0 && regions[j - 1].link_paddr > start; j--)
+			regions[j] = regions[j - 1];
+		regions[j] = (struct kernel_region){ .link_paddr = start,
+						     .paddr = 0,
+						     .size = end - start };
+	}
+	if (nr == 0)
+		return EFI_INVALID_PARAMETER;
+
+	for (u32 i = 0; i < nr; i++) {
+		struct kernel_region *r = &regions[i];
+		struct kernel_region *last = &regions[merged ? merged - 1 : 0];
+
+		if (merged && r->link_paddr <= last->link_paddr + last->size) {
+			last->size = max(last->size, r->link_paddr + r->size -
+							     last->link_paddr);
+			continue;
+		}
+		regions[merged++] = *r;
+	}
+
+	for (u32 i = 0; i < merged; i++) {
+		struct kernel_region *r = &regions[i];
+
+		status = allocate_kernel_block(r->link_paddr, r->size,
+					       &r->paddr);
+		if (status != EFI_SUCCESS) {
+			efi_err("Failed to allocate %llu bytes for kernel segments at 0x%llx\n",
+				r->size, r->link_paddr);
+			while (i--)
+				efi_free(regions[i].size, regions[i].paddr);
+			return status;
+		}
+		efi_remap_image_all_rwx(r->paddr, r->size);
+		efi_info("Allocated kernel region: link paddr=0x%llx, paddr=0x%llx, size=%llu bytes\n",
+			 r->link_paddr, r->paddr, r->size);
+	}
+
+	*ret_nr = merged;
+	*ret_min_vaddr = min_vaddr;
+	return EFI_SUCCESS;
+}
+
+/**
+ * place_segments() - 把程序头表副本中的p_paddr改成段被加载到的物理地址
+ * @placed:	程序头表的副本
+ * @phdrs_nr:	程序头的数量
+ * @regions:	分配好的内核内存
+ * @nr_regions:	@regions的项数
+ */
+static void place_segments(Elf64_Phdr *placed, u32 phdrs_nr,
+			   const struct kernel_region *regions, u32 nr_regions)
+{
+	for (u32 i = 0; i < phdrs_nr; ++i) {
+		Elf64_Phdr *phdr = &placed[i];
+
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		for (u32 j = 0; j < nr_regions; j++) {
+			const struct kernel_region *r = &regions[j];
+
+			if (phdr->p_paddr >= r->link_paddr &&
+			    phdr->p_paddr <= r->link_paddr + r->size) {
+				phdr->p_paddr = r->paddr +
+						(phdr->p_paddr - r->link_paddr);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * report_segments() - 在交给内核的配置表中记录每个PT_LOAD段被加载到的位置
+ * @tbl:	配置表
+ * @phdr_start:	程序头表
+ * @placed:	p_paddr加上@load_offset就是段被加载到的地址的程序头表
+ * @phdrs_nr:	程序头的数量
+ * @load_offset:	见@placed
+ *
+ * 所有段都位于链接时的物理地址时，设置DRAGONSTUB_PAYLOAD_EXACT。
+ */
+static void report_segments(struct dragonstub_payload_efi *tbl,
+			    const Elf64_Phdr *phdr_start,
+			    const Elf64_Phdr *placed, u32 phdrs_nr,
+			    u64 load_offset)
+{
+	bool exact = true;
+	u32 n = 0;
+
+	for (u32 i = 0; i < phdrs_nr; ++i) {
+		const Elf64_Phdr *phdr = &phdr_start[i];
+
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		tbl->segments[n++] = (struct dragonstub_payload_segment){
+			.vaddr = phdr->p_vaddr,
+			.link_paddr = phdr->p_paddr,
+			.paddr = load_offset + placed[i].p_paddr,
+			.size = phdr->p_memsz,
+			.flags = phdr->p_flags,
+		};
+		exact &= load_offset + placed[i].p_paddr == phdr->p_paddr;
+	}
+	tbl->nr_segments = n;
+	if (exact && n)
+		tbl->flags |= DRAGONSTUB_PAYLOAD_EXACT;
+}
+
+/// @brief 把解压出来的ELF文件内容分发到各个段时使用的上下文
+struct segment_stream_ctx {
+	const Elf64_Phdr *phdr_start;
+	u32 phdrs_nr;
+	/// @brief 段的p_paddr加上这个偏移，就是它被加载到的地址
+	u64 load_offset;
+	/// @brief 已经写入各个段的字节数
+	u64 loaded_bytes;
+	/// @brief 不为NULL时，在写入各个段的同时计算它们的摘要
+	struct sha256_state *sha;
+};
+
+/// @brief 如果ELF文件中[offset, offset + len)这一段完全落在某个段里面，
+/// 就返回它在内核内存中的地址，让解压器直接解压到那里
+static void *segment_stream_direct(void *_ctx, u64 offset, u64 len)
+{
+	struct segment_stream_ctx *ctx = _ctx;
+	const Elf64_Phdr *phdr = ctx->phdr_start;
+
+	for (u32 i = 0; i < ctx->phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (offset >= phdr->p_offset &&
+		    offset + len <= phdr->p_offset + phdr->p_filesz)
+			return (void *)(ctx->load_offset + phdr->p_paddr +
+					(offset - phdr->p_offset));
+	}
+	return NULL;
+}
+
+/// @brief 把ELF文件中[offset, offset + len)这一段复制到所有与它相交的段中
+static efi_status_t segment_stream_emit(void *_ctx, u64 offset,
+					const void *data, u64 len)
+{
+	struct segment_stream_ctx *ctx = _ctx;
+	const Elf64_Phdr *phdr = ctx->phdr_start;
+
+	for (u32 i = 0; i < ctx->phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+
+		u64 start = max(offset, (u64)phdr->p_offset);
+		u64 end = min(offset + len,
+			      (u64)(phdr->p_offset + phdr->p_filesz));
+		if (start >= end)
+			continue;
+
+		void *dst = (void *)(ctx->load_offset + phdr->p_paddr +
+				     (start - phdr->p_offset));
+		const void *src = data + (start - offset);
+		// dst == src说明已经被直接解压到这里了
+		if (ctx->sha)
+			sha256_copy(ctx->sha, dst, src, end - start);
+		else if (dst != src)
+			memcpy(dst, src, end - start);
+		ctx->loaded_bytes += end - start;
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+ * payload_read() - 从负载（解压后）的ELF文件的@offset处读取@size字节
+ */
+static efi_status_t payload_read(const struct payload_info *payload_info,
+				 u64 offset, void *buf, u64 size)
+{
+	const void *payload_start = (const void *)payload_info->payload_addr;
+
+	switch (payload_info->payload_type) {
+	case PAYLOAD_TYPE_LZ4:
+		return lz4_frame_read(payload_start, payload_info->payload_size,
+				      offset, buf, size);
+	case PAYLOAD_TYPE_ELF_FILE:
+		return efi_file_read_at((struct efi_file *)&payload_info->file,
+					offset, buf, size);
+	default:
+		if (offset > payload_info->payload_size ||
+		    size > payload_info->payload_size - offset)
+			return EFI_END_OF_FILE;
+		memcpy(buf, payload_start + offset, size);
+		return EFI_SUCCESS;
+	}
+}
+
+/**
+ * segments_in_file_order() - 检查各个PT_LOAD段在文件中是否按程序头表的顺序
+ * 排列并且互不重叠
+ *
+ * 只有这样，按文件偏移的顺序解压出来的数据才正好是按程序头表的顺序拼接的
+ * 各个段，可以在解压的同时计算摘要。
+ */
+static bool segments_in_file_order(const Elf64_Phdr *phdr_start, u32 phdrs_nr)
+{
+	const Elf64_Phdr *phdr = phdr_start;
+	u64 file_end = 0;
+
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD || phdr->p_filesz == 0)
+			continue;
+		if (phdr->p_offset < file_end)
+			return false;
+		file_end = phdr->p_offset + phdr->p_filesz;
+	}
+	return true;
+}
+
+/**
+ * sha256_elf_headers() - 计算ELF文件头和程序头表的摘要
+ *
+ * 它们在各个段的内容之前进入摘要（与tools/payload-digest.py的顺序相同），
+ * 这样改写了入口或者段的加载地址的内核也无法通过校验。
+ */
+static void sha256_elf_headers(struct sha256_state *sha,
+			       const Elf64_Ehdr *ehdr,
+			       const Elf64_Phdr *phdr_start, u32 phdrs_nr)
+{
+	sha256_update(sha, ehdr, sizeof(*ehdr));
+	sha256_update(sha, phdr_start, (u64)phdrs_nr * sizeof(*phdr_start));
+}
+
+/// @brief 计算已经加载好的各个段的摘要
+static void sha256_loaded_segments(struct sha256_state *sha,
+				   const Elf64_Phdr *phdr_start, u32 phdrs_nr,
+				   u64 load_offset)
+{
+	const Elf64_Phdr *phdr = phdr_start;
+
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD || phdr->p_filesz == 0)
+			continue;
+		sha256_update(sha, (void *)(load_offset + phdr->p_paddr),
+			      phdr->p_filesz);
+	}
+}
+
+/**
+ * load_segments_lz4() - 把压缩的负载直接解压到各个段中
+ * @payload_info:	负载信息
+ * @phdr_start:		程序头表（已经解压出来）
+ * @phdrs_nr:		程序头的数量
+ * @load_offset:	段的p_paddr加上这个偏移，就是它被加载到的地址
+ * @sha:		不为NULL时，同时计算各个段的摘要
+ *
+ * 解压是按块流式进行的，不需要一个与整个ELF文件一样大的缓冲区。
+ * 最后一个段的文件内容结束后就停止解压，不会解压ELF尾部的节头表等内容。
+ */
+static efi_status_t load_segments_lz4(const struct payload_info *payload_info,
+				      const Elf64_Phdr *phdr_start,
+				      u32 phdrs_nr, u64 load_offset,
+				      struct sha256_state *sha)
+{
+	static const struct lz4_stream_ops ops = {
+		.direct = segment_stream_direct,
+		.emit = segment_stream_emit,
+	};
+	// 段的顺序与文件中的顺序不一致时，只能在解压完之后再计算摘要
+	bool fused = sha && segments_in_file_order(phdr_start, phdrs_nr);
+	struct segment_stream_ctx ctx = { .phdr_start = phdr_start,
+					  .phdrs_nr = phdrs_nr,
+					  .load_offset = load_offset,
+					  .loaded_bytes = 0,
+					  .sha = fused ? sha : NULL };
+	const Elf64_Phdr *phdr = phdr_start;
+	u64 file_end = 0;
+	u64 expected = 0;
+	efi_status_t status;
+
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		file_end = max(file_end,
+			       (u64)(phdr->p_offset + phdr->p_filesz));
+		expected += phdr->p_filesz;
+	}
+
+	if (file_end == 0)
+		return EFI_SUCCESS;
+
+	status = lz4_frame_decompress((const void *)payload_info->payload_addr,
+				      payload_info->payload_size, file_end,
+				      &ops, &ctx);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to decompress payload: %lx\n", status);
+		return status;
+	}
+
+	if (ctx.loaded_bytes != expected) {
+		efi_err("Payload segments incomplete: loaded %llu of %llu bytes\n",
+			ctx.loaded_bytes, expected);
+		return EFI_LOAD_ERROR;
+	}
+
+	if (sha && !fused) {
+		efi_debug("Payload segments are not in file order, hashing them after decompression\n");
+		sha256_loaded_segments(sha, phdr_start, phdrs_nr, load_offset);
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * 从文件中加载并校验内核时，每读这么多字节就马上计算它们的摘要，
+ * 这时数据还在缓存中。
+ */
+#define VERIFY_READ_CHUNK (256 * 1024)
+
+/**
+ * load_segments_file() - 把文件中的各个段直接读到内核内存中
+ *
+ * 参数与load_segments_lz4()相同。只读取各个段的文件内容，
+ * 不会把整个文件读到内存中。
+ */
+static efi_status_t load_segments_file(struct payload_info *payload_info,
+				       const Elf64_Phdr *phdr_start,
+				       u32 phdrs_nr, u64 load_offset,
+				       struct sha256_state *sha)
+{
+	const Elf64_Phdr *phdr = phdr_start;
+	efi_status_t status;
+
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD || phdr->p_filesz == 0)
+			continue;
+
+		void *dst = (void *)(load_offset + phdr->p_paddr);
+		u64 chunk = sha ? VERIFY_READ_CHUNK : phdr->p_filesz;
+
+		for (u64 off = 0; off < phdr->p_filesz; off += chunk) {
+			u64 n = min(chunk, phdr->p_filesz - off);
+
+			status = efi_file_read_at(&payload_info->file,
+						  phdr->p_offset + off,
+						  dst + off, n);
+			if (status != EFI_SUCCESS) {
+				efi_err("Failed to read segment %d from the kernel file: 0x%lx\n",
+					i, status);
+				return status;
+			}
+			if (sha)
+				sha256_update(sha, dst + off, n);
+		}
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+ * finish_payload_digest() - 处理加载时计算出的内核的摘要
+ * @payload_info:	负载信息，其中的digest是编译时记录的摘要（可以为NULL）
+ * @sha:		ELF文件头、程序头表和加载各个段时计算的摘要
+ * @bytes:		各个段的文件内容的总大小
+ * @ticks:		加载并计算摘要花费的时间（时间戳）
+ *
+ * 与编译时记录的摘要比较，然后把摘要度量到TPM中。
+ */
+static efi_status_t
+finish_payload_digest(const struct payload_info *payload_info,
+		      struct sha256_state *sha, u64 bytes, u64 ticks)
+{
+	u8 digest[SHA256_DIGEST_SIZE];
+	u64 freq = boot_ts_frequency();
+
+	sha256_final(sha, digest);
+	if (payload_info->digest &&
+	    memcmp(digest, payload_info->digest, SHA256_DIGEST_SIZE)) {
+		efi_err("Kernel SHA-256 mismatch, refusing to boot a kernel that differs from the one it was built for\n");
+		efi_err("  expected: %*phN\n", SHA256_DIGEST_SIZE,
+			payload_info->digest);
+		efi_err("  actual:   %*phN\n", SHA256_DIGEST_SIZE, digest);
+		return EFI_SECURITY_VIOLATION;
+	}
+
+	if (freq && ticks)
+		efi_info("Kernel SHA-256 %s: %llu bytes loaded and hashed at %llu MB/s\n",
+			 payload_info->digest ? "verified" : "computed", bytes,
+			 bytes * freq / ticks / 1000000);
+	else
+		efi_info("Kernel SHA-256 %s: %llu bytes\n",
+			 payload_info->digest ? "verified" : "computed", bytes);
+
+	if (efi_measurement_enabled() &&
+	    efi_measure_digest(digest, EFISTUB_EVT_KERNEL) == EFI_SUCCESS)
+		efi_info("Measured kernel SHA-256 into PCR 9\n");
+	return EFI_SUCCESS;
+}
+
+/**
+ * next_unloaded_range() - 查找内核内存中下一段不会被ELF文件内容覆盖的区域
+ * @phdr_start:	程序头表
+ * @phdrs_nr:	程序头的数量
+ * @min_paddr:	内核内存起始处对应的p_paddr
+ * @size:	内核内存的大小
+ * @cursor:	从内核内存中的这个偏移开始查找
+ * @ret_end:	返回这段区域的结束偏移
+ *
+ * Return:	这段区域的起始偏移，没有的话返回@size
+ *
+ * 这些区域包括段之前和段之间的空隙、段的BSS部分（p_memsz - p_filesz），
+ * 以及为了对齐而多分配的部分。段的数量很少，所以直接遍历。
+ */
+static u64 next_unloaded_range(const Elf64_Phdr *phdr_start, u32 phdrs_nr,
+			       u64 min_paddr, u64 size, u64 cursor,
+			       u64 *ret_end)
+{
+	while (cursor < size) {
+		const Elf64_Phdr *phdr = phdr_start;
+		u64 next = size;
+		bool covered = false;
+
+		for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+			if (phdr->p_type != PT_LOAD || phdr->p_filesz == 0)
+				continue;
+
+			u64 start = phdr->p_paddr - min_paddr;
+			u64 end = min(start + phdr->p_filesz, size);
+			if (start <= cursor && cursor < end) {
+				// 跳过这个段的文件内容，再从它的结尾开始找
+				cursor = end;
+				covered = true;
+				break;
+			}
+			if (start > cursor)
+				next = min(next, start);
+		}
+
+		if (!covered) {
+			*ret_end = next;
+			return cursor;
+		}
+	}
+
+	*ret_end = size;
+	return size;
+}
+
+/// @brief 把内核内存中不会被ELF文件内容覆盖的部分清零
+static void zero_unloaded_ranges(u64 base, u64 size,
 				 const Elf64_Phdr *phdr_start, u32 phdrs_nr,
-				 u64 *ret_program_mem_paddr,
-				 u64 *ret_program_mem_size, u64 *ret_min_paddr,
-				 u64 *ret_min_vaddr)
+				 u64 min_paddr)
 {
-	efi_status_t status = EFI_SUCCESS;
+	u64 start, end = 0;
 
-	u64 allocated_paddr = 0;
-	u64 allocated_size = 0;
-	u64 min_paddr = 0;
+	while ((start = next_unloaded_range(phdr_start, phdrs_nr, min_paddr,
+					    size, end, &end)) < size)
+		efi_smp_memset((void *)(base + start), 0, end - start);
+}
+
+#ifdef CONFIG_DRAGONSTUB_CHECK_ZEROING
+
+/// @brief 检查解压出来的ELF文件内容是否与各个段中的内容一致
+static efi_status_t segment_verify_emit(void *_ctx, u64 offset,
+					const void *data, u64 len)
+{
+	struct segment_stream_ctx *ctx = _ctx;
+	const Elf64_Phdr *phdr = ctx->phdr_start;
+
+	for (u32 i = 0; i < ctx->phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+
+		u64 start = max(offset, (u64)phdr->p_offset);
+		u64 end = min(offset + len,
+			      (u64)(phdr->p_offset + phdr->p_filesz));
+		if (start >= end)
+			continue;
+
+		const void *dst = (void *)(ctx->load_offset + phdr->p_paddr +
+					   (start - phdr->p_offset));
+		if (memcmp(dst, data + (start - offset), end - start)) {
+			efi_err("Segment %d differs from the payload near file offset %p\n",
+				i, start);
+			return EFI_COMPROMISED_DATA;
+		}
+		ctx->loaded_bytes += end - start;
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+ * check_loaded_program() - 检查加载结果是否与“整体清零再复制各个段”的结果一致
+ *
+ * 只在打开了CONFIG_DRAGONSTUB_CHECK_ZEROING时编译（make CHECK_ZEROING=1），
+ * 用于调试只清零部分内存的逻辑。
+ */
+static efi_status_t
+check_loaded_program(const struct payload_info *payload_info,
+		     const Elf64_Phdr *phdr_start, u32 phdrs_nr, u64 base,
+		     u64 size, u64 min_paddr)
+{
+	const Elf64_Phdr *phdr = phdr_start;
+	u64 start, end = 0;
+
+	// 不被文件内容覆盖的部分必须全是0
+	while ((start = next_unloaded_range(phdr_start, phdrs_nr, min_paddr,
+					    size, end, &end)) < size) {
+		const u8 *p = (const u8 *)(base + start);
+		for (u64 i = 0; i < end - start; i++) {
+			if (p[i]) {
+				efi_err("Kernel memory at offset %p is not zeroed\n",
+					start + i);
+				return EFI_COMPROMISED_DATA;
+			}
+		}
+	}
+
+	// 段的文件内容必须与负载中的一致
+	if (payload_info->payload_type == PAYLOAD_TYPE_LZ4) {
+		static const struct lz4_stream_ops ops = {
+			.direct = NULL,
+			.emit = segment_verify_emit,
+		};
+		struct segment_stream_ctx ctx = { .phdr_start = phdr_start,
+						  .phdrs_nr = phdrs_nr,
+						  .load_offset = base - min_paddr,
+						  .loaded_bytes = 0 };
+		u64 file_end = 0;
+
+		for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+			if (phdr->p_type == PT_LOAD)
+				file_end = max(file_end, (u64)(phdr->p_offset +
+							       phdr->p_filesz));
+		}
+		if (file_end == 0)
+			return EFI_SUCCESS;
+		return lz4_frame_decompress(
+			(const void *)payload_info->payload_addr,
+			payload_info->payload_size, file_end, &ops, &ctx);
+	}
+
+	if (payload_info->payload_type == PAYLOAD_TYPE_ELF_FILE) {
+		// 按块重新读取文件中各个段的内容进行比较
+		const u64 chunk_size = 64 * 1024;
+		efi_status_t status;
+		void *buf = NULL;
+
+		status = efi_bs_call(AllocatePool, EfiLoaderData, chunk_size,
+				     &buf);
+		if (status != EFI_SUCCESS)
+			return status;
+
+		for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+			if (phdr->p_type != PT_LOAD)
+				continue;
+			for (u64 off = 0; off < phdr->p_filesz;
+			     off += chunk_size) {
+				u64 n = min(chunk_size, phdr->p_filesz - off);
+				status = payload_read(payload_info,
+						      phdr->p_offset + off, buf,
+						      n);
+				if (status == EFI_SUCCESS &&
+				    memcmp((void *)(base + (phdr->p_paddr -
+							    min_paddr) +
+						    off),
+					   buf, n)) {
+					efi_err("Segment %d differs from the kernel file\n",
+						i);
+					status = EFI_COMPROMISED_DATA;
+				}
+				if (status != EFI_SUCCESS) {
+					efi_bs_call(FreePool, buf);
+					return status;
+				}
+			}
+		}
+		efi_bs_call(FreePool, buf);
+		return EFI_SUCCESS;
+	}
+
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (memcmp((void *)(base + (phdr->p_paddr - min_paddr)),
+			   (void *)(payload_info->payload_addr + phdr->p_offset),
+			   phdr->p_filesz)) {
+			efi_err("Segment %d differs from the payload\n", i);
+			return EFI_COMPROMISED_DATA;
+		}
+	}
+	return EFI_SUCCESS;
+}
+
+#endif
+
+/**
+ * load_program_inplace() - 让内核直接在嵌入的负载所在的位置运行
+ * @payload_info:	负载信息（make PAYLOAD_INPLACE=1嵌入的负载）
+ * @ehdr:		ELF文件头
+ * @phdr_start:		程序头表
+ * @phdrs_nr:		程序头的数量
+ * @tbl:		记录各个段被加载到的位置
+ * @ret_paddr:		返回内核内存的起始地址
+ * @ret_size:		返回内核内存的大小
+ * @ret_min_paddr:	返回内核内存起始处对应的p_paddr
+ * @ret_min_vaddr:	返回最小的p_vaddr
+ *
+ * tools/payload-inplace.py已经把各个段的内容按内存布局排好，放在DragonStub
+ * 映像的末尾。映像被加载到满足对齐要求的地址时，不需要复制任何段，只要在
+ * 映像之后分配剩下的BSS，并清零不被文件内容覆盖的部分。
+ *
+ * Return:	EFI_UNSUPPORTED表示无法原地运行，调用者应该复制到新分配的内存中
+ */
+static efi_status_t
+load_program_inplace(struct payload_info *payload_info,
+		     const Elf64_Ehdr *ehdr, const Elf64_Phdr *phdr_start,
+		     u32 phdrs_nr,
+		     struct dragonstub_payload_efi *tbl, u64 *ret_paddr,
+		     u64 *ret_size, u64 *ret_min_paddr, u64 *ret_min_vaddr)
+{
+	const u64 align = payload_info->inplace_align;
+	u64 payload_start = payload_info->payload_addr;
+	u64 min_paddr = UINT64_MAX;
 	u64 max_paddr = 0;
-	u64 min_vaddr = 0;
-	status = efi_allocate_kernel_memory(phdr_start, phdrs_nr,
-					    &allocated_paddr, &allocated_size,
-					    &min_paddr, &max_paddr, &min_vaddr);
+	u64 min_vaddr = UINT64_MAX;
+	u64 base = 0;
+	const Elf64_Phdr *phdr = phdr_start;
+	efi_status_t status;
+
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		min_paddr = min(min_paddr, (u64)phdr->p_paddr);
+		min_vaddr = min(min_vaddr, (u64)phdr->p_vaddr);
+		max_paddr =
+			max(max_paddr, (u64)(phdr->p_paddr + phdr->p_memsz));
+	}
+	if (max_paddr == 0)
+		return EFI_UNSUPPORTED;
+
+	// 每个段在负载中的位置与它在内存中的位置都只差同一个偏移，才能原地运行
+	phdr = phdr_start;
+	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+		if (phdr->p_type != PT_LOAD)
+			continue;
+
+		u64 seg_base = payload_start + phdr->p_offset -
+			       (phdr->p_paddr - min_paddr);
+		if (base && seg_base != base) {
+			efi_warn("Payload segments are not laid out for in-place execution, copying the kernel\n");
+			return EFI_UNSUPPORTED;
+		}
+		base = seg_base;
+	}
 
+	if (base & (align - 1)) {
+		efi_info("Payload at 0x%llx is not aligned to 0x%llx, copying the kernel\n",
+			 base, align);
+		return EFI_UNSUPPORTED;
+	}
+
+	/*
+	 * 负载的末尾已经补齐到页，并且是映像中的最后一部分，
+	 * 剩下的BSS紧接着映像分配
+	 */
+	u64 mem_size = ALIGN_UP(max_paddr - min_paddr, EFI_PAGE_SIZE);
+	u64 image_size =
+		ALIGN_UP(payload_start + payload_info->payload_size,
+			 EFI_PAGE_SIZE) -
+		base;
+	u64 bss_size = mem_size > image_size ? mem_size - image_size : 0;
+
+	if (bss_size) {
+		status = efi_allocate_pages_exact(bss_size, base + image_size);
+		if (status != EFI_SUCCESS) {
+			efi_info("Memory after the stub image is in use (%lx), copying the kernel\n",
+				 status);
+			return EFI_UNSUPPORTED;
+		}
+	}
+
+	efi_remap_image_all_rwx(base, mem_size);
+	zero_unloaded_ranges(base, mem_size, phdr_start, phdrs_nr, min_paddr);
+
+	if (payload_info->digest || efi_measurement_enabled()) {
+		struct sha256_state sha;
+		u64 bytes = 0;
+		u64 start = efi_arch_read_timestamp();
+
+		sha256_init(&sha);
+		sha256_elf_headers(&sha, ehdr, phdr_start, phdrs_nr);
+		sha256_loaded_segments(&sha, phdr_start, phdrs_nr,
+				       base - min_paddr);
+		phdr = phdr_start;
+		for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+			if (phdr->p_type == PT_LOAD)
+				bytes += phdr->p_filesz;
+		}
+		status = finish_payload_digest(payload_info, &sha, bytes,
+					       efi_arch_read_timestamp() -
+						       start);
+		if (status != EFI_SUCCESS)
+			goto failed;
+	}
+
+#ifdef CONFIG_DRAGONSTUB_CHECK_ZEROING
+	status = check_loaded_program(payload_info, phdr_start, phdrs_nr, base,
+				      mem_size, min_paddr);
 	if (status != EFI_SUCCESS) {
-		efi_err("Failed to allocate kernel memory\n");
-		return status;
+		efi_err("Loaded kernel image check failed\n");
+		goto failed;
 	}
+	efi_info("Loaded kernel image check passed\n");
+#endif
+
+	efi_info("Running the kernel in place at 0x%llx, %llu bytes of BSS allocated after the stub\n",
+		 base, bss_size);
+	report_segments(tbl, phdr_start, phdr_start, phdrs_nr,
+			base - min_paddr);
+	*ret_paddr = base;
+	*ret_size = mem_size;
+	*ret_min_paddr = min_paddr;
+	*ret_min_vaddr = min_vaddr;
+	return EFI_SUCCESS;
+failed:
+	efi_free(bss_size, base + image_size);
+	return status;
+}
 
-	// 清空内存
-	memset((void *)allocated_paddr, 0, allocated_size);
+/**
+ * load_program() - 把各个PT_LOAD段加载到内核内存中
+ * @payload_info:	负载信息
+ * @payload_size:	（解压后）ELF文件的大小
+ * @ehdr:		ELF文件头
+ * @phdr_start:		程序头表
+ * @phdrs_nr:		程序头的数量
+ * @tbl:		记录各个段被加载到的位置，交给内核
+ * @ret_program_mem_paddr:	返回内核内存（稀疏加载时是第一块）的地址
+ * @ret_program_mem_size:	返回它的大小
+ * @ret_min_paddr:	返回它的起始处对应的p_paddr
+ * @ret_min_vaddr:	返回最小的p_vaddr
+ * @ret_sparse_entry:	稀疏加载时返回入口被加载到的物理地址
+ *
+ * 稀疏加载时各簇段之间的相对位置变了，入口要按它所在的段计算，不在任何段
+ * 中的话加载失败，已经分配的内核内存在这里释放。
+ */
+static efi_status_t load_program(struct payload_info *payload_info,
+				 u64 payload_size, const Elf64_Ehdr *ehdr,
+				 const Elf64_Phdr *phdr_start, u32 phdrs_nr,
+				 struct dragonstub_payload_efi *tbl,
+				 u64 *ret_program_mem_paddr,
+				 u64 *ret_program_mem_size, u64 *ret_min_paddr,
+				 u64 *ret_min_vaddr, u64 *ret_sparse_entry)
+{
+	efi_status_t status = EFI_SUCCESS;
+	const void *payload_start = (const void *)payload_info->payload_addr;
 
+	u64 min_paddr = 0;
+	u64 max_paddr = 0;
+	u64 min_vaddr = 0;
 	const Elf64_Phdr *phdr = phdr_start;
 
 	for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
@@ -355,64 +1162,299 @@ static efi_status_t load_program(const void *payload_start, u64 payload_size,
 		}
 
 		if (phdr->p_align & !EFI_PAGE_SIZE) {
-			efi_err("ELF segment alignment should be multiple of EFI_PAGE_SIZE(%d), but got %d\n",
+			efi_err("ELF segment alignment should be multiple of EFI_PAGE_SIZE(%d), but got %lu\n",
 				EFI_PAGE_SIZE, phdr->p_align);
-			status = EFI_INVALID_PARAMETER;
-			goto failed;
+			return EFI_INVALID_PARAMETER;
 		}
 
-		u64 paddr = phdr->p_paddr;
-
 		u64 mem_size = phdr->p_memsz;
 		u64 file_size = phdr->p_filesz;
 		u64 file_offset = phdr->p_offset;
-		// efi_debug(
-		// 	"loading segment: paddr=%p, mem_size=%d, file_size=%d\n",
-		// 	paddr, mem_size, file_size);
 
 		if (file_offset + file_size > payload_size) {
-			status = EFI_INVALID_PARAMETER;
-			goto failed;
+			return EFI_INVALID_PARAMETER;
 		}
 
 		if (mem_size < file_size) {
-			status = EFI_INVALID_PARAMETER;
+			return EFI_INVALID_PARAMETER;
+		}
+	}
+
+	if (payload_info->inplace_align) {
+		status = load_program_inplace(payload_info, ehdr, phdr_start,
+					      phdrs_nr, tbl,
+					      ret_program_mem_paddr,
+					      ret_program_mem_size,
+					      ret_min_paddr, ret_min_vaddr);
+		// EFI_UNSUPPORTED表示无法原地运行，退回到复制的方式
+		if (status != EFI_UNSUPPORTED)
+			return status;
+	}
+
+	/*
+	 * placed是程序头表的副本，其中的p_paddr被改成段被加载到的物理地址。
+	 * 后面的清零、复制和校验都基于它，不需要关心内核内存是一整块还是
+	 * 分成了几块。
+	 */
+	Elf64_Phdr *placed = NULL;
+	struct kernel_region *regions;
+	u32 nr_regions = 1;
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     phdrs_nr * (sizeof(*placed) + sizeof(*regions)),
+			     (void **)&placed);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to allocate memory for segment placement\n");
+		return status;
+	}
+	regions = (struct kernel_region *)(placed + phdrs_nr);
+	memcpy(placed, phdr_start, phdrs_nr * sizeof(*placed));
+
+	if (efi_sparse_load) {
+		status = efi_allocate_kernel_regions(phdr_start, phdrs_nr,
+						     regions, &nr_regions,
+						     &min_vaddr);
+		min_paddr = regions[0].link_paddr;
+	} else {
+		status = efi_allocate_kernel_memory(
+			phdr_start, phdrs_nr, &regions[0].paddr,
+			&regions[0].size, &min_paddr, &max_paddr, &min_vaddr);
+		regions[0].link_paddr = min_paddr;
+	}
+
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to allocate kernel memory\n");
+		efi_bs_call(FreePool, placed);
+		return status;
+	}
+	place_segments(placed, phdrs_nr, regions, nr_regions);
+
+	/*
+	 * 只清零不会被文件内容覆盖的部分（段之间的空隙、BSS、对齐多出来的部分），
+	 * 其余的部分马上就会被段的内容覆盖，不需要先清零。
+	 */
+	for (u32 i = 0; i < nr_regions; i++)
+		zero_unloaded_ranges(regions[i].paddr, regions[i].size, placed,
+				     phdrs_nr, regions[i].paddr);
+
+	/*
+	 * 需要校验或者度量到TPM中的话，在复制各个段的同时计算摘要，
+	 * 不再单独读一遍内核
+	 */
+	struct sha256_state sha_state;
+	struct sha256_state *sha = NULL;
+	u64 load_start = efi_arch_read_timestamp();
+	if (payload_info->digest || efi_measurement_enabled()) {
+		sha256_init(&sha_state);
+		sha256_elf_headers(&sha_state, ehdr, phdr_start, phdrs_nr);
+		sha = &sha_state;
+	}
+
+	if (payload_info->payload_type == PAYLOAD_TYPE_LZ4) {
+		status = load_segments_lz4(payload_info, placed, phdrs_nr, 0,
+					   sha);
+		if (status != EFI_SUCCESS)
+			goto failed;
+	} else if (payload_info->payload_type == PAYLOAD_TYPE_ELF_FILE) {
+		status = load_segments_file(payload_info, placed, phdrs_nr, 0,
+					    sha);
+		if (status != EFI_SUCCESS)
 			goto failed;
+	} else {
+		phdr = placed;
+		for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+			if (phdr->p_type != PT_LOAD || phdr->p_filesz == 0)
+				continue;
+
+			// efi_debug(
+			// 	"loading segment: paddr=%p, mem_size=%d, file_size=%d\n",
+			// 	phdr->p_paddr, phdr->p_memsz, phdr->p_filesz);
+			void *dst = (void *)phdr->p_paddr;
+			if (sha)
+				sha256_copy(sha, dst,
+					    payload_start + phdr->p_offset,
+					    phdr->p_filesz);
+			else
+				efi_smp_memcpy(dst,
+					       payload_start + phdr->p_offset,
+					       phdr->p_filesz);
 		}
+	}
 
-		if (mem_size == 0) {
-			continue;
+	if (sha) {
+		u64 bytes = 0;
+
+		phdr = phdr_start;
+		for (u32 i = 0; i < phdrs_nr; ++i, ++phdr) {
+			if (phdr->p_type == PT_LOAD)
+				bytes += phdr->p_filesz;
 		}
+		status = finish_payload_digest(
+			payload_info, sha, bytes,
+			efi_arch_read_timestamp() - load_start);
+		if (status != EFI_SUCCESS)
+			goto failed;
+	}
 
-		memcpy((void *)(allocated_paddr + (paddr - min_paddr)),
-		       payload_start + file_offset, file_size);
+#ifdef CONFIG_DRAGONSTUB_CHECK_ZEROING
+	for (u32 i = 0; i < nr_regions; i++) {
+		status = check_loaded_program(payload_info, placed, phdrs_nr,
+					      regions[i].paddr,
+					      regions[i].size,
+					      regions[i].paddr);
+		if (status != EFI_SUCCESS) {
+			efi_err("Loaded kernel image check failed\n");
+			goto failed;
+		}
+	}
+	efi_info("Loaded kernel image check passed\n");
+#endif
 
-		// efi_debug(
-		// 	"segment loaded: file_offset: %p paddr=%p, mem_size=%p, file_size=%p\n",
-		// 	file_offset, paddr, mem_size, file_size);
+	report_segments(tbl, phdr_start, placed, phdrs_nr, 0);
+	if (efi_sparse_load) {
+		u64 entry = ehdr->e_entry;
+
+		*ret_sparse_entry = 0;
+		for (u32 i = 0; i < tbl->nr_segments; i++) {
+			struct dragonstub_payload_segment *seg =
+				&tbl->segments[i];
+
+			if (entry >= seg->vaddr &&
+			    entry < seg->vaddr + seg->size) {
+				*ret_sparse_entry =
+					seg->paddr + (entry - seg->vaddr);
+				break;
+			}
+		}
+		if (*ret_sparse_entry == 0) {
+			efi_err("Kernel entry %llx is not in any segment\n",
+				entry);
+			status = EFI_LOAD_ERROR;
+			goto failed;
+		}
+		tbl->flags |= DRAGONSTUB_PAYLOAD_SPARSE;
+		efi_info("Loaded %d kernel segments into %d separate regions\n",
+			 tbl->nr_segments, nr_regions);
 	}
 
-	*ret_program_mem_paddr = allocated_paddr;
-	*ret_program_mem_size = allocated_size;
+	*ret_program_mem_paddr = regions[0].paddr;
+	*ret_program_mem_size = regions[0].size;
 	*ret_min_paddr = min_paddr;
 	*ret_min_vaddr = min_vaddr;
 
+	efi_bs_call(FreePool, placed);
 	return EFI_SUCCESS;
 failed:
-	efi_free(allocated_size, allocated_paddr);
+	for (u32 i = 0; i < nr_regions; i++)
+		efi_free(regions[i].size, regions[i].paddr);
+	efi_bs_call(FreePool, placed);
 	return status;
 }
 
-efi_status_t load_elf(struct payload_info *payload_info)
+/*
+ * 压缩的负载和文件中的负载需要先读出ELF文件头和程序头表才能解析。
+ * 一般来说程序头表紧跟在ELF文件头后面，先读取这么多，不够的话再按需扩大。
+ */
+#define PAYLOAD_HEADER_WINDOW 4096
+
+/**
+ * read_payload_headers() - 读出负载开头的ELF文件头和程序头表
+ * @payload_info:	负载信息
+ * @ret_buf:		返回读出来的内容，使用完之后需要用FreePool释放
+ * @ret_buf_size:	返回@ret_buf的大小
+ * @ret_elf_size:	返回（解压后）ELF文件的大小
+ *
+ * 不支持程序头数量为PN_XNUM的ELF文件，因为此时真正的数量存放在文件末尾的
+ * 节头表里。
+ */
+static efi_status_t
+read_payload_headers(const struct payload_info *payload_info, void **ret_buf,
+		     u64 *ret_buf_size, u64 *ret_elf_size)
 {
-	const void *payload_start = (void *)payload_info->payload_addr;
+	const void *payload_start = (const void *)payload_info->payload_addr;
 	u64 payload_size = payload_info->payload_size;
+	efi_status_t status;
+	u64 elf_size;
+
+	if (payload_info->payload_type == PAYLOAD_TYPE_LZ4) {
+		elf_size = lz4_frame_content_size(payload_start, payload_size);
+		if (elf_size == 0) {
+			efi_err("Compressed payload does not record its uncompressed size, please compress it with 'lz4 --content-size'\n");
+			return EFI_UNSUPPORTED;
+		}
+	} else {
+		elf_size = payload_size;
+	}
+
+	u64 size = min((u64)PAYLOAD_HEADER_WINDOW, elf_size);
+	for (;;) {
+		void *buf = NULL;
+		status = efi_bs_call(AllocatePool, EfiLoaderData, size, &buf);
+		if (status != EFI_SUCCESS) {
+			efi_err("Failed to allocate memory for ELF headers\n");
+			return status;
+		}
+
+		status = payload_read(payload_info, 0, buf, size);
+		if (status != EFI_SUCCESS) {
+			efi_err("Failed to read ELF headers: %lx\n", status);
+			efi_bs_call(FreePool, buf);
+			return status;
+		}
+
+		u64 needed = size;
+		if (size >= sizeof(Elf64_Ehdr)) {
+			Elf64_Ehdr *ehdr = buf;
+			needed = ehdr->e_phoff +
+				 (u64)ehdr->e_phnum * ehdr->e_phentsize;
+		}
+
+		if (needed <= size || size == elf_size) {
+			*ret_buf = buf;
+			*ret_buf_size = size;
+			*ret_elf_size = elf_size;
+			return EFI_SUCCESS;
+		}
+
+		efi_bs_call(FreePool, buf);
+		size = min(needed, elf_size);
+	}
+}
+
+/// @brief 加载完成（或失败）之后，释放负载占用的资源
+static void payload_release(struct payload_info *payload_info)
+{
+	if (payload_info->payload_type == PAYLOAD_TYPE_ELF_FILE)
+		efi_file_close(&payload_info->file);
+
+	if (payload_info->payload_allocated) {
+		efi_bs_call(FreePool, (void *)payload_info->payload_addr);
+		payload_info->payload_addr = 0;
+		payload_info->payload_allocated = false;
+	}
+}
+
+efi_status_t load_elf(struct payload_info *payload_info)
+{
+	const void *elf_start = (void *)payload_info->payload_addr;
+	u64 elf_size = payload_info->payload_size;
+	u64 headers_size = elf_size;
+	void *headers_buf = NULL;
 	Elf64_Ehdr *ehdr = NULL;
-	efi_status_t status =
-		elf_get_header(payload_start, payload_size, &ehdr);
+	efi_status_t status;
+
+	if (payload_info->payload_type != PAYLOAD_TYPE_ELF) {
+		status = read_payload_headers(payload_info, &headers_buf,
+					      &headers_size, &elf_size);
+		if (status != EFI_SUCCESS)
+			goto out;
+		elf_start = headers_buf;
+	}
+
+	status = elf_get_header(elf_start, headers_size, &ehdr);
 	if (status != EFI_SUCCESS) {
 		efi_err("Failed to get ELF header\n");
-		return status;
+		goto out;
 	}
 	ASSERT(ehdr != NULL);
 
@@ -421,53 +1463,79 @@ efi_status_t load_elf(struct payload_info *payload_info)
 	u32 phdrs_nr = 0;
 	Elf64_Phdr *phdr_start = NULL;
 
-	status = parse_phdrs(payload_start, payload_size, ehdr, &phdrs_nr,
+	status = parse_phdrs(elf_start, headers_size, ehdr, &phdrs_nr,
 			     &phdr_start);
 	if (status != EFI_SUCCESS) {
 		efi_err("Failed to parse ELF segments\n");
-		return status;
+		goto out;
 	}
 
 	efi_debug("program headers: %d\n", phdrs_nr);
 
+	// 交给内核的配置表，加载时在其中记录每个PT_LOAD段的位置
+	struct dragonstub_payload_efi *tbl = NULL;
+	u32 nr_loads = 0;
+	for (u32 i = 0; i < phdrs_nr; ++i)
+		nr_loads += phdr_start[i].p_type == PT_LOAD;
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     sizeof(*tbl) + nr_loads * sizeof(tbl->segments[0]),
+			     (void **)&tbl);
+
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to allocate memory for dragonstub_payload_efi\n");
+		goto out;
+	}
+	tbl->flags = 0;
+	tbl->nr_segments = 0;
+
 	u64 program_paddr = 0;
 	u64 program_size = 0;
 	u64 image_link_base_paddr = 0;
 	u64 image_link_base_vaddr = 0;
-	load_program(payload_start, payload_size, phdr_start, phdrs_nr,
-		     &program_paddr, &program_size, &image_link_base_paddr,
-		     &image_link_base_vaddr);
+	u64 sparse_entry = 0;
+	status = load_program(payload_info, elf_size, ehdr, phdr_start,
+			      phdrs_nr, tbl, &program_paddr, &program_size,
+			      &image_link_base_paddr, &image_link_base_vaddr,
+			      &sparse_entry);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to load ELF segments\n");
+		efi_bs_call(FreePool, tbl);
+		goto out;
+	}
 	payload_info->loaded_paddr = program_paddr;
 	payload_info->loaded_size = program_size;
 	payload_info->kernel_entry =
 		ehdr->e_entry - image_link_base_vaddr + program_paddr;
 
-	efi_info("loaded_paddr: %p\n", payload_info->loaded_paddr);
-	efi_info("loaded_size: %p\n", payload_info->loaded_size);
+	// 各簇段之间的相对位置变了，入口由load_program()按它所在的段计算
+	if (tbl->flags & DRAGONSTUB_PAYLOAD_SPARSE)
+		payload_info->kernel_entry = sparse_entry;
+
+	efi_info("Kernel segments are %s\n",
+		 (tbl->flags & DRAGONSTUB_PAYLOAD_EXACT) ?
+			 "at their link-time physical addresses" :
+			 "relocated");
+	efi_info("loaded_paddr: 0x%llx\n", payload_info->loaded_paddr);
+	efi_info("loaded_size: 0x%llx\n", payload_info->loaded_size);
 	efi_info("ehdr->e_entry: %lx\n", ehdr->e_entry);
-	efi_info("image_link_base_paddr: %lx\n", image_link_base_paddr);
-	efi_info("kernel_entry: %lx\n", payload_info->kernel_entry);
+	efi_info("image_link_base_paddr: %llx\n", image_link_base_paddr);
+	efi_info("kernel_entry: %llx\n", payload_info->kernel_entry);
+	for (u32 i = 0; i < tbl->nr_segments; i++)
+		efi_debug("segment %u: vaddr=%llx, paddr=0x%llx, size=%llx\n", i,
+			  tbl->segments[i].vaddr, tbl->segments[i].paddr,
+			  tbl->segments[i].size);
 	// 处理权限问题
 
 	efi_remap_image_all_rwx(program_paddr, program_size);
 	extern void _start(void);
 	extern void _image_end(void);
 	u64 image_size = (u64)&_image_end - (u64)&_start;
-	efi_debug("image_size: %d\n", image_size);
+	efi_debug("image_size: %llu\n", image_size);
 	efi_remap_image_all_rwx((u64)&_start, (image_size + 4095) & ~4095);
 
 	// 添加地址到efi configuration table
 
-	struct dragonstub_payload_efi *tbl = NULL;
-	status = efi_bs_call(AllocatePool, EfiLoaderData,
-			     sizeof(struct dragonstub_payload_efi),
-			     (void **)&tbl);
-
-	if (status != EFI_SUCCESS) {
-		efi_err("Failed to allocate memory for dragonstub_payload_efi\n");
-		return status;
-	}
-
 	tbl->loaded_addr = payload_info->loaded_paddr;
 	tbl->size = payload_info->loaded_size;
 
@@ -479,8 +1547,12 @@ efi_status_t load_elf(struct payload_info *payload_info)
 
 	if (status != EFI_SUCCESS) {
 		efi_err("Failed to install dragonstub_payload_efi\n");
-		return status;
+		goto out;
 	}
 
-	return EFI_SUCCESS;
-}
\ No newline at end of file
+out:
+	if (headers_buf)
+		efi_bs_call(FreePool, headers_buf);
+	payload_release(payload_info);
+	return status;
+}
@@ -2,6 +2,8 @@
 #include "dragonstub/printk.h"
 #include "efidef.h"
 #include <dragonstub/dragonstub.h>
+#include <dragonstub/linux/math.h>
+#include <dragonstub/sha256.h>
 #include <libfdt.h>
 #include <libfdt_internal.h>
 
@@ -65,32 +67,316 @@ static efi_status_t update_fdt_memmap(void *fdt, struct efi_boot_memmap *map)
 	if (err)
 		return EFI_LOAD_ERROR;
 
+	/* 内存映射缓存扩大时紧凑内存映射会被重新分配，这里填入最终的地址 */
+	struct dragonstub_memmap *compact = efi_compact_memmap();
+	if (compact) {
+		fdt_val64 = cpu_to_fdt64((unsigned long)compact);
+		err = fdt_setprop_inplace_var(fdt, node, "dragonstub,memmap",
+					      fdt_val64);
+		if (err)
+			return EFI_LOAD_ERROR;
+	}
+
 	return EFI_SUCCESS;
 }
 
-static efi_status_t update_fdt(void *orig_fdt, unsigned long orig_fdt_size,
-			       void *fdt, int new_fdt_size, char *cmdline_ptr)
+/// @brief update_fdt()在/chosen中设置的属性最多有多少个
+#define FDT_CHOSEN_MAX_PROPS 16
+
+/// @brief update_fdt()要在/chosen中设置的属性
+struct fdt_chosen {
+	int nr;
+	struct {
+		const char *name;
+		const void *val;
+		int len;
+		/// @brief 整数属性的值（已经是大端序），val指向这里
+		union {
+			fdt64_t val64;
+			fdt32_t val32;
+		};
+	} props[FDT_CHOSEN_MAX_PROPS];
+};
+
+static void chosen_add(struct fdt_chosen *chosen, const char *name,
+		       const void *val, int len)
 {
-	int node, num_rsv;
-	int status;
-	u32 fdt_val32;
-	u64 fdt_val64;
+	chosen->props[chosen->nr].name = name;
+	chosen->props[chosen->nr].val = val;
+	chosen->props[chosen->nr].len = len;
+	chosen->nr++;
+}
 
-	/* Do some checks on provided FDT, if it exists: */
-	if (orig_fdt) {
-		if (fdt_check_header(orig_fdt)) {
-			efi_err("Device Tree header not valid!\n");
-			return EFI_LOAD_ERROR;
+static void chosen_add_u64(struct fdt_chosen *chosen, const char *name,
+			   u64 val)
+{
+	chosen->props[chosen->nr].val64 = cpu_to_fdt64(val);
+	chosen_add(chosen, name, &chosen->props[chosen->nr].val64,
+		   sizeof(fdt64_t));
+}
+
+static void chosen_add_u32(struct fdt_chosen *chosen, const char *name,
+			   u32 val)
+{
+	chosen->props[chosen->nr].val32 = cpu_to_fdt32(val);
+	chosen_add(chosen, name, &chosen->props[chosen->nr].val32,
+		   sizeof(fdt32_t));
+}
+
+/**
+ * fdt_collect_chosen() - 收集要在/chosen中设置的属性
+ *
+ * 两种构建FDT的方式都按这个列表设置/chosen，估算FDT的大小也用它。
+ * 空间不够重试的时候沿用同一个列表，kaslr-seed也就不会变。
+ */
+static void fdt_collect_chosen(struct fdt_chosen *chosen, char *cmdline_ptr)
+{
+	chosen->nr = 0;
+
+	if (cmdline_ptr != NULL && strlen(cmdline_ptr) > 0)
+		chosen_add(chosen, "bootargs", cmdline_ptr,
+			   strlen(cmdline_ptr) + 1);
+
+	/* Add FDT entries for EFI runtime services in chosen node. */
+	chosen_add_u64(chosen, "linux,uefi-system-table",
+		       (u64)(unsigned long)ST);
+
+	/* 启动时间戳表的物理地址，以及时间戳的频率 */
+	struct dragonstub_boot_timestamps *ts = boot_ts_table();
+	if (ts) {
+		chosen_add_u64(chosen, "dragonstub,boot-timestamps",
+			       (u64)(unsigned long)ts);
+		chosen_add_u64(chosen, "dragonstub,timebase-frequency",
+			       ts->timebase_frequency);
+	}
+
+	/* 初始页表信息的物理地址 */
+	struct dragonstub_pgtable *pgtable = efi_pgtable();
+	if (pgtable)
+		chosen_add_u64(chosen, "dragonstub,pgtable",
+			       (u64)(unsigned long)pgtable);
+
+	/* 日志环形缓冲区的物理地址 */
+	struct dragonstub_log_buf *log = efi_log_buf();
+	if (log)
+		chosen_add_u64(chosen, "dragonstub,log-buf",
+			       (u64)(unsigned long)log);
+
+	/*
+	 * 紧凑内存映射的物理地址，内容在退出boot services时才填好，
+	 * 这里的地址到时也会被改写为最终的地址
+	 */
+	struct dragonstub_memmap *memmap = efi_compact_memmap();
+	if (memmap)
+		chosen_add_u64(chosen, "dragonstub,memmap",
+			       (u64)(unsigned long)memmap);
+
+	const struct linux_efi_initrd *initrd = efi_initrd();
+	if (initrd && initrd->size) {
+		chosen_add_u64(chosen, "linux,initrd-start", initrd->base);
+		chosen_add_u64(chosen, "linux,initrd-end",
+			       initrd->base + initrd->size);
+	}
+
+	/* placeholders */
+	chosen_add_u64(chosen, "linux,uefi-mmap-start", UINT64_MAX);
+	chosen_add_u32(chosen, "linux,uefi-mmap-size", UINT32_MAX);
+	chosen_add_u32(chosen, "linux,uefi-mmap-desc-size", UINT32_MAX);
+	chosen_add_u32(chosen, "linux,uefi-mmap-desc-ver", UINT32_MAX);
+
+	bool enalbed_ramdomize_base = false;
+#ifdef CONFIG_RANDOMIZE_BASE
+	enalbed_ramdomize_base = true;
+#endif
+	if (enalbed_ramdomize_base && !efi_nokaslr) {
+		efi_status_t efi_status;
+		u64 seed;
+
+		efi_status = efi_get_random_bytes(sizeof(seed), (u8 *)&seed);
+		if (efi_status == EFI_SUCCESS) {
+			/* 随机数不需要转换字节序 */
+			chosen->props[chosen->nr].val64 = seed;
+			chosen_add(chosen, "kaslr-seed",
+				   &chosen->props[chosen->nr].val64,
+				   sizeof(fdt64_t));
 		}
+	}
+}
+
+/// @brief @name是否是@chosen中会设置的属性
+static bool chosen_has(const struct fdt_chosen *chosen, const char *name)
+{
+	for (int i = 0; i < chosen->nr; i++) {
+		if (!strcmp(chosen->props[i].name, name))
+			return true;
+	}
+	return false;
+}
+
+/// @brief 按顺序写出@chosen中的属性（fdt_sw）
+static int chosen_write(void *fdt, const struct fdt_chosen *chosen)
+{
+	for (int i = 0; i < chosen->nr; i++) {
+		int err = fdt_property(fdt, chosen->props[i].name,
+				       chosen->props[i].val,
+				       chosen->props[i].len);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/// @brief fdt_rebuild()缓存的属性名数量，按原来的树中的名字偏移索引
+#define FDT_NAME_CACHE_SIZE 64
+
+/**
+ * fdt_rebuild() - 遍历一次@orig_fdt，用fdt_sw把修改之后的树写到@fdt中
+ *
+ * fdt_setprop()等函数每次插入都要把插入点之后的整棵树往后移，而这里每个
+ * 节点和属性只复制一次：内存保留表直接丢弃，/chosen中原有的、会被重新设置
+ * 的属性被跳过，新的属性在/chosen的第一个子节点之前（没有子节点时在/chosen
+ * 结束之前）写出，因为子节点之后的属性是找不到的；没有/chosen时在根节点
+ * 结束之前加上。@fdt和@orig_fdt不能重叠。开销只与树的大小有关，与修改的数量
+ * 无关。@prune不为NULL时，还跳过其中规划好要删除的子树和属性。
+ *
+ * fdt_property()每次都要在新的字符串表中查找属性名，这里按原来的树中的名字
+ * 偏移缓存查找的结果，同一个名字只查找一次。
+ */
+static int fdt_rebuild(const void *orig_fdt, void *fdt, int size,
+		       const struct fdt_chosen *chosen,
+		       const struct fdt_prune *prune)
+{
+	int chosen_node = fdt_subnode_offset(orig_fdt, 0, "chosen");
+	struct {
+		int orig;
+		int nameoff;
+	} names[FDT_NAME_CACHE_SIZE];
+	int chosen_depth = -1;
+	int depth = 0;
+	int offset = 0;
+	int next, err;
+	u32 range = 0, pprop = 0;
+	u32 tag;
+
+	for (int i = 0; i < FDT_NAME_CACHE_SIZE; i++)
+		names[i].orig = -1;
+
+	err = fdt_create(fdt, size);
+	if (err)
+		return err;
+	/*
+	 * Delete all memory reserve map entries. When booting via UEFI,
+	 * kernel will use the UEFI memory map to find reserved regions.
+	 */
+	err = fdt_finish_reservemap(fdt);
+	if (err)
+		return err;
+
+	do {
+		const struct fdt_node_header *nh;
+		const struct fdt_property *prop;
+		const char *name = NULL;
+		int nameoff, slot;
+
 		/*
-		 * We don't get the size of the FDT if we get if from a
-		 * configuration table:
+		 * fdt_next_tag()已经检查过这个标记的内容都在结构块中，
+		 * 下面直接访问节点名和属性，不再经过fdt_get_name()等函数重复检查
 		 */
-		if (orig_fdt_size && fdt_totalsize(orig_fdt) > orig_fdt_size) {
-			efi_err("Truncated device tree! foo!\n");
-			return EFI_LOAD_ERROR;
+		tag = fdt_next_tag(orig_fdt, offset, &next);
+		switch (tag) {
+		case FDT_BEGIN_NODE:
+			/* /chosen的第一个子节点，属性要在它之前写完 */
+			if (depth == chosen_depth) {
+				err = chosen_write(fdt, chosen);
+				chosen_depth = -1;
+				if (err)
+					break;
+			}
+			/* 要删除的子树整个跳过 */
+			if (prune && range < prune->nr_ranges &&
+			    prune->ranges[range].start == offset) {
+				next = prune->ranges[range++].end;
+				break;
+			}
+			nh = fdt_offset_ptr_(orig_fdt, offset);
+			err = fdt_begin_node(fdt, nh->name);
+			depth++;
+			if (offset == chosen_node)
+				chosen_depth = depth;
+			break;
+		case FDT_PROP:
+			if (prune) {
+				while (pprop < prune->nr_props &&
+				       prune->props[pprop] < offset)
+					pprop++;
+				if (pprop < prune->nr_props &&
+				    prune->props[pprop] == offset)
+					break;
+			}
+			prop = fdt_offset_ptr_(orig_fdt, offset);
+			nameoff = fdt32_to_cpu(prop->nameoff);
+			slot = nameoff % FDT_NAME_CACHE_SIZE;
+			/*
+			 * 属性在子节点之前，/chosen的第一个子节点开始时
+			 * chosen_depth已经清除，depth相等就是/chosen本身的属性
+			 */
+			if (depth == chosen_depth || names[slot].orig != nameoff) {
+				name = fdt_string(orig_fdt, nameoff);
+				if (!name)
+					return -FDT_ERR_BADSTRUCTURE;
+			}
+			if (depth == chosen_depth && chosen_has(chosen, name))
+				break;
+
+			if (names[slot].orig != nameoff) {
+				names[slot].orig = nameoff;
+				names[slot].nameoff = 0;
+			}
+			err = fdt_property_nameoff(fdt, name, &names[slot].nameoff,
+						   prop->data,
+						   fdt32_to_cpu(prop->len));
+			break;
+		case FDT_END_NODE:
+			if (depth == chosen_depth) {
+				err = chosen_write(fdt, chosen);
+				chosen_depth = -1;
+			} else if (depth == 1 && chosen_node < 0) {
+				err = fdt_begin_node(fdt, "chosen");
+				err = err ?: chosen_write(fdt, chosen);
+				err = err ?: fdt_end_node(fdt);
+			}
+			err = err ?: fdt_end_node(fdt);
+			depth--;
+			break;
+		case FDT_END:
+			/* 结构块在FDT_END之前就结束了 */
+			if (next < 0)
+				return next;
+			break;
+		case FDT_NOP:
+			break;
+		default:
+			return next < 0 ? next : -FDT_ERR_BADSTRUCTURE;
 		}
-	}
+		if (err)
+			return err;
+		offset = next;
+	} while (tag != FDT_END);
+
+	return fdt_finish(fdt);
+}
+
+/**
+ * fdt_update_rw() - 把@orig_fdt复制到@fdt中，再用fdt_setprop()逐个修改
+ *
+ * 修改只有/chosen中的十几个属性，每次插入移动整棵树的开销不大，所以默认
+ * 使用这种方式。@orig_fdt可以等于@fdt。
+ */
+static int fdt_update_rw(void *orig_fdt, void *fdt, int new_fdt_size,
+			 const struct fdt_chosen *chosen)
+{
+	int node, num_rsv;
+	int status;
 
 	if (orig_fdt) {
 		status = fdt_open_into(orig_fdt, fdt, new_fdt_size);
@@ -106,7 +392,7 @@ static efi_status_t update_fdt(void *orig_fdt, unsigned long orig_fdt_size,
 	}
 
 	if (status != 0)
-		goto fdt_set_fail;
+		return status;
 
 	/*
 	 * Delete all memory reserve map entries. When booting via UEFI,
@@ -121,76 +407,184 @@ static efi_status_t update_fdt(void *orig_fdt, unsigned long orig_fdt_size,
 		node = fdt_add_subnode(fdt, 0, "chosen");
 		if (node < 0) {
 			/* 'node' is an error code when negative: */
-			status = node;
-			goto fdt_set_fail;
+			return node;
 		}
 	}
 
-	if (cmdline_ptr != NULL && strlen(cmdline_ptr) > 0) {
-		status = fdt_setprop(fdt, node, "bootargs", cmdline_ptr,
-				     strlen(cmdline_ptr) + 1);
+	for (int i = 0; i < chosen->nr; i++) {
+		status = fdt_setprop(fdt, node, chosen->props[i].name,
+				     chosen->props[i].val,
+				     chosen->props[i].len);
 		if (status)
-			goto fdt_set_fail;
+			return status;
 	}
 
-	/* Add FDT entries for EFI runtime services in chosen node. */
-	node = fdt_subnode_offset(fdt, 0, "chosen");
-	fdt_val64 = cpu_to_fdt64((u64)(unsigned long)ST);
+	/* Shrink the FDT back to its minimum size: */
+	return fdt_pack(fdt);
+}
 
-	status = fdt_setprop_var(fdt, node, "linux,uefi-system-table",
-				 fdt_val64);
-	if (status)
-		goto fdt_set_fail;
+static efi_status_t update_fdt(void *orig_fdt, unsigned long orig_fdt_size,
+			       void *fdt, int new_fdt_size,
+			       const struct fdt_chosen *chosen,
+			       const struct fdt_prune *prune)
+{
+	int status;
 
-	fdt_val64 = UINT64_MAX; /* placeholder */
+	/* Do some checks on provided FDT, if it exists: */
+	if (orig_fdt) {
+		if (fdt_check_header(orig_fdt)) {
+			efi_err("Device Tree header not valid!\n");
+			return EFI_LOAD_ERROR;
+		}
+		/*
+		 * We don't get the size of the FDT if we get if from a
+		 * configuration table:
+		 */
+		if (orig_fdt_size && fdt_totalsize(orig_fdt) > orig_fdt_size) {
+			efi_err("Truncated device tree! foo!\n");
+			return EFI_LOAD_ERROR;
+		}
+	}
+
+	/*
+	 * 版本0x10之前的树中节点名是完整路径，交给fdt_open_into()转换。
+	 * 只有重建时才能删除节点，@prune只会为新的树规划。
+	 */
+	if ((efi_fdt_rebuild || prune) && orig_fdt && orig_fdt != fdt &&
+	    fdt_version(orig_fdt) >= 0x10)
+		status = fdt_rebuild(orig_fdt, fdt, new_fdt_size, chosen,
+				     prune);
+	else
+		status = fdt_update_rw(orig_fdt, fdt, new_fdt_size, chosen);
 
-	status = fdt_setprop_var(fdt, node, "linux,uefi-mmap-start", fdt_val64);
+	if (status == -FDT_ERR_NOSPACE)
+		return EFI_BUFFER_TOO_SMALL;
 	if (status)
-		goto fdt_set_fail;
+		return EFI_LOAD_ERROR;
+	return EFI_SUCCESS;
+}
 
-	fdt_val32 = UINT32_MAX; /* placeholder */
+/// @brief 估算之外多留的空间，在按页取整之前加上
+#define FDT_SIZE_SLACK 256
 
-	status = fdt_setprop_var(fdt, node, "linux,uefi-mmap-size", fdt_val32);
-	if (status)
-		goto fdt_set_fail;
+/// @brief 新增一个属性最多需要的空间：属性头、对齐后的值和字符串表中的名字
+static unsigned long fdt_prop_space(const char *name, unsigned long len)
+{
+	return sizeof(struct fdt_property) + FDT_TAGALIGN(len) + strlen(name) +
+	       1;
+}
 
-	status = fdt_setprop_var(fdt, node, "linux,uefi-mmap-desc-size",
-				 fdt_val32);
-	if (status)
-		goto fdt_set_fail;
+/**
+ * fdt_extra_size() - update_fdt()最多会给@orig_fdt增加多少字节
+ *
+ * 按@chosen中的全部属性计算，不管它们是否已经存在，所以只会多估。
+ * 没有@orig_fdt时按空树计算。
+ */
+static unsigned long fdt_extra_size(const void *orig_fdt,
+				    const struct fdt_chosen *chosen)
+{
+	unsigned long size = 0;
+
+	if (!orig_fdt) {
+		/* fdt_create_empty_tree()和fdt_update_cell_size() */
+		size += sizeof(struct fdt_header) +
+			sizeof(struct fdt_reserve_entry) + 4 * FDT_TAGSIZE;
+		size += fdt_prop_space("#address-cells", sizeof(fdt32_t));
+		size += fdt_prop_space("#size-cells", sizeof(fdt32_t));
+	}
 
-	status = fdt_setprop_var(fdt, node, "linux,uefi-mmap-desc-ver",
-				 fdt_val32);
-	if (status)
-		goto fdt_set_fail;
+	/* /chosen节点本身 */
+	size += 2 * FDT_TAGSIZE + FDT_TAGALIGN(sizeof("chosen"));
 
-	bool enalbed_ramdomize_base = false;
-#ifdef CONFIG_RANDOMIZE_BASE
-	enalbed_ramdomize_base = true;
-#endif
-	if (enalbed_ramdomize_base && !efi_nokaslr) {
-		efi_status_t efi_status;
+	for (int i = 0; i < chosen->nr; i++)
+		size += fdt_prop_space(chosen->props[i].name,
+				       chosen->props[i].len);
+	return size;
+}
 
-		efi_status = efi_get_random_bytes(sizeof(fdt_val64),
-						  (u8 *)&fdt_val64);
-		if (efi_status == EFI_SUCCESS) {
-			status = fdt_setprop_var(fdt, node, "kaslr-seed",
-						 fdt_val64);
-			if (status)
-				goto fdt_set_fail;
-		}
-	}
+/// @brief @fdt中实际使用的字节数（不包括末尾的空闲空间）
+static unsigned long fdt_used_size(const void *fdt)
+{
+	/* 块的顺序不是通常的顺序时，无法确定空闲空间在哪里 */
+	if (fdt_off_dt_strings(fdt) < fdt_off_dt_struct(fdt) ||
+	    fdt_off_dt_struct(fdt) < fdt_off_mem_rsvmap(fdt))
+		return fdt_totalsize(fdt);
+	return fdt_off_dt_strings(fdt) + fdt_size_dt_strings(fdt);
+}
 
-	/* Shrink the FDT back to its minimum size: */
-	fdt_pack(fdt);
+/*
+ * 每次启动都会变的/chosen属性：kaslr-seed，stub分配的各个表和initrd的
+ * 地址，以及之后才填入的内存映射。度量FDT时把它们的值当作全0。
+ */
+static const char *const fdt_volatile_props[] = {
+	"kaslr-seed",
+	"dragonstub,boot-timestamps",
+	"dragonstub,pgtable",
+	"dragonstub,log-buf",
+	"dragonstub,memmap",
+	"linux,initrd-start",
+	"linux,initrd-end",
+	"linux,uefi-mmap-start",
+	"linux,uefi-mmap-size",
+	"linux,uefi-mmap-desc-size",
+	"linux,uefi-mmap-desc-ver",
+};
 
-	return EFI_SUCCESS;
+#define FDT_NR_VOLATILE_PROPS \
+	(sizeof(fdt_volatile_props) / sizeof(fdt_volatile_props[0]))
 
-fdt_set_fail:
-	if (status == -FDT_ERR_NOSPACE)
-		return EFI_BUFFER_TOO_SMALL;
+/// @brief 度量时要当作0的一段属性值
+struct fdt_hole {
+	const u8 *val;
+	int len;
+};
 
-	return EFI_LOAD_ERROR;
+static int fdt_hole_cmp(const void *a, const void *b)
+{
+	const struct fdt_hole *x = a, *y = b;
+
+	if (x->val == y->val)
+		return 0;
+	return x->val < y->val ? -1 : 1;
+}
+
+/**
+ * fdt_measure() - 把交给内核的FDT度量到PCR 9中
+ *
+ * 度量的是整个FDT，只是fdt_volatile_props中的属性的值按全0计算，
+ * 这样同样的固件、设备树和命令行每次启动度量出的值都相同。对
+ * /sys/firmware/fdt做同样的处理就可以重新算出这个值。
+ */
+static void fdt_measure(const void *fdt)
+{
+	static const u8 zeros[16];
+	struct fdt_hole holes[FDT_NR_VOLATILE_PROPS];
+	u8 digest[SHA256_DIGEST_SIZE];
+	struct sha256_state sha;
+	const u8 *pos = fdt;
+	int node, nr = 0;
+
+	node = fdt_subnode_offset(fdt, 0, "chosen");
+	for (u32 i = 0; node >= 0 && i < FDT_NR_VOLATILE_PROPS; i++) {
+		holes[nr].val = fdt_getprop(fdt, node, fdt_volatile_props[i],
+					    &holes[nr].len);
+		if (holes[nr].val)
+			nr++;
+	}
+	sort(holes, nr, sizeof(*holes), fdt_hole_cmp, NULL);
+
+	sha256_init(&sha);
+	for (int i = 0; i < nr; i++) {
+		sha256_update(&sha, pos, holes[i].val - pos);
+		for (int n = holes[i].len; n > 0; n -= sizeof(zeros))
+			sha256_update(&sha, zeros,
+				      min_t(int, n, sizeof(zeros)));
+		pos = holes[i].val + holes[i].len;
+	}
+	sha256_update(&sha, pos, (const u8 *)fdt + fdt_totalsize(fdt) - pos);
+	sha256_final(&sha, digest);
+	if (efi_measure_digest(digest, EFISTUB_EVT_FDT) == EFI_SUCCESS)
+		efi_info("Measured FDT SHA-256 into PCR 9\n");
 }
 
 static efi_status_t exit_boot_func(struct efi_boot_memmap *map, void *priv)
@@ -206,6 +600,8 @@ static efi_status_t exit_boot_func(struct efi_boot_memmap *map, void *priv)
 	 */
 	efi_get_virtmap(map->map, map->map_size, map->desc_size, p->runtime_map,
 			&p->runtime_entry_count);
+	efi_pgtable_map_runtime(map);
+	efi_build_compact_memmap(map);
 
 	return update_fdt_memmap(p->new_fdt_addr, map);
 }
@@ -231,6 +627,14 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 	struct exit_boot_struct priv = { 0 };
 	unsigned long fdt_addr = 0;
 	unsigned long fdt_size = 0;
+	unsigned long fdt_need, new_fdt_size;
+	bool fdt_in_place = false;
+	struct fdt_chosen chosen;
+	struct fdt_prune prune = { 0 };
+	bool fdt_pruned = false;
+	/* fdt_addr处的树是stub分配的（dtb=或者合并了overlay），用完要释放 */
+	bool fdt_allocated = false;
+	unsigned long orig_addr, orig_size;
 	if (!efi_novamap) {
 		status = efi_alloc_virtmap(&priv.runtime_map, &desc_size,
 					   &desc_ver);
@@ -239,6 +643,12 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 			return status;
 		}
 	}
+
+	status = efi_alloc_compact_memmap();
+	if (status != EFI_SUCCESS)
+		efi_warn("Unable to allocate the compact memory map: 0x%lx\n",
+			 status);
+
 	/*
 	 * Unauthenticated device tree data is a security hazard, so ignore
 	 * 'dtb=' unless UEFI Secure Boot is disabled.  We assume that secure
@@ -250,18 +660,27 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 #endif
 	print_efi_secureboot_mode(efi_get_secureboot());
 
+	fdt_collect_chosen(&chosen, cmdline_ptr);
+
 	if (!config_efi_armstub_dtb_loader ||
 	    efi_get_secureboot() != efi_secureboot_mode_disabled) {
 		if (strstr(cmdline_ptr, "dtb="))
 			efi_err("Ignoring DTB from command line.\n");
 	} else {
-		efi_todo("Load DTB from command line\n");
-		// status = efi_load_dtb(image, &fdt_addr, &fdt_size);
-
-		// if (status != EFI_SUCCESS && status != EFI_NOT_READY) {
-		// 	efi_err("Failed to load device tree!\n");
-		// 	goto fail;
-		// }
+		/*
+		 * 留出update_fdt()需要的空间，通常可以直接在读入的树上修改。
+		 * 按空树估算只会偏大。
+		 */
+		status = efi_load_dtb(image, cmdline_ptr,
+				      fdt_extra_size(NULL, &chosen) +
+					      FDT_SIZE_SLACK,
+				      &fdt_addr, &fdt_size);
+		if (status == EFI_SUCCESS) {
+			fdt_allocated = true;
+		} else if (status != EFI_NOT_READY) {
+			efi_err("Failed to load device tree!\n");
+			goto fail;
+		}
 	}
 
 	if (fdt_addr) {
@@ -276,15 +695,98 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 	if (!fdt_addr)
 		efi_info("Generating empty DTB\n");
 
-	status = efi_allocate_pages(MAX_FDT_SIZE, new_fdt_addr, ULONG_MAX);
-	if (status != EFI_SUCCESS) {
-		efi_err("Unable to allocate memory for new device tree.\n");
-		goto fail;
-	}
-	efi_debug("New FDT address: 0x%lx\n", *new_fdt_addr);
 	efi_info("Generating new FDT...\n");
-	status = update_fdt((void *)fdt_addr, fdt_size, (void *)*new_fdt_addr,
-			    MAX_FDT_SIZE, cmdline_ptr);
+	boot_ts_begin(DRAGONSTUB_PHASE_FDT);
+	/*
+	 * overlay合并到新分配的内存中，其中留出update_fdt()需要的空间，
+	 * 这样通常可以直接在合并之后的树上修改。
+	 */
+	orig_addr = fdt_addr;
+	orig_size = fdt_size;
+	status = efi_fdt_apply_overlays(image, cmdline_ptr,
+					fdt_extra_size((void *)fdt_addr,
+						       &chosen) +
+						FDT_SIZE_SLACK,
+					&fdt_addr, &fdt_size);
+	if (status == EFI_SUCCESS) {
+		if (fdt_allocated)
+			efi_free(orig_size, orig_addr);
+		fdt_allocated = true;
+	} else if (status != EFI_NOT_READY)
+		efi_warn("Not applying device tree overlays: 0x%lx\n", status);
+
+	/*
+	 * 新的树只比原来的树多出update_fdt()设置的那些属性，按它们的大小
+	 * 分配一次。估算只会偏大，万一空间还是不够，就加倍重试。
+	 */
+	fdt_need = fdt_extra_size((void *)fdt_addr, &chosen);
+	if (fdt_addr)
+		fdt_need += fdt_used_size((void *)fdt_addr);
+
+	new_fdt_size = round_up(fdt_need + FDT_SIZE_SLACK, EFI_PAGE_SIZE);
+
+	/*
+	 * 删除节点要在重建时完成，原地修改时不能删除。规划失败不影响启动，
+	 * 只是不删除。估算的大小不扣除删掉的部分，只会偏大。
+	 */
+	if (fdt_addr && !fdt_check_header((void *)fdt_addr) &&
+	    fdt_version((void *)fdt_addr) >= 0x10) {
+		status = efi_fdt_prune_plan((void *)fdt_addr, cmdline_ptr,
+					    &prune);
+		if (status == EFI_SUCCESS)
+			fdt_pruned = true;
+		else if (status != EFI_NOT_READY)
+			efi_warn("Not pruning the FDT: 0x%lx\n", status);
+	}
+	/*
+	 * 只在stub自己分配的树（dtb=或者合并了overlay）上原地修改。固件的树
+	 * 总是复制一份：它可能是固件还要使用的配置表，也可能位于内核会覆盖
+	 * 的内存中。
+	 */
+	if (fdt_allocated && !fdt_pruned &&
+	    fdt_need <= fdt_totalsize((void *)fdt_addr)) {
+		*new_fdt_addr = fdt_addr;
+		status = update_fdt((void *)fdt_addr, fdt_size,
+				    (void *)*new_fdt_addr,
+				    fdt_totalsize((void *)fdt_addr), &chosen,
+				    NULL);
+		if (status == EFI_SUCCESS) {
+			efi_info("Updated the FDT in place\n");
+			fdt_in_place = true;
+		}
+	}
+	while (!fdt_in_place) {
+		status = efi_allocate_pages(new_fdt_size, new_fdt_addr,
+					    ULONG_MAX);
+		if (status != EFI_SUCCESS) {
+			efi_err("Unable to allocate memory for new device tree.\n");
+			boot_ts_end(DRAGONSTUB_PHASE_FDT);
+			efi_fdt_prune_free(&prune);
+			goto fail;
+		}
+		efi_debug("New FDT address: 0x%lx, size: 0x%lx\n",
+			  *new_fdt_addr, new_fdt_size);
+		status = update_fdt((void *)fdt_addr, fdt_size,
+				    (void *)*new_fdt_addr, new_fdt_size,
+				    &chosen, fdt_pruned ? &prune : NULL);
+		if (status != EFI_BUFFER_TOO_SMALL)
+			break;
+
+		efi_warn("FDT size estimate of 0x%lx bytes was too small\n",
+			 new_fdt_size);
+		efi_free(new_fdt_size, *new_fdt_addr);
+		new_fdt_size *= 2;
+	}
+	boot_ts_end(DRAGONSTUB_PHASE_FDT);
+	if (fdt_pruned && status == EFI_SUCCESS)
+		efi_info("Pruned %u nodes (%u bytes) from the FDT\n",
+			 prune.nr_nodes, prune.bytes);
+	efi_fdt_prune_free(&prune);
+	/* stub分配的树已经复制到新的树中，不再需要 */
+	if (fdt_allocated && !fdt_in_place && status == EFI_SUCCESS) {
+		efi_free(fdt_size, fdt_addr);
+		fdt_size = 0;
+	}
 
 	if (status != EFI_SUCCESS) {
 		efi_err("Unable to construct new device tree.\n");
@@ -293,6 +795,14 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 
 	priv.new_fdt_addr = (void *)*new_fdt_addr;
 
+	/*
+	 * 退出boot services之后就不能再访问TPM了，所以在这里度量FDT。
+	 * 之后只有/chosen中的linux,uefi-mmap-*会被原地改写为最终的内存映射，
+	 * 它们不参与度量。
+	 */
+	if (efi_measurement_enabled())
+		fdt_measure(priv.new_fdt_addr);
+
 	efi_info("Exiting boot services...\n");
 	status = efi_exit_boot_services(handle, &priv, exit_boot_func);
 
@@ -313,7 +823,7 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 			 */
 		if (status != EFI_SUCCESS) {
 			efi_memory_desc_t *p;
-			int l;
+			unsigned long l;
 
 			/*
 				 * Set the virtual address field of all
@@ -328,6 +838,14 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 				if (p->Attribute & EFI_MEMORY_RUNTIME)
 					p->VirtualStart = UINT64_MAX;
 			}
+
+			struct dragonstub_memmap *memmap = efi_compact_memmap();
+			for (u32 i = 0; memmap && i < memmap->nr_entries; i++) {
+				if (memmap->entries[i].attribute &
+				    EFI_MEMORY_RUNTIME)
+					memmap->entries[i].virt_start =
+						UINT64_MAX;
+			}
 		}
 		return EFI_SUCCESS;
 	}
@@ -335,10 +853,13 @@ static efi_status_t allocate_new_fdt_and_exit_boot(void *handle,
 	efi_err("Exit boot services failed.\n");
 
 fail_free_new_fdt:
-	efi_free(MAX_FDT_SIZE, *new_fdt_addr);
+	if (!fdt_in_place)
+		efi_free(new_fdt_size, *new_fdt_addr);
 
 fail:
-	efi_free(fdt_size, fdt_addr);
+	/* 固件的树不是stub分配的，不能释放 */
+	if (fdt_allocated)
+		efi_free(fdt_size, fdt_addr);
 
 	efi_bs_call(FreePool, priv.runtime_map);
 
@@ -355,15 +876,31 @@ efi_status_t efi_boot_kernel(efi_handle_t handle,
 
 	efi_info("Loading ELF payload...\n");
 	// 加载ELF
+	boot_ts_begin(DRAGONSTUB_PHASE_LOAD_ELF);
+	if (efi_smp)
+		efi_smp_start();
 	status = load_elf(payload_info);
+	// 辅助核只在加载内核时使用，退出boot services之前交还给固件
+	efi_smp_stop();
+	boot_ts_end(DRAGONSTUB_PHASE_LOAD_ELF);
 
 	if (status != EFI_SUCCESS) {
-		efi_err("Failed to load ELF payload, efi error code: %d\n",
+		efi_err("Failed to load ELF payload, efi error code: 0x%lx\n",
 			status);
 		return status;
 	}
 
-	efi_debug("kernel entry point: 0x%lx\n", payload_info->kernel_entry);
+	efi_debug("kernel entry point: 0x%llx\n", payload_info->kernel_entry);
+
+	// 页表要在生成FDT之前建立，FDT中要记录它的地址
+	if (efi_mmu) {
+		boot_ts_begin(DRAGONSTUB_PHASE_PGTABLE);
+		status = efi_setup_pgtable(payload_info);
+		boot_ts_end(DRAGONSTUB_PHASE_PGTABLE);
+		if (status != EFI_SUCCESS)
+			efi_warn("Failed to build page tables, entering the kernel with the MMU off\n");
+	}
+
 	status = allocate_new_fdt_and_exit_boot(handle, loaded_image, &fdt_addr,
 						cmdline_ptr);
 	if (status != EFI_SUCCESS) {
@@ -374,6 +911,8 @@ efi_status_t efi_boot_kernel(efi_handle_t handle,
 	efi_handle_post_ebs_state();
 #endif
 
+	boot_ts_begin(DRAGONSTUB_PHASE_KERNEL_JUMP);
+	boot_ts_end(DRAGONSTUB_PHASE_KERNEL_JUMP);
 	efi_enter_kernel(payload_info, fdt_addr,
 			 fdt_totalsize((void *)fdt_addr));
 	/* not reached */
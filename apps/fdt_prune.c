@@ -0,0 +1,691 @@
+#include <dragonstub/dragonstub.h>
+#include <libfdt.h>
+#include <libfdt_internal.h>
+
+/*
+ * 裁剪交给内核的FDT（efi=fdtprune、fdtprune=<path>）
+ *
+ * 内核会解析FDT中的每一个节点，包括板级DTS中大量status = "disabled"的节点。
+ * 这里在原来的树上先规划好要删除哪些子树和属性，fdt_rebuild()遍历的时候
+ * 直接跳过它们，所以删除多少节点都只需要复制一次树。规划只遍历原来的树
+ * 两次：第一次找出要删除的子树，第二次找出对它们的引用和别名。
+ *
+ * 被禁用的节点如果还被其他节点通过phandle引用（例如被禁用的核中的中断控制器
+ * 仍然出现在PLIC的interrupts-extended中），删除之后引用就悬空了，所以保留。
+ * 属性中哪些cell是phandle取决于binding，这里只检查已知会引用phandle的属性，
+ * 把其中的每个cell都当作可能的phandle：误判只会多保留节点。
+ * /aliases和/__symbols__中指向被删除节点的项也一起删除。
+ * fdtprune=给出的路径总是删除。
+ */
+
+/// @brief fdtprune=最多可以指定这么多个路径
+#define FDT_PRUNE_MAX_PATHS 16
+
+/// @brief 缓存的属性分类数量，按原来的树中的名字偏移索引
+#define PRUNE_NAME_CACHE_SIZE 64
+
+/// @brief 子树和phandle数组的初始容量，不够时加倍
+#define PRUNE_MIN_CAPACITY 64
+
+/// @brief 匹配别名时节点路径的最大长度和树的最大深度，超过的节点不匹配
+#define PRUNE_PATH_MAX 256
+#define PRUNE_MAX_DEPTH 32
+
+/// @brief 规划时关心的几类属性
+enum prune_prop_kind {
+	PRUNE_PROP_OTHER,
+	PRUNE_PROP_STATUS,
+	PRUNE_PROP_PHANDLE,
+	/// @brief 值中可能有phandle
+	PRUNE_PROP_REFS,
+};
+
+/// @brief 候选的子树中出现的phandle
+struct prune_phandle {
+	u32 phandle;
+	u32 range;
+};
+
+/// @brief /aliases或/__symbols__中的一项
+struct prune_alias {
+	const char *path;
+	int offset;
+	/// @brief 指向的节点所在的候选子树，-1表示不在任何一个中
+	int range;
+};
+
+/// @brief 遍历时当前节点的路径，用来匹配别名
+struct prune_path {
+	char buf[PRUNE_PATH_MAX];
+	/// @brief 路径的长度，-1表示太长
+	int len;
+	int depth;
+	int saved[PRUNE_MAX_DEPTH];
+};
+
+/// @brief 规划时使用的状态
+struct prune_scan {
+	const void *fdt;
+	/// @brief fdtprune=给出的节点在原来的树中的偏移
+	int paths[FDT_PRUNE_MAX_PATHS];
+	int nr_paths;
+	/// @brief 候选的子树，按偏移排序
+	struct fdt_prune_range *ranges;
+	u32 nr_ranges;
+	u32 cap_ranges;
+	/// @brief 候选的子树中出现的phandle，找完之后按phandle排序
+	struct prune_phandle *phandles;
+	u32 nr_phandles;
+	u32 cap_phandles;
+	/// @brief /aliases和/__symbols__，以及其中的项，按路径排序
+	int alias_nodes[2];
+	struct prune_alias *aliases;
+	u32 nr_aliases;
+	/// @brief 属性名偏移到分类的缓存，两遍扫描都要对每个属性分类
+	struct {
+		int nameoff;
+		enum prune_prop_kind kind;
+	} names[PRUNE_NAME_CACHE_SIZE];
+};
+
+/// @brief 按名字判断属性的值中是否可能有phandle
+static bool prop_has_phandles(const char *name)
+{
+	static const char *const names[] = {
+		"interrupt-parent",
+		"interrupts-extended",
+		"interrupt-map",
+		"clocks",
+		"assigned-clocks",
+		"assigned-clock-parents",
+		"resets",
+		"power-domains",
+		"phys",
+		"dmas",
+		"iommus",
+		"iommu-map",
+		"msi-parent",
+		"msi-map",
+		"mboxes",
+		"memory-region",
+		"nvmem-cells",
+		"pwms",
+		"io-channels",
+		"interconnects",
+		"hwlocks",
+		"remote-endpoint",
+		"cpu",
+		"next-level-cache",
+		"cpu-idle-states",
+		"operating-points-v2",
+		"thermal-sensors",
+		"cooling-device",
+		"wakeup-parent",
+		"sound-dai",
+		"gpio",
+		"gpios",
+	};
+	int n = strlen(name);
+
+	if (!strncmp(name, "pinctrl-", 8) && name[8] >= '0' && name[8] <= '9')
+		return true;
+	if ((n > 7 && !strcmp(name + n - 7, "-supply")) ||
+	    (n > 6 && !strcmp(name + n - 6, "-gpios")) ||
+	    (n > 5 && !strcmp(name + n - 5, "-gpio")))
+		return true;
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcmp(name, names[i]))
+			return true;
+	}
+	return false;
+}
+
+/// @brief 节点@offset是否由fdtprune=指定
+static bool prune_node_forced(const struct prune_scan *scan, int offset)
+{
+	for (int i = 0; i < scan->nr_paths; i++) {
+		if (scan->paths[i] == offset)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * prune_prop() - 取出@offset处的属性，并按名字分类
+ *
+ * 同一个名字在树中只存一次，按名字偏移缓存分类的结果，大多数属性不需要
+ * 再比较名字。@offset必须是fdt_next_tag()返回过FDT_PROP的偏移。
+ */
+static const struct fdt_property *prune_prop(struct prune_scan *scan,
+					     int offset,
+					     enum prune_prop_kind *kind)
+{
+	const struct fdt_property *prop = fdt_offset_ptr_(scan->fdt, offset);
+	int nameoff = fdt32_to_cpu(prop->nameoff);
+	int slot = nameoff % PRUNE_NAME_CACHE_SIZE;
+	const char *name;
+
+	if (scan->names[slot].nameoff != nameoff) {
+		name = fdt_string(scan->fdt, nameoff);
+		if (!name)
+			return NULL;
+		if (!strcmp(name, "status"))
+			scan->names[slot].kind = PRUNE_PROP_STATUS;
+		else if (!strcmp(name, "phandle") ||
+			 !strcmp(name, "linux,phandle"))
+			scan->names[slot].kind = PRUNE_PROP_PHANDLE;
+		else if (prop_has_phandles(name))
+			scan->names[slot].kind = PRUNE_PROP_REFS;
+		else
+			scan->names[slot].kind = PRUNE_PROP_OTHER;
+		scan->names[slot].nameoff = nameoff;
+	}
+	*kind = scan->names[slot].kind;
+	return prop;
+}
+
+/// @brief status是否表示节点被禁用，与内核的of_device_is_available()一致
+static bool prop_disabled(const struct fdt_property *prop)
+{
+	int len = fdt32_to_cpu(prop->len);
+
+	if (len == sizeof("okay") && !memcmp(prop->data, "okay", len))
+		return false;
+	if (len == sizeof("ok") && !memcmp(prop->data, "ok", len))
+		return false;
+	return len > 0;
+}
+
+/// @brief 把*@array的容量加倍（至少PRUNE_MIN_CAPACITY项），已有的@nr项复制过去
+static efi_status_t prune_grow(void **array, u32 nr, u32 *capacity,
+			       size_t size)
+{
+	u32 cap = max_t(u32, *capacity * 2, PRUNE_MIN_CAPACITY);
+	efi_status_t status;
+	void *new;
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData, cap * size, &new);
+	if (status != EFI_SUCCESS)
+		return status;
+	if (*array) {
+		memcpy(new, *array, nr * size);
+		efi_bs_call(FreePool, *array);
+	}
+	*array = new;
+	*capacity = cap;
+	return EFI_SUCCESS;
+}
+
+/// @brief 在@start开始一个新的子树，内存不够时返回NULL
+static struct fdt_prune_range *prune_add_range(struct prune_scan *scan,
+					       int start)
+{
+	struct fdt_prune_range *r;
+
+	if (scan->nr_ranges == scan->cap_ranges &&
+	    prune_grow((void **)&scan->ranges, scan->nr_ranges,
+		       &scan->cap_ranges, sizeof(*r)) != EFI_SUCCESS)
+		return NULL;
+
+	r = &scan->ranges[scan->nr_ranges++];
+	r->start = start;
+	r->end = start;
+	r->nr_nodes = 0;
+	r->keep = false;
+	return r;
+}
+
+/// @brief 记录最后一个子树中的@phandle
+static bool prune_add_phandle(struct prune_scan *scan, u32 phandle)
+{
+	if (scan->nr_phandles == scan->cap_phandles &&
+	    prune_grow((void **)&scan->phandles, scan->nr_phandles,
+		       &scan->cap_phandles,
+		       sizeof(*scan->phandles)) != EFI_SUCCESS)
+		return false;
+
+	scan->phandles[scan->nr_phandles].phandle = phandle;
+	scan->phandles[scan->nr_phandles].range = scan->nr_ranges - 1;
+	scan->nr_phandles++;
+	return true;
+}
+
+/// @brief 记下/aliases和/__symbols__，免得再为它们遍历一次树
+static void prune_alias_node(struct prune_scan *scan, int offset)
+{
+	const struct fdt_node_header *nh = fdt_offset_ptr_(scan->fdt, offset);
+
+	if (!strcmp(nh->name, "aliases"))
+		scan->alias_nodes[0] = offset;
+	else if (!strcmp(nh->name, "__symbols__"))
+		scan->alias_nodes[1] = offset;
+}
+
+/**
+ * prune_find_ranges() - 找出所有要删除的子树，以及其中的phandle
+ *
+ * fdtprune=给出的节点在开始时就能确定；被禁用的节点要读到status才知道，
+ * 这时子树从当前节点开始，它在status之前的phandle也要补上。根节点和
+ * /chosen不删除，已经在要删除的子树中的节点不用再看。
+ *
+ * Return: 0，libfdt的错误码，内存不够时返回-FDT_ERR_NOSPACE
+ */
+static int prune_find_ranges(struct prune_scan *scan)
+{
+	const void *fdt = scan->fdt;
+	int chosen = fdt_subnode_offset(fdt, 0, "chosen");
+	struct fdt_prune_range *r = NULL;
+	int depth = 0, range_depth = 0;
+	int offset = 0, next, node = 0;
+	bool node_phandle = false;
+	u32 phandle = 0;
+	u32 tag;
+
+	do {
+		const struct fdt_property *prop;
+		enum prune_prop_kind kind;
+
+		tag = fdt_next_tag(fdt, offset, &next);
+		switch (tag) {
+		case FDT_BEGIN_NODE:
+			depth++;
+			node = offset;
+			node_phandle = false;
+			if (depth == 2)
+				prune_alias_node(scan, offset);
+			if (!range_depth && depth > 1 && offset != chosen &&
+			    prune_node_forced(scan, offset)) {
+				r = prune_add_range(scan, offset);
+				if (!r)
+					return -FDT_ERR_NOSPACE;
+				range_depth = depth;
+			}
+			if (range_depth)
+				r->nr_nodes++;
+			break;
+		case FDT_PROP:
+			prop = prune_prop(scan, offset, &kind);
+			if (!prop)
+				return -FDT_ERR_BADSTRUCTURE;
+			if (kind == PRUNE_PROP_PHANDLE &&
+			    fdt32_to_cpu(prop->len) == sizeof(fdt32_t)) {
+				phandle = fdt32_ld_(
+					(const fdt32_t *)prop->data);
+				if (!range_depth)
+					node_phandle = true;
+				else if (!prune_add_phandle(scan, phandle))
+					return -FDT_ERR_NOSPACE;
+			}
+			if (kind != PRUNE_PROP_STATUS || range_depth ||
+			    !efi_fdt_prune || depth < 2 || node == chosen ||
+			    !prop_disabled(prop))
+				break;
+
+			r = prune_add_range(scan, node);
+			if (!r)
+				return -FDT_ERR_NOSPACE;
+			r->nr_nodes = 1;
+			range_depth = depth;
+			if (node_phandle && !prune_add_phandle(scan, phandle))
+				return -FDT_ERR_NOSPACE;
+			break;
+		case FDT_END_NODE:
+			if (range_depth == depth) {
+				r->end = next;
+				range_depth = 0;
+			}
+			depth--;
+			break;
+		case FDT_END:
+			if (next < 0)
+				return next;
+			break;
+		case FDT_NOP:
+			break;
+		default:
+			return next < 0 ? next : -FDT_ERR_BADSTRUCTURE;
+		}
+		offset = next;
+	} while (tag != FDT_END);
+
+	return 0;
+}
+
+/// @brief 按phandle排序。dtc通常按顺序分配phandle，但不能依赖这一点
+static int phandle_cmp(const void *a, const void *b)
+{
+	u32 l = ((const struct prune_phandle *)a)->phandle;
+	u32 r = ((const struct prune_phandle *)b)->phandle;
+
+	return l < r ? -1 : l > r;
+}
+
+static int alias_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct prune_alias *)a)->path,
+		      ((const struct prune_alias *)b)->path);
+}
+
+static int offset_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/// @brief 查找@phandle，返回它所在的子树，没有找到返回-1
+static int phandle_range(const struct prune_scan *scan, u32 phandle)
+{
+	u32 lo = 0, hi = scan->nr_phandles;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (scan->phandles[mid].phandle == phandle)
+			return scan->phandles[mid].range;
+		if (scan->phandles[mid].phandle < phandle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+/// @brief 进入@offset处的节点，太深的节点不记录路径
+static void path_enter(struct prune_path *p, const void *fdt, int offset)
+{
+	const struct fdt_node_header *nh;
+	int n;
+
+	if (p->depth >= PRUNE_MAX_DEPTH) {
+		p->depth++;
+		return;
+	}
+	p->saved[p->depth++] = p->len;
+	if (p->depth == 1 || p->len < 0)
+		return;
+
+	nh = fdt_offset_ptr_(fdt, offset);
+	n = strlen(nh->name);
+	if (p->len + 1 + n >= PRUNE_PATH_MAX) {
+		p->len = -1;
+		return;
+	}
+	p->buf[p->len] = '/';
+	memcpy(p->buf + p->len + 1, nh->name, n);
+	p->len += 1 + n;
+}
+
+static void path_leave(struct prune_path *p)
+{
+	if (--p->depth < PRUNE_MAX_DEPTH)
+		p->len = p->saved[p->depth];
+}
+
+/**
+ * prune_match_aliases() - 指向@p或者其下节点的项都在第@range个子树中
+ *
+ * 以@p开头的项按路径排在一起，二分查找第一个。
+ */
+static void prune_match_aliases(struct prune_scan *scan,
+				const struct prune_path *p, int range)
+{
+	u32 lo = 0, hi = scan->nr_aliases;
+
+	if (p->depth > PRUNE_MAX_DEPTH || p->len <= 0)
+		return;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (strncmp(scan->aliases[mid].path, p->buf, p->len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < scan->nr_aliases &&
+	       !strncmp(scan->aliases[lo].path, p->buf, p->len);
+	     lo++) {
+		char c = scan->aliases[lo].path[p->len];
+
+		if (!c || c == '/')
+			scan->aliases[lo].range = range;
+	}
+}
+
+/**
+ * prune_keep_referenced() - 保留仍然被引用的子树
+ *
+ * 引用来自另一个要删除的子树时也保留，这样就不需要反复迭代。
+ * fdtprune=给出的子树不受影响。有别名时顺便记下每个候选子树的路径，
+ * 找出指向它们的项，而不是为每一项调用fdt_path_offset()从头遍历树。
+ */
+static int prune_keep_referenced(struct prune_scan *scan)
+{
+	const void *fdt = scan->fdt;
+	struct prune_path path = { .len = 0 };
+	int offset = 0, next;
+	u32 range = 0, start = 0;
+	u32 tag;
+
+	for (;;) {
+		const struct fdt_property *prop;
+		enum prune_prop_kind kind;
+		const fdt32_t *cells;
+		int len;
+
+		tag = fdt_next_tag(fdt, offset, &next);
+		switch (tag) {
+		case FDT_BEGIN_NODE:
+			if (!scan->nr_aliases)
+				break;
+			path_enter(&path, fdt, offset);
+			while (start < scan->nr_ranges &&
+			       scan->ranges[start].start < offset)
+				start++;
+			if (start < scan->nr_ranges &&
+			    scan->ranges[start].start == offset)
+				prune_match_aliases(scan, &path, start);
+			break;
+		case FDT_END_NODE:
+			if (scan->nr_aliases)
+				path_leave(&path);
+			break;
+		case FDT_END:
+			return next < 0 ? next : 0;
+		}
+		if (tag != FDT_PROP) {
+			offset = next;
+			continue;
+		}
+
+		prop = prune_prop(scan, offset, &kind);
+		if (!prop)
+			return -FDT_ERR_BADSTRUCTURE;
+		len = fdt32_to_cpu(prop->len);
+		offset = next;
+		if (kind != PRUNE_PROP_REFS || !len || len % sizeof(fdt32_t))
+			continue;
+
+		/* 第一个还没有结束的子树，这个属性可能在它之中 */
+		while (range < scan->nr_ranges &&
+		       scan->ranges[range].end <= offset)
+			range++;
+
+		cells = (const fdt32_t *)prop->data;
+		for (int i = 0; i < len / (int)sizeof(fdt32_t); i++) {
+			int r = phandle_range(scan, fdt32_ld_(&cells[i]));
+
+			/* 子树内部的引用不算 */
+			if (r < 0 || ((u32)r == range &&
+				      scan->ranges[r].start < offset))
+				continue;
+			if (!prune_node_forced(scan, scan->ranges[r].start))
+				scan->ranges[r].keep = true;
+		}
+	}
+}
+
+/**
+ * prune_find_aliases() - 取出/aliases和/__symbols__中的项，按路径排序
+ *
+ * 只匹配完整的路径。指向不存在的节点的别名会被内核忽略，所以漏掉的项
+ * 也不会出问题。
+ */
+static int prune_find_aliases(struct prune_scan *scan)
+{
+	const void *fdt = scan->fdt;
+	u32 nr = 0;
+	int offset;
+
+	for (int n = 0; n < 2; n++) {
+		if (scan->alias_nodes[n] < 0)
+			continue;
+		fdt_for_each_property_offset(offset, fdt, scan->alias_nodes[n])
+			nr++;
+	}
+	if (!nr)
+		return 0;
+
+	if (efi_bs_call(AllocatePool, EfiLoaderData,
+			nr * sizeof(*scan->aliases),
+			(void **)&scan->aliases) != EFI_SUCCESS)
+		return -FDT_ERR_NOSPACE;
+
+	for (int n = 0; n < 2; n++) {
+		int node = scan->alias_nodes[n];
+
+		if (node < 0)
+			continue;
+		fdt_for_each_property_offset(offset, fdt, node) {
+			struct prune_alias *alias;
+			const char *path;
+			int len;
+
+			path = fdt_getprop_by_offset(fdt, offset, NULL, &len);
+			if (!path || len < 2 || path[0] != '/' ||
+			    path[len - 1])
+				continue;
+			alias = &scan->aliases[scan->nr_aliases++];
+			alias->path = path;
+			alias->offset = offset;
+			alias->range = -1;
+		}
+	}
+	sort(scan->aliases, scan->nr_aliases, sizeof(*scan->aliases),
+	     alias_cmp, NULL);
+	return 0;
+}
+
+/// @brief 删除指向最终要删除的子树的项，@prune->props按偏移排序
+static int prune_alias_props(struct prune_scan *scan, struct fdt_prune *prune)
+{
+	u32 nr = 0;
+
+	for (u32 i = 0; i < scan->nr_aliases; i++) {
+		int r = scan->aliases[i].range;
+
+		if (r >= 0 && !scan->ranges[r].keep)
+			nr++;
+	}
+	if (!nr)
+		return 0;
+
+	if (efi_bs_call(AllocatePool, EfiLoaderData, nr * sizeof(*prune->props),
+			(void **)&prune->props) != EFI_SUCCESS)
+		return -FDT_ERR_NOSPACE;
+
+	for (u32 i = 0; i < scan->nr_aliases; i++) {
+		const struct fdt_property *prop;
+		int r = scan->aliases[i].range;
+
+		if (r < 0 || scan->ranges[r].keep)
+			continue;
+		prop = fdt_offset_ptr_(scan->fdt, scan->aliases[i].offset);
+		prune->props[prune->nr_props++] = scan->aliases[i].offset;
+		prune->bytes += sizeof(struct fdt_property) +
+				FDT_TAGALIGN(fdt32_to_cpu(prop->len));
+	}
+	sort(prune->props, prune->nr_props, sizeof(*prune->props), offset_cmp,
+	     NULL);
+	return 0;
+}
+
+efi_status_t efi_fdt_prune_plan(const void *fdt, const char *cmdline,
+				struct fdt_prune *prune)
+{
+	struct prune_scan scan = { .fdt = fdt, .alias_nodes = { -1, -1 } };
+	u32 nr = 0;
+	int err;
+
+	memset(prune, 0, sizeof(*prune));
+	for (int i = 0; i < PRUNE_NAME_CACHE_SIZE; i++)
+		scan.names[i].nameoff = -1;
+
+	for (int i = 0;; i++) {
+		char *path;
+		int offset;
+
+		if (efi_cmdline_get_option(cmdline, "fdtprune", i, &path) !=
+		    EFI_SUCCESS)
+			break;
+		offset = fdt_path_offset(fdt, path);
+		if (offset <= 0)
+			efi_warn("fdtprune=%s: no such node\n", path);
+		else if (scan.nr_paths == FDT_PRUNE_MAX_PATHS)
+			efi_warn("Too many fdtprune= options, at most %d\n",
+				 FDT_PRUNE_MAX_PATHS);
+		else
+			scan.paths[scan.nr_paths++] = offset;
+		efi_bs_call(FreePool, path);
+	}
+	if (!efi_fdt_prune && !scan.nr_paths)
+		return EFI_NOT_READY;
+
+	err = prune_find_ranges(&scan);
+	if (!err && scan.nr_ranges) {
+		sort(scan.phandles, scan.nr_phandles, sizeof(*scan.phandles),
+		     phandle_cmp, NULL);
+		err = prune_find_aliases(&scan);
+		err = err ?: prune_keep_referenced(&scan);
+		err = err ?: prune_alias_props(&scan, prune);
+	}
+	if (scan.phandles)
+		efi_bs_call(FreePool, scan.phandles);
+	if (scan.aliases)
+		efi_bs_call(FreePool, scan.aliases);
+	if (err) {
+		if (scan.ranges)
+			efi_bs_call(FreePool, scan.ranges);
+		efi_fdt_prune_free(prune);
+		efi_warn("Failed to scan the FDT for pruning: %d\n", err);
+		return EFI_LOAD_ERROR;
+	}
+
+	/* 被引用的子树保留，其余的就地移到前面 */
+	prune->ranges = scan.ranges;
+	for (u32 i = 0; i < scan.nr_ranges; i++) {
+		struct fdt_prune_range *r = &scan.ranges[i];
+
+		if (r->keep)
+			continue;
+		prune->ranges[nr++] = *r;
+		prune->nr_nodes += r->nr_nodes;
+		prune->bytes += r->end - r->start;
+	}
+	prune->nr_ranges = nr;
+	if (nr < scan.nr_ranges)
+		efi_debug("Keeping %u disabled nodes that are still referenced\n",
+			  scan.nr_ranges - nr);
+	if (!nr) {
+		efi_fdt_prune_free(prune);
+		return EFI_NOT_READY;
+	}
+	return EFI_SUCCESS;
+}
+
+void efi_fdt_prune_free(struct fdt_prune *prune)
+{
+	if (prune->ranges)
+		efi_bs_call(FreePool, prune->ranges);
+	if (prune->props)
+		efi_bs_call(FreePool, prune->props);
+	memset(prune, 0, sizeof(*prune));
+}
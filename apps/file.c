@@ -0,0 +1,334 @@
+#include <dragonstub/dragonstub.h>
+#include <dragonstub/linux/math.h>
+#include <dragonstub/linux/sizes.h>
+#include <libfdt.h>
+
+/*
+ * 读取启动卷（DragonStub所在的卷）上的文件
+ *
+ * 文件路径来自命令行中的选项（例如kernel=），可以用'/'或'\'分隔。
+ */
+
+/*
+ * 有些固件一次Read()太多数据会出错，每次最多读取这么多
+ */
+#define EFI_READ_CHUNK_SIZE SZ_1M
+
+/**
+ * efi_cmdline_get_option() - 取出命令行中第@index个@param=<value>选项的值
+ * @cmdline:	命令行
+ * @param:	选项名（不包括'='）
+ * @index:	同一个选项出现多次时，要取出第几个（从0开始）
+ * @ret_val:	返回选项的值，使用完之后需要用FreePool释放
+ *
+ * Return:	找到了返回EFI_SUCCESS，没有找到返回EFI_NOT_FOUND
+ */
+efi_status_t efi_cmdline_get_option(const char *cmdline, const char *param,
+				    int index, char **ret_val)
+{
+	efi_status_t status;
+	char *str, *buf, *ret;
+	size_t len;
+
+	if (!cmdline)
+		return EFI_NOT_FOUND;
+
+	len = strnlen(cmdline, COMMAND_LINE_SIZE - 1) + 1;
+	status = efi_bs_call(AllocatePool, EfiLoaderData, len, (void **)&buf);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	memcpy(buf, cmdline, len - 1);
+	buf[len - 1] = '\0';
+	str = skip_spaces(buf);
+
+	status = EFI_NOT_FOUND;
+	while (*str) {
+		char *key, *val;
+
+		str = next_arg(str, &key, &val);
+		if (!val && !strcmp(key, "--"))
+			break;
+		if (!val || strcmp(key, param) || index-- > 0)
+			continue;
+
+		len = strlen(val) + 1;
+		status = efi_bs_call(AllocatePool, EfiLoaderData, len,
+				     (void **)&ret);
+		if (status != EFI_SUCCESS)
+			break;
+		memcpy(ret, val, len);
+		*ret_val = ret;
+		break;
+	}
+
+	efi_bs_call(FreePool, buf);
+	return status;
+}
+
+/**
+ * efi_open_file() - 打开启动卷上的文件
+ * @image:	DragonStub的loaded image
+ * @path:	文件路径
+ * @file:	返回打开的文件
+ */
+efi_status_t efi_open_file(efi_loaded_image_t *image, const char *path,
+			   struct efi_file *file)
+{
+	EFI_FILE_HANDLE root, fh;
+	EFI_FILE_INFO *info;
+	efi_char16_t *wpath = NULL;
+	efi_status_t status;
+	size_t len, i;
+
+	root = LibOpenRoot(image->DeviceHandle);
+	if (!root) {
+		efi_err("Failed to open the boot volume\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	len = strlen(path);
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     (len + 1) * sizeof(efi_char16_t),
+			     (void **)&wpath);
+	if (status != EFI_SUCCESS)
+		goto close_root;
+
+	for (i = 0; i < len; i++)
+		wpath[i] = path[i] == '/' ? L'\\' : (efi_char16_t)path[i];
+	wpath[len] = L'\0';
+
+	status = efi_call_proto(root, Open, &fh, wpath, EFI_FILE_MODE_READ,
+				(u64)0);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to open file %s: 0x%lx\n", path, status);
+		goto free_path;
+	}
+
+	info = LibFileInfo(fh);
+	if (!info) {
+		efi_err("Failed to get the size of %s\n", path);
+		efi_call_proto(fh, Close);
+		status = EFI_LOAD_ERROR;
+		goto free_path;
+	}
+
+	file->handle = fh;
+	file->size = info->FileSize;
+	efi_bs_call(FreePool, info);
+	efi_debug("Opened %s, size: %llu bytes\n", path, file->size);
+
+free_path:
+	efi_bs_call(FreePool, wpath);
+close_root:
+	efi_call_proto(root, Close);
+	return status;
+}
+
+/**
+ * efi_file_read_at() - 从文件的@offset处读取@size字节到@buf中
+ *
+ * 读到的数据不足@size字节时返回EFI_END_OF_FILE。
+ */
+efi_status_t efi_file_read_at(struct efi_file *file, u64 offset, void *buf,
+			      u64 size)
+{
+	efi_status_t status;
+
+	if (offset > file->size || size > file->size - offset)
+		return EFI_END_OF_FILE;
+
+	status = efi_call_proto(file->handle, SetPosition, offset);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	while (size) {
+		UINTN chunk = min_t(u64, size, EFI_READ_CHUNK_SIZE);
+
+		status = efi_call_proto(file->handle, Read, &chunk, buf);
+		if (status != EFI_SUCCESS)
+			return status;
+		if (chunk == 0)
+			return EFI_END_OF_FILE;
+
+		buf += chunk;
+		size -= chunk;
+	}
+	return EFI_SUCCESS;
+}
+
+void efi_file_close(struct efi_file *file)
+{
+	if (file->handle) {
+		efi_call_proto(file->handle, Close);
+		file->handle = NULL;
+	}
+}
+
+/* initrd=最多可以指定这么多个文件 */
+#define EFI_INITRD_MAX_FILES 8
+
+/**
+ * efi_load_initrd_cmdline() - 加载命令行中initrd=指定的文件
+ * @image:	DragonStub的loaded image
+ * @cmdline:	命令行
+ * @max:	initrd的最高地址
+ * @initrd:	返回加载的initrd
+ *
+ * 可以指定多个initrd=，这些文件会按顺序拼接在一起。先打开所有文件得到
+ * 总大小，只分配一次内存，然后把每个文件直接读到它的最终位置。
+ *
+ * Return:	命令行中没有initrd=时返回EFI_NOT_READY
+ */
+efi_status_t efi_load_initrd_cmdline(efi_loaded_image_t *image,
+				     const char *cmdline, unsigned long max,
+				     struct linux_efi_initrd *initrd)
+{
+	struct efi_file files[EFI_INITRD_MAX_FILES] = {};
+	unsigned long base = 0;
+	u64 size = 0, off = 0;
+	efi_status_t status;
+	int nr, i;
+	char *path;
+
+	for (nr = 0;; nr++) {
+		status = efi_cmdline_get_option(cmdline, "initrd", nr, &path);
+		if (status == EFI_NOT_FOUND)
+			break;
+		if (status != EFI_SUCCESS)
+			goto close_files;
+		if (nr == EFI_INITRD_MAX_FILES) {
+			efi_err("Too many initrd= options, at most %d\n",
+				EFI_INITRD_MAX_FILES);
+			efi_bs_call(FreePool, path);
+			status = EFI_INVALID_PARAMETER;
+			goto close_files;
+		}
+
+		status = efi_open_file(image, path, &files[nr]);
+		efi_bs_call(FreePool, path);
+		if (status != EFI_SUCCESS)
+			goto close_files;
+		size += files[nr].size;
+	}
+
+	if (nr == 0)
+		return EFI_NOT_READY;
+
+	status = efi_allocate_pages(size, &base, max);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to allocate %llu bytes for initrd\n", size);
+		goto close_files;
+	}
+
+	for (i = 0; i < nr; i++) {
+		status = efi_file_read_at(&files[i], 0, (void *)(base + off),
+					  files[i].size);
+		if (status != EFI_SUCCESS) {
+			efi_err("Failed to read initrd: 0x%lx\n", status);
+			efi_free(size, base);
+			goto close_files;
+		}
+		off += files[i].size;
+	}
+
+	initrd->base = base;
+	initrd->size = size;
+
+close_files:
+	for (i = 0; i < nr && i < EFI_INITRD_MAX_FILES; i++)
+		efi_file_close(&files[i]);
+	return status;
+}
+
+/**
+ * efi_load_dtb() - 加载命令行中dtb=指定的DTB
+ * @image:	DragonStub的loaded image
+ * @cmdline:	命令行
+ * @headroom:	树的末尾还要留出的空闲空间
+ * @fdt_addr:	返回加载的树
+ * @fdt_size:	返回树占用的内存大小，使用完之后用efi_free()释放
+ *
+ * 先只读出FDT头，检查过之后才按totalsize加上@headroom分配内存，再把整个
+ * 树直接读到最终的位置，之后原地用fdt_open_into()把空闲空间并入totalsize，
+ * 这样树只复制一次，可以直接在上面修改。被截断或者不是FDT的文件在读入
+ * 之前就被拒绝。
+ *
+ * Return:	命令行中没有dtb=时返回EFI_NOT_READY
+ */
+efi_status_t efi_load_dtb(efi_loaded_image_t *image, const char *cmdline,
+			  unsigned long headroom, unsigned long *fdt_addr,
+			  unsigned long *fdt_size)
+{
+	struct efi_file file = {};
+	/* fdt_check_header()要求8字节对齐 */
+	struct fdt_header hdr __attribute__((aligned(8)));
+	unsigned long base = 0;
+	u64 size;
+	efi_status_t status;
+	char *path;
+	int err;
+
+	status = efi_cmdline_get_option(cmdline, "dtb", 0, &path);
+	if (status == EFI_NOT_FOUND)
+		return EFI_NOT_READY;
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = efi_open_file(image, path, &file);
+	if (status != EFI_SUCCESS)
+		goto free_path;
+
+	status = efi_file_read_at(&file, 0, &hdr, sizeof(hdr));
+	if (status == EFI_SUCCESS && fdt_check_header(&hdr))
+		status = EFI_INVALID_PARAMETER;
+	if (status != EFI_SUCCESS) {
+		efi_err("%s is not a device tree blob\n", path);
+		goto close_file;
+	}
+	if (fdt_totalsize(&hdr) > file.size) {
+		efi_err("%s is truncated: %llu of %u bytes\n", path, file.size,
+			fdt_totalsize(&hdr));
+		status = EFI_END_OF_FILE;
+		goto close_file;
+	}
+
+	/* fdt_open_into()的大小是int */
+	size = round_up((u64)fdt_totalsize(&hdr) + headroom, EFI_PAGE_SIZE);
+	if (size > INT32_MAX) {
+		status = EFI_BUFFER_TOO_SMALL;
+		goto close_file;
+	}
+	status = efi_allocate_pages(size, &base, ULONG_MAX);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to allocate %llu bytes for %s\n", size, path);
+		goto close_file;
+	}
+
+	status = efi_file_read_at(&file, 0, (void *)base,
+				  fdt_totalsize(&hdr));
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to read %s: 0x%lx\n", path, status);
+		goto free_fdt;
+	}
+
+	/* 各部分已经按顺序排好时fdt_open_into()只修改头，不移动数据 */
+	err = fdt_open_into((void *)base, (void *)base, size);
+	if (err) {
+		efi_err("Invalid device tree %s: %d\n", path, err);
+		status = EFI_LOAD_ERROR;
+		goto free_fdt;
+	}
+
+	*fdt_addr = base;
+	*fdt_size = size;
+	goto close_file;
+
+free_fdt:
+	efi_free(size, base);
+close_file:
+	efi_file_close(&file);
+free_path:
+	efi_bs_call(FreePool, path);
+	return status;
+}
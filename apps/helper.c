@@ -4,23 +4,26 @@
 #include <efilib.h>
 #include <lib.h>
 #include <dragonstub/dragonstub.h>
+#include <dragonstub/sha256.h>
 
 bool efi_nochunk;
 bool efi_nokaslr = true;
 // bool efi_nokaslr = !IS_ENABLED(CONFIG_RANDOMIZE_BASE);
 bool efi_novamap = false;
+bool efi_sparse_load;
+bool efi_mmu;
+bool efi_mmu_sv39;
+bool efi_smp;
+bool efi_fdt_rebuild;
+bool efi_fdt_prune;
+int efi_loglevel = CONSOLE_LOGLEVEL_DEFAULT;
 
 static bool efi_noinitrd;
+static bool efi_nomeasure;
 static bool efi_nosoftreserve;
 static bool efi_disable_pci_dma = false;
 // static bool efi_disable_pci_dma = IS_ENABLED(CONFIG_EFI_DISABLE_PCI_DMA);
 
-enum efistub_event {
-	EFISTUB_EVT_INITRD,
-	EFISTUB_EVT_LOAD_OPTIONS,
-	EFISTUB_EVT_COUNT,
-};
-
 #define STR_WITH_SIZE(s) sizeof(s), s
 
 static const struct {
@@ -34,17 +37,43 @@ static const struct {
 	[EFISTUB_EVT_LOAD_OPTIONS] = { 9, LOAD_OPTIONS_EVENT_TAG_ID,
 				       STR_WITH_SIZE(
 					       "LOADED_IMAGE::LoadOptions") },
+	[EFISTUB_EVT_KERNEL] = { 9, DRAGONSTUB_KERNEL_EVENT_TAG_ID,
+				 STR_WITH_SIZE("DragonStub kernel SHA-256") },
+	[EFISTUB_EVT_FDT] = { 9, DRAGONSTUB_FDT_EVENT_TAG_ID,
+			      STR_WITH_SIZE("DragonStub FDT SHA-256") },
 };
 
+/// @brief 查找TCG2 protocol，只在第一次调用时访问固件
+static efi_tcg2_protocol_t *efi_tcg2(void)
+{
+	static efi_tcg2_protocol_t *tcg2;
+	static bool probed;
+
+	if (efi_nomeasure)
+		return NULL;
+	if (!probed) {
+		efi_guid_t tcg2_guid = EFI_TCG2_PROTOCOL_GUID;
+
+		efi_bs_call(LocateProtocol, &tcg2_guid, NULL, (void **)&tcg2);
+		probed = true;
+		if (!tcg2)
+			efi_debug("No TCG2 protocol, skipping TPM measurements\n");
+	}
+	return tcg2;
+}
+
+bool efi_measurement_enabled(void)
+{
+	return efi_tcg2() != NULL;
+}
+
 static efi_status_t efi_measure_tagged_event(unsigned long load_addr,
 					     unsigned long load_size,
 					     enum efistub_event event)
 {
-	efi_guid_t tcg2_guid = EFI_TCG2_PROTOCOL_GUID;
-	efi_tcg2_protocol_t *tcg2 = NULL;
+	efi_tcg2_protocol_t *tcg2 = efi_tcg2();
 	efi_status_t status;
 
-	efi_bs_call(LocateProtocol, &tcg2_guid, NULL, (void **)&tcg2);
 	if (tcg2) {
 		struct efi_measured_event {
 			efi_tcg2_event_t event_data;
@@ -91,6 +120,19 @@ fail:
 	return status;
 }
 
+/*
+ * TCG2的HashLogExtendEvent()只接受原始数据（PE_COFF_IMAGE标志也只是让固件
+ * 按Authenticode的规则解析PE映像），没有直接传入摘要的接口。因此把
+ * DragonStub算出的SHA-256本身作为被度量的数据：固件只需要处理32字节，
+ * PCR中扩展的是H(SHA-256(内容))。验证者用tools/payload-digest.py算出内核的
+ * SHA-256，再按PCR bank的算法计算一次摘要，就能与事件日志对照。
+ */
+efi_status_t efi_measure_digest(const u8 *digest, enum efistub_event event)
+{
+	return efi_measure_tagged_event((unsigned long)digest,
+					SHA256_DIGEST_SIZE, event);
+}
+
 /*
  * At least some versions of Dell firmware pass the entire contents of the
  * Boot#### variable, i.e. the EFI_LOAD_OPTION descriptor, rather than just the
@@ -98,8 +140,8 @@ fail:
  *
  * Detect this case and extract OptionalData.
  */
-void efi_apply_loadoptions_quirk(const void **load_options,
-				 u32 *load_options_size)
+void efi_apply_loadoptions_quirk(const void **load_options __maybe_unused,
+				 u32 *load_options_size __maybe_unused)
 {
 #ifndef CONFIG_X86
 	return;
@@ -282,7 +324,11 @@ efi_status_t efi_parse_options(char const *cmdline)
 		if (!strcmp(param, "nokaslr")) {
 			efi_nokaslr = true;
 		} else if (!strcmp(param, "quiet")) {
-			// efi_loglevel = CONSOLE_LOGLEVEL_QUIET;
+			efi_loglevel = CONSOLE_LOGLEVEL_QUIET;
+		} else if (!strcmp(param, "loglevel") && val) {
+			int level;
+			if (get_option(&val, &level))
+				efi_loglevel = level;
 		} else if (!strcmp(param, "noinitrd")) {
 			efi_noinitrd = true;
 		}
@@ -306,8 +352,24 @@ efi_status_t efi_parse_options(char const *cmdline)
 			if (parse_option_str(val, "no_disable_early_pci_dma"))
 				efi_disable_pci_dma = false;
 			if (parse_option_str(val, "debug")) {
-				// efi_loglevel = CONSOLE_LOGLEVEL_DEBUG;
+				efi_loglevel = CONSOLE_LOGLEVEL_DEBUG;
 			}
+			if (parse_option_str(val, "noconsole"))
+				efi_log_console = false;
+			if (parse_option_str(val, "nomeasure"))
+				efi_nomeasure = true;
+			if (parse_option_str(val, "sparse"))
+				efi_sparse_load = true;
+			if (parse_option_str(val, "mmu"))
+				efi_mmu = true;
+			if (parse_option_str(val, "sv39"))
+				efi_mmu = efi_mmu_sv39 = true;
+			if (parse_option_str(val, "smp"))
+				efi_smp = true;
+			if (parse_option_str(val, "fdtrebuild"))
+				efi_fdt_rebuild = true;
+			if (parse_option_str(val, "fdtprune"))
+				efi_fdt_prune = true;
 		} else if (!strcmp(param, "video") && val &&
 			   strstarts(val, "efifb:")) {
 			// efi_parse_option_graphics(val + strlen("efifb:"));
@@ -365,22 +427,33 @@ efi_status_t efi_exit_boot_services(void *handle, void *priv,
 		// efi_pci_disable_bridge_busmaster();
 	}
 
+	/*
+	 * 在获取内存映射之前把日志全部输出，之后的消息（包括错误）只写入
+	 * 日志缓冲区，避免输出到控制台时改变内存映射
+	 */
+	efi_log_flush();
+	efi_log_memory_map_taken(true);
+
+	boot_ts_begin(DRAGONSTUB_PHASE_GET_MEMORY_MAP);
 	status = efi_get_memory_map(&map, true);
+	boot_ts_end(DRAGONSTUB_PHASE_GET_MEMORY_MAP);
 	if (status != EFI_SUCCESS)
-		return status;
+		goto fail;
 	efi_debug("before priv_func\n");
 	status = priv_func(map, priv);
 	if (status != EFI_SUCCESS) {
-		
-		efi_bs_call(FreePool, map);
-		return status;
+		efi_free_memory_map();
+		goto fail;
 	}
 
-	efi_debug("before ExitBootServices, handle=%p, map_key=%p\n", handle, map->map_key);
+	efi_debug("before ExitBootServices, handle=%p, map_key=0x%lx\n", handle, map->map_key);
 	efi_debug("BS->ExitBootServices=%p\n", BS->ExitBootServices);
 	efi_debug("ST->BS->ExitBootServices=%p\n", ST->BootServices->ExitBootServices);
+	// exit之后不能再输出到控制台，消息只写入日志缓冲区
+	efi_log_exit_boot_services();
+	boot_ts_begin(DRAGONSTUB_PHASE_EXIT_BOOT_SERVICES);
 	status = efi_bs_call(ExitBootServices, handle, map->map_key);
-	// exit之后不能再使用打印函数，否则会出现错误
+	boot_ts_end(DRAGONSTUB_PHASE_EXIT_BOOT_SERVICES);
 
 	if (status == EFI_INVALID_PARAMETER) {
 		/*
@@ -397,9 +470,11 @@ efi_status_t efi_exit_boot_services(void *handle, void *priv,
 		 * to get_memory_map() is expected to succeed here.
 		 */
 		map->map_size = map->buff_size;
-		status = efi_bs_call(GetMemoryMap, &map->map_size, &map->map,
+		boot_ts_begin(DRAGONSTUB_PHASE_GET_MEMORY_MAP);
+		status = efi_bs_call(GetMemoryMap, &map->map_size, map->map,
 				     &map->map_key, &map->desc_size,
 				     &map->desc_ver);
+		boot_ts_end(DRAGONSTUB_PHASE_GET_MEMORY_MAP);
 
 		/* exit_boot_services() was called, thus cannot free */
 		if (status != EFI_SUCCESS)
@@ -410,8 +485,155 @@ efi_status_t efi_exit_boot_services(void *handle, void *priv,
 		if (status != EFI_SUCCESS)
 			return status;
 
+		boot_ts_begin(DRAGONSTUB_PHASE_EXIT_BOOT_SERVICES);
 		status = efi_bs_call(ExitBootServices, handle, map->map_key);
+		boot_ts_end(DRAGONSTUB_PHASE_EXIT_BOOT_SERVICES);
+	}
+
+	return status;
+
+fail:
+	/* 没有退出boot services，调用者可能重试，之后的消息可以输出了 */
+	efi_log_memory_map_taken(false);
+	efi_log_flush();
+	return status;
+}
+static const struct {
+	struct efi_vendor_dev_path vendor;
+	struct efi_generic_dev_path end;
+} __packed initrd_dev_path = {
+	{
+		{
+			EFI_DEV_MEDIA,
+			EFI_DEV_MEDIA_VENDOR,
+			sizeof(struct efi_vendor_dev_path),
+		},
+		LINUX_EFI_INITRD_MEDIA_GUID,
+	},
+	{
+		EFI_DEV_END_PATH,
+		EFI_DEV_END_ENTIRE,
+		sizeof(struct efi_generic_dev_path),
+	},
+};
+
+/**
+ * efi_load_initrd_dev_path() - 通过LINUX_EFI_INITRD_MEDIA_GUID设备路径上的
+ *				LoadFile2协议加载initrd
+ * @initrd:	返回加载的initrd
+ * @max:	initrd的最高地址
+ *
+ * 先询问initrd的大小，一次性分配好内存，再让固件直接加载到这块内存中。
+ *
+ * Return:	没有安装这个设备路径时返回EFI_NOT_FOUND
+ */
+static efi_status_t efi_load_initrd_dev_path(struct linux_efi_initrd *initrd,
+					     unsigned long max)
+{
+	efi_guid_t lf2_proto_guid = EFI_LOAD_FILE2_PROTOCOL_GUID;
+	EFI_DEVICE_PATH *dp;
+	EFI_LOAD_FILE_PROTOCOL *lf2;
+	efi_handle_t handle;
+	UINTN size = 0;
+	efi_status_t status;
+
+	dp = (EFI_DEVICE_PATH *)&initrd_dev_path;
+	status = efi_bs_call(LocateDevicePath, &lf2_proto_guid, &dp, &handle);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = efi_bs_call(HandleProtocol, handle, &lf2_proto_guid,
+			     (void **)&lf2);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = efi_call_proto(lf2, LoadFile, dp, false, &size, NULL);
+	if (status != EFI_BUFFER_TOO_SMALL)
+		return EFI_LOAD_ERROR;
+
+	status = efi_allocate_pages(size, &initrd->base, max);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = efi_call_proto(lf2, LoadFile, dp, false, &size,
+				(void *)initrd->base);
+	if (status != EFI_SUCCESS) {
+		efi_free(size, initrd->base);
+		return EFI_LOAD_ERROR;
 	}
+	initrd->size = size;
+	return EFI_SUCCESS;
+}
 
+static struct linux_efi_initrd *initrd_table = NULL;
+
+/**
+ * efi_load_initrd() - 加载initrd
+ * @image:	DragonStub的loaded image
+ * @cmdline:	命令行
+ * @max:	initrd的最高地址
+ *
+ * 优先使用LINUX_EFI_INITRD_MEDIA_GUID设备路径（由引导程序提供），
+ * 没有的话再加载命令行中initrd=指定的文件。加载好的initrd通过
+ * LINUX_EFI_INITRD_MEDIA_GUID配置表，以及FDT /chosen节点中的
+ * linux,initrd-start和linux,initrd-end属性交给内核。
+ *
+ * Return:	没有initrd或者指定了noinitrd时也返回EFI_SUCCESS
+ */
+efi_status_t efi_load_initrd(efi_loaded_image_t *image, const char *cmdline,
+			     unsigned long max)
+{
+	efi_guid_t tbl_guid = LINUX_EFI_INITRD_MEDIA_GUID;
+	struct linux_efi_initrd initrd, *tbl;
+	efi_status_t status;
+
+	if (efi_noinitrd)
+		return EFI_SUCCESS;
+
+	status = efi_load_initrd_dev_path(&initrd, max);
+	if (status == EFI_SUCCESS) {
+		efi_info("Loaded initrd from LINUX_EFI_INITRD_MEDIA_GUID device path\n");
+	} else if (status == EFI_NOT_FOUND) {
+		status = efi_load_initrd_cmdline(image, cmdline, max, &initrd);
+		/* 没有initrd=选项 */
+		if (status == EFI_NOT_READY)
+			return EFI_SUCCESS;
+		if (status == EFI_SUCCESS)
+			efi_info("Loaded initrd from command line option\n");
+	}
+	if (status != EFI_SUCCESS)
+		goto failed;
+
+	if (initrd.size > 0 &&
+	    efi_measure_tagged_event(initrd.base, initrd.size,
+				     EFISTUB_EVT_INITRD) == EFI_SUCCESS)
+		efi_info("Measured initrd data into PCR 9\n");
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData, sizeof(initrd),
+			     (void **)&tbl);
+	if (status != EFI_SUCCESS)
+		goto free_initrd;
+
+	*tbl = initrd;
+	status = efi_bs_call(InstallConfigurationTable, &tbl_guid, tbl);
+	if (status != EFI_SUCCESS)
+		goto free_tbl;
+
+	initrd_table = tbl;
+	efi_debug("initrd at %p, size: %lu bytes\n", (void *)tbl->base,
+		  tbl->size);
+	return EFI_SUCCESS;
+
+free_tbl:
+	efi_bs_call(FreePool, tbl);
+free_initrd:
+	efi_free(initrd.size, initrd.base);
+failed:
+	efi_err("Failed to load initrd: 0x%lx\n", status);
 	return status;
-}
\ No newline at end of file
+}
+
+const struct linux_efi_initrd *efi_initrd(void)
+{
+	return initrd_table;
+}
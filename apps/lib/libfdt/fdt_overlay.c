@@ -11,6 +11,77 @@
 
 #include "libfdt_internal.h"
 
+/*
+ * struct overlay_ctx - the fdt_overlay_ops of fdt_overlay_apply_ops()
+ *
+ * The overlay_*() wrappers below call the hooks when they are set and
+ * the plain libfdt functions otherwise.
+ */
+struct overlay_ctx {
+	const struct fdt_overlay_ops *ops;
+	void *ctx;
+};
+
+static int overlay_max_phandle(const struct overlay_ctx *oc,
+			       const void *fdt, uint32_t *phandle)
+{
+	if (oc->ops && oc->ops->max_phandle)
+		return oc->ops->max_phandle(oc->ctx, fdt, phandle);
+	return fdt_find_max_phandle(fdt, phandle);
+}
+
+static int overlay_node_offset_by_phandle(const struct overlay_ctx *oc,
+					  const void *fdt, uint32_t phandle)
+{
+	if (oc->ops && oc->ops->node_offset_by_phandle)
+		return oc->ops->node_offset_by_phandle(oc->ctx, fdt, phandle);
+	return fdt_node_offset_by_phandle(fdt, phandle);
+}
+
+static int overlay_symbols_offset(const struct overlay_ctx *oc,
+				  const void *fdt)
+{
+	if (oc->ops && oc->ops->symbols_offset)
+		return oc->ops->symbols_offset(oc->ctx, fdt);
+	return fdt_subnode_offset(fdt, 0, "__symbols__");
+}
+
+static int overlay_setprop_placeholder(const struct overlay_ctx *oc,
+				       void *fdt, int nodeoffset,
+				       const char *name, int len,
+				       void **prop_data)
+{
+	if (oc->ops && oc->ops->setprop_placeholder)
+		return oc->ops->setprop_placeholder(oc->ctx, fdt, nodeoffset,
+						    name, len, prop_data);
+	return fdt_setprop_placeholder(fdt, nodeoffset, name, len, prop_data);
+}
+
+static int overlay_setprop(const struct overlay_ctx *oc, void *fdt,
+			   int nodeoffset, const char *name, const void *val,
+			   int len)
+{
+	void *prop_data;
+	int ret;
+
+	ret = overlay_setprop_placeholder(oc, fdt, nodeoffset, name, len,
+					  &prop_data);
+	if (ret)
+		return ret;
+
+	if (len)
+		memcpy(prop_data, val, len);
+	return 0;
+}
+
+static int overlay_add_subnode(const struct overlay_ctx *oc, void *fdt,
+			       int parentoffset, const char *name)
+{
+	if (oc->ops && oc->ops->add_subnode)
+		return oc->ops->add_subnode(oc->ctx, fdt, parentoffset, name);
+	return fdt_add_subnode(fdt, parentoffset, name);
+}
+
 /**
  * overlay_get_target_phandle - retrieves the target phandle of a fragment
  * @fdto: pointer to the device tree overlay blob
@@ -40,8 +111,9 @@ static uint32_t overlay_get_target_phandle(const void *fdto, int fragment)
 	return fdt32_to_cpu(*val);
 }
 
-int fdt_overlay_target_offset(const void *fdt, const void *fdto,
-			      int fragment_offset, char const **pathp)
+static int overlay_target_offset(const struct overlay_ctx *oc,
+				 const void *fdt, const void *fdto,
+				 int fragment_offset, char const **pathp)
 {
 	uint32_t phandle;
 	const char *path = NULL;
@@ -61,7 +133,7 @@ int fdt_overlay_target_offset(const void *fdt, const void *fdto,
 		else
 			ret = path_len;
 	} else
-		ret = fdt_node_offset_by_phandle(fdt, phandle);
+		ret = overlay_node_offset_by_phandle(oc, fdt, phandle);
 
 	/*
 	* If we haven't found either a target or a
@@ -84,6 +156,14 @@ int fdt_overlay_target_offset(const void *fdt, const void *fdto,
 	return ret;
 }
 
+int fdt_overlay_target_offset(const void *fdt, const void *fdto,
+			      int fragment_offset, char const **pathp)
+{
+	const struct overlay_ctx oc = { NULL, NULL };
+
+	return overlay_target_offset(&oc, fdt, fdto, fragment_offset, pathp);
+}
+
 /**
  * overlay_phandle_add_offset - Increases a phandle by an offset
  * @fdt: Base device tree blob
@@ -329,6 +409,7 @@ static int overlay_update_local_references(void *fdto, uint32_t delta)
 
 /**
  * overlay_fixup_one_phandle - Set an overlay phandle to the base one
+ * @oc: Lookups in the base device tree
  * @fdt: Base Device Tree blob
  * @fdto: Device tree overlay blob
  * @symbols_off: Node offset of the symbols node in the base device tree
@@ -350,33 +431,44 @@ static int overlay_update_local_references(void *fdto, uint32_t delta)
  *      0 on success
  *      Negative error code on failure
  */
-static int overlay_fixup_one_phandle(void *fdt, void *fdto,
+static int overlay_fixup_one_phandle(const struct overlay_ctx *oc,
+				     void *fdt, void *fdto,
 				     int symbols_off,
 				     const char *path, uint32_t path_len,
 				     const char *name, uint32_t name_len,
 				     int poffset, const char *label)
 {
 	const char *symbol_path;
-	uint32_t phandle;
+	uint32_t phandle = 0;
 	fdt32_t phandle_prop;
 	int symbol_off, fixup_off;
-	int prop_len;
+	int prop_len, ret;
 
-	if (symbols_off < 0)
-		return symbols_off;
+	if (oc->ops && oc->ops->symbol_phandle) {
+		ret = oc->ops->symbol_phandle(oc->ctx, fdt, label, &phandle);
+		if (ret && ret != -FDT_ERR_NOTFOUND)
+			return ret;
+		if (ret)
+			phandle = 0;
+	}
+
+	if (!phandle) {
+		if (symbols_off < 0)
+			return symbols_off;
 
-	symbol_path = fdt_getprop(fdt, symbols_off, label,
-				  &prop_len);
-	if (!symbol_path)
-		return prop_len;
+		symbol_path = fdt_getprop(fdt, symbols_off, label,
+					  &prop_len);
+		if (!symbol_path)
+			return prop_len;
 
-	symbol_off = fdt_path_offset(fdt, symbol_path);
-	if (symbol_off < 0)
-		return symbol_off;
+		symbol_off = fdt_path_offset(fdt, symbol_path);
+		if (symbol_off < 0)
+			return symbol_off;
 
-	phandle = fdt_get_phandle(fdt, symbol_off);
-	if (!phandle)
-		return -FDT_ERR_NOTFOUND;
+		phandle = fdt_get_phandle(fdt, symbol_off);
+		if (!phandle)
+			return -FDT_ERR_NOTFOUND;
+	}
 
 	fixup_off = fdt_path_offset_namelen(fdto, path, path_len);
 	if (fixup_off == -FDT_ERR_NOTFOUND)
@@ -393,6 +485,7 @@ static int overlay_fixup_one_phandle(void *fdt, void *fdto,
 
 /**
  * overlay_fixup_phandle - Set an overlay phandle to the base one
+ * @oc: Lookups in the base device tree
  * @fdt: Base Device Tree blob
  * @fdto: Device tree overlay blob
  * @symbols_off: Node offset of the symbols node in the base device tree
@@ -410,8 +503,8 @@ static int overlay_fixup_one_phandle(void *fdt, void *fdto,
  *      0 on success
  *      Negative error code on failure
  */
-static int overlay_fixup_phandle(void *fdt, void *fdto, int symbols_off,
-				 int property)
+static int overlay_fixup_phandle(const struct overlay_ctx *oc, void *fdt,
+				 void *fdto, int symbols_off, int property)
 {
 	const char *value;
 	const char *label;
@@ -465,7 +558,7 @@ static int overlay_fixup_phandle(void *fdt, void *fdto, int symbols_off,
 		if ((*endptr != '\0') || (endptr <= (sep + 1)))
 			return -FDT_ERR_BADOVERLAY;
 
-		ret = overlay_fixup_one_phandle(fdt, fdto, symbols_off,
+		ret = overlay_fixup_one_phandle(oc, fdt, fdto, symbols_off,
 						path, path_len, name, name_len,
 						poffset, label);
 		if (ret)
@@ -478,6 +571,7 @@ static int overlay_fixup_phandle(void *fdt, void *fdto, int symbols_off,
 /**
  * overlay_fixup_phandles - Resolve the overlay phandles to the base
  *                          device tree
+ * @oc: Lookups in the base device tree
  * @fdt: Base Device Tree blob
  * @fdto: Device tree overlay blob
  *
@@ -492,7 +586,8 @@ static int overlay_fixup_phandle(void *fdt, void *fdto, int symbols_off,
  *      0 on success
  *      Negative error code on failure
  */
-static int overlay_fixup_phandles(void *fdt, void *fdto)
+static int overlay_fixup_phandles(const struct overlay_ctx *oc, void *fdt,
+				  void *fdto)
 {
 	int fixups_off, symbols_off;
 	int property;
@@ -505,14 +600,15 @@ static int overlay_fixup_phandles(void *fdt, void *fdto)
 		return fixups_off;
 
 	/* And base DTs without symbols */
-	symbols_off = fdt_path_offset(fdt, "/__symbols__");
+	symbols_off = overlay_symbols_offset(oc, fdt);
 	if ((symbols_off < 0 && (symbols_off != -FDT_ERR_NOTFOUND)))
 		return symbols_off;
 
 	fdt_for_each_property_offset(property, fdto, fixups_off) {
 		int ret;
 
-		ret = overlay_fixup_phandle(fdt, fdto, symbols_off, property);
+		ret = overlay_fixup_phandle(oc, fdt, fdto, symbols_off,
+					    property);
 		if (ret)
 			return ret;
 	}
@@ -522,6 +618,7 @@ static int overlay_fixup_phandles(void *fdt, void *fdto)
 
 /**
  * overlay_apply_node - Merges a node into the base device tree
+ * @oc: Edits of the base device tree
  * @fdt: Base Device Tree blob
  * @target: Node offset in the base device tree to apply the fragment to
  * @fdto: Device tree overlay blob
@@ -539,8 +636,8 @@ static int overlay_fixup_phandles(void *fdt, void *fdto)
  *      0 on success
  *      Negative error code on failure
  */
-static int overlay_apply_node(void *fdt, int target,
-			      void *fdto, int node)
+static int overlay_apply_node(const struct overlay_ctx *oc, void *fdt,
+			      int target, void *fdto, int node)
 {
 	int property;
 	int subnode;
@@ -558,7 +655,7 @@ static int overlay_apply_node(void *fdt, int target,
 		if (prop_len < 0)
 			return prop_len;
 
-		ret = fdt_setprop(fdt, target, name, prop, prop_len);
+		ret = overlay_setprop(oc, fdt, target, name, prop, prop_len);
 		if (ret)
 			return ret;
 	}
@@ -568,7 +665,7 @@ static int overlay_apply_node(void *fdt, int target,
 		int nnode;
 		int ret;
 
-		nnode = fdt_add_subnode(fdt, target, name);
+		nnode = overlay_add_subnode(oc, fdt, target, name);
 		if (nnode == -FDT_ERR_EXISTS) {
 			nnode = fdt_subnode_offset(fdt, target, name);
 			if (nnode == -FDT_ERR_NOTFOUND)
@@ -578,7 +675,7 @@ static int overlay_apply_node(void *fdt, int target,
 		if (nnode < 0)
 			return nnode;
 
-		ret = overlay_apply_node(fdt, nnode, fdto, subnode);
+		ret = overlay_apply_node(oc, fdt, nnode, fdto, subnode);
 		if (ret)
 			return ret;
 	}
@@ -588,6 +685,7 @@ static int overlay_apply_node(void *fdt, int target,
 
 /**
  * overlay_merge - Merge an overlay into its base device tree
+ * @oc: Lookups and edits of the base device tree
  * @fdt: Base Device Tree blob
  * @fdto: Device tree overlay blob
  *
@@ -601,7 +699,7 @@ static int overlay_apply_node(void *fdt, int target,
  *      0 on success
  *      Negative error code on failure
  */
-static int overlay_merge(void *fdt, void *fdto)
+static int overlay_merge(const struct overlay_ctx *oc, void *fdt, void *fdto)
 {
 	int fragment;
 
@@ -621,11 +719,11 @@ static int overlay_merge(void *fdt, void *fdto)
 		if (overlay < 0)
 			return overlay;
 
-		target = fdt_overlay_target_offset(fdt, fdto, fragment, NULL);
+		target = overlay_target_offset(oc, fdt, fdto, fragment, NULL);
 		if (target < 0)
 			return target;
 
-		ret = overlay_apply_node(fdt, target, fdto, overlay);
+		ret = overlay_apply_node(oc, fdt, target, fdto, overlay);
 		if (ret)
 			return ret;
 	}
@@ -663,6 +761,7 @@ static int get_path_len(const void *fdt, int nodeoffset)
 
 /**
  * overlay_symbol_update - Update the symbols of base tree after a merge
+ * @oc: Lookups and edits of the base device tree
  * @fdt: Base Device Tree blob
  * @fdto: Device tree overlay blob
  *
@@ -677,7 +776,8 @@ static int get_path_len(const void *fdt, int nodeoffset)
  *      0 on success
  *      Negative error code on failure
  */
-static int overlay_symbol_update(void *fdt, void *fdto)
+static int overlay_symbol_update(const struct overlay_ctx *oc, void *fdt,
+				 void *fdto)
 {
 	int root_sym, ov_sym, prop, path_len, fragment, target;
 	int len, frag_name_len, ret, rel_path_len;
@@ -696,11 +796,11 @@ static int overlay_symbol_update(void *fdt, void *fdto)
 	if (ov_sym < 0)
 		return 0;
 
-	root_sym = fdt_subnode_offset(fdt, 0, "__symbols__");
+	root_sym = overlay_symbols_offset(oc, fdt);
 
 	/* it no root symbols exist we should create them */
 	if (root_sym == -FDT_ERR_NOTFOUND)
-		root_sym = fdt_add_subnode(fdt, 0, "__symbols__");
+		root_sym = overlay_add_subnode(oc, fdt, 0, "__symbols__");
 
 	/* any error is fatal now */
 	if (root_sym < 0)
@@ -764,7 +864,8 @@ static int overlay_symbol_update(void *fdt, void *fdto)
 			return -FDT_ERR_BADOVERLAY;
 
 		/* get the target of the fragment */
-		ret = fdt_overlay_target_offset(fdt, fdto, fragment, &target_path);
+		ret = overlay_target_offset(oc, fdt, fdto, fragment,
+					    &target_path);
 		if (ret < 0)
 			return ret;
 		target = ret;
@@ -779,14 +880,15 @@ static int overlay_symbol_update(void *fdt, void *fdto)
 			len = strlen(target_path);
 		}
 
-		ret = fdt_setprop_placeholder(fdt, root_sym, name,
+		ret = overlay_setprop_placeholder(oc, fdt, root_sym, name,
 				len + (len > 1) + rel_path_len + 1, &p);
 		if (ret < 0)
 			return ret;
 
 		if (!target_path) {
 			/* again in case setprop_placeholder changed it */
-			ret = fdt_overlay_target_offset(fdt, fdto, fragment, &target_path);
+			ret = overlay_target_offset(oc, fdt, fdto, fragment,
+						    &target_path);
 			if (ret < 0)
 				return ret;
 			target = ret;
@@ -814,13 +916,20 @@ static int overlay_symbol_update(void *fdt, void *fdto)
 
 int fdt_overlay_apply(void *fdt, void *fdto)
 {
+	return fdt_overlay_apply_ops(fdt, fdto, NULL, NULL);
+}
+
+int fdt_overlay_apply_ops(void *fdt, void *fdto,
+			  const struct fdt_overlay_ops *ops, void *ctx)
+{
+	const struct overlay_ctx oc = { ops, ctx };
 	uint32_t delta;
 	int ret;
 
 	FDT_RO_PROBE(fdt);
 	FDT_RO_PROBE(fdto);
 
-	ret = fdt_find_max_phandle(fdt, &delta);
+	ret = overlay_max_phandle(&oc, fdt, &delta);
 	if (ret)
 		goto err;
 
@@ -832,15 +941,15 @@ int fdt_overlay_apply(void *fdt, void *fdto)
 	if (ret)
 		goto err;
 
-	ret = overlay_fixup_phandles(fdt, fdto);
+	ret = overlay_fixup_phandles(&oc, fdt, fdto);
 	if (ret)
 		goto err;
 
-	ret = overlay_merge(fdt, fdto);
+	ret = overlay_merge(&oc, fdt, fdto);
 	if (ret)
 		goto err;
 
-	ret = overlay_symbol_update(fdt, fdto);
+	ret = overlay_symbol_update(&oc, fdt, fdto);
 	if (ret)
 		goto err;
 
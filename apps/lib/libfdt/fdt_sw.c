@@ -334,6 +334,36 @@ int fdt_property(void *fdt, const char *name, const void *val, int len)
 	return 0;
 }
 
+int fdt_property_nameoff(void *fdt, const char *name, int *nameoffp,
+			 const void *val, int len)
+{
+	struct fdt_property *prop;
+	int nameoff = *nameoffp;
+	int allocated = 0;
+
+	FDT_SW_PROBE_STRUCT(fdt);
+
+	if (!nameoff) {
+		nameoff = fdt_find_add_string_(fdt, name, &allocated);
+		if (nameoff == 0)
+			return -FDT_ERR_NOSPACE;
+	}
+
+	prop = fdt_grab_space_(fdt, sizeof(*prop) + FDT_TAGALIGN(len));
+	if (! prop) {
+		if (allocated)
+			fdt_del_last_string_(fdt, name);
+		return -FDT_ERR_NOSPACE;
+	}
+
+	prop->tag = cpu_to_fdt32(FDT_PROP);
+	prop->nameoff = cpu_to_fdt32(nameoff);
+	prop->len = cpu_to_fdt32(len);
+	memcpy(prop->data, val, len);
+	*nameoffp = nameoff;
+	return 0;
+}
+
 int fdt_finish(void *fdt)
 {
 	char *p = (char *)fdt;
@@ -1510,6 +1510,29 @@ static inline int fdt_property_cell(void *fdt, const char *name, uint32_t val)
  */
 int fdt_property_placeholder(void *fdt, const char *name, int len, void **valp);
 
+/**
+ * fdt_property_nameoff - add a new property, reusing a known name offset
+ *
+ * @fdt: pointer to the device tree blob
+ * @name: name of property to add
+ * @nameoffp: 0, or the name offset this function stored for @name before
+ * @val: pointer to data for the property value
+ * @len: length of property value in bytes
+ *
+ * Like fdt_property(), but the string table is only searched for @name when
+ * *@nameoffp is 0, and the offset used is stored back into *@nameoffp. Callers
+ * that write the same names many times, e.g. when copying an existing tree,
+ * can keep the offsets and skip the search, which is linear in the size of
+ * the string table.
+ *
+ * returns:
+ *	0, on success
+ *	-FDT_ERR_BADMAGIC,
+ *	-FDT_ERR_NOSPACE, standard meanings
+ */
+int fdt_property_nameoff(void *fdt, const char *name, int *nameoffp,
+			 const void *val, int len);
+
 #define fdt_property_string(fdt, name, str) \
 	fdt_property(fdt, name, str, strlen(str)+1)
 int fdt_end_node(void *fdt);
@@ -2141,6 +2164,53 @@ int fdt_overlay_apply(void *fdt, void *fdto);
 int fdt_overlay_target_offset(const void *fdt, const void *fdto,
 			      int fragment_offset, char const **pathp);
 
+/**
+ * struct fdt_overlay_ops - base tree lookups and edits for overlays
+ * @max_phandle: like fdt_find_max_phandle()
+ * @node_offset_by_phandle: like fdt_node_offset_by_phandle()
+ * @symbols_offset: offset of /__symbols__, or -FDT_ERR_NOTFOUND
+ * @symbol_phandle: phandle of the node labelled @label in /__symbols__,
+ *	-FDT_ERR_NOTFOUND falls back to resolving the path in /__symbols__
+ * @setprop_placeholder: like fdt_setprop_placeholder()
+ * @add_subnode: like fdt_add_subnode()
+ *
+ * Every lookup fdt_overlay_apply() does in the base tree scans the
+ * whole tree.  A caller applying many overlays can instead keep an
+ * index of the base tree and answer the lookups from it.  All edits of
+ * the base tree go through @setprop_placeholder and @add_subnode, so
+ * the index can follow the offsets they move.  Any hook may be NULL to
+ * use the default.
+ */
+struct fdt_overlay_ops {
+	int (*max_phandle)(void *ctx, const void *fdt, uint32_t *phandle);
+	int (*node_offset_by_phandle)(void *ctx, const void *fdt,
+				      uint32_t phandle);
+	int (*symbols_offset)(void *ctx, const void *fdt);
+	int (*symbol_phandle)(void *ctx, const void *fdt, const char *label,
+			      uint32_t *phandle);
+	int (*setprop_placeholder)(void *ctx, void *fdt, int nodeoffset,
+				   const char *name, int len,
+				   void **prop_data);
+	int (*add_subnode)(void *ctx, void *fdt, int parentoffset,
+			   const char *name);
+};
+
+/**
+ * fdt_overlay_apply_ops - Applies a DT overlay using caller lookups
+ * @fdt: pointer to the base device tree blob
+ * @fdto: pointer to the device tree overlay blob
+ * @ops: lookups and edits of the base tree, or NULL
+ * @ctx: passed to @ops
+ *
+ * Same as fdt_overlay_apply(), but the base tree is searched and edited
+ * through @ops.
+ *
+ * returns:
+ *	same as fdt_overlay_apply()
+ */
+int fdt_overlay_apply_ops(void *fdt, void *fdto,
+			  const struct fdt_overlay_ops *ops, void *ctx);
+
 /**********************************************************************/
 /* Debugging / informational functions                                */
 /**********************************************************************/
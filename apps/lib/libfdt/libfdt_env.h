@@ -16,6 +16,20 @@
 #include <dragonstub/types.h>
 #include <dragonstub/limits.h>
 
+/*
+ * 上面没有包含<string.h>，这里声明libfdt用到的字符串函数，与<lib.h>和
+ * dragonstub.h中的声明一致。没有声明时它们被隐式声明为返回int，
+ * memchr()和strrchr()返回的指针会被截断。
+ */
+void *memset(void *s, int c, __SIZE_TYPE__ n);
+void *memcpy(void *dest, const void *src, __SIZE_TYPE__ n);
+void *memmove(void *dst, const void *src, uint64_t size);
+int memcmp(const void *vl, const void *vr, size_t n);
+void *memchr(const void *src, int c, size_t n);
+size_t strlen(const char *s);
+size_t strnlen(const char *s, size_t maxlen);
+char *strrchr(const char *s, int c);
+
 #ifdef __CHECKER__
 #define FDT_FORCE __attribute__((force))
 #define FDT_BITWISE __attribute__((bitwise))
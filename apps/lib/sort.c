@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * A fast, small, non-recursive O(n log n) sort, following linux/lib/sort.c.
+ *
+ * Heapsort needs no extra memory and has no quadratic worst case, which
+ * is what the stub wants for the tables it builds from the device tree.
+ */
+
+#include <dragonstub/dragonstub.h>
+
+static void generic_swap(void *a, void *b, int size)
+{
+	u8 *l = a, *r = b;
+
+	do {
+		u8 t = *l;
+		*l++ = *r;
+		*r++ = t;
+	} while (--size > 0);
+}
+
+static void sift_down(u8 *base, size_t size, size_t root, size_t num,
+		      int (*cmp_func)(const void *, const void *),
+		      void (*swap_func)(void *, void *, int))
+{
+	for (;;) {
+		size_t child = 2 * root + 1;
+
+		if (child >= num)
+			return;
+		if (child + 1 < num &&
+		    cmp_func(base + (child + 1) * size,
+			     base + child * size) > 0)
+			child++;
+		if (cmp_func(base + root * size, base + child * size) >= 0)
+			return;
+
+		swap_func(base + root * size, base + child * size, size);
+		root = child;
+	}
+}
+
+/**
+ * sort - sort an array of elements
+ * @base: pointer to data to sort
+ * @num: number of elements
+ * @size: size of each element
+ * @cmp_func: pointer to comparison function
+ * @swap_func: pointer to swap function or NULL
+ *
+ * The sort is not stable: elements that compare equal may end up in
+ * any order.
+ */
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp_func)(const void *, const void *),
+	  void (*swap_func)(void *, void *, int))
+{
+	u8 *p = base;
+
+	if (num < 2 || !size)
+		return;
+	if (!swap_func)
+		swap_func = generic_swap;
+
+	for (size_t i = num / 2; i-- > 0;)
+		sift_down(p, size, i, num, cmp_func, swap_func);
+	for (size_t i = num - 1; i > 0; i--) {
+		swap_func(p, p + i * size, size);
+		sift_down(p, size, 0, i, cmp_func, swap_func);
+	}
+}
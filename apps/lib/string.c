@@ -130,7 +130,7 @@ size_t strnlen(const char *s, size_t maxlen)
 #define __ALIGN (sizeof(size_t))
 #define ONES ((size_t)-1 / UCHAR_MAX)
 #define HIGHS (ONES * (UCHAR_MAX / 2 + 1))
-#define HASZERO(x) ((x)-ONES & ~(x)&HIGHS)
+#define HASZERO(x) (((x) - ONES) & ~(x) & HIGHS)
 
 char *__strchrnul(const char *s, int c)
 {
@@ -398,7 +398,7 @@ number(char *buf, char *end, unsigned long long num, struct printf_spec spec)
 	return buf;
 }
 
-static noinline_for_stack char *
+static noinline_for_stack __maybe_unused char *
 special_hex_number(char *buf, char *end, unsigned long long num, int size)
 {
 	struct printf_spec spec;
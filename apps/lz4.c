@@ -0,0 +1,522 @@
+#include <efi.h>
+#include <efilib.h>
+#include <dragonstub/dragonstub.h>
+#include <dragonstub/lz4.h>
+
+/*
+ * LZ4 frame格式: https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+ * LZ4 block格式: https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ */
+
+#define LZ4_FLG_VERSION_MASK 0xC0
+#define LZ4_FLG_VERSION 0x40
+#define LZ4_FLG_BLOCK_INDEP 0x20
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_RESERVED 0x02
+#define LZ4_FLG_DICT_ID 0x01
+
+#define LZ4_BD_BLOCK_MAX_SHIFT 4
+#define LZ4_BD_BLOCK_MAX_MASK 0x7
+
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000U
+#define LZ4_MIN_MATCH 4
+
+/// @brief 解析后的LZ4帧头
+struct lz4_frame_header {
+	u8 flags;
+	/// @brief 块的最大解压大小
+	u32 block_max;
+	/// @brief 解压后的总大小，0表示未知
+	u64 content_size;
+	/// @brief 帧头的长度（第一个数据块的偏移）
+	u32 header_size;
+};
+
+static inline u32 lz4_read_le32(const u8 *p)
+{
+	return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) |
+	       ((u32)p[3] << 24);
+}
+
+static inline u64 lz4_read_le64(const u8 *p)
+{
+	return (u64)lz4_read_le32(p) | ((u64)lz4_read_le32(p + 4) << 32);
+}
+
+static efi_status_t lz4_parse_header(const u8 *src, u64 src_size,
+				     struct lz4_frame_header *hdr)
+{
+	// magic + FLG + BD + HC
+	if (src_size < 7 || lz4_read_le32(src) != LZ4_FRAME_MAGIC)
+		return EFI_INVALID_PARAMETER;
+
+	u8 flg = src[4];
+	u8 bd = src[5];
+	if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION ||
+	    (flg & LZ4_FLG_RESERVED) || (bd & 0x8F)) {
+		efi_err("Unsupported LZ4 frame descriptor: FLG=0x%x, BD=0x%x\n",
+			flg, bd);
+		return EFI_UNSUPPORTED;
+	}
+
+	u32 block_max_id =
+		(bd >> LZ4_BD_BLOCK_MAX_SHIFT) & LZ4_BD_BLOCK_MAX_MASK;
+	if (block_max_id < 4) {
+		efi_err("Invalid LZ4 block maximum size id: %d\n",
+			block_max_id);
+		return EFI_UNSUPPORTED;
+	}
+
+	u32 size = 6;
+	hdr->flags = flg;
+	// 4: 64KB, 5: 256KB, 6: 1MB, 7: 4MB
+	hdr->block_max = 1U << (8 + 2 * block_max_id);
+	hdr->content_size = 0;
+	if (flg & LZ4_FLG_CONTENT_SIZE) {
+		if (src_size < size + 8 + 1)
+			return EFI_INVALID_PARAMETER;
+		hdr->content_size = lz4_read_le64(src + size);
+		size += 8;
+	}
+	if (flg & LZ4_FLG_DICT_ID) {
+		// 使用了外部字典，无法独立解压
+		efi_err("LZ4 frames with a dictionary are not supported\n");
+		return EFI_UNSUPPORTED;
+	}
+	// 跳过header checksum
+	size += 1;
+	if (src_size < size)
+		return EFI_INVALID_PARAMETER;
+
+	if (!(flg & LZ4_FLG_BLOCK_INDEP)) {
+		efi_err("LZ4 frames with linked blocks are not supported, please compress with independent blocks\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	hdr->header_size = size;
+	return EFI_SUCCESS;
+}
+
+bool lz4_frame_check(const void *src, u64 src_size)
+{
+	return src_size >= 4 && lz4_read_le32(src) == LZ4_FRAME_MAGIC;
+}
+
+u64 lz4_frame_content_size(const void *src, u64 src_size)
+{
+	struct lz4_frame_header hdr;
+
+	if (lz4_parse_header(src, src_size, &hdr) != EFI_SUCCESS)
+		return 0;
+	return hdr.content_size;
+}
+
+/**
+ * lz4_block_decompress() - 解压一个LZ4块
+ * @src:	压缩数据
+ * @src_size:	压缩数据的大小
+ * @dst:	目标缓冲区
+ * @dst_cap:	目标缓冲区的大小
+ * @ret_size:	返回解压出来的字节数
+ *
+ * 对输入做完整的边界检查，损坏的数据不会导致越界读写。
+ */
+static efi_status_t lz4_block_decompress(const u8 *src, u64 src_size, u8 *dst,
+					 u64 dst_cap, u64 *ret_size)
+{
+	const u8 *ip = src;
+	const u8 *const iend = src + src_size;
+	u8 *op = dst;
+	u8 *const oend = dst + dst_cap;
+
+	while (ip < iend) {
+		u8 token = *ip++;
+
+		// 字面量
+		u64 len = token >> 4;
+		if (len == 15) {
+			u8 c;
+			do {
+				if (ip >= iend)
+					return EFI_COMPROMISED_DATA;
+				c = *ip++;
+				len += c;
+			} while (c == 255);
+		}
+		if (len > (u64)(iend - ip) || len > (u64)(oend - op))
+			return EFI_COMPROMISED_DATA;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		// 最后一个序列只有字面量
+		if (ip == iend)
+			break;
+
+		// 匹配
+		if (iend - ip < 2)
+			return EFI_COMPROMISED_DATA;
+		u64 offset = (u64)ip[0] | ((u64)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (u64)(op - dst))
+			return EFI_COMPROMISED_DATA;
+
+		len = token & 15;
+		if (len == 15) {
+			u8 c;
+			do {
+				if (ip >= iend)
+					return EFI_COMPROMISED_DATA;
+				c = *ip++;
+				len += c;
+			} while (c == 255);
+		}
+		len += LZ4_MIN_MATCH;
+		if (len > (u64)(oend - op))
+			return EFI_COMPROMISED_DATA;
+
+		const u8 *match = op - offset;
+		if (offset >= len) {
+			memcpy(op, match, len);
+			op += len;
+		} else {
+			// 重叠的匹配（例如重复的字节），只能顺序复制
+			for (u64 i = 0; i < len; i++)
+				*op++ = *match++;
+		}
+	}
+
+	*ret_size = op - dst;
+	return EFI_SUCCESS;
+}
+
+/// @brief 并行解压时每一批数据块使用的临时缓冲区总大小的上限
+#define LZ4_PARALLEL_SCRATCH_MAX SZ_32M
+
+/// @brief 由辅助核预先解压的一个数据块
+struct lz4_parallel_block {
+	/// @brief 块的数据（不包括块头）
+	const u8 *src;
+	u32 size;
+	bool uncompressed;
+	/// @brief 假定这一批中之前的压缩块都解压出cap字节时，这个块的位置
+	u64 pos;
+	/// @brief 最多解压出的字节数
+	u64 cap;
+	/// @brief direct()给出的目标地址或者临时缓冲区，NULL表示没有预先解压
+	u8 *dst;
+	u64 out_size;
+	efi_status_t status;
+};
+
+/**
+ * struct lz4_parallel - 用辅助核（efi=smp）并行解压的状态
+ *
+ * 数据块一批一批地处理：先把这一批的块分给各个核同时解压，再由
+ * lz4_frame_decompress()按顺序交给emit()。
+ *
+ * 块解压出多少字节要解压之后才知道。这里假定除了最后一个块以外，每个压缩块
+ * 都正好解压出block_max字节（`lz4`命令行工具的输出都是这样），据此从这一批
+ * 开始时的实际位置算出每个块的位置。能直接写到目标地址的块解压到那里，其他
+ * 的块解压到临时缓冲区中。按顺序处理时，只有块的实际位置与假定的位置一致
+ * 才使用预先解压的结果，否则重新解压。假定的位置只会偏后，所以写错地方的
+ * 数据都落在之后还要按顺序重新写入的范围内。
+ */
+struct lz4_parallel {
+	struct lz4_parallel_block *blocks;
+	/// @brief 每一批最多的块数
+	u32 batch;
+	/// @brief 这一批的块数，以及下一个要按顺序处理的块
+	u32 nr;
+	u32 index;
+	/// @brief batch个block_max大小的临时缓冲区，用到时才分配
+	u8 *scratch;
+};
+
+static void lz4_parallel_job(void *arg, u64 index)
+{
+	struct lz4_parallel_block *b = (struct lz4_parallel_block *)arg + index;
+
+	if (!b->dst)
+		return;
+	if (b->uncompressed) {
+		memcpy(b->dst, b->src, b->size);
+		b->out_size = b->size;
+		b->status = EFI_SUCCESS;
+		return;
+	}
+	b->status = lz4_block_decompress(b->src, b->size, b->dst, b->cap,
+					 &b->out_size);
+}
+
+static void lz4_parallel_init(struct lz4_parallel *par,
+			      const struct lz4_frame_header *hdr)
+{
+	u32 harts = efi_smp_workers() + 1;
+	efi_status_t status;
+
+	memset(par, 0, sizeof(*par));
+	if (harts < 2)
+		return;
+
+	// 每个核分到几个块，块越大临时缓冲区越大，分到的块越少
+	par->batch = min_t(u32,
+			   max_t(u32, LZ4_PARALLEL_SCRATCH_MAX / hdr->block_max,
+				 harts),
+			   4 * harts);
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     par->batch * sizeof(*par->blocks),
+			     (void **)&par->blocks);
+	if (status != EFI_SUCCESS)
+		par->blocks = NULL;
+}
+
+static void lz4_parallel_free(struct lz4_parallel *par)
+{
+	if (par->scratch)
+		efi_bs_call(FreePool, par->scratch);
+	if (par->blocks)
+		efi_bs_call(FreePool, par->blocks);
+}
+
+/**
+ * lz4_parallel_fill() - 从@ip处的块开始取出一批块，并行地解压
+ * @pos:	@ip处的块在解压流中的实际位置
+ *
+ * 块头损坏时提前结束这一批，留给按顺序解压时报错。
+ */
+static void lz4_parallel_fill(struct lz4_parallel *par,
+			      const struct lz4_frame_header *hdr, const u8 *ip,
+			      const u8 *iend, u64 pos, u64 limit,
+			      const struct lz4_stream_ops *ops, void *ctx)
+{
+	bool need_scratch = false;
+
+	par->nr = par->index = 0;
+	while (par->nr < par->batch && pos < limit && iend - ip >= 4) {
+		u32 bsize = lz4_read_le32(ip);
+		ip += 4;
+		if (bsize == 0)
+			break;
+
+		bool uncompressed = bsize & LZ4_BLOCK_UNCOMPRESSED;
+		bsize &= ~LZ4_BLOCK_UNCOMPRESSED;
+		if (bsize > hdr->block_max || bsize > (u64)(iend - ip))
+			break;
+
+		u64 cap = uncompressed ? bsize : hdr->block_max;
+		if (!uncompressed && hdr->content_size) {
+			if (pos >= hdr->content_size)
+				break;
+			cap = min(cap, hdr->content_size - pos);
+		}
+
+		struct lz4_parallel_block *b = &par->blocks[par->nr++];
+		b->src = ip;
+		b->size = bsize;
+		b->uncompressed = uncompressed;
+		b->pos = pos;
+		b->cap = cap;
+		b->dst = ops->direct && pos + cap <= limit ?
+				 ops->direct(ctx, pos, cap) :
+				 NULL;
+		b->status = EFI_NOT_STARTED;
+		// 未压缩的块直接从输入交给emit()，不需要临时缓冲区
+		if (!b->dst && !uncompressed)
+			need_scratch = true;
+
+		pos += cap;
+		ip += bsize;
+		if (hdr->flags & LZ4_FLG_BLOCK_CHECKSUM)
+			ip += 4;
+	}
+	if (par->nr < 2)
+		return;
+
+	if (need_scratch && !par->scratch &&
+	    efi_bs_call(AllocatePool, EfiLoaderData,
+			(u64)par->batch * hdr->block_max,
+			(void **)&par->scratch) != EFI_SUCCESS)
+		par->scratch = NULL;
+	if (par->scratch) {
+		for (u32 i = 0; i < par->nr; i++) {
+			struct lz4_parallel_block *b = &par->blocks[i];
+
+			if (!b->dst && !b->uncompressed)
+				b->dst = par->scratch +
+					 (u64)i * hdr->block_max;
+		}
+	}
+
+	efi_smp_run(lz4_parallel_job, par->blocks, par->nr);
+}
+
+efi_status_t lz4_frame_decompress(const void *src, u64 src_size, u64 limit,
+				  const struct lz4_stream_ops *ops, void *ctx)
+{
+	struct lz4_frame_header hdr;
+	efi_status_t status;
+	u8 *scratch = NULL;
+
+	status = lz4_parse_header(src, src_size, &hdr);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	const u8 *ip = (const u8 *)src + hdr.header_size;
+	const u8 *const iend = (const u8 *)src + src_size;
+	u64 pos = 0;
+	struct lz4_parallel par;
+
+	lz4_parallel_init(&par, &hdr);
+
+	while (pos < limit) {
+		if (iend - ip < 4) {
+			status = EFI_COMPROMISED_DATA;
+			goto out;
+		}
+		u32 bsize = lz4_read_le32(ip);
+		ip += 4;
+		if (bsize == 0) {
+			// EndMark
+			break;
+		}
+
+		bool uncompressed = bsize & LZ4_BLOCK_UNCOMPRESSED;
+		bsize &= ~LZ4_BLOCK_UNCOMPRESSED;
+		if (bsize > hdr.block_max || bsize > (u64)(iend - ip)) {
+			status = EFI_COMPROMISED_DATA;
+			goto out;
+		}
+
+		u64 out_size;
+		const void *out;
+		struct lz4_parallel_block *b = NULL;
+		if (par.blocks) {
+			if (par.index == par.nr)
+				lz4_parallel_fill(&par, &hdr, ip - 4, iend, pos,
+						  limit, ops, ctx);
+			if (par.index < par.nr)
+				b = &par.blocks[par.index++];
+		}
+		if (b && b->dst && b->src == ip && b->pos == pos &&
+		    b->status == EFI_SUCCESS) {
+			out = b->dst;
+			out_size = b->out_size;
+		} else if (uncompressed) {
+			out = ip;
+			out_size = bsize;
+		} else {
+			/*
+			 * 如果知道总大小，就能算出这个块最多解压出多少字节，
+			 * 从而尽量让最后一个块也能直接解压到目标地址
+			 */
+			u64 cap = hdr.block_max;
+			if (hdr.content_size) {
+				if (pos >= hdr.content_size) {
+					status = EFI_COMPROMISED_DATA;
+					goto out;
+				}
+				cap = min(cap, hdr.content_size - pos);
+			}
+
+			u8 *dst = ops->direct ? ops->direct(ctx, pos, cap) :
+						NULL;
+			if (!dst) {
+				if (!scratch) {
+					status = efi_bs_call(AllocatePool,
+							     EfiLoaderData,
+							     hdr.block_max,
+							     (void **)&scratch);
+					if (status != EFI_SUCCESS) {
+						efi_err("Failed to allocate LZ4 scratch buffer\n");
+						goto out;
+					}
+				}
+				dst = scratch;
+			}
+
+			status = lz4_block_decompress(ip, bsize, dst, cap,
+						      &out_size);
+			if (status != EFI_SUCCESS) {
+				efi_err("Corrupted LZ4 block at input offset 0x%llx\n",
+					(u64)(ip - (const u8 *)src));
+				goto out;
+			}
+			out = dst;
+		}
+
+		status = ops->emit(ctx, pos, out, out_size);
+		if (status != EFI_SUCCESS)
+			goto out;
+
+		pos += out_size;
+		ip += bsize;
+		// 跳过block checksum
+		if (hdr.flags & LZ4_FLG_BLOCK_CHECKSUM)
+			ip += 4;
+	}
+
+	if (limit != UINT64_MAX && pos < limit) {
+		status = EFI_END_OF_FILE;
+		goto out;
+	}
+	if (limit == UINT64_MAX && hdr.content_size &&
+	    pos != hdr.content_size) {
+		efi_err("LZ4 content size mismatch: expected 0x%llx, got 0x%llx\n",
+			hdr.content_size, pos);
+		status = EFI_COMPROMISED_DATA;
+		goto out;
+	}
+	status = EFI_SUCCESS;
+out:
+	if (scratch)
+		efi_bs_call(FreePool, scratch);
+	lz4_parallel_free(&par);
+	return status;
+}
+
+/// @brief lz4_frame_read()的目标缓冲区
+struct lz4_read_ctx {
+	u8 *buf;
+	u64 offset;
+	u64 size;
+};
+
+static void *lz4_read_direct(void *_ctx, u64 offset, u64 len)
+{
+	struct lz4_read_ctx *ctx = _ctx;
+
+	if (offset >= ctx->offset && offset + len <= ctx->offset + ctx->size)
+		return ctx->buf + (offset - ctx->offset);
+	return NULL;
+}
+
+static efi_status_t lz4_read_emit(void *_ctx, u64 offset, const void *data,
+				  u64 len)
+{
+	struct lz4_read_ctx *ctx = _ctx;
+	u64 start = max(offset, ctx->offset);
+	u64 end = min(offset + len, ctx->offset + ctx->size);
+
+	if (start >= end)
+		return EFI_SUCCESS;
+
+	u8 *dst = ctx->buf + (start - ctx->offset);
+	const u8 *s = (const u8 *)data + (start - offset);
+	if (dst != s)
+		memcpy(dst, s, end - start);
+	return EFI_SUCCESS;
+}
+
+efi_status_t lz4_frame_read(const void *src, u64 src_size, u64 offset,
+			    void *buf, u64 size)
+{
+	static const struct lz4_stream_ops ops = {
+		.direct = lz4_read_direct,
+		.emit = lz4_read_emit,
+	};
+	struct lz4_read_ctx ctx = { .buf = buf, .offset = offset, .size = size };
+
+	return lz4_frame_decompress(src, src_size, offset + size, &ops, &ctx);
+}
@@ -3,66 +3,307 @@
 #include <dragonstub/linux/align.h>
 #include <dragonstub/minmax.h>
 
+/*
+ * 内存映射缓存
+ *
+ * 所有获取内存映射的地方共用一个缓冲区，每次在原地刷新。缓冲区不够大时
+ * 才重新分配，分配时留出的余量按之前观察到的描述符增长来定，而不是固定的
+ * EFI_MMAP_NR_SLACK_SLOTS个。这样既少了每次分配、释放缓冲区对内存映射本身
+ * 的扰动，也保证了ExitBootServices()失败之后重新获取的内存映射能放得下。
+ *
+ * 最后交给内核的内存映射也在这个缓冲区中（LINUX_EFI_BOOT_MEMMAP_GUID），
+ * 所以它总是分配成EfiACPIReclaimMemory。
+ */
+
+/// @brief 第一次分配时，每多少个描述符预留一个空位
+#define MEMMAP_SLACK_RATIO 16
+
+/// @brief 缓冲区的大小最多重新调整几次
+#define MEMMAP_MAX_RESIZE 4
+
+static struct efi_boot_memmap *memmap;
+/// @brief memmap是否已经安装为配置表
+static bool memmap_installed;
+/// @brief 上一次得到的描述符数量，以及两次刷新之间观察到的最大增长
+static unsigned long memmap_last_nr;
+static unsigned long memmap_max_growth;
+
+/// @brief 紧凑内存映射，没有分配时为NULL
+static struct dragonstub_memmap *compact_memmap;
+
+/// @brief 记录这一次得到的描述符数量
+static void memmap_track(unsigned long nr)
+{
+	if (memmap_last_nr && nr > memmap_last_nr)
+		memmap_max_growth = max(memmap_max_growth, nr - memmap_last_nr);
+	memmap_last_nr = nr;
+}
+
+/// @brief 按已经观察到的增长计算需要预留的描述符数量
+static unsigned long memmap_slack(unsigned long nr)
+{
+	unsigned long slack = EFI_MMAP_NR_SLACK_SLOTS;
+
+	if (memmap_max_growth)
+		slack = max(slack, 2 * memmap_max_growth);
+	return max(slack, nr / MEMMAP_SLACK_RATIO);
+}
+
+/**
+ * compact_memmap_alloc() - 分配能放下@capacity个描述符的紧凑内存映射
+ *
+ * 新的表安装为配置表之后才释放旧的表。FDT中的dragonstub,memmap在退出
+ * boot services时才改写为最终的地址，所以之后还可以重新分配。
+ */
+static efi_status_t compact_memmap_alloc(u32 capacity)
+{
+	efi_guid_t guid = DRAGONSTUB_EFI_MEMMAP_GUID;
+	struct dragonstub_memmap *tbl;
+	efi_status_t status;
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     sizeof(*tbl) + capacity * sizeof(tbl->entries[0]),
+			     (void **)&tbl);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	memset(tbl, 0, sizeof(*tbl));
+	tbl->version = DRAGONSTUB_MEMMAP_VERSION;
+	tbl->entry_size = sizeof(tbl->entries[0]);
+	tbl->capacity = capacity;
+
+	status = efi_bs_call(InstallConfigurationTable, &guid, tbl);
+	if (status != EFI_SUCCESS) {
+		efi_bs_call(FreePool, tbl);
+		return status;
+	}
+	if (compact_memmap)
+		efi_bs_call(FreePool, compact_memmap);
+	compact_memmap = tbl;
+	return EFI_SUCCESS;
+}
+
+/// @brief 重新分配能放下@map_size字节的内存映射（再加上余量）的缓冲区
+static efi_status_t memmap_resize(unsigned long map_size,
+				  unsigned long desc_size)
+{
+	efi_guid_t tbl_guid = LINUX_EFI_BOOT_MEMMAP_GUID;
+	unsigned long nr = map_size / desc_size;
+	struct efi_boot_memmap *m;
+	unsigned long size;
+	efi_status_t status;
+
+	size = (nr + memmap_slack(nr)) * desc_size;
+	status = efi_bs_call(AllocatePool, EfiACPIReclaimMemory,
+			     sizeof(*m) + size, (void **)&m);
+	if (status != EFI_SUCCESS)
+		return status;
+	m->buff_size = size;
+
+	/*
+	 * 先让配置表指向新的缓冲区再释放旧的。安装配置表可能会分配内存，
+	 * 接下来在新的缓冲区中重新获取内存映射
+	 */
+	if (memmap_installed) {
+		status = efi_bs_call(InstallConfigurationTable, &tbl_guid, m);
+		if (status != EFI_SUCCESS) {
+			efi_bs_call(FreePool, m);
+			return status;
+		}
+	}
+	if (memmap)
+		efi_bs_call(FreePool, memmap);
+	memmap = m;
+	efi_debug("Memory map buffer: %lu descriptors, %lu slots of slack\n",
+		  nr, size / desc_size - nr);
+
+	/*
+	 * 最终的内存映射一定能放进这个缓冲区，紧凑内存映射跟着扩大。失败的话
+	 * 只是内核拿不到紧凑内存映射，不影响启动
+	 */
+	if (compact_memmap && compact_memmap->capacity < size / desc_size) {
+		status = compact_memmap_alloc(size / desc_size);
+		if (status != EFI_SUCCESS)
+			efi_warn("Unable to grow the compact memory map: 0x%lx\n",
+				 status);
+	}
+	return EFI_SUCCESS;
+}
+
 /**
  * efi_get_memory_map() - get memory map
- * @map:		pointer to memory map pointer to which to assign the
- *			newly allocated memory map
+ * @map:		返回共享的内存映射缓存
  * @install_cfg_tbl:	whether or not to install the boot memory map as a
  *			configuration table
  *
- * Retrieve the UEFI memory map. The allocated memory leaves room for
- * up to EFI_MMAP_NR_SLACK_SLOTS additional memory map entries.
+ * 在共享的缓冲区中刷新内存映射，只有放不下时才重新分配。返回的内存映射
+ * 在下一次调用之前有效，调用者不需要释放。
  *
  * Return:	status code
  */
 efi_status_t efi_get_memory_map(struct efi_boot_memmap **map,
 				bool install_cfg_tbl)
 {
-	int memtype = install_cfg_tbl ? EfiACPIReclaimMemory : EfiLoaderData;
 	efi_guid_t tbl_guid = LINUX_EFI_BOOT_MEMMAP_GUID;
-	struct efi_boot_memmap *m, tmp;
+	unsigned long map_size, map_key, desc_size;
 	efi_status_t status;
-	unsigned long size;
-
-	tmp.map_size = 0;
-	status = efi_bs_call(GetMemoryMap, &tmp.map_size, NULL, &tmp.map_key,
-			     &tmp.desc_size, &tmp.desc_ver);
-	if (status != EFI_BUFFER_TOO_SMALL)
-		return EFI_LOAD_ERROR;
+	u32 desc_ver;
 
-	size = tmp.map_size + tmp.desc_size * EFI_MMAP_NR_SLACK_SLOTS;
-	status = efi_bs_call(AllocatePool, memtype, sizeof(*m) + size,
-			     (void **)&m);
-	if (status != EFI_SUCCESS)
-		return status;
+	if (!memmap) {
+		map_size = 0;
+		status = efi_bs_call(GetMemoryMap, &map_size, NULL, &map_key,
+				     &desc_size, &desc_ver);
+		if (status != EFI_BUFFER_TOO_SMALL)
+			return EFI_LOAD_ERROR;
+		status = memmap_resize(map_size, desc_size);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
 
-	if (install_cfg_tbl) {
+	if (install_cfg_tbl && !memmap_installed) {
 		/*
 		 * Installing a configuration table might allocate memory, and
 		 * this may modify the memory map. This means we should install
 		 * the configuration table first, and re-install or delete it
 		 * as needed.
 		 */
-		status = efi_bs_call(InstallConfigurationTable, &tbl_guid, m);
+		status = efi_bs_call(InstallConfigurationTable, &tbl_guid,
+				     memmap);
 		if (status != EFI_SUCCESS)
-			goto free_map;
+			return status;
+		memmap_installed = true;
 	}
 
-	m->buff_size = m->map_size = size;
-	status = efi_bs_call(GetMemoryMap, &m->map_size, m->map, &m->map_key,
-			     &m->desc_size, &m->desc_ver);
+	for (int i = 0; i < MEMMAP_MAX_RESIZE; i++) {
+		memmap->map_size = memmap->buff_size;
+		status = efi_bs_call(GetMemoryMap, &memmap->map_size,
+				     memmap->map, &memmap->map_key,
+				     &memmap->desc_size, &memmap->desc_ver);
+		if (status == EFI_SUCCESS)
+			break;
+		if (status != EFI_BUFFER_TOO_SMALL)
+			return status;
+
+		// 这次的增长超出了预留的余量，记下来，按新的增长留出余量
+		memmap_track(memmap->map_size / memmap->desc_size);
+		status = memmap_resize(memmap->map_size, memmap->desc_size);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
 	if (status != EFI_SUCCESS)
-		goto uninstall_table;
+		return status;
 
-	*map = m;
+	memmap_track(memmap->map_size / memmap->desc_size);
+	*map = memmap;
 	return EFI_SUCCESS;
+}
+
+void efi_free_memory_map(void)
+{
+	efi_guid_t tbl_guid = LINUX_EFI_BOOT_MEMMAP_GUID;
 
-uninstall_table:
-	if (install_cfg_tbl)
+	if (!memmap)
+		return;
+	if (memmap_installed)
 		efi_bs_call(InstallConfigurationTable, &tbl_guid, NULL);
-free_map:
-	efi_bs_call(FreePool, m);
-	return status;
+	efi_bs_call(FreePool, memmap);
+	memmap = NULL;
+	memmap_installed = false;
+}
+
+efi_status_t efi_alloc_compact_memmap(void)
+{
+	struct efi_boot_memmap *map;
+	efi_status_t status;
+
+	if (compact_memmap)
+		return EFI_SUCCESS;
+
+	/*
+	 * 最终的内存映射一定能放进内存映射缓存，按它的容量分配。缓存之后
+	 * 扩大的话，memmap_resize()会一起扩大紧凑内存映射
+	 */
+	status = efi_get_memory_map(&map, false);
+	if (status != EFI_SUCCESS)
+		return status;
+	return compact_memmap_alloc(map->buff_size / map->desc_size);
+}
+
+struct dragonstub_memmap *efi_compact_memmap(void)
+{
+	return compact_memmap;
+}
+
+/*
+ * 按物理地址排序。有的固件按地址从高到低给出内存映射，sort()是堆排序，
+ * 不依赖输入已经大致有序
+ */
+static int memmap_entry_cmp(const void *a, const void *b)
+{
+	const struct dragonstub_memmap_entry *x = a, *y = b;
+
+	if (x->phys_start == y->phys_start)
+		return 0;
+	return x->phys_start < y->phys_start ? -1 : 1;
+}
+
+/// @brief @next能否合并到@prev的末尾
+static bool memmap_mergeable(const struct dragonstub_memmap_entry *prev,
+			     const struct dragonstub_memmap_entry *next)
+{
+	u64 size = prev->num_pages * EFI_PAGE_SIZE;
+
+	if (prev->type != next->type || prev->attribute != next->attribute ||
+	    prev->phys_start + size != next->phys_start)
+		return false;
+	return !(prev->attribute & EFI_MEMORY_RUNTIME) ||
+	       prev->virt_start + size == next->virt_start;
+}
+
+void efi_build_compact_memmap(struct efi_boot_memmap *map)
+{
+	struct dragonstub_memmap *tbl = compact_memmap;
+	u32 nr_raw = map->map_size / map->desc_size;
+	u32 n = 0;
+
+	if (!tbl)
+		return;
+
+	tbl->nr_raw = nr_raw;
+	tbl->nr_entries = 0;
+	if (nr_raw > tbl->capacity) {
+		efi_warn("Memory map has %u descriptors, more than the %u reserved for the compact map\n",
+			 nr_raw, tbl->capacity);
+		return;
+	}
+
+	for (u32 i = 0; i < nr_raw; i++) {
+		efi_memory_desc_t *md = (void *)map->map + i * map->desc_size;
+		struct dragonstub_memmap_entry *e = &tbl->entries[i];
+
+		e->phys_start = md->PhysicalStart;
+		e->virt_start = md->VirtualStart;
+		e->num_pages = md->NumberOfPages;
+		e->attribute = md->Attribute;
+		e->type = md->Type;
+		e->reserved = 0;
+	}
+	sort(tbl->entries, nr_raw, sizeof(tbl->entries[0]), memmap_entry_cmp,
+	     NULL);
+
+	for (u32 i = 0; i < nr_raw; i++) {
+		struct dragonstub_memmap_entry *e = &tbl->entries[i];
+
+		if (n && memmap_mergeable(&tbl->entries[n - 1], e))
+			tbl->entries[n - 1].num_pages += e->num_pages;
+		else
+			tbl->entries[n++] = *e;
+	}
+	tbl->nr_entries = n;
+
+	// 此时已经不能输出到控制台，只写入日志缓冲区
+	efi_info("Compact memory map: %u descriptors merged into %u entries\n",
+		 nr_raw, n);
 }
 
 /**
@@ -83,7 +324,7 @@ free_map:
 efi_status_t efi_allocate_pages(unsigned long size, unsigned long *addr,
 				unsigned long max)
 {
-	efi_physical_addr_t alloc_addr;
+	EFI_PHYSICAL_ADDRESS alloc_addr;
 	efi_status_t status;
 
 	max = min(max, EFI_ALLOC_LIMIT);
@@ -122,15 +363,12 @@ efi_status_t efi_allocate_pages_exact(unsigned long size, unsigned long addr)
 
 	u32 pagecount = DIV_ROUND_UP(size, EFI_PAGE_SIZE);
 	efi_debug(
-		"efi_allocate_pages_exact: size=%d, addr=%p, addr_rounded=%p, pagecount=%d\n",
+		"efi_allocate_pages_exact: size=%lu, addr=0x%lx, addr_rounded=0x%llx, pagecount=%u\n",
 		size, addr, addr_rounded, pagecount);
 
+	// AllocateAddress要求地址按页对齐，所以从addr_rounded开始分配
 	status = efi_bs_call(AllocatePages, AllocateAddress, EfiLoaderData,
-			     pagecount, (EFI_PHYSICAL_ADDRESS *)&addr);
-
-	// status = efi_bs_call(AllocatePages, AllocateAddress, EfiLoaderData,
-	// 		     DIV_ROUND_UP(size, EFI_PAGE_SIZE),
-	// 		     (EFI_PHYSICAL_ADDRESS *)&addr);
+			     pagecount, (EFI_PHYSICAL_ADDRESS *)&addr_rounded);
 	if (status != EFI_SUCCESS)
 		return status;
 
@@ -0,0 +1,579 @@
+#include "elf.h"
+#include <dragonstub/dragonstub.h>
+#include <dragonstub/linux/align.h>
+#include <dragonstub/linux/sizes.h>
+#include <dragonstub/minmax.h>
+#include <asm/csr.h>
+
+/*
+ * 为内核建立初始页表（efi=mmu）
+ *
+ * 在退出boot services之前，根据内存映射和内核各个段被加载到的位置建立
+ * Sv39/Sv48页表，efi_enter_kernel()打开MMU之后直接跳转到内核的虚拟入口。
+ * 页表的格式和内容见dragonstub.h中struct dragonstub_pgtable的说明。
+ *
+ * 所有的页表页都从一次分配的页表池中取出，池的大小按最坏的情况事先算好。
+ * 运行时服务区域的虚拟地址要到exit_boot_func()中才最终确定，那时不能再分配
+ * 内存，所以建立页表时先按当前的内存映射映射一次，并在池中留出几页备用。
+ */
+
+#define PTE_V (1ULL << 0)
+#define PTE_R (1ULL << 1)
+#define PTE_W (1ULL << 2)
+#define PTE_X (1ULL << 3)
+#define PTE_G (1ULL << 5)
+#define PTE_A (1ULL << 6)
+#define PTE_D (1ULL << 7)
+#define PTE_PPN_SHIFT 10
+#define PTE_PPN_MASK (((1ULL << 44) - 1) << PTE_PPN_SHIFT)
+
+#define PTRS_PER_TABLE 512
+#define PGTABLE_PAGE_SIZE SZ_4K
+
+/* 第@level级页表项映射的大小：0级是4K，1级是2M，2级是1G */
+#define LEVEL_SHIFT(level) (12 + 9 * (level))
+#define LEVEL_SIZE(level) (1ULL << LEVEL_SHIFT(level))
+
+/* 最大只使用1G的页，Sv48的512G页很少能用上 */
+#define MAX_LEAF_LEVEL 2
+
+/* 与Linux相同的线性映射基址 */
+#define LINEAR_BASE_SV39 0xffffffd800000000ULL
+#define LINEAR_BASE_SV48 0xffffaf8000000000ULL
+
+/* 留给exit_boot_func()重新映射运行时服务区域的页数 */
+#define PGTABLE_SPARE_PAGES 4
+
+#define PGTABLE_PROT_RWX (PTE_R | PTE_W | PTE_X)
+#define PGTABLE_PROT_RW (PTE_R | PTE_W)
+
+/// @brief 安装好的交接信息，没有建立页表时为NULL
+static struct dragonstub_pgtable *pgtable;
+
+/// @brief 页表池中下一个空闲的页，以及可以使用的上限
+static u64 pool_next, pool_limit;
+
+/// @brief 根页表
+static u64 *root;
+
+/// @brief 页表的级数
+static u32 levels;
+
+static u64 *alloc_table(void)
+{
+	u64 *table;
+
+	if (pool_next + PGTABLE_PAGE_SIZE > pool_limit)
+		return NULL;
+
+	table = (u64 *)pool_next;
+	pool_next += PGTABLE_PAGE_SIZE;
+	memset(table, 0, PGTABLE_PAGE_SIZE);
+	return table;
+}
+
+static inline u64 pte_paddr(u64 pte)
+{
+	return ((pte & PTE_PPN_MASK) >> PTE_PPN_SHIFT) << 12;
+}
+
+static inline u64 make_pte(u64 paddr, u64 prot)
+{
+	return ((paddr >> 12) << PTE_PPN_SHIFT) | prot | PTE_V;
+}
+
+static inline bool pte_is_leaf(u64 pte)
+{
+	return pte & PGTABLE_PROT_RWX;
+}
+
+static inline u64 *pte_offset(u64 *table, u64 vaddr, u32 level)
+{
+	return &table[(vaddr >> LEVEL_SHIFT(level)) & (PTRS_PER_TABLE - 1)];
+}
+
+/// @brief 检查@vaddr是否是当前模式下合法（符号扩展）的虚拟地址
+static bool vaddr_valid(u64 vaddr)
+{
+	s64 sext = (s64)(vaddr << (64 - LEVEL_SHIFT(levels)));
+
+	return (u64)(sext >> (64 - LEVEL_SHIFT(levels))) == vaddr;
+}
+
+/**
+ * map_one() - 用一个第@level级的页把@vaddr映射到@paddr
+ *
+ * 已经映射过的地址，只要映射到相同的物理地址，就合并权限；
+ * 已经被拆成更小的页的，逐个映射更小的页。
+ */
+static efi_status_t map_one(u64 vaddr, u64 paddr, u32 level, u64 prot)
+{
+	u64 *table = root, *pte;
+	efi_status_t status;
+
+	prot |= PTE_A | PTE_D | PTE_G;
+
+	for (u32 l = levels - 1; l > level; l--) {
+		pte = pte_offset(table, vaddr, l);
+		if (!(*pte & PTE_V)) {
+			u64 *next = alloc_table();
+			if (!next)
+				return EFI_OUT_OF_RESOURCES;
+			*pte = make_pte((u64)next, 0);
+		} else if (pte_is_leaf(*pte)) {
+			// 被更大的页覆盖了
+			if (pte_paddr(*pte) + (vaddr & (LEVEL_SIZE(l) - 1)) !=
+			    paddr)
+				return EFI_INVALID_PARAMETER;
+			*pte |= prot;
+			return EFI_SUCCESS;
+		}
+		table = (u64 *)pte_paddr(*pte);
+	}
+
+	pte = pte_offset(table, vaddr, level);
+	if (!(*pte & PTE_V)) {
+		*pte = make_pte(paddr, prot);
+		return EFI_SUCCESS;
+	}
+	if (pte_is_leaf(*pte)) {
+		if (pte_paddr(*pte) != paddr)
+			return EFI_INVALID_PARAMETER;
+		*pte |= prot;
+		return EFI_SUCCESS;
+	}
+
+	for (u64 i = 0; i < PTRS_PER_TABLE; i++) {
+		status = map_one(vaddr + i * LEVEL_SIZE(level - 1),
+				 paddr + i * LEVEL_SIZE(level - 1), level - 1,
+				 prot);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+ * map_range() - 把[@vaddr, @vaddr + @size)映射到@paddr
+ *
+ * 地址和大小都按4K对齐。对齐的部分尽量使用1G和2M的页。
+ */
+static efi_status_t map_range(u64 vaddr, u64 paddr, u64 size, u64 prot)
+{
+	efi_status_t status;
+
+	if (!size)
+		return EFI_SUCCESS;
+	if (!vaddr_valid(vaddr) || !vaddr_valid(vaddr + size - 1) ||
+	    vaddr + size - 1 < vaddr)
+		return EFI_INVALID_PARAMETER;
+
+	while (size) {
+		u32 level = min_t(u32, MAX_LEAF_LEVEL, levels - 1);
+
+		while (level &&
+		       (!IS_ALIGNED(vaddr | paddr, LEVEL_SIZE(level)) ||
+			size < LEVEL_SIZE(level)))
+			level--;
+
+		status = map_one(vaddr, paddr, level, prot);
+		if (status != EFI_SUCCESS)
+			return status;
+
+		vaddr += LEVEL_SIZE(level);
+		paddr += LEVEL_SIZE(level);
+		size -= LEVEL_SIZE(level);
+	}
+	return EFI_SUCCESS;
+}
+
+/// @brief 描述符是否是可以被线性映射的内存
+static bool is_usable_ram(const efi_memory_desc_t *md)
+{
+	if (!(md->Attribute & EFI_MEMORY_WB))
+		return false;
+
+	switch (md->Type) {
+	case EfiLoaderCode:
+	case EfiLoaderData:
+	case EfiBootServicesCode:
+	case EfiBootServicesData:
+	case EfiRuntimeServicesCode:
+	case EfiRuntimeServicesData:
+	case EfiConventionalMemory:
+	case EfiACPIReclaimMemory:
+	case EfiACPIMemoryNVS:
+	case EfiPersistentMemory:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * next_ram_range() - 从@pos处的描述符开始，找到下一段连续的可用内存
+ *
+ * 地址相邻的描述符合并成一段，这样才能用上大页。
+ */
+static bool next_ram_range(struct efi_boot_memmap *map, unsigned long *pos,
+			   u64 *start, u64 *end)
+{
+	bool found = false;
+
+	for (; *pos < map->map_size; *pos += map->desc_size) {
+		efi_memory_desc_t *md = (void *)map->map + *pos;
+
+		if (!is_usable_ram(md))
+			continue;
+		if (found && md->PhysicalStart != *end)
+			break;
+		if (!found)
+			*start = md->PhysicalStart;
+		*end = md->PhysicalStart + md->NumberOfPages * EFI_PAGE_SIZE;
+		found = true;
+	}
+	return found;
+}
+
+/// @brief 恒等映射和线性映射内存映射中所有可用的内存
+static efi_status_t map_ram(struct efi_boot_memmap *map, u64 linear_virt,
+			    u64 linear_phys)
+{
+	unsigned long pos = 0;
+	u64 start, end;
+	efi_status_t status;
+
+	while (next_ram_range(map, &pos, &start, &end)) {
+		status = map_range(start, start, end - start, PGTABLE_PROT_RWX);
+		if (status != EFI_SUCCESS)
+			return status;
+		status = map_range(linear_virt + start - linear_phys, start,
+				   end - start, PGTABLE_PROT_RW);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+	return EFI_SUCCESS;
+}
+
+/// @brief 把运行时服务区域映射到描述符中的VirtualStart
+static efi_status_t map_runtime(struct efi_boot_memmap *map)
+{
+	efi_status_t status;
+
+	for (unsigned long l = 0; l < map->map_size; l += map->desc_size) {
+		efi_memory_desc_t *md = (void *)map->map + l;
+
+		if (!(md->Attribute & EFI_MEMORY_RUNTIME))
+			continue;
+
+		status = map_range(md->VirtualStart, md->PhysicalStart,
+				   md->NumberOfPages * EFI_PAGE_SIZE,
+				   md->Type == EfiRuntimeServicesCode ?
+					   PGTABLE_PROT_RWX :
+					   PGTABLE_PROT_RW);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+	return EFI_SUCCESS;
+}
+
+/// @brief 把内核的各个段映射到p_vaddr
+static efi_status_t map_kernel(const struct dragonstub_payload_efi *tbl)
+{
+	efi_status_t status;
+
+	for (u32 i = 0; i < tbl->nr_segments; i++) {
+		const struct dragonstub_payload_segment *seg =
+			&tbl->segments[i];
+		u64 offset = seg->vaddr & (PGTABLE_PAGE_SIZE - 1);
+		u64 prot = PTE_R;
+
+		if ((seg->paddr & (PGTABLE_PAGE_SIZE - 1)) != offset) {
+			efi_err("Segment %d: p_vaddr 0x%llx and address 0x%llx are not congruent modulo 4K\n",
+				i, seg->vaddr, seg->paddr);
+			return EFI_INVALID_PARAMETER;
+		}
+		if (seg->flags & PF_W)
+			prot |= PTE_W;
+		if (seg->flags & PF_X)
+			prot |= PTE_X;
+
+		status = map_range(seg->vaddr - offset, seg->paddr - offset,
+				   ALIGN_UP(seg->size + offset, PGTABLE_PAGE_SIZE),
+				   prot);
+		if (status != EFI_SUCCESS) {
+			efi_err("Failed to map segment %d at 0x%llx\n", i,
+				seg->vaddr);
+			return status;
+		}
+	}
+	return EFI_SUCCESS;
+}
+
+/// @brief 内核入口（物理地址@entry）对应的虚拟地址，找不到时返回0
+static u64 kernel_entry_vaddr(const struct dragonstub_payload_efi *tbl,
+			      u64 entry)
+{
+	for (u32 i = 0; i < tbl->nr_segments; i++) {
+		const struct dragonstub_payload_segment *seg =
+			&tbl->segments[i];
+
+		if (entry >= seg->paddr && entry < seg->paddr + seg->size)
+			return seg->vaddr + entry - seg->paddr;
+	}
+	return 0;
+}
+
+/// @brief 可用内存的物理地址范围，起点按1G向下对齐
+static void ram_span(struct efi_boot_memmap *map, u64 *span_start,
+		     u64 *span_end)
+{
+	unsigned long pos = 0;
+	u64 start, end;
+
+	*span_start = ~0ULL;
+	*span_end = 0;
+	while (next_ram_range(map, &pos, &start, &end)) {
+		*span_start = min_t(u64, *span_start, start);
+		*span_end = max_t(u64, *span_end, end);
+	}
+	*span_start = ALIGN_DOWN(*span_start, SZ_1G);
+}
+
+/**
+ * range_tables() - 把[@vaddr, @vaddr + @size)映射到@paddr最多需要的页表页数
+ * @whole:	这个范围是不是用一次map_range()映射的
+ *
+ * 不包括根页表。一次映射的范围，虚拟地址和物理地址对大页的大小同余时，
+ * 中间的部分都用大页映射，只有首尾两块需要下一级页表。
+ */
+static u64 range_tables(u64 vaddr, u64 paddr, u64 size, bool whole)
+{
+	u64 n = 0;
+
+	if (!size)
+		return 0;
+	// 第l级的每一项（覆盖LEVEL_SIZE(l)）下面最多一个页表
+	for (u32 l = 1; l < levels; l++) {
+		u64 blocks = (ALIGN_DOWN(vaddr + size - 1, LEVEL_SIZE(l)) -
+			      ALIGN_DOWN(vaddr, LEVEL_SIZE(l))) /
+				     LEVEL_SIZE(l) +
+			     1;
+
+		if (whole && l <= MAX_LEAF_LEVEL &&
+		    IS_ALIGNED(vaddr ^ paddr, LEVEL_SIZE(l)))
+			blocks = min_t(u64, blocks, 2);
+		n += blocks;
+	}
+	return n;
+}
+
+/**
+ * estimate_tables() - 建立全部映射最多需要的页表页数
+ *
+ * 按每段映射单独计算再相加，不考虑共用的页表，所以一定够用，
+ * 页表池只需要分配一次。
+ */
+static u64 estimate_tables(struct efi_boot_memmap *map,
+			   const struct dragonstub_payload_efi *tbl,
+			   const struct dragonstub_pgtable *pt)
+{
+	u64 n = 1, segs = 0, vstart = ~0ULL, vend = 0, start, end;
+	unsigned long pos = 0;
+
+	// 内核的段通常是挨着的，按整个范围算往往更少
+	for (u32 i = 0; i < tbl->nr_segments; i++) {
+		const struct dragonstub_payload_segment *seg =
+			&tbl->segments[i];
+
+		segs += range_tables(seg->vaddr, seg->paddr, seg->size, true);
+		vstart = min_t(u64, vstart, seg->vaddr);
+		vend = max_t(u64, vend, seg->vaddr + seg->size);
+	}
+	n += min_t(u64, segs, range_tables(vstart, 0, vend - vstart, false));
+
+	while (next_ram_range(map, &pos, &start, &end)) {
+		n += range_tables(start, start, end - start, true);
+		n += range_tables(pt->linear_virt + start - pt->linear_phys,
+				  start, end - start, true);
+	}
+
+	for (pos = 0; pos < map->map_size; pos += map->desc_size) {
+		efi_memory_desc_t *md = (void *)map->map + pos;
+
+		if (md->Attribute & EFI_MEMORY_RUNTIME)
+			n += range_tables(md->VirtualStart, md->PhysicalStart,
+					  md->NumberOfPages * EFI_PAGE_SIZE,
+					  true);
+	}
+	return n;
+}
+
+/// @brief 建立全部的页表，@map中运行时服务区域的VirtualStart已经确定
+static efi_status_t build(struct efi_boot_memmap *map,
+			  const struct dragonstub_payload_efi *tbl,
+			  const struct dragonstub_pgtable *pt)
+{
+	efi_status_t status;
+
+	root = alloc_table();
+	if (!root)
+		return EFI_OUT_OF_RESOURCES;
+
+	status = map_kernel(tbl);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = map_ram(map, pt->linear_virt, pt->linear_phys);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to map RAM (linear map at 0x%llx)\n",
+			pt->linear_virt);
+		return status;
+	}
+
+	status = map_runtime(map);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to map EFI runtime regions\n");
+		return status;
+	}
+	return EFI_SUCCESS;
+}
+
+/// @brief 安装交接信息的配置表
+static efi_status_t install_table(const struct dragonstub_pgtable *pt)
+{
+	efi_guid_t guid = DRAGONSTUB_EFI_PGTABLE_GUID;
+	struct dragonstub_pgtable *tbl;
+	efi_status_t status;
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData, sizeof(*tbl),
+			     (void **)&tbl);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	*tbl = *pt;
+	status = efi_bs_call(InstallConfigurationTable, &guid, tbl);
+	if (status != EFI_SUCCESS) {
+		efi_bs_call(FreePool, tbl);
+		return status;
+	}
+	pgtable = tbl;
+	return EFI_SUCCESS;
+}
+
+efi_status_t efi_setup_pgtable(struct payload_info *payload_info)
+{
+	efi_guid_t payload_guid = DRAGONSTUB_EFI_PAYLOAD_EFI_GUID;
+	const struct dragonstub_payload_efi *tbl;
+	struct dragonstub_pgtable pt = { 0 };
+	struct efi_boot_memmap *map = NULL;
+	efi_memory_desc_t *runtime_map = NULL;
+	unsigned long pool = 0, pool_size;
+	u64 ram_end;
+	int count;
+	efi_status_t status;
+
+	tbl = get_efi_config_table(payload_guid);
+	if (!tbl)
+		return EFI_NOT_FOUND;
+
+	levels = min_t(u32, efi_arch_pgtable_levels(), 4);
+	if (efi_mmu_sv39)
+		levels = min_t(u32, levels, 3);
+	if (levels < 3) {
+		efi_warn("The boot hart does not support Sv39\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	pt.version = DRAGONSTUB_PGTABLE_VERSION;
+	pt.levels = levels;
+	pt.linear_virt = levels == 4 ? LINEAR_BASE_SV48 : LINEAR_BASE_SV39;
+	pt.kernel_entry = kernel_entry_vaddr(tbl, payload_info->kernel_entry);
+	if (!pt.kernel_entry) {
+		efi_err("Kernel entry 0x%llx is not in any segment\n",
+			payload_info->kernel_entry);
+		return EFI_LOAD_ERROR;
+	}
+
+	status = efi_get_memory_map(&map, false);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	ram_span(map, &pt.linear_phys, &ram_end);
+	pt.linear_size = ram_end > pt.linear_phys ? ram_end - pt.linear_phys :
+						    0;
+	if (pt.linear_size > -pt.linear_virt) {
+		efi_err("RAM spans 0x%llx bytes, too large for the linear map\n",
+			pt.linear_size);
+		return EFI_UNSUPPORTED;
+	}
+
+	// 与exit_boot_func()中一样给运行时服务区域分配虚拟地址，描述符的副本用不到
+	status = efi_bs_call(AllocatePool, EfiLoaderData, map->map_size,
+			     (void **)&runtime_map);
+	if (status != EFI_SUCCESS)
+		return status;
+	efi_get_virtmap(map->map, map->map_size, map->desc_size, runtime_map,
+			&count);
+
+	pool_size = (estimate_tables(map, tbl, &pt) + PGTABLE_SPARE_PAGES) *
+		    PGTABLE_PAGE_SIZE;
+	status = efi_allocate_pages(pool_size, &pool, ULONG_MAX);
+	if (status != EFI_SUCCESS)
+		goto free_runtime_map;
+
+	pool_next = pool;
+	pool_limit = pool + pool_size - PGTABLE_SPARE_PAGES * PGTABLE_PAGE_SIZE;
+	status = build(map, tbl, &pt);
+	if (status != EFI_SUCCESS)
+		goto free_pool;
+
+	// 备用的页留给exit_boot_func()
+	pool_limit = pool + pool_size;
+	pt.root = (u64)root;
+	pt.satp = (levels == 4 ? SATP_MODE_48 : SATP_MODE_39) |
+		  ((u64)root >> 12);
+	pt.pool_addr = pool;
+	pt.pool_size = pool_size;
+	pt.nr_pages = (pool_next - pool) / PGTABLE_PAGE_SIZE;
+	pt.flags = DRAGONSTUB_PGTABLE_RUNTIME;
+
+	status = install_table(&pt);
+	if (status != EFI_SUCCESS)
+		goto free_pool;
+
+	efi_info("Built Sv%d page tables at %p (%d pages), kernel entry: 0x%llx\n",
+		 LEVEL_SHIFT(levels), root, pt.nr_pages, pt.kernel_entry);
+	efi_debug("Linear map: 0x%llx -> 0x%llx, size: 0x%llx\n", pt.linear_virt,
+		  pt.linear_phys, pt.linear_size);
+	efi_bs_call(FreePool, runtime_map);
+	return EFI_SUCCESS;
+
+free_pool:
+	efi_free(pool_size, pool);
+free_runtime_map:
+	efi_bs_call(FreePool, runtime_map);
+	root = NULL;
+	return status;
+}
+
+void efi_pgtable_map_runtime(struct efi_boot_memmap *map)
+{
+	if (!pgtable)
+		return;
+
+	/*
+	 * 区域与建立页表时相同的话不需要新的页表页。
+	 * 这里不能再分配内存，备用的页不够时只能告诉内核没有映射。
+	 */
+	if (map_runtime(map) == EFI_SUCCESS)
+		pgtable->flags |= DRAGONSTUB_PGTABLE_RUNTIME;
+	else
+		pgtable->flags &= ~DRAGONSTUB_PGTABLE_RUNTIME;
+	pgtable->nr_pages = (pool_next - pgtable->pool_addr) / PGTABLE_PAGE_SIZE;
+}
+
+struct dragonstub_pgtable *efi_pgtable(void)
+{
+	return pgtable;
+}
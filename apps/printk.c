@@ -0,0 +1,354 @@
+#include <dragonstub/dragonstub.h>
+
+/*
+ * efi_printk的实现
+ *
+ * 每条消息先用vsnprintf格式化成UTF-8字符串，加上级别前缀之后追加到日志
+ * 环形缓冲区中。环形缓冲区中还没有输出到控制台的内容积累到PRINTK_BATCH
+ * 字节以上、或者输出了错误消息时，才转换成UTF-16，批量调用
+ * ConOut->OutputString。efi_loglevel只在这时起作用：级别不够的消息仍然
+ * 留在环形缓冲区中，只是不输出到控制台。
+ *
+ * 环形缓冲区通过efi config table和FDT /chosen节点交给内核。
+ * 从获取退出boot services用的内存映射开始，消息只写入环形缓冲区。
+ *
+ * 在退出boot services之前，stub是单线程运行的，不需要加锁。
+ */
+
+#define PRINTK_BUF_SIZE 1024
+/* 每次OutputString最多输出的UTF-16字符数（不包括结尾的0） */
+#define PRINTK_WBUF_CHARS 1024
+/* 积累到这么多字节之后才输出到控制台 */
+#define PRINTK_BATCH 2048
+/* 每条消息的级别前缀："\001"加上一个数字，与Linux的KERN_SOH相同 */
+#define LOG_SOH '\001'
+#define LOG_PREFIX_LEN 2
+
+static char printk_buf[PRINTK_BUF_SIZE];
+static efi_char16_t printk_wbuf[PRINTK_WBUF_CHARS + 1];
+static size_t printk_wpos;
+
+/* 日志环形缓冲区，第一次输出消息的时候分配 */
+static struct dragonstub_log_buf *log_buf = NULL;
+static bool log_buf_alloc_failed = false;
+static bool log_buf_installed = false;
+/* 已经输出到控制台的位置（与log_buf->head含义相同） */
+static u64 console_pos = 0;
+/* console_pos所在的消息的级别 */
+static int console_level = LOGLEVEL_EMERG;
+/* 是否输出到控制台，efi=noconsole会关闭 */
+bool efi_log_console = true;
+/* 是否已经（或即将）退出boot services */
+static bool boot_services_exited = false;
+/*
+ * 是否已经获取了退出boot services用的内存映射。输出到控制台和分配内存
+ * 都可能改变内存映射，使ExitBootServices()失败
+ */
+static bool memory_map_taken = false;
+
+/// @brief 现在能否输出到控制台
+static bool console_usable(void)
+{
+	return efi_log_console && !boot_services_exited && !memory_map_taken;
+}
+
+static void efi_char16_puts(efi_char16_t *str)
+{
+	ST->ConOut->OutputString(ST->ConOut, str);
+}
+
+/// @brief 从UTF-8字符串中解码一个字符，并把*s8移动到下一个字符
+static u32 utf8_to_utf32(const u8 **s8)
+{
+	u32 c32;
+	u8 c0, cx;
+	size_t clen, i;
+
+	c0 = cx = *(*s8)++;
+	/*
+	 * The position of the most-significant 0 bit gives us the length of
+	 * a multi-octet encoding.
+	 */
+	for (clen = 0; cx & 0x80; ++clen)
+		cx <<= 1;
+	/*
+	 * If the 0 bit is in position 8, this is a valid single-octet
+	 * encoding. If the 0 bit is in position 7 or positions 1-3, the
+	 * encoding is invalid.
+	 * In either case, we just return the first octet.
+	 */
+	if (clen < 2 || clen > 4)
+		return c0;
+	/* Get the bits from the first octet. */
+	c32 = cx >> clen--;
+	for (i = 0; i < clen; ++i) {
+		/* Trailing octets must have 10 in most significant bits. */
+		cx = (*s8)[i] ^ 0x80;
+		if (cx & 0xc0)
+			return c0;
+		c32 = (c32 << 6) | cx;
+	}
+	/*
+	 * Check for validity:
+	 * - The character must be in the Unicode range.
+	 * - It must not be a surrogate.
+	 * - It must be encoded using the correct number of octets.
+	 */
+	if (c32 > 0x10ffff || (c32 & 0xf800) == 0xd800 ||
+	    clen != (size_t)((c32 >= 0x80) + (c32 >= 0x800) + (c32 >= 0x10000)))
+		return c0;
+	*s8 += clen;
+	return c32;
+}
+
+static void wbuf_flush(void)
+{
+	if (printk_wpos == 0)
+		return;
+	printk_wbuf[printk_wpos] = L'\0';
+	efi_char16_puts(printk_wbuf);
+	printk_wpos = 0;
+}
+
+/// @brief 把一个字符转换成UTF-16放到printk_wbuf中，换行符转换成"\r\n"
+static void wbuf_putc(u32 c32)
+{
+	/* 最多写入2个UTF-16字符 */
+	if (printk_wpos > PRINTK_WBUF_CHARS - 2)
+		wbuf_flush();
+
+	if (c32 == '\n')
+		printk_wbuf[printk_wpos++] = L'\r';
+	if (c32 < 0x10000) {
+		/* Characters in plane 0 use a single word. */
+		printk_wbuf[printk_wpos++] = c32;
+	} else {
+		/*
+		 * Characters in other planes encode into a surrogate pair.
+		 */
+		printk_wbuf[printk_wpos++] =
+			(0xd800 - (0x10000 >> 10)) + (c32 >> 10);
+		printk_wbuf[printk_wpos++] = 0xdc00 + (c32 & 0x3ff);
+	}
+}
+
+/**
+ * efi_puts - 把UTF-8字符串直接输出到控制台
+ *
+ * 不经过环形缓冲区，换行符会被转换成"\r\n"。
+ */
+void efi_puts(const char *str)
+{
+	const u8 *s8 = (const u8 *)str;
+
+	while (*s8)
+		wbuf_putc(utf8_to_utf32(&s8));
+	wbuf_flush();
+}
+
+static struct dragonstub_log_buf *log_buf_get(void)
+{
+	struct dragonstub_log_buf *buf = NULL;
+	efi_status_t status;
+
+	if (log_buf || log_buf_alloc_failed || boot_services_exited ||
+	    memory_map_taken)
+		return log_buf;
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     sizeof(*buf) + CONFIG_DRAGONSTUB_LOG_BUF_SIZE,
+			     (void **)&buf);
+	if (status != EFI_SUCCESS) {
+		/* 没有环形缓冲区的话，直接输出到控制台 */
+		log_buf_alloc_failed = true;
+		return NULL;
+	}
+
+	buf->version = DRAGONSTUB_LOG_BUF_VERSION;
+	buf->size = CONFIG_DRAGONSTUB_LOG_BUF_SIZE;
+	buf->head = 0;
+	log_buf = buf;
+	return log_buf;
+}
+
+static void log_buf_write(struct dragonstub_log_buf *buf, const char *str,
+			  size_t len)
+{
+	size_t off, n;
+
+	/* 比整个缓冲区还长的话，只保留最后的部分 */
+	if (len > buf->size) {
+		buf->head += len - buf->size;
+		str += len - buf->size;
+		len = buf->size;
+	}
+
+	off = buf->head % buf->size;
+	n = min_t(size_t, len, buf->size - off);
+	memcpy(buf->data + off, str, n);
+	memcpy(buf->data, str + n, len - n);
+	buf->head += len;
+}
+
+/**
+ * log_buf_flush_console() - 把环形缓冲区中还没有输出的内容输出到控制台
+ *
+ * 按每条消息的级别前缀过滤，只输出级别小于efi_loglevel的消息。
+ */
+static void log_buf_flush_console(struct dragonstub_log_buf *buf)
+{
+	u64 pos = console_pos;
+	u8 tmp[5];
+	const u8 *s8;
+	u32 c32;
+	size_t i;
+
+	/* 被覆盖掉的内容已经无法输出了 */
+	if (buf->head - pos > buf->size)
+		pos = buf->head - buf->size;
+
+	while (pos < buf->head) {
+		/* 一个UTF-8字符可能跨越缓冲区的末尾，先复制出来再解码 */
+		for (i = 0; i < 4 && pos + i < buf->head; i++)
+			tmp[i] = buf->data[(pos + i) % buf->size];
+		tmp[i] = 0;
+
+		if (tmp[0] == LOG_SOH && i >= LOG_PREFIX_LEN) {
+			console_level = tmp[1] - '0';
+			pos += LOG_PREFIX_LEN;
+			continue;
+		}
+
+		s8 = tmp;
+		c32 = utf8_to_utf32(&s8);
+		if (console_level < efi_loglevel)
+			wbuf_putc(c32);
+		pos += s8 - tmp;
+	}
+	wbuf_flush();
+	console_pos = pos;
+}
+
+void efi_log_flush(void)
+{
+	if (log_buf && console_usable())
+		log_buf_flush_console(log_buf);
+}
+
+void efi_log_memory_map_taken(bool taken)
+{
+	memory_map_taken = taken;
+}
+
+void efi_log_exit_boot_services(void)
+{
+	boot_services_exited = true;
+}
+
+static int efi_vprintk(int level, const char *fmt, va_list args)
+{
+	static bool busy = false;
+	char nested_buf[128];
+	char *buf = printk_buf;
+	size_t size = sizeof(printk_buf);
+	struct dragonstub_log_buf *lb;
+	int printed;
+
+	/*
+	 * vsnprintf遇到不支持的格式时会调用WARN，再次进入efi_printk。
+	 * 这时共享缓冲区正在使用，改用栈上的小缓冲区
+	 */
+	if (busy) {
+		buf = nested_buf;
+		size = sizeof(nested_buf);
+	}
+	busy = true;
+
+	buf[0] = LOG_SOH;
+	buf[1] = '0' + level;
+	printed = vsnprintf(buf + LOG_PREFIX_LEN, size - LOG_PREFIX_LEN, fmt,
+			   args);
+	if (printed >= (int)(size - LOG_PREFIX_LEN))
+		printed = size - LOG_PREFIX_LEN - 1;
+
+	lb = log_buf_get();
+	if (lb) {
+		/* 还没有输出到控制台的内容即将被覆盖，先输出 */
+		if (lb->head + LOG_PREFIX_LEN + printed - console_pos >
+		    lb->size)
+			efi_log_flush();
+		log_buf_write(lb, buf, printed + LOG_PREFIX_LEN);
+		if (lb->head - console_pos >= PRINTK_BATCH)
+			efi_log_flush();
+	} else if (console_usable() && level < efi_loglevel) {
+		efi_puts(buf + LOG_PREFIX_LEN);
+	}
+
+	if (buf == printk_buf)
+		busy = false;
+	return printed;
+}
+
+/**
+ * efi_printk - 格式化并输出一条消息
+ *
+ * 格式字符串使用vsnprintf的语法（%s是char *）。过长的消息会被截断。
+ * 消息按LOGLEVEL_ERR记录，quiet时也会输出到控制台。
+ *
+ * 返回值：消息的长度
+ */
+int efi_printk(const char *fmt, ...)
+{
+	va_list args;
+	int printed;
+
+	va_start(args, fmt);
+	printed = efi_vprintk(LOGLEVEL_ERR, fmt, args);
+	va_end(args);
+	return printed;
+}
+
+/**
+ * efi_log_printk - 以@level级别格式化并记录一条消息
+ *
+ * 消息总是写入日志环形缓冲区，级别小于efi_loglevel时才输出到控制台。
+ *
+ * 返回值：消息的长度（不包括级别前缀）
+ */
+int efi_log_printk(int level, const char *fmt, ...)
+{
+	va_list args;
+	int printed;
+
+	va_start(args, fmt);
+	printed = efi_vprintk(level, fmt, args);
+	va_end(args);
+	return printed;
+}
+
+efi_status_t efi_log_install(void)
+{
+	efi_guid_t guid = DRAGONSTUB_EFI_LOG_BUF_GUID;
+	efi_status_t status;
+
+	if (log_buf_installed)
+		return EFI_SUCCESS;
+	if (!log_buf_get())
+		return EFI_OUT_OF_RESOURCES;
+
+	status = efi_bs_call(InstallConfigurationTable, &guid, log_buf);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to install log buffer table\n");
+		return status;
+	}
+
+	log_buf_installed = true;
+	efi_debug("Log buffer installed at %p, size: %d\n", log_buf,
+		  log_buf->size);
+	return EFI_SUCCESS;
+}
+
+struct dragonstub_log_buf *efi_log_buf(void)
+{
+	return log_buf_installed ? log_buf : NULL;
+}
@@ -7,6 +7,12 @@
 /// @brief 当前的hartid
 static unsigned long hartid;
 
+/// @brief 是否为了加速内存操作打开了向量单元
+static bool vector_enabled;
+
+/// @brief 启动核支持的最大页表级数，FDT中没有mmu-type时假定支持Sv39
+static u32 pgtable_levels = 3;
+
 typedef void __noreturn (*jump_kernel_func)(unsigned long, unsigned long);
 
 static efi_status_t get_boot_hartid_from_fdt(void)
@@ -60,6 +66,314 @@ static efi_status_t get_boot_hartid_from_efi(void)
 	return efi_call_proto(boot_protocol, get_boot_hartid, &hartid);
 }
 
+/**
+ * riscv_isa_has_ext() - 检查riscv,isa字符串中是否包含某个扩展
+ * @isa:	例如"rv64imafdcv_zicbom_zicboz"
+ * @ext:	单字母扩展（例如"v"）或者多字母扩展（例如"zicboz"）
+ */
+static bool riscv_isa_has_ext(const char *isa, const char *ext)
+{
+	size_t ext_len = strlen(ext);
+
+	if (strncmp(isa, "rv32", 4) && strncmp(isa, "rv64", 4))
+		return false;
+	isa += 4;
+
+	// 单字母扩展都在第一个'_'之前
+	if (ext_len == 1) {
+		for (; *isa && *isa != '_'; isa++) {
+			if (tolower(*isa) == ext[0])
+				return true;
+		}
+		return false;
+	}
+
+	while ((isa = strchr(isa, '_')) != NULL) {
+		isa++;
+		// 扩展名后面可能带有版本号，例如"zicboz1p0"
+		if (!strncmp(isa, ext, ext_len) &&
+		    (isa[ext_len] == '\0' || isa[ext_len] == '_' ||
+		     isdigit(isa[ext_len])))
+			return true;
+	}
+	return false;
+}
+
+/// @brief 检查cpu节点是否声明了某个ISA扩展
+static bool cpu_has_ext(const void *fdt, int node, const char *ext)
+{
+	const char *isa;
+	int len;
+
+	// 新的绑定：riscv,isa-extensions是一个字符串列表
+	if (fdt_getprop(fdt, node, "riscv,isa-extensions", &len))
+		return fdt_stringlist_search(fdt, node, "riscv,isa-extensions",
+					     ext) >= 0;
+
+	isa = fdt_getprop(fdt, node, "riscv,isa", &len);
+	if (!isa || len <= 0)
+		return false;
+	return riscv_isa_has_ext(isa, ext);
+}
+
+/// @brief 在FDT的/cpus下找到启动核的cpu节点
+static int find_boot_cpu_node(const void *fdt)
+{
+	int cpus, node, len;
+
+	cpus = fdt_path_offset(fdt, "/cpus");
+	if (cpus < 0)
+		return cpus;
+
+	fdt_for_each_subnode(node, fdt, cpus)
+	{
+		const char *type = fdt_getprop(fdt, node, "device_type", NULL);
+		if (!type || strcmp(type, "cpu"))
+			continue;
+
+		const fdt32_t *reg = fdt_getprop(fdt, node, "reg", &len);
+		if (!reg || len < (int)sizeof(fdt32_t))
+			continue;
+
+		u64 id = fdt32_to_cpu(reg[0]);
+		if (len >= 2 * (int)sizeof(fdt32_t))
+			id = (id << 32) | fdt32_to_cpu(reg[1]);
+		if (id == hartid)
+			return node;
+	}
+	return -FDT_ERR_NOTFOUND;
+}
+
+/**
+ * init_mem_extensions() - 根据启动核支持的扩展，选择内存操作的实现
+ *
+ * 支持V扩展时，大块的memcpy/memset/memmove/memcmp使用向量指令；
+ * 支持Zicboz扩展时，大块的清零使用cbo.zero。
+ * 读不到FDT或者找不到启动核的节点时，使用按字操作的通用实现。
+ *
+ * 同时根据Zbc扩展选择CRC32的实现（clmul或者查表）。
+ */
+static void init_mem_extensions(void)
+{
+	const void *fdt;
+	UINTN ext = 0;
+	u32 cboz_block = 0;
+	int node, len;
+
+	fdt = get_efi_config_table(DEVICE_TREE_GUID);
+	if (!fdt)
+		return;
+
+	node = find_boot_cpu_node(fdt);
+	if (node < 0) {
+		efi_warn("Boot hart not found in FDT, using generic memory routines\n");
+		return;
+	}
+
+	if (cpu_has_ext(fdt, node, "v")) {
+		// 打开向量单元，进入内核之前再关掉
+		csr_set(CSR_SSTATUS, SR_VS_INITIAL);
+		vector_enabled = true;
+		ext |= LIB_MEM_EXT_VECTOR;
+	}
+
+	if (cpu_has_ext(fdt, node, "zicboz")) {
+		const fdt32_t *prop =
+			fdt_getprop(fdt, node, "riscv,cboz-block-size", &len);
+		if (prop && len == sizeof(fdt32_t)) {
+			cboz_block = fdt32_to_cpu(*prop);
+			ext |= LIB_MEM_EXT_CBOZ;
+		}
+	}
+
+	LibSetCrcExtensions(cpu_has_ext(fdt, node, "zbc") ? LIB_CRC_EXT_CLMUL :
+							    0);
+
+	LibSetMemExtensions(ext, cboz_block);
+	ext = LibGetMemExtensions();
+	efi_info("Memory routines: vector=%d, cbo.zero=%d (block size: %d)\n",
+		 !!(ext & LIB_MEM_EXT_VECTOR), !!(ext & LIB_MEM_EXT_CBOZ),
+		 cboz_block);
+	efi_info("CRC32: clmul=%d\n",
+		 !!(LibGetCrcExtensions() & LIB_CRC_EXT_CLMUL));
+}
+
+/// @brief 根据启动核的mmu-type属性确定支持的分页模式
+static void init_mmu_type(void)
+{
+	const void *fdt;
+	const char *type;
+	int node;
+
+	fdt = get_efi_config_table(DEVICE_TREE_GUID);
+	if (!fdt)
+		return;
+
+	node = find_boot_cpu_node(fdt);
+	if (node < 0)
+		return;
+
+	type = fdt_getprop(fdt, node, "mmu-type", NULL);
+	if (!type)
+		return;
+	if (!strcmp(type, "riscv,sv39"))
+		pgtable_levels = 3;
+	else if (!strcmp(type, "riscv,sv48"))
+		pgtable_levels = 4;
+	else if (!strcmp(type, "riscv,sv57"))
+		pgtable_levels = 5;
+	else
+		pgtable_levels = 0;
+	efi_debug("MMU type: %s\n", type);
+}
+
+u32 efi_arch_pgtable_levels(void)
+{
+	return pgtable_levels;
+}
+
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_BASE_PROBE_EXT 3
+#define SBI_EXT_HSM 0x48534D
+#define SBI_EXT_HSM_HART_START 0
+#define SBI_EXT_HSM_HART_STOP 1
+#define SBI_EXT_HSM_HART_GET_STATUS 2
+#define SBI_HSM_STATE_STOPPED 1
+
+struct sbiret {
+	long error;
+	long value;
+};
+
+static struct sbiret sbi_ecall(unsigned long ext, unsigned long fid,
+			       unsigned long arg0, unsigned long arg1,
+			       unsigned long arg2)
+{
+	register unsigned long a0 __asm__("a0") = arg0;
+	register unsigned long a1 __asm__("a1") = arg1;
+	register unsigned long a2 __asm__("a2") = arg2;
+	register unsigned long a6 __asm__("a6") = fid;
+	register unsigned long a7 __asm__("a7") = ext;
+
+	__asm__ __volatile__("ecall"
+			     : "+r"(a0), "+r"(a1)
+			     : "r"(a2), "r"(a6), "r"(a7)
+			     : "memory");
+	return (struct sbiret){ .error = a0, .value = a1 };
+}
+
+/// @brief 查询hart的HSM状态，出错时返回负数
+static long sbi_hart_status(u64 id)
+{
+	struct sbiret ret =
+		sbi_ecall(SBI_EXT_HSM, SBI_EXT_HSM_HART_GET_STATUS, id, 0, 0);
+
+	return ret.error ? ret.error : ret.value;
+}
+
+/*
+ * 辅助核的入口。SBI以a0 = hartid、a1 = opaque（struct efi_smp_worker）
+ * 跳转到这里，此时satp为0，只需要从worker->stack_top取出栈指针。
+ */
+void riscv_smp_secondary(struct efi_smp_worker *worker);
+__asm__(".text\n"
+	".balign 4\n"
+	".global riscv_smp_entry\n"
+	"riscv_smp_entry:\n"
+	"	ld	sp, 0(a1)\n"
+	"	mv	a0, a1\n"
+	"	call	riscv_smp_secondary\n"
+	"1:	wfi\n"
+	"	j	1b\n");
+extern char riscv_smp_entry[];
+
+void riscv_smp_secondary(struct efi_smp_worker *worker)
+{
+	// memcpy/memset可能使用向量指令，与启动核保持一致
+	if (vector_enabled)
+		csr_set(CSR_SSTATUS, SR_VS_INITIAL);
+
+	efi_smp_worker_main(worker);
+
+	if (vector_enabled)
+		csr_clear(CSR_SSTATUS, SR_VS);
+	__atomic_store_n(&worker->parked, 1, __ATOMIC_RELEASE);
+	// 回到STOPPED状态，内核以后还可以通过HSM启动它
+	sbi_ecall(SBI_EXT_HSM, SBI_EXT_HSM_HART_STOP, 0, 0, 0);
+}
+
+u32 efi_arch_smp_harts(u64 *hartids, u32 max)
+{
+	const void *fdt;
+	struct sbiret ret;
+	int cpus, node, len;
+	u32 nr = 0;
+
+	ret = sbi_ecall(SBI_EXT_BASE, SBI_EXT_BASE_PROBE_EXT, SBI_EXT_HSM, 0,
+			0);
+	if (ret.error || !ret.value) {
+		efi_info("SBI HSM extension not available\n");
+		return 0;
+	}
+
+	fdt = get_efi_config_table(DEVICE_TREE_GUID);
+	if (!fdt)
+		return 0;
+	cpus = fdt_path_offset(fdt, "/cpus");
+	if (cpus < 0)
+		return 0;
+
+	fdt_for_each_subnode(node, fdt, cpus)
+	{
+		const char *type = fdt_getprop(fdt, node, "device_type", NULL);
+		if (!type || strcmp(type, "cpu"))
+			continue;
+
+		const char *status = fdt_getprop(fdt, node, "status", NULL);
+		if (status && strcmp(status, "okay") && strcmp(status, "ok"))
+			continue;
+
+		const fdt32_t *reg = fdt_getprop(fdt, node, "reg", &len);
+		if (!reg || len < (int)sizeof(fdt32_t))
+			continue;
+
+		u64 id = fdt32_to_cpu(reg[0]);
+		if (len >= 2 * (int)sizeof(fdt32_t))
+			id = (id << 32) | fdt32_to_cpu(reg[1]);
+		if (id == hartid)
+			continue;
+
+		// 只使用固件中停着的核，固件自己在用的核不去碰
+		if (sbi_hart_status(id) != SBI_HSM_STATE_STOPPED)
+			continue;
+		if (nr == max)
+			break;
+		hartids[nr++] = id;
+	}
+	return nr;
+}
+
+efi_status_t efi_arch_smp_start(struct efi_smp_worker *worker)
+{
+	struct sbiret ret;
+
+	ret = sbi_ecall(SBI_EXT_HSM, SBI_EXT_HSM_HART_START, worker->hartid,
+			(unsigned long)riscv_smp_entry, (unsigned long)worker);
+	return ret.error ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+}
+
+bool efi_arch_smp_parked(struct efi_smp_worker *worker)
+{
+	return __atomic_load_n(&worker->parked, __ATOMIC_ACQUIRE) &&
+	       sbi_hart_status(worker->hartid) == SBI_HSM_STATE_STOPPED;
+}
+
+void efi_arch_cpu_relax(void)
+{
+	// Zihintpause的pause，不支持时是一条无害的fence
+	__asm__ __volatile__(".4byte 0x0100000f" : : : "memory");
+}
+
 efi_status_t check_platform_features(void)
 {
 	efi_info("Checking platform features...\n");
@@ -77,21 +391,46 @@ efi_status_t check_platform_features(void)
 	}
 
 	efi_info("Boot hartid: %ld\n", hartid);
+	init_mem_extensions();
+	init_mmu_type();
 	return EFI_SUCCESS;
 }
 
+u64 efi_arch_read_timestamp(void)
+{
+	return csr_read(CSR_TIME);
+}
+
 void __noreturn efi_enter_kernel(struct payload_info *payload_info,
 				 unsigned long fdt, unsigned long fdt_size)
 {
 	unsigned long kernel_entry = payload_info->kernel_entry;
 	jump_kernel_func jump_kernel = (jump_kernel_func)kernel_entry;
 
+	struct dragonstub_pgtable *pgtable = efi_pgtable();
+
 	/*
 	 * Jump to real kernel here with following constraints.
-	 * 1. MMU should be disabled.
+	 * 1. MMU should be disabled, or enabled with the page tables
+	 *    described by struct dragonstub_pgtable (efi=mmu).
 	 * 2. a0 should contain hartid
 	 * 3. a1 should DT address
 	 */
 	csr_write(CSR_SATP, 0);
+	if (pgtable) {
+		// 恒等映射覆盖了这里的代码和栈，写satp之后可以继续执行
+		csr_write(CSR_SATP, pgtable->satp);
+		if (csr_read(CSR_SATP) == pgtable->satp) {
+			__asm__ __volatile__("sfence.vma" : : : "memory");
+			jump_kernel = (jump_kernel_func)pgtable->kernel_entry;
+		} else {
+			// 硬件不支持这个分页模式
+			csr_write(CSR_SATP, 0);
+			pgtable->satp = 0;
+		}
+	}
+	// 把为了加速内存操作而打开的向量单元恢复到关闭的状态
+	if (vector_enabled)
+		csr_clear(CSR_SSTATUS, SR_VS);
 	jump_kernel(hartid, fdt);
 }
\ No newline at end of file
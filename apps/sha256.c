@@ -0,0 +1,193 @@
+#include <efi.h>
+#include <efilib.h>
+#include <dragonstub/dragonstub.h>
+#include <dragonstub/sha256.h>
+
+/*
+ * SHA-256: https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.180-4.pdf
+ */
+
+/*
+ * sha256_copy()每次先复制这么多字节，再趁它们还在L1缓存里计算摘要。
+ * 比逐块调用memcpy()快，又不会大到被挤出缓存。
+ */
+#define SHA256_COPY_CHUNK 4096
+
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline u32 sha256_ror(u32 x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline u32 sha256_load_be32(const u8 *p)
+{
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) |
+	       (u32)p[3];
+}
+
+static inline void sha256_store_be32(u8 *p, u32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+#define S0(x) (sha256_ror(x, 2) ^ sha256_ror(x, 13) ^ sha256_ror(x, 22))
+#define S1(x) (sha256_ror(x, 6) ^ sha256_ror(x, 11) ^ sha256_ror(x, 25))
+#define s0(x) (sha256_ror(x, 7) ^ sha256_ror(x, 18) ^ ((x) >> 3))
+#define s1(x) (sha256_ror(x, 17) ^ sha256_ror(x, 19) ^ ((x) >> 10))
+#define Ch(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define Maj(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+/* 消息调度只保留最近的16个字 */
+#define W(i) w[(i) & 15]
+#define SCHEDULE(i)                                                        \
+	(W(i) += s1(W((i) - 2)) + W((i) - 7) + s0(W((i) - 15)))
+
+/*
+ * 一轮压缩。a~h的角色每轮轮换一次，通过宏参数的顺序实现，
+ * 这样就不需要在寄存器之间搬运8个变量。
+ */
+#define ROUND(a, b, c, d, e, f, g, h, i, wi)                               \
+	do {                                                               \
+		u32 t1 = (h) + S1(e) + Ch(e, f, g) + sha256_k[i] + (wi);   \
+		u32 t2 = S0(a) + Maj(a, b, c);                             \
+		(d) += t1;                                                 \
+		(h) = t1 + t2;                                             \
+	} while (0)
+
+#define ROUNDS8(i, wi)                                                     \
+	do {                                                               \
+		ROUND(a, b, c, d, e, f, g, h, (i) + 0, wi((i) + 0));       \
+		ROUND(h, a, b, c, d, e, f, g, (i) + 1, wi((i) + 1));       \
+		ROUND(g, h, a, b, c, d, e, f, (i) + 2, wi((i) + 2));       \
+		ROUND(f, g, h, a, b, c, d, e, (i) + 3, wi((i) + 3));       \
+		ROUND(e, f, g, h, a, b, c, d, (i) + 4, wi((i) + 4));       \
+		ROUND(d, e, f, g, h, a, b, c, (i) + 5, wi((i) + 5));       \
+		ROUND(c, d, e, f, g, h, a, b, (i) + 6, wi((i) + 6));       \
+		ROUND(b, c, d, e, f, g, h, a, (i) + 7, wi((i) + 7));       \
+	} while (0)
+
+/// @brief 压缩@data开始的@blocks个块
+static void sha256_blocks(u32 *state, const u8 *data, u64 blocks)
+{
+	u32 w[16];
+
+	while (blocks--) {
+		u32 a = state[0], b = state[1], c = state[2], d = state[3];
+		u32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int i = 0; i < 16; i++)
+			w[i] = sha256_load_be32(data + i * 4);
+
+		ROUNDS8(0, W);
+		ROUNDS8(8, W);
+		ROUNDS8(16, SCHEDULE);
+		ROUNDS8(24, SCHEDULE);
+		ROUNDS8(32, SCHEDULE);
+		ROUNDS8(40, SCHEDULE);
+		ROUNDS8(48, SCHEDULE);
+		ROUNDS8(56, SCHEDULE);
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+		data += SHA256_BLOCK_SIZE;
+	}
+}
+
+void sha256_init(struct sha256_state *sctx)
+{
+	static const u32 iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(sctx->state, iv, sizeof(iv));
+	sctx->count = 0;
+}
+
+void sha256_update(struct sha256_state *sctx, const void *data, u64 len)
+{
+	unsigned int partial = sctx->count % SHA256_BLOCK_SIZE;
+	const u8 *p = data;
+
+	sctx->count += len;
+
+	if (partial) {
+		unsigned int fill = SHA256_BLOCK_SIZE - partial;
+
+		if (len < fill) {
+			memcpy(sctx->buf + partial, p, len);
+			return;
+		}
+		memcpy(sctx->buf + partial, p, fill);
+		sha256_blocks(sctx->state, sctx->buf, 1);
+		p += fill;
+		len -= fill;
+	}
+
+	if (len >= SHA256_BLOCK_SIZE) {
+		sha256_blocks(sctx->state, p, len / SHA256_BLOCK_SIZE);
+		p += len & ~(u64)(SHA256_BLOCK_SIZE - 1);
+		len %= SHA256_BLOCK_SIZE;
+	}
+
+	if (len)
+		memcpy(sctx->buf, p, len);
+}
+
+void sha256_copy(struct sha256_state *sctx, void *dst, const void *src,
+		 u64 len)
+{
+	while (len) {
+		u64 n = min_t(u64, len, SHA256_COPY_CHUNK);
+
+		if (dst != src)
+			memcpy(dst, src, n);
+		sha256_update(sctx, dst, n);
+		dst += n;
+		src += n;
+		len -= n;
+	}
+}
+
+void sha256_final(struct sha256_state *sctx, u8 out[SHA256_DIGEST_SIZE])
+{
+	unsigned int partial = sctx->count % SHA256_BLOCK_SIZE;
+	u64 bits = sctx->count << 3;
+
+	sctx->buf[partial++] = 0x80;
+	if (partial > SHA256_BLOCK_SIZE - 8) {
+		memset(sctx->buf + partial, 0, SHA256_BLOCK_SIZE - partial);
+		sha256_blocks(sctx->state, sctx->buf, 1);
+		partial = 0;
+	}
+	memset(sctx->buf + partial, 0, SHA256_BLOCK_SIZE - 8 - partial);
+	sha256_store_be32(sctx->buf + 56, bits >> 32);
+	sha256_store_be32(sctx->buf + 60, bits);
+	sha256_blocks(sctx->state, sctx->buf, 1);
+
+	for (int i = 0; i < 8; i++)
+		sha256_store_be32(out + i * 4, sctx->state[i]);
+	memset(sctx, 0, sizeof(*sctx));
+}
@@ -0,0 +1,273 @@
+#include <dragonstub/dragonstub.h>
+#include <dragonstub/linux/align.h>
+#include <dragonstub/linux/math.h>
+#include <dragonstub/linux/sizes.h>
+#include <dragonstub/minmax.h>
+
+/*
+ * 辅助核工作池（efi=smp）
+ *
+ * 加载内核时，启动核以外的核大多在固件中停着。efi_smp_start()把它们启动起来，
+ * 在efi_smp_worker_main()中等待任务；efi_smp_run()发布一个任务之后，启动核和
+ * 所有的辅助核一起领取任务项，直到全部完成。efi_smp_stop()让辅助核回到停止
+ * 状态，之后内核仍然可以按通常的方式启动它们。
+ *
+ * 任务队列只有一个槽位，不需要锁：queue.next的高32位是任务的代数，低32位是
+ * 下一个未领取的任务项，领取任务项就是对它做一次CAS。CAS成功说明领取时任务
+ * 还没有完成，启动核也就还没有改写queue中的其他字段，读到的fn/arg/nr一定属于
+ * 这一代任务。
+ *
+ * 辅助核上不能调用固件的服务，任务只能访问内存。
+ */
+
+/// @brief 每个辅助核的栈大小
+#define SMP_STACK_SIZE SZ_16K
+
+/// @brief memcpy/memset分块的大小
+#define SMP_CHUNK_SIZE SZ_1M
+
+/// @brief 小于这个大小的复制和清零不值得分给辅助核
+#define SMP_MIN_SIZE SZ_4M
+
+/// @brief 等待辅助核停下的时间（微秒）
+#define SMP_PARK_TIMEOUT_US 1000000
+
+#define SMP_PARK_POLL_US 10
+
+static struct {
+	/// @brief 高32位是任务的代数，低32位是下一个未领取的任务项
+	u64 next;
+	/// @brief 已经完成的任务项数
+	u64 done;
+	/// @brief 任务，NULL表示辅助核应该退出工作循环
+	efi_smp_fn_t fn;
+	void *arg;
+	u64 nr;
+} queue;
+
+/// @brief 最近一次发布的任务的代数，0留给初始状态
+static u32 generation;
+
+static struct efi_smp_worker *workers;
+static u32 nr_workers;
+
+/// @brief 辅助核的栈
+static unsigned long stacks;
+static unsigned long stacks_size;
+
+/// @brief 发布一代新的任务，返回它的代数
+static u32 smp_publish(efi_smp_fn_t fn, void *arg, u64 nr)
+{
+	if (++generation == 0)
+		++generation;
+
+	__atomic_store_n(&queue.fn, fn, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue.arg, arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue.nr, nr, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue.done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue.next, (u64)generation << 32,
+			 __ATOMIC_RELEASE);
+	return generation;
+}
+
+/// @brief 领取并执行第@gen代任务的任务项，任务项领完之后返回
+static void smp_work(u32 gen)
+{
+	for (;;) {
+		u64 cur = __atomic_load_n(&queue.next, __ATOMIC_ACQUIRE);
+		if ((u32)(cur >> 32) != gen)
+			return;
+
+		efi_smp_fn_t fn =
+			__atomic_load_n(&queue.fn, __ATOMIC_RELAXED);
+		void *arg = __atomic_load_n(&queue.arg, __ATOMIC_RELAXED);
+		u64 nr = __atomic_load_n(&queue.nr, __ATOMIC_RELAXED);
+		if (!fn || (u32)cur >= nr)
+			return;
+
+		if (!__atomic_compare_exchange_n(&queue.next, &cur, cur + 1,
+						 false, __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED))
+			continue;
+
+		fn(arg, (u32)cur);
+		__atomic_fetch_add(&queue.done, 1, __ATOMIC_RELEASE);
+	}
+}
+
+void efi_smp_worker_main(struct efi_smp_worker *worker __always_unused)
+{
+	u32 seen = 0;
+
+	for (;;) {
+		u32 gen = __atomic_load_n(&queue.next, __ATOMIC_ACQUIRE) >> 32;
+		if (gen == seen) {
+			efi_arch_cpu_relax();
+			continue;
+		}
+		if (!__atomic_load_n(&queue.fn, __ATOMIC_RELAXED))
+			return;
+		smp_work(gen);
+		seen = gen;
+	}
+}
+
+void efi_smp_run(efi_smp_fn_t fn, void *arg, u64 nr)
+{
+	if (!nr_workers || nr < 2 || nr > UINT32_MAX) {
+		for (u64 i = 0; i < nr; i++)
+			fn(arg, i);
+		return;
+	}
+
+	// 启动核也领取任务项，然后等待辅助核做完各自领取的部分
+	smp_work(smp_publish(fn, arg, nr));
+	while (__atomic_load_n(&queue.done, __ATOMIC_ACQUIRE) < nr)
+		efi_arch_cpu_relax();
+}
+
+u32 efi_smp_workers(void)
+{
+	return nr_workers;
+}
+
+/// @brief 分块的memcpy/memset
+struct smp_mem_job {
+	u8 *dst;
+	const u8 *src;
+	int c;
+	u64 len;
+};
+
+static void smp_memcpy_chunk(void *arg, u64 index)
+{
+	struct smp_mem_job *job = arg;
+	u64 offset = index * SMP_CHUNK_SIZE;
+
+	memcpy(job->dst + offset, job->src + offset,
+	       min_t(u64, SMP_CHUNK_SIZE, job->len - offset));
+}
+
+static void smp_memset_chunk(void *arg, u64 index)
+{
+	struct smp_mem_job *job = arg;
+	u64 offset = index * SMP_CHUNK_SIZE;
+
+	memset(job->dst + offset, job->c,
+	       min_t(u64, SMP_CHUNK_SIZE, job->len - offset));
+}
+
+void efi_smp_memcpy(void *dst, const void *src, u64 len)
+{
+	struct smp_mem_job job = { .dst = dst, .src = src, .len = len };
+
+	if (!nr_workers || len < SMP_MIN_SIZE) {
+		memcpy(dst, src, len);
+		return;
+	}
+	efi_smp_run(smp_memcpy_chunk, &job,
+		    DIV_ROUND_UP(len, SMP_CHUNK_SIZE));
+}
+
+void efi_smp_memset(void *dst, int c, u64 len)
+{
+	struct smp_mem_job job = { .dst = dst, .c = c, .len = len };
+
+	if (!nr_workers || len < SMP_MIN_SIZE) {
+		memset(dst, c, len);
+		return;
+	}
+	efi_smp_run(smp_memset_chunk, &job,
+		    DIV_ROUND_UP(len, SMP_CHUNK_SIZE));
+}
+
+void efi_smp_start(void)
+{
+	u64 hartids[CONFIG_DRAGONSTUB_SMP_MAX_HARTS - 1];
+	efi_status_t status;
+	u32 nr;
+
+	if (nr_workers)
+		return;
+
+	nr = efi_arch_smp_harts(hartids,
+				sizeof(hartids) / sizeof(hartids[0]));
+	if (!nr) {
+		efi_info("No secondary harts to start, running on the boot hart only\n");
+		return;
+	}
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     nr * sizeof(*workers), (void **)&workers);
+	if (status != EFI_SUCCESS)
+		goto fail;
+
+	stacks_size = nr * SMP_STACK_SIZE;
+	status = efi_allocate_pages(stacks_size, &stacks, ULONG_MAX);
+	if (status != EFI_SUCCESS) {
+		efi_bs_call(FreePool, workers);
+		goto fail;
+	}
+
+	for (u32 i = 0; i < nr; i++) {
+		struct efi_smp_worker *worker = &workers[nr_workers];
+
+		worker->stack_top = stacks + (nr_workers + 1) * SMP_STACK_SIZE;
+		worker->hartid = hartids[i];
+		worker->index = nr_workers + 1;
+		worker->parked = 0;
+
+		status = efi_arch_smp_start(worker);
+		if (status != EFI_SUCCESS) {
+			efi_warn("Failed to start hart %llu: 0x%lx\n",
+				 hartids[i], status);
+			continue;
+		}
+		nr_workers++;
+	}
+
+	if (!nr_workers) {
+		efi_free(stacks_size, stacks);
+		efi_bs_call(FreePool, workers);
+		workers = NULL;
+		return;
+	}
+	efi_info("Started %u secondary harts\n", nr_workers);
+	return;
+fail:
+	efi_warn("Failed to allocate the worker pool, running on the boot hart only\n");
+	workers = NULL;
+}
+
+void efi_smp_stop(void)
+{
+	bool stuck = false;
+
+	if (!nr_workers)
+		return;
+
+	smp_publish(NULL, NULL, 0);
+	for (u32 i = 0; i < nr_workers; i++) {
+		u32 waited = 0;
+
+		while (!efi_arch_smp_parked(&workers[i]) &&
+		       waited < SMP_PARK_TIMEOUT_US) {
+			efi_bs_call(Stall, SMP_PARK_POLL_US);
+			waited += SMP_PARK_POLL_US;
+		}
+		if (!efi_arch_smp_parked(&workers[i])) {
+			efi_warn("Hart %llu did not stop\n",
+				 workers[i].hartid);
+			stuck = true;
+		}
+	}
+
+	efi_info("Parked %u secondary harts\n", nr_workers);
+	nr_workers = 0;
+	// 没有停下的核可能还在使用自己的栈
+	if (stuck)
+		return;
+	efi_free(stacks_size, stacks);
+	efi_bs_call(FreePool, workers);
+	workers = NULL;
+}
@@ -5,6 +5,8 @@
 #include <elf.h>
 #include <dragonstub/dragonstub.h>
 #include <dragonstub/elfloader.h>
+#include <dragonstub/lz4.h>
+#include <dragonstub/sha256.h>
 #include <dragonstub/linux/math.h>
 #include <dragonstub/linux/align.h>
 
@@ -96,9 +98,9 @@ static efi_status_t init_efi_program_info(efi_loaded_image_t *loaded_image)
 	image_base = (u64)loaded_image->ImageBase;
 	image_size = loaded_image->ImageSize;
 	image_end = (u64)_image_end;
-	efi_info("DragonStub loaded at 0x%p\n", image_base);
-	efi_info("DragonStub + payload size: 0x%p\n", image_size);
-	efi_info("DragonStub end addr: 0x%p\n", image_end);
+	efi_info("DragonStub loaded at 0x%llx\n", image_base);
+	efi_info("DragonStub + payload size: 0x%llx\n", image_size);
+	efi_info("DragonStub end addr: 0x%llx\n", image_end);
 	return EFI_SUCCESS;
 }
 
@@ -109,9 +111,57 @@ static struct payload_info payload_info_new(u64 payload_addr, u64 payload_size)
 				     .payload_size = payload_size,
 				     .loaded_paddr = 0,
 				     .loaded_size = 0,
-				     .kernel_entry = 0 };
+				     .kernel_entry = 0,
+				     .payload_type = PAYLOAD_TYPE_ELF,
+				     .file = { .handle = NULL, .size = 0 },
+				     .payload_allocated = false,
+				     .digest = NULL,
+				     .inplace_align = 0 };
 	return info;
 }
+/// @brief 检查内存中的负载（ELF文件或者LZ4压缩的ELF文件），并填写@info
+static efi_status_t check_payload(u64 payload_start, u64 payload_size,
+				  struct payload_info *info)
+{
+	if (lz4_frame_check((void *)payload_start, payload_size)) {
+		// 负载被压缩了，先解压出ELF文件头进行检查
+		u8 ehdr[sizeof(Elf64_Ehdr)];
+		efi_status_t status = lz4_frame_read((void *)payload_start,
+						     payload_size, 0, ehdr,
+						     sizeof(ehdr));
+		if (status != EFI_SUCCESS) {
+			efi_err("Failed to decompress payload's ELF header: %lx\n",
+				status);
+			return EFI_NOT_FOUND;
+		}
+
+		efi_info("Checking compressed payload's ELF header...\n");
+		if (elf_check(ehdr, sizeof(ehdr))) {
+			info->payload_addr = payload_start;
+			info->payload_size = payload_size;
+			info->payload_type = PAYLOAD_TYPE_LZ4;
+			efi_info("Found LZ4 compressed payload, uncompressed size: 0x%llx\n",
+				 lz4_frame_content_size((void *)payload_start,
+							payload_size));
+			return EFI_SUCCESS;
+		}
+		return EFI_NOT_FOUND;
+	}
+
+	efi_info("Checking payload's ELF header...\n");
+	bool found = elf_check((void *)payload_start, payload_size);
+
+	if (found) {
+		info->payload_addr = payload_start;
+		info->payload_size = payload_size;
+		info->payload_type = PAYLOAD_TYPE_ELF;
+		efi_info("Found payload ELF header\n");
+		return EFI_SUCCESS;
+	}
+
+	return EFI_NOT_FOUND;
+}
+
 static efi_status_t find_elf(struct payload_info *info)
 {
 	extern __weak void _binary_payload_start(void);
@@ -122,35 +172,122 @@ static efi_status_t find_elf(struct payload_info *info)
 
 	u64 payload_size = payload_end - payload_start;
 
-	efi_info("payload_addr: %p\n", payload_start);
-	efi_info("payload_end: %p\n", payload_end);
-	efi_info("payload_size: %p\n", payload_size);
+	efi_info("payload_addr: 0x%llx\n", payload_start);
+	efi_info("payload_end: 0x%llx\n", payload_end);
+	efi_info("payload_size: 0x%llx\n", payload_size);
 
 	if (payload_start == 0 || payload_end <= payload_start + 4 ||
 	    payload_size == 0) {
 		return EFI_NOT_FOUND;
 	}
 
-	efi_info("Checking payload's ELF header...\n");
-	bool found = elf_check((void *)payload_start, payload_size);
+	efi_status_t status = check_payload(payload_start, payload_size, info);
+	if (status != EFI_SUCCESS)
+		return status;
 
-	if (found) {
-		info->payload_addr = payload_start;
-		info->payload_size = payload_size;
-		efi_info("Found payload ELF header\n");
-		return EFI_SUCCESS;
+	// tools/payload-inplace.py生成的负载会记录段的内容所在位置的对齐
+	extern __weak void _binary_payload_inplace_align(void);
+	const u64 *inplace_align = (const u64 *)_binary_payload_inplace_align;
+	if (inplace_align && info->payload_type == PAYLOAD_TYPE_ELF) {
+		info->inplace_align = *inplace_align;
+		efi_info("Payload is laid out for in-place execution, alignment: 0x%llx\n",
+			 info->inplace_align);
 	}
+	return EFI_SUCCESS;
+}
 
-	return EFI_NOT_FOUND;
+/**
+ * find_payload_digest() - 获取编译时嵌入的内核摘要（make PAYLOAD_VERIFY=1）
+ *
+ * Return:	SHA256_DIGEST_SIZE字节的摘要，没有嵌入的话返回NULL
+ */
+static const u8 *find_payload_digest(void)
+{
+	extern __weak void _binary_payload_sha256_start(void);
+	extern __weak void _binary_payload_sha256_end(void);
+	u64 start = (u64)_binary_payload_sha256_start;
+	u64 end = (u64)_binary_payload_sha256_end;
+
+	if (start == 0 || end - start != SHA256_DIGEST_SIZE)
+		return NULL;
+	return (const u8 *)start;
+}
+
+/**
+ * find_elf_file() - 使用启动卷上的文件作为负载
+ *
+ * 未压缩的ELF文件只读取文件头，各个段在加载时直接读到内核内存中。
+ * LZ4压缩的文件无法按偏移读取，整个读到内存中之后再流式解压。
+ */
+static efi_status_t find_elf_file(efi_loaded_image_t *image, const char *path,
+				  struct payload_info *info)
+{
+	u8 ehdr[sizeof(Elf64_Ehdr)];
+	struct efi_file file;
+	void *buf = NULL;
+	efi_status_t status;
+
+	efi_info("Loading kernel from file: %s\n", path);
+	status = efi_open_file(image, path, &file);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	if (file.size < sizeof(ehdr)) {
+		efi_err("Kernel file is too small\n");
+		status = EFI_LOAD_ERROR;
+		goto close;
+	}
+
+	status = efi_file_read_at(&file, 0, ehdr, sizeof(ehdr));
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to read kernel file: 0x%lx\n", status);
+		goto close;
+	}
+
+	if (lz4_frame_check(ehdr, sizeof(ehdr))) {
+		status = efi_bs_call(AllocatePool, EfiLoaderData, file.size,
+				     &buf);
+		if (status != EFI_SUCCESS) {
+			efi_err("Failed to allocate memory for the compressed kernel\n");
+			goto close;
+		}
+		status = efi_file_read_at(&file, 0, buf, file.size);
+		if (status == EFI_SUCCESS)
+			status = check_payload((u64)buf, file.size, info);
+		if (status != EFI_SUCCESS) {
+			efi_bs_call(FreePool, buf);
+			goto close;
+		}
+		info->payload_allocated = true;
+		goto close;
+	}
+
+	efi_info("Checking kernel file's ELF header...\n");
+	if (!elf_check(ehdr, sizeof(ehdr))) {
+		status = EFI_NOT_FOUND;
+		goto close;
+	}
+
+	info->payload_addr = 0;
+	info->payload_size = file.size;
+	info->payload_type = PAYLOAD_TYPE_ELF_FILE;
+	info->file = file;
+	return EFI_SUCCESS;
+
+close:
+	efi_file_close(&file);
+	return status;
 }
 
 /// @brief 寻找要加载的内核负载
 /// @param handle efi_handle
 /// @param image efi_loaded_image_t
+/// @param cmdline 命令行，其中的kernel=选项指定从启动卷上的文件加载内核
 /// @param ret_info 返回的负载信息
 /// @return
-efi_status_t find_payload(efi_handle_t handle, efi_loaded_image_t *loaded_image,
-			  struct payload_info *ret_info)
+efi_status_t find_payload(efi_handle_t handle __always_unused,
+			  efi_loaded_image_t *loaded_image,
+			  const char *cmdline, struct payload_info *ret_info)
 {
 	efi_info("Try to find payload to boot\n");
 	efi_status_t status = init_efi_program_info(loaded_image);
@@ -161,13 +298,30 @@ efi_status_t find_payload(efi_handle_t handle, efi_loaded_image_t *loaded_image,
 
 	struct payload_info info = payload_info_new(0, 0);
 
+	char *kernel_path = NULL;
+	if (efi_cmdline_get_option(cmdline, "kernel", 0, &kernel_path) ==
+	    EFI_SUCCESS) {
+		status = find_elf_file(loaded_image, kernel_path, &info);
+		if (status != EFI_SUCCESS)
+			efi_err("Failed to load kernel from %s\n", kernel_path);
+		efi_bs_call(FreePool, kernel_path);
+		if (status != EFI_SUCCESS)
+			return status;
+
+		info.digest = find_payload_digest();
+		*ret_info = info;
+		return EFI_SUCCESS;
+	}
+
 	status = find_elf(&info);
 	if (status != EFI_SUCCESS) {
-		efi_err("Payload not found: Did you forget to add the payload by setting PAYLOAD_ELF at compile time?\n"
+		efi_err("Payload not found: Did you forget to add the payload by setting PAYLOAD_ELF at compile time,\n"
+			"or to pass kernel=<path> on the command line?\n"
 			"Or the payload is not an ELF file?\n");
 		return status;
 	}
 
+	info.digest = find_payload_digest();
 	*ret_info = info;
 	return EFI_SUCCESS;
 }
@@ -183,21 +337,23 @@ efi_status_t find_payload(efi_handle_t handle, efi_loaded_image_t *loaded_image,
 efi_status_t efi_alloc_virtmap(efi_memory_desc_t **virtmap,
 			       unsigned long *desc_size, u32 *desc_ver)
 {
-	unsigned long size, mmap_key;
+	struct efi_boot_memmap *map;
 	efi_status_t status;
 
 	/*
-	 * Use the size of the current memory map as an upper bound for the
+	 * Use the size of the memory map buffer as an upper bound for the
 	 * size of the buffer we need to pass to SetVirtualAddressMap() to
-	 * cover all EFI_MEMORY_RUNTIME regions.
+	 * cover all EFI_MEMORY_RUNTIME regions. The buffer is shared with
+	 * efi_exit_boot_services(), which refreshes it in place.
 	 */
-	size = 0;
-	status = efi_bs_call(GetMemoryMap, &size, NULL, &mmap_key, desc_size,
-			     desc_ver);
-	if (status != EFI_BUFFER_TOO_SMALL)
+	status = efi_get_memory_map(&map, false);
+	if (status != EFI_SUCCESS)
 		return EFI_LOAD_ERROR;
 
-	return efi_bs_call(AllocatePool, EfiLoaderData, size, (void **)virtmap);
+	*desc_size = map->desc_size;
+	*desc_ver = map->desc_ver;
+	return efi_bs_call(AllocatePool, EfiLoaderData, map->buff_size,
+			   (void **)virtmap);
 }
 
 /*
@@ -213,7 +369,7 @@ void efi_get_virtmap(efi_memory_desc_t *memory_map, unsigned long map_size,
 {
 	u64 efi_virt_base = virtmap_base;
 	efi_memory_desc_t *in, *out = runtime_map;
-	int l;
+	unsigned long l;
 
 	*count = 0;
 
@@ -305,7 +461,6 @@ efi_status_t efi_stub_common(efi_handle_t handle,
 			     struct payload_info *payload_info,
 			     char *cmdline_ptr)
 {
-	struct screen_info *si;
 	efi_status_t status;
 
 	status = check_platform_features();
@@ -319,8 +474,11 @@ efi_status_t efi_stub_common(efi_handle_t handle,
 	// /* Ask the firmware to clear memory on unclean shutdown */
 	// efi_enable_reset_attack_mitigation();
 
-	// efi_load_initrd(image, ULONG_MAX, efi_get_max_initrd_addr(image_addr),
-	// 		NULL);
+	boot_ts_begin(DRAGONSTUB_PHASE_LOAD_INITRD);
+	status = efi_load_initrd(loaded_image, cmdline_ptr, EFI_ALLOC_LIMIT);
+	boot_ts_end(DRAGONSTUB_PHASE_LOAD_INITRD);
+	if (status != EFI_SUCCESS)
+		return status;
 
 	// efi_random_get_seed();
 
@@ -330,6 +488,11 @@ efi_status_t efi_stub_common(efi_handle_t handle,
 
 	install_memreserve_table();
 	efi_info("Memreserve table installed\n");
+
+	// 启动时间戳不是必须的，安装失败也继续启动
+	boot_ts_install();
+	// 日志缓冲区同理
+	efi_log_install();
 	efi_info("Booting DragonOS kernel...\n");
 	status = efi_boot_kernel(handle, loaded_image, payload_info,
 				 cmdline_ptr);
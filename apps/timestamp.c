@@ -0,0 +1,113 @@
+#include <dragonstub/dragonstub.h>
+#include <libfdt.h>
+
+/*
+ * 启动各阶段的时间戳
+ *
+ * 在安装到efi config table之前，时间戳记录在early_table中。安装时把它复制到
+ * EfiLoaderData类型的内存中，之后的时间戳（包括退出boot services之后的）
+ * 直接写到安装好的表里，内核可以读到完整的记录。
+ */
+
+static struct dragonstub_boot_timestamps early_table = {
+	.version = DRAGONSTUB_BOOT_TIMESTAMPS_VERSION,
+	.nr_phases = DRAGONSTUB_PHASE_NR,
+};
+
+static struct dragonstub_boot_timestamps *current_table = &early_table;
+static bool installed = false;
+
+void boot_ts_begin(enum dragonstub_boot_phase phase)
+{
+	if (phase >= DRAGONSTUB_PHASE_NR)
+		return;
+
+	u64 now = efi_arch_read_timestamp();
+	// 对于会重试的阶段，保留第一次开始的时间
+	if (current_table->phases[phase].start == 0)
+		current_table->phases[phase].start = now;
+	if (phase == DRAGONSTUB_PHASE_EXIT_BOOT_SERVICES)
+		current_table->ebs_attempts++;
+}
+
+void boot_ts_end(enum dragonstub_boot_phase phase)
+{
+	if (phase >= DRAGONSTUB_PHASE_NR)
+		return;
+
+	current_table->phases[phase].end = efi_arch_read_timestamp();
+}
+
+/// @brief 从FDT的/cpus节点中读取timebase-frequency
+static u64 get_timebase_frequency(void)
+{
+	const void *fdt;
+	const fdt32_t *prop;
+	int node, len;
+
+	fdt = get_efi_config_table(DEVICE_TREE_GUID);
+	if (!fdt)
+		return 0;
+
+	node = fdt_path_offset(fdt, "/cpus");
+	if (node < 0)
+		return 0;
+
+	prop = fdt_getprop(fdt, node, "timebase-frequency", &len);
+	if (!prop)
+		return 0;
+	if (len == sizeof(fdt32_t))
+		return fdt32_to_cpu(*prop);
+	if (len == sizeof(fdt64_t))
+		return ((u64)fdt32_to_cpu(prop[0]) << 32) |
+		       fdt32_to_cpu(prop[1]);
+	return 0;
+}
+
+u64 boot_ts_frequency(void)
+{
+	static u64 frequency;
+
+	if (!frequency)
+		frequency = get_timebase_frequency();
+	return frequency;
+}
+
+efi_status_t boot_ts_install(void)
+{
+	efi_guid_t guid = DRAGONSTUB_EFI_BOOT_TIMESTAMPS_GUID;
+	struct dragonstub_boot_timestamps *tbl = NULL;
+	efi_status_t status;
+
+	if (installed)
+		return EFI_SUCCESS;
+
+	status = efi_bs_call(AllocatePool, EfiLoaderData,
+			     sizeof(struct dragonstub_boot_timestamps),
+			     (void **)&tbl);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to allocate memory for boot timestamps\n");
+		return status;
+	}
+
+	*tbl = early_table;
+	tbl->timebase_frequency = boot_ts_frequency();
+
+	status = efi_bs_call(InstallConfigurationTable, &guid, tbl);
+	if (status != EFI_SUCCESS) {
+		efi_err("Failed to install boot timestamps table\n");
+		efi_bs_call(FreePool, tbl);
+		return status;
+	}
+
+	current_table = tbl;
+	installed = true;
+	efi_debug("Boot timestamps table installed at %p, timebase: %llu Hz\n",
+		  tbl, tbl->timebase_frequency);
+	return EFI_SUCCESS;
+}
+
+struct dragonstub_boot_timestamps *boot_ts_table(void)
+{
+	return installed ? current_table : NULL;
+}
@@ -39,12 +39,11 @@
 #define barrier() __asm__ __volatile__("" : : : "memory")
 #endif
 
-#define BUILD_BUG_ON(condition)                            \
-	do {                                               \
-		efi_err("BUILD_BUG_ON(%s)\n", #condition); \
-		while (1)                                  \
-			;                                  \
-	} while (1)
+/*
+ * 条件为真时编译失败。不能在运行时检查：vsnprintf在解析每个整数格式时
+ * 都会用到它。
+ */
+#define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2 * !!(condition)]))
 
 #ifdef __CHECKER__
 #define BUILD_BUG_ON_ZERO(e) (0)
@@ -27,6 +27,9 @@ char *efi_convert_cmdline(EFI_LOADED_IMAGE *image, int *cmd_line_len);
 typedef u32 efi_tcg2_event_log_format;
 #define INITRD_EVENT_TAG_ID 0x8F3B22ECU
 #define LOAD_OPTIONS_EVENT_TAG_ID 0x8F3B22EDU
+/* DragonStub自己的事件，数据是DragonStub计算出的SHA-256，而不是原始内容 */
+#define DRAGONSTUB_KERNEL_EVENT_TAG_ID 0x4453B001U
+#define DRAGONSTUB_FDT_EVENT_TAG_ID 0x4453B002U
 #define EV_EVENT_TAG 0x00000006U
 #define EFI_TCG2_EVENT_HEADER_VERSION 0x1
 
@@ -47,6 +50,36 @@ struct efi_tcg2_tagged_event {
 	/* u8  tagged event data follows here */
 } __packed;
 
+/// @brief 度量到TPM中的事件
+enum efistub_event {
+	/// @brief initrd的内容（由固件计算摘要）
+	EFISTUB_EVT_INITRD,
+	/// @brief LoadOptions（由固件计算摘要）
+	EFISTUB_EVT_LOAD_OPTIONS,
+	/// @brief 内核各个PT_LOAD段的SHA-256（由DragonStub计算）
+	EFISTUB_EVT_KERNEL,
+	/// @brief 交给内核的FDT的SHA-256（由DragonStub计算）
+	EFISTUB_EVT_FDT,
+	EFISTUB_EVT_COUNT,
+};
+
+/**
+ * efi_measurement_enabled() - 是否需要把启动的内容度量到TPM中
+ *
+ * 第一次调用时查找TCG2 protocol，结果会被缓存，之后的调用不会再访问固件。
+ * 没有TCG2 protocol或者命令行中有efi=nomeasure时返回false。
+ */
+bool efi_measurement_enabled(void);
+
+/**
+ * efi_measure_digest() - 把DragonStub自己算出的摘要度量到TPM中
+ * @digest:	SHA256_DIGEST_SIZE字节的SHA-256
+ *
+ * 固件只需要对这32字节计算各个PCR bank的摘要并扩展、记录日志，
+ * 不需要再读一遍被度量的内容。
+ */
+efi_status_t efi_measure_digest(const u8 *digest, enum efistub_event event);
+
 typedef struct efi_tcg2_event efi_tcg2_event_t;
 typedef struct efi_tcg2_tagged_event efi_tcg2_tagged_event_t;
 typedef union efi_tcg2_protocol efi_tcg2_protocol_t;
@@ -156,6 +189,9 @@ long simple_strtol(const char *cp, char **endp, unsigned int base);
 
 #define strtoul(cp, endp, base) simple_strtoull(cp, endp, base)
 
+int get_option(char **str, int *pint);
+char *get_options(const char *str, int nints, int *ints);
+
 size_t strnlen(const char *s, size_t maxlen);
 /**
  * strlen - Find the length of a string
@@ -174,6 +210,14 @@ char *strstr(const char *s1, const char *s2);
 
 char *next_arg(char *args, char **param, char **val);
 
+/**
+ * sort - sort an array of elements (heapsort, not stable)
+ * @swap_func: NULL swaps the elements byte by byte
+ */
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp_func)(const void *, const void *),
+	  void (*swap_func)(void *, void *, int));
+
 /**
  * strstarts - does @str start with @prefix?
  * @str: string to examine
@@ -186,11 +230,58 @@ static inline bool strstarts(const char *str, const char *prefix)
 
 efi_status_t efi_parse_options(char const *cmdline);
 
+/// @brief 内核负载的格式
+enum payload_type {
+	/// @brief 未压缩的ELF文件
+	PAYLOAD_TYPE_ELF = 0,
+	/// @brief 用LZ4 frame格式压缩的ELF文件
+	PAYLOAD_TYPE_LZ4,
+	/// @brief 启动卷上未压缩的ELF文件（kernel=），加载时按需读取
+	PAYLOAD_TYPE_ELF_FILE,
+};
+
+/// @brief 启动卷上打开的文件
+struct efi_file {
+	EFI_FILE_HANDLE handle;
+	/// @brief 文件大小
+	u64 size;
+};
+
+efi_status_t efi_cmdline_get_option(const char *cmdline, const char *param,
+				    int index, char **ret_val);
+efi_status_t efi_open_file(efi_loaded_image_t *image, const char *path,
+			   struct efi_file *file);
+efi_status_t efi_file_read_at(struct efi_file *file, u64 offset, void *buf,
+			      u64 size);
+void efi_file_close(struct efi_file *file);
+
+/**
+ * 安装到LINUX_EFI_INITRD_MEDIA_GUID配置表的initrd信息
+ *
+ * 与Linux中的struct linux_efi_initrd相同
+ */
+struct linux_efi_initrd {
+	unsigned long base;
+	unsigned long size;
+};
+
+efi_status_t efi_load_initrd_cmdline(efi_loaded_image_t *image,
+				     const char *cmdline, unsigned long max,
+				     struct linux_efi_initrd *initrd);
+efi_status_t efi_load_initrd(efi_loaded_image_t *image, const char *cmdline,
+			     unsigned long max);
+efi_status_t efi_load_dtb(efi_loaded_image_t *image, const char *cmdline,
+			  unsigned long headroom, unsigned long *fdt_addr,
+			  unsigned long *fdt_size);
+
+/// @brief 获取已经加载的initrd，没有加载initrd的话返回NULL
+const struct linux_efi_initrd *efi_initrd(void);
+
 /// @brief 要加载的内核负载信息
 struct payload_info {
 	/// @brief 负载起始地址
 	u64 payload_addr;
-	/// @brief 负载大小
+	/// @brief 负载大小（如果被压缩了，则为压缩后的大小）
 	u64 payload_size;
 	/// @brief 被加载到的物理地址
 	u64 loaded_paddr;
@@ -198,15 +289,27 @@ struct payload_info {
 	u64 loaded_size;
 	/// @brief 加载的内核的入口物理地址
 	u64 kernel_entry;
+	/// @brief 负载的格式
+	enum payload_type payload_type;
+	/// @brief PAYLOAD_TYPE_ELF_FILE：负载所在的文件
+	struct efi_file file;
+	/// @brief payload_addr处的内存是从pool中分配的，加载完之后需要释放
+	bool payload_allocated;
+	/// @brief 编译时记录的各个PT_LOAD段内容的SHA-256，NULL表示不校验
+	const u8 *digest;
+	/// @brief 不为0表示嵌入的负载已经按内存布局排好（make PAYLOAD_INPLACE=1），
+	/// 段的内容位于这个对齐的地址时可以原地运行
+	u64 inplace_align;
 };
 
 /// @brief 寻找要加载的内核负载
 /// @param handle efi_handle
 /// @param image efi_loaded_image_t
+/// @param cmdline 命令行，其中的kernel=选项指定从启动卷上的文件加载内核
 /// @param ret_info 返回的负载信息
 /// @return
 efi_status_t find_payload(efi_handle_t handle, efi_loaded_image_t *loaded_image,
-			  struct payload_info *ret_info);
+			  const char *cmdline, struct payload_info *ret_info);
 
 /* shared entrypoint between the normal stub and the zboot stub */
 efi_status_t efi_stub_common(efi_handle_t handle, efi_loaded_image_t *image,
@@ -234,8 +337,8 @@ static inline char *efi_guid_to_str(efi_guid_t *guid, char *out)
 
 static inline void print_efi_guid(efi_guid_t *guid)
 {
-	efi_info("GUID: data1: %p data2: %p data3: %p data4: %p\n", guid->Data1,
-		 guid->Data2, guid->Data3, guid->Data4);
+	efi_info("GUID: %08x-%04x-%04x-%*phN\n", guid->Data1,
+		 guid->Data2, guid->Data3, 8, guid->Data4);
 }
 
 /*
@@ -263,6 +366,22 @@ void efi_get_virtmap(efi_memory_desc_t *memory_map, unsigned long map_size,
 extern bool efi_nochunk;
 extern bool efi_nokaslr;
 extern bool efi_novamap;
+/// @brief 是否把日志输出到控制台（efi=noconsole时为false）
+extern bool efi_log_console;
+/// @brief 获取了（或放弃了）退出boot services用的内存映射，期间不输出到控制台
+void efi_log_memory_map_taken(bool taken);
+/// @brief 是否为相距较远的各簇段分别分配内存（efi=sparse）
+extern bool efi_sparse_load;
+/// @brief 是否建立页表，打开MMU进入内核（efi=mmu，efi=sv39时只使用Sv39）
+extern bool efi_mmu;
+extern bool efi_mmu_sv39;
+/// @brief 是否启动辅助核分担复制、清零和解压（efi=smp）
+extern bool efi_smp;
+/// @brief 是否遍历一次原来的FDT来重建，而不是用fdt_setprop()逐个修改
+/// （efi=fdtrebuild）
+extern bool efi_fdt_rebuild;
+/// @brief 是否从FDT中删除被禁用且不再被引用的节点（efi=fdtprune）
+extern bool efi_fdt_prune;
 
 /*
  * Determine whether we're in secure boot mode.
@@ -270,6 +389,58 @@ extern bool efi_novamap;
 enum efi_secureboot_mode efi_get_secureboot(void);
 void *get_fdt(unsigned long *fdt_size);
 
+/// @brief 要从FDT中删除的一棵子树，[start, end)是它在原来的树的结构块中的偏移
+struct fdt_prune_range {
+	int start;
+	int end;
+	/// @brief 子树中的节点数
+	u32 nr_nodes;
+	/// @brief 仍然被其他节点引用，不删除
+	bool keep;
+};
+
+/// @brief efi_fdt_prune_plan()规划好的删除
+struct fdt_prune {
+	/// @brief 要删除的子树，按偏移排序
+	struct fdt_prune_range *ranges;
+	u32 nr_ranges;
+	/// @brief 要删除的/aliases和/__symbols__中的属性的偏移，按偏移排序
+	int *props;
+	u32 nr_props;
+	/// @brief 删除的节点数，以及结构块因此减少的字节数
+	u32 nr_nodes;
+	u32 bytes;
+};
+
+/**
+ * efi_fdt_prune_plan() - 规划要从@fdt中删除的节点和属性
+ *
+ * 删除efi=fdtprune时被禁用且不再被引用的节点，以及fdtprune=<path>给出的节点。
+ * @fdt本身不会被修改，删除由fdt_rebuild()在复制时完成。
+ *
+ * Return: EFI_SUCCESS表示@prune中有要删除的内容，用完之后由
+ * efi_fdt_prune_free()释放；EFI_NOT_READY表示没有要删除的内容
+ */
+efi_status_t efi_fdt_prune_plan(const void *fdt, const char *cmdline,
+				struct fdt_prune *prune);
+void efi_fdt_prune_free(struct fdt_prune *prune);
+
+/**
+ * efi_fdt_apply_overlays() - 把设备树overlay应用到*@fdt_addr处的树上
+ * @headroom:	合并之后的树中还要留出的空闲空间
+ * @fdt_addr:	原来的树，没有时为0；成功时返回合并之后的树
+ * @fdt_size:	成功时返回合并之后的树占用的内存大小
+ *
+ * overlay来自make DTBO=嵌入的.dtbo和命令行中的dtbo=<path>。原来的树不会
+ * 被修改，合并之后的树在新分配的页中。
+ *
+ * Return: EFI_NOT_READY表示没有overlay，其他错误时*@fdt_addr不变
+ */
+efi_status_t efi_fdt_apply_overlays(efi_loaded_image_t *image,
+				    const char *cmdline, unsigned long headroom,
+				    unsigned long *fdt_addr,
+				    unsigned long *fdt_size);
+
 /*
  * Allow the platform to override the allocation granularity: this allows
  * systems that have the capability to run with a larger page size to deal
@@ -356,37 +527,92 @@ void efi_free(unsigned long size, unsigned long addr);
 
 /*
  * An efi_boot_memmap is used by efi_get_memory_map() to return the
- * EFI memory map in a dynamically allocated buffer.
+ * EFI memory map in a buffer shared by all callers (see apps/mem.c).
  *
- * The buffer allocated for the EFI memory map includes extra room for
- * a minimum of EFI_MMAP_NR_SLACK_SLOTS additional EFI memory descriptors.
- * This facilitates the reuse of the EFI memory map buffer when a second
- * call to ExitBootServices() is needed because of intervening changes to
- * the EFI memory map. Other related structures, e.g. x86 e820ext, need
- * to factor in this headroom requirement as well.
+ * The buffer includes extra room for additional EFI memory descriptors:
+ * at least EFI_MMAP_NR_SLACK_SLOTS, more when the memory map has been seen
+ * to grow by more than that between two calls. This facilitates the reuse
+ * of the EFI memory map buffer when a second call to ExitBootServices() is
+ * needed because of intervening changes to the EFI memory map.
  */
 #define EFI_MMAP_NR_SLACK_SLOTS 8
 
 /**
  * efi_get_memory_map() - get memory map
- * @map:		pointer to memory map pointer to which to assign the
- *			newly allocated memory map
+ * @map:		返回共享的内存映射缓存，在下一次调用之前有效，不需要释放
  * @install_cfg_tbl:	whether or not to install the boot memory map as a
  *			configuration table
  *
- * Retrieve the UEFI memory map. The allocated memory leaves room for
- * up to EFI_MMAP_NR_SLACK_SLOTS additional memory map entries.
+ * 在共享的缓冲区中刷新内存映射，放不下时按观察到的增长重新分配。
  *
  * Return:	status code
  */
 efi_status_t efi_get_memory_map(struct efi_boot_memmap **map,
 				bool install_cfg_tbl);
 
-#ifdef CONFIG_64BIT
-#define MAX_FDT_SIZE (1UL << 21)
-#else
-#error "MAX_FDT_SIZE not yet defined for 32-bit"
-#endif
+/// @brief 释放内存映射缓存（启动失败、回到固件之前）
+void efi_free_memory_map(void);
+
+#define DRAGONSTUB_MEMMAP_VERSION 1
+
+/// @brief 紧凑内存映射中的一项，字段的含义与efi_memory_desc_t相同
+struct dragonstub_memmap_entry {
+	u64 phys_start;
+	/// @brief 只对EFI_MEMORY_RUNTIME区域有意义
+	u64 virt_start;
+	u64 num_pages;
+	u64 attribute;
+	u32 type;
+	u32 reserved;
+};
+
+/**
+ * 交给内核的紧凑内存映射
+ *
+ * 在最后一次GetMemoryMap()之后，由交给内核的UEFI内存映射生成：按物理地址
+ * 排序，把物理上相邻、类型和属性都相同的描述符合并成一项（运行时区域还要求
+ * 虚拟地址也相邻）。每一项的大小固定为entry_size，不像UEFI的描述符那样
+ * 要按desc_size跳过。原始的内存映射仍然通过linux,uefi-mmap-*交给内核。
+ *
+ * 内核可以通过DRAGONSTUB_EFI_MEMMAP_GUID配置表，或者FDT /chosen节点中的
+ * dragonstub,memmap属性找到这个表。nr_entries为0表示没能生成（例如内存映射
+ * 超出了预先分配的空间），这时只能使用原始的内存映射。
+ */
+struct dragonstub_memmap {
+	u32 version;
+	/// @brief entries中每一项的大小
+	u32 entry_size;
+	/// @brief entries的容量
+	u32 capacity;
+	/// @brief 原始内存映射中的描述符数量
+	u32 nr_raw;
+	u32 nr_entries;
+	u32 reserved;
+	struct dragonstub_memmap_entry entries[];
+};
+
+#define DRAGONSTUB_EFI_MEMMAP_GUID                                    \
+	MAKE_EFI_GUID(0xb69e2b7d, 0x89cd, 0x4c5c, 0x8b, 0xbe, 0xb2, 0xde, \
+		      0x49, 0x60, 0x66, 0x8b)
+
+/**
+ * efi_alloc_compact_memmap() - 为紧凑内存映射分配空间并安装配置表
+ *
+ * 在获取最终的内存映射之前调用，容量按内存映射缓存的大小确定。内存映射
+ * 缓存之后扩大时，紧凑内存映射会被重新分配，efi_compact_memmap()返回的
+ * 地址也随之改变。
+ */
+efi_status_t efi_alloc_compact_memmap(void);
+
+/**
+ * efi_build_compact_memmap() - 由最终的内存映射生成紧凑内存映射
+ *
+ * 在exit_boot_func()中调用，不分配内存。
+ */
+void efi_build_compact_memmap(struct efi_boot_memmap *map);
+
+/// @brief 获取紧凑内存映射，没有分配的话返回NULL
+struct dragonstub_memmap *efi_compact_memmap(void);
 
 /* Helper macros for the usual case of using simple C variables: */
 #ifndef fdt_setprop_inplace_var
@@ -466,16 +692,307 @@ union efi_memory_attribute_protocol {
 	} mixed_mode;
 };
 
+/// @brief 内核的一个PT_LOAD段被加载到的位置
+struct dragonstub_payload_segment {
+	/// @brief 段的p_vaddr
+	u64 vaddr;
+	/// @brief 段的p_paddr（链接时的物理地址）
+	u64 link_paddr;
+	/// @brief 段被加载到的物理地址
+	u64 paddr;
+	/// @brief 段的p_memsz
+	u64 size;
+	/// @brief 段的p_flags（PF_R、PF_W、PF_X）
+	u64 flags;
+};
+
+/*
+ * 各簇段被分别加载到不同的地址（efi=sparse），簇之间的相对位置与链接时不同，
+ * 内核需要按照segments建立映射
+ */
+#define DRAGONSTUB_PAYLOAD_SPARSE (1 << 0)
+/* 每个段都被加载到了链接时的物理地址（p_paddr），内核不需要重定位自己 */
+#define DRAGONSTUB_PAYLOAD_EXACT (1 << 1)
+
 /**
  * 安装到efi config table的信息
  * 
- * 表示dragonstub把内核加载到的地址和大小
+ * 表示dragonstub把内核加载到的地址和大小，以及每个PT_LOAD段被加载到的位置
 */
 struct dragonstub_payload_efi {
+	/// @brief 内核内存（稀疏加载时是最小的p_paddr所在的那一块）的地址和大小
 	u64 loaded_addr;
 	u64 size;
+	/// @brief DRAGONSTUB_PAYLOAD_*
+	u32 flags;
+	/// @brief segments的项数，按程序头表的顺序排列
+	u32 nr_segments;
+	struct dragonstub_payload_segment segments[];
 };
 
 #define DRAGONSTUB_EFI_PAYLOAD_EFI_GUID                               \
 	MAKE_EFI_GUID(0xddf1d47c, 0x102c, 0xaaf9, 0xce, 0x34, 0xbc, 0xef, \
 		      0x98, 0x12, 0x00, 0x31)
+
+/// @brief 记录了时间戳的启动阶段
+enum dragonstub_boot_phase {
+	/// @brief 打印banner（efi_main()的入口）
+	DRAGONSTUB_PHASE_BANNER = 0,
+	/// @brief 获取并转换命令行
+	DRAGONSTUB_PHASE_CMDLINE,
+	/// @brief 寻找内核负载
+	DRAGONSTUB_PHASE_FIND_PAYLOAD,
+	/// @brief 加载内核的各个段
+	DRAGONSTUB_PHASE_LOAD_ELF,
+	/// @brief 生成新的FDT
+	DRAGONSTUB_PHASE_FDT,
+	/// @brief 退出boot services之前最后一次获取内存映射（包括重试）
+	DRAGONSTUB_PHASE_GET_MEMORY_MAP,
+	/// @brief ExitBootServices()（包括重试）
+	DRAGONSTUB_PHASE_EXIT_BOOT_SERVICES,
+	/// @brief 跳转到内核（start和end相同）
+	DRAGONSTUB_PHASE_KERNEL_JUMP,
+	/// @brief 加载initrd（新增的阶段追加在这里，已有阶段的编号保持不变）
+	DRAGONSTUB_PHASE_LOAD_INITRD,
+	/// @brief 建立内核的初始页表（efi=mmu）
+	DRAGONSTUB_PHASE_PGTABLE,
+	DRAGONSTUB_PHASE_NR,
+};
+
+#define DRAGONSTUB_BOOT_TIMESTAMPS_VERSION 1
+
+/// @brief 一个启动阶段开始和结束时的时间戳，0表示没有记录
+struct dragonstub_boot_phase_ts {
+	u64 start;
+	u64 end;
+};
+
+/**
+ * 安装到efi config table的启动时间戳
+ *
+ * 时间戳是time CSR（rdtime）的值，除以timebase_frequency就是秒数。
+ * 内核可以通过DRAGONSTUB_EFI_BOOT_TIMESTAMPS_GUID配置表，
+ * 或者FDT /chosen节点中的dragonstub,boot-timestamps属性找到这个表。
+ * 表的格式是固定的，新增的字段只会追加到末尾，并增加version。
+ */
+struct dragonstub_boot_timestamps {
+	/// @brief DRAGONSTUB_BOOT_TIMESTAMPS_VERSION
+	u32 version;
+	/// @brief phases[]中的元素个数
+	u32 nr_phases;
+	/// @brief 时间戳的频率（Hz），0表示未知
+	u64 timebase_frequency;
+	/// @brief 调用ExitBootServices()的次数，大于1说明发生了重试
+	u32 ebs_attempts;
+	u32 reserved;
+	struct dragonstub_boot_phase_ts phases[DRAGONSTUB_PHASE_NR];
+};
+
+#define DRAGONSTUB_EFI_BOOT_TIMESTAMPS_GUID                           \
+	MAKE_EFI_GUID(0x2fd179be, 0x5a3a, 0x483e, 0x92, 0xf1, 0x3a, 0xb0, \
+		      0xab, 0x01, 0x25, 0x86)
+
+/// @brief 读取当前的时间戳（由架构相关的代码实现）
+u64 efi_arch_read_timestamp(void);
+
+/// @brief 时间戳的频率（Hz），从FDT中读取，未知时返回0
+u64 boot_ts_frequency(void);
+
+/// @brief 记录一个启动阶段的开始
+void boot_ts_begin(enum dragonstub_boot_phase phase);
+
+/// @brief 记录一个启动阶段的结束
+void boot_ts_end(enum dragonstub_boot_phase phase);
+
+/**
+ * boot_ts_install() - 把启动时间戳表安装到efi config table中
+ *
+ * 之后记录的时间戳会直接写到安装好的表中，包括退出boot services之后的。
+ */
+efi_status_t boot_ts_install(void);
+
+/// @brief 获取已经安装的启动时间戳表，还没有安装的话返回NULL
+struct dragonstub_boot_timestamps *boot_ts_table(void);
+
+#define DRAGONSTUB_LOG_BUF_VERSION 2
+
+/**
+ * 安装到efi config table的日志环形缓冲区
+ *
+ * 内核可以通过DRAGONSTUB_EFI_LOG_BUF_GUID配置表，或者FDT /chosen节点中的
+ * dragonstub,log-buf属性找到它。data[]中保存的是UTF-8文本，
+ * head是写入的总字节数：下一个字节写到data[head % size]，
+ * head大于size时，最早的head - size字节已经被覆盖。
+ *
+ * 与Linux的KERN_SOH相同，每条消息以'\001'和一个表示级别的数字
+ * （'0'到'7'，见LOGLEVEL_*）开头。
+ */
+struct dragonstub_log_buf {
+	/// @brief DRAGONSTUB_LOG_BUF_VERSION
+	u32 version;
+	/// @brief data[]的大小
+	u32 size;
+	/// @brief 写入的总字节数
+	u64 head;
+	char data[];
+};
+
+#define DRAGONSTUB_EFI_LOG_BUF_GUID                                   \
+	MAKE_EFI_GUID(0x92add2a2, 0xa772, 0x4652, 0xa6, 0x80, 0x14, 0x1a, \
+		      0xc4, 0x93, 0xc0, 0xfb)
+
+/**
+ * efi_log_install() - 把日志环形缓冲区安装到efi config table中
+ *
+ * 退出boot services之后的消息也会写到这个缓冲区中。
+ */
+efi_status_t efi_log_install(void);
+
+/// @brief 获取已经安装的日志环形缓冲区，还没有安装的话返回NULL
+struct dragonstub_log_buf *efi_log_buf(void);
+
+#define DRAGONSTUB_PGTABLE_VERSION 1
+
+/* 运行时服务区域已经映射到交给SetVirtualAddressMap()的VirtualStart */
+#define DRAGONSTUB_PGTABLE_RUNTIME (1 << 0)
+
+/**
+ * 安装到efi config table的初始页表信息（efi=mmu）
+ *
+ * 内核可以通过DRAGONSTUB_EFI_PGTABLE_GUID配置表，或者FDT /chosen节点中的
+ * dragonstub,pgtable属性找到这个表。进入内核时satp已经指向root处的页表，
+ * pc是内核入口的虚拟地址，a0和a1与关闭MMU时相同（hartid和FDT的物理地址）。
+ * 页表中有：
+ *   - 内核的各个PT_LOAD段：p_vaddr映射到DRAGONSTUB_EFI_PAYLOAD_EFI_GUID表中
+ *     的paddr，权限取自p_flags
+ *   - 内存映射中所有可用内存（EFI_MEMORY_WB的RAM类型）的恒等映射，可读写执行，
+ *     stub的代码和栈、FDT都在其中
+ *   - 同样这些内存的线性映射，物理地址pa映射到linear_virt + (pa - linear_phys)，
+ *     可读写
+ *   - flags中有DRAGONSTUB_PGTABLE_RUNTIME时，还有运行时服务区域
+ * 所有的页表项都设置了A、D、G位，对齐的部分使用1G和2M的页。
+ * 页表页都在[pool_addr, pool_addr + pool_size)中（EfiLoaderData），
+ * 内核切换到自己的页表之后可以回收。
+ * 硬件不接受satp的值时，stub关闭MMU、跳转到物理入口，并把satp改为0。
+ */
+struct dragonstub_pgtable {
+	/// @brief DRAGONSTUB_PGTABLE_VERSION
+	u32 version;
+	/// @brief DRAGONSTUB_PGTABLE_*
+	u32 flags;
+	/// @brief 进入内核时satp的值（ASID为0），0表示没有打开MMU
+	u64 satp;
+	/// @brief 根页表的物理地址
+	u64 root;
+	/// @brief 页表的级数：3（Sv39）或者4（Sv48）
+	u32 levels;
+	/// @brief 已经使用的页表页数
+	u32 nr_pages;
+	/// @brief 页表池的物理地址和大小
+	u64 pool_addr;
+	u64 pool_size;
+	/// @brief 线性映射的虚拟基址，它对应的物理地址（按1G对齐）和映射的范围
+	u64 linear_virt;
+	u64 linear_phys;
+	u64 linear_size;
+	/// @brief 内核入口的虚拟地址
+	u64 kernel_entry;
+};
+
+#define DRAGONSTUB_EFI_PGTABLE_GUID                                   \
+	MAKE_EFI_GUID(0x145c1748, 0xb733, 0x4d26, 0x81, 0x14, 0x45, 0x58, \
+		      0xb5, 0x29, 0x85, 0xbe)
+
+/// @brief 启动核支持的最大页表级数（Sv39为3，Sv48为4），0表示不支持分页
+u32 efi_arch_pgtable_levels(void);
+
+/**
+ * efi_setup_pgtable() - 为内核建立初始页表，并安装DRAGONSTUB_EFI_PGTABLE_GUID表
+ *
+ * 在内核加载之后、退出boot services之前调用。失败时不影响启动，
+ * 内核仍然在关闭MMU的状态下进入。
+ */
+efi_status_t efi_setup_pgtable(struct payload_info *payload_info);
+
+/**
+ * efi_pgtable_map_runtime() - 按最终的VirtualStart映射运行时服务区域
+ *
+ * 在exit_boot_func()中efi_get_virtmap()之后调用，不会分配内存。
+ */
+void efi_pgtable_map_runtime(struct efi_boot_memmap *map);
+
+/// @brief 获取已经建立的初始页表，没有建立的话返回NULL
+struct dragonstub_pgtable *efi_pgtable(void);
+
+/// @brief 辅助核的数量上限（包括启动核），可以用SMP_MAX_HARTS=<n>修改
+#ifndef CONFIG_DRAGONSTUB_SMP_MAX_HARTS
+#define CONFIG_DRAGONSTUB_SMP_MAX_HARTS 64
+#endif
+
+/**
+ * struct efi_smp_worker - 一个辅助核（efi=smp）
+ * @stack_top:	栈顶，必须是第一个成员，辅助核的入口代码从这里取出栈指针
+ * @hartid:	核的编号
+ * @index:	在工作池中的序号，从1开始（0是启动核）
+ * @parked:	辅助核已经退出工作循环，由架构相关的代码设置
+ */
+struct efi_smp_worker {
+	u64 stack_top;
+	u64 hartid;
+	u32 index;
+	u32 parked;
+};
+
+/// @brief 在辅助核上执行的任务，@index是任务项的编号
+typedef void (*efi_smp_fn_t)(void *arg, u64 index);
+
+/**
+ * efi_arch_smp_harts() - 列出可以启动的辅助核
+ * @hartids:	返回核的编号
+ * @max:	@hartids的大小
+ *
+ * Return:	核的数量。固件不支持启动辅助核时返回0
+ */
+u32 efi_arch_smp_harts(u64 *hartids, u32 max);
+
+/**
+ * efi_arch_smp_start() - 启动辅助核，在它上面调用efi_smp_worker_main(@worker)
+ *
+ * efi_smp_worker_main()返回之后，辅助核设置@worker->parked并停下来。
+ */
+efi_status_t efi_arch_smp_start(struct efi_smp_worker *worker);
+
+/// @brief 检查辅助核是否已经停下，可以交还给固件和内核
+bool efi_arch_smp_parked(struct efi_smp_worker *worker);
+
+/// @brief 在等待其他核的循环中调用，降低自旋的代价
+void efi_arch_cpu_relax(void);
+
+/// @brief 辅助核的工作循环，efi_smp_stop()之后返回
+void efi_smp_worker_main(struct efi_smp_worker *worker);
+
+/**
+ * efi_smp_start() - 启动辅助核组成工作池（efi=smp）
+ *
+ * 固件不支持时工作池为空，所有的工作都在启动核上完成。
+ */
+void efi_smp_start(void);
+
+/// @brief 让所有的辅助核停下来，必须在ExitBootServices()之前调用
+void efi_smp_stop(void);
+
+/// @brief 工作池中辅助核的数量（不包括启动核）
+u32 efi_smp_workers(void);
+
+/**
+ * efi_smp_run() - 把@nr个任务项分给启动核和所有的辅助核执行
+ *
+ * 返回时所有的任务项都已经完成。@fn在辅助核上运行，不能调用固件的服务。
+ */
+void efi_smp_run(efi_smp_fn_t fn, void *arg, u64 nr);
+
+/// @brief 分块并行的memcpy()，区域较小或者没有辅助核时直接调用memcpy()
+void efi_smp_memcpy(void *dst, const void *src, u64 len);
+
+/// @brief 分块并行的memset()
+void efi_smp_memset(void *dst, int c, u64 len);
@@ -21,6 +21,9 @@
 #define LLONG_MAX	((long long)(~0ULL >> 1))
 #define LLONG_MIN	(-LLONG_MAX - 1)
 #define ULLONG_MAX	(~0ULL)
+/* <stdint.h>（efibind.h包含它）已经定义了同样的值 */
+#ifndef UINTPTR_MAX
 #define UINTPTR_MAX	ULONG_MAX
+#endif
 
 #endif /* __VDSO_LIMITS_H */
@@ -63,99 +63,99 @@
 //  * (It is unfortunate that gcc doesn't perform all this internally.)
 //  */
 
-// #define __div64_const32(n, ___b)                                            \
-// 	({                                                                  \
-// 		/*								\
-// 	 * Multiplication by reciprocal of b: n / b = n * (p / b) / p	\
-// 	 *								\
-// 	 * We rely on the fact that most of this code gets optimized	\
-// 	 * away at compile time due to constant propagation and only	\
-// 	 * a few multiplication instructions should remain.		\
-// 	 * Hence this monstrous macro (static inline doesn't always	\
-// 	 * do the trick here).						\
-// 	 */                                                 \
-// 		uint64_t ___res, ___x, ___t, ___m, ___n = (n);              \
-// 		uint32_t ___p, ___bias;                                     \
-//                                                                             \
-// 		/* determine MSB of b */                                    \
-// 		___p = 1 << ilog2(___b);                                    \
-//                                                                             \
-// 		/* compute m = ((p << 64) + b - 1) / b */                   \
-// 		___m = (~0ULL / ___b) * ___p;                               \
-// 		___m += (((~0ULL % ___b + 1) * ___p) + ___b - 1) / ___b;    \
-//                                                                             \
-// 		/* one less than the dividend with highest result */        \
-// 		___x = ~0ULL / ___b * ___b - 1;                             \
-//                                                                             \
-// 		/* test our ___m with res = m * x / (p << 64) */            \
-// 		___res = ((___m & 0xffffffff) * (___x & 0xffffffff)) >> 32; \
-// 		___t = ___res += (___m & 0xffffffff) * (___x >> 32);        \
-// 		___res += (___x & 0xffffffff) * (___m >> 32);               \
-// 		___t = (___res < ___t) ? (1ULL << 32) : 0;                  \
-// 		___res = (___res >> 32) + ___t;                             \
-// 		___res += (___m >> 32) * (___x >> 32);                      \
-// 		___res /= ___p;                                             \
-//                                                                             \
-// 		/* Now sanitize and optimize what we've got. */             \
-// 		if (~0ULL % (___b / (___b & -___b)) == 0) {                 \
-// 			/* special case, can be simplified to ... */        \
-// 			___n /= (___b & -___b);                             \
-// 			___m = ~0ULL / (___b / (___b & -___b));             \
-// 			___p = 1;                                           \
-// 			___bias = 1;                                        \
-// 		} else if (___res != ___x / ___b) {                         \
-// 			/*							\
-// 		 * We can't get away without a bias to compensate	\
-// 		 * for bit truncation errors.  To avoid it we'd need an	\
-// 		 * additional bit to represent m which would overflow	\
-// 		 * a 64-bit variable.					\
-// 		 *							\
-// 		 * Instead we do m = p / b and n / b = (n * m + m) / p.	\
-// 		 */                                          \
-// 			___bias = 1;                                        \
-// 			/* Compute m = (p << 64) / b */                     \
-// 			___m = (~0ULL / ___b) * ___p;                       \
-// 			___m += ((~0ULL % ___b + 1) * ___p) / ___b;         \
-// 		} else {                                                    \
-// 			/*							\
-// 		 * Reduce m / p, and try to clear bit 31 of m when	\
-// 		 * possible, otherwise that'll need extra overflow	\
-// 		 * handling later.					\
-// 		 */                                          \
-// 			uint32_t ___bits = -(___m & -___m);                 \
-// 			___bits |= ___m >> 32;                              \
-// 			___bits = (~___bits) << 1;                          \
-// 			/*							\
-// 		 * If ___bits == 0 then setting bit 31 is  unavoidable.	\
-// 		 * Simply apply the maximum possible reduction in that	\
-// 		 * case. Otherwise the MSB of ___bits indicates the	\
-// 		 * best reduction we should apply.			\
-// 		 */                                          \
-// 			if (!___bits) {                                     \
-// 				___p /= (___m & -___m);                     \
-// 				___m /= (___m & -___m);                     \
-// 			} else {                                            \
-// 				___p >>= ilog2(___bits);                    \
-// 				___m >>= ilog2(___bits);                    \
-// 			}                                                   \
-// 			/* No bias needed. */                               \
-// 			___bias = 0;                                        \
-// 		}                                                           \
-//                                                                             \
-// 		/*								\
-// 	 * Now we have a combination of 2 conditions:			\
-// 	 *								\
-// 	 * 1) whether or not we need to apply a bias, and		\
-// 	 *								\
-// 	 * 2) whether or not there might be an overflow in the cross	\
-// 	 *    product determined by (___m & ((1 << 63) | (1 << 31))).	\
-// 	 *								\
-// 	 * Select the best way to do (m_bias + m * n) / (1 << 64).	\
-// 	 * From now on there will be actual runtime code generated.	\
-// 	 */                                                 \
-// 		___res = __arch_xprod_64(___m, ___n, ___bias);              \
-//                                                                             \
-// 		___res /= ___p;                                             \
+// #define __div64_const32(n, ___b)
+// 	({
+// 		/*
+// 	 * Multiplication by reciprocal of b: n / b = n * (p / b) / p
+// 	 *
+// 	 * We rely on the fact that most of this code gets optimized
+// 	 * away at compile time due to constant propagation and only
+// 	 * a few multiplication instructions should remain.
+// 	 * Hence this monstrous macro (static inline doesn't always
+// 	 * do the trick here).
+// 	 */
+// 		uint64_t ___res, ___x, ___t, ___m, ___n = (n);
+// 		uint32_t ___p, ___bias;
+//
+// 		/* determine MSB of b */
+// 		___p = 1 << ilog2(___b);
+//
+// 		/* compute m = ((p << 64) + b - 1) / b */
+// 		___m = (~0ULL / ___b) * ___p;
+// 		___m += (((~0ULL % ___b + 1) * ___p) + ___b - 1) / ___b;
+//
+// 		/* one less than the dividend with highest result */
+// 		___x = ~0ULL / ___b * ___b - 1;
+//
+// 		/* test our ___m with res = m * x / (p << 64) */
+// 		___res = ((___m & 0xffffffff) * (___x & 0xffffffff)) >> 32;
+// 		___t = ___res += (___m & 0xffffffff) * (___x >> 32);
+// 		___res += (___x & 0xffffffff) * (___m >> 32);
+// 		___t = (___res < ___t) ? (1ULL << 32) : 0;
+// 		___res = (___res >> 32) + ___t;
+// 		___res += (___m >> 32) * (___x >> 32);
+// 		___res /= ___p;
+//
+// 		/* Now sanitize and optimize what we've got. */
+// 		if (~0ULL % (___b / (___b & -___b)) == 0) {
+// 			/* special case, can be simplified to ... */
+// 			___n /= (___b & -___b);
+// 			___m = ~0ULL / (___b / (___b & -___b));
+// 			___p = 1;
+// 			___bias = 1;
+// 		} else if (___res != ___x / ___b) {
+// 			/*
+// 		 * We can't get away without a bias to compensate
+// 		 * for bit truncation errors.  To avoid it we'd need an
+// 		 * additional bit to represent m which would overflow
+// 		 * a 64-bit variable.
+// 		 *
+// 		 * Instead we do m = p / b and n / b = (n * m + m) / p.
+// 		 */
+// 			___bias = 1;
+// 			/* Compute m = (p << 64) / b */
+// 			___m = (~0ULL / ___b) * ___p;
+// 			___m += ((~0ULL % ___b + 1) * ___p) / ___b;
+// 		} else {
+// 			/*
+// 		 * Reduce m / p, and try to clear bit 31 of m when
+// 		 * possible, otherwise that'll need extra overflow
+// 		 * handling later.
+// 		 */
+// 			uint32_t ___bits = -(___m & -___m);
+// 			___bits |= ___m >> 32;
+// 			___bits = (~___bits) << 1;
+// 			/*
+// 		 * If ___bits == 0 then setting bit 31 is  unavoidable.
+// 		 * Simply apply the maximum possible reduction in that
+// 		 * case. Otherwise the MSB of ___bits indicates the
+// 		 * best reduction we should apply.
+// 		 */
+// 			if (!___bits) {
+// 				___p /= (___m & -___m);
+// 				___m /= (___m & -___m);
+// 			} else {
+// 				___p >>= ilog2(___bits);
+// 				___m >>= ilog2(___bits);
+// 			}
+// 			/* No bias needed. */
+// 			___bias = 0;
+// 		}
+//
+// 		/*
+// 	 * Now we have a combination of 2 conditions:
+// 	 *
+// 	 * 1) whether or not we need to apply a bias, and
+// 	 *
+// 	 * 2) whether or not there might be an overflow in the cross
+// 	 *    product determined by (___m & ((1 << 63) | (1 << 31))).
+// 	 *
+// 	 * Select the best way to do (m_bias + m * n) / (1 << 64).
+// 	 * From now on there will be actual runtime code generated.
+// 	 */
+// 		___res = __arch_xprod_64(___m, ___n, ___bias);
+//
+// 		___res /= ___p;
 // 	})
 
 // #ifndef __arch_xprod_64
@@ -217,27 +217,27 @@
 // /* The unnecessary pointer compare is there
 //  * to check for type safety (n must be 64bit)
 //  */
-// #define do_div(n, base)                                                      \
-// 	({                                                                   \
-// 		uint32_t __base = (base);                                    \
-// 		uint32_t __rem;                                              \
-// 		(void)(((typeof((n)) *)0) == ((uint64_t *)0));               \
-// 		if (__builtin_constant_p(__base) && is_power_of_2(__base)) { \
-// 			__rem = (n) & (__base - 1);                          \
-// 			(n) >>= ilog2(__base);                               \
-// 		} else if (__builtin_constant_p(__base) && __base != 0) {    \
-// 			uint32_t __res_lo, __n_lo = (n);                     \
-// 			(n) = __div64_const32(n, __base);                    \
-// 			/* the remainder can be computed with 32-bit regs */ \
-// 			__res_lo = (n);                                      \
-// 			__rem = __n_lo - __res_lo * __base;                  \
-// 		} else if (likely(((n) >> 32) == 0)) {                       \
-// 			__rem = (uint32_t)(n) % __base;                      \
-// 			(n) = (uint32_t)(n) / __base;                        \
-// 		} else {                                                     \
-// 			__rem = __div64_32(&(n), __base);                    \
-// 		}                                                            \
-// 		__rem;                                                       \
+// #define do_div(n, base)
+// 	({
+// 		uint32_t __base = (base);
+// 		uint32_t __rem;
+// 		(void)(((typeof((n)) *)0) == ((uint64_t *)0));
+// 		if (__builtin_constant_p(__base) && is_power_of_2(__base)) {
+// 			__rem = (n) & (__base - 1);
+// 			(n) >>= ilog2(__base);
+// 		} else if (__builtin_constant_p(__base) && __base != 0) {
+// 			uint32_t __res_lo, __n_lo = (n);
+// 			(n) = __div64_const32(n, __base);
+// 			/* the remainder can be computed with 32-bit regs */
+// 			__res_lo = (n);
+// 			__rem = __n_lo - __res_lo * __base;
+// 		} else if (likely(((n) >> 32) == 0)) {
+// 			__rem = (uint32_t)(n) % __base;
+// 			(n) = (uint32_t)(n) / __base;
+// 		} else {
+// 			__rem = __div64_32(&(n), __base);
+// 		}
+// 		__rem;
 // 	})
 
 
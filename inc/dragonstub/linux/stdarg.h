@@ -5,19 +5,20 @@
 #ifndef va_list
 typedef __builtin_va_list va_list;
 #endif
+/* 与efistdarg.h中的定义逐字相同，两个头文件都包含时不算重复定义 */
 #ifndef va_start
-#define va_start(v, l)	__builtin_va_start(v, l)
+#define va_start(v,l)	__builtin_va_start(v,l)
 #endif
 #ifndef va_end
 #define va_end(v)	__builtin_va_end(v)
 #endif
 
 #ifndef va_arg
-#define va_arg(v, T)	__builtin_va_arg(v, T)
+#define va_arg(v,l)	__builtin_va_arg(v,l)
 #endif
 
 #ifndef va_copy
-#define va_copy(d, s)	__builtin_va_copy(d, s)
+#define va_copy(d,s)	__builtin_va_copy(d,s)
 #endif
 
 #endif
\ No newline at end of file
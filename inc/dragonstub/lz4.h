@@ -0,0 +1,50 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * LZ4 frame格式的流式解压
+ *
+ * 只支持块相互独立（Block Independence = 1）的帧，这是`lz4`命令行工具的默认
+ * 输出格式。块之间没有依赖，因此每个块都可以直接解压到它在内核内存中的最终
+ * 位置，而不需要保存之前的解压历史，也不需要一个与整个负载一样大的中间缓冲区。
+ */
+
+#define LZ4_FRAME_MAGIC 0x184D2204U
+
+/**
+ * struct lz4_stream_ops - 解压数据的去向
+ * @direct:	询问解压流中[offset, offset + len)这一段能否直接写到某个连续的
+ *		目标地址。可以的话返回目标地址，否则返回NULL（此时会先解压到
+ *		临时缓冲区中）。可以为NULL。
+ * @emit:	解压流中[offset, offset + len)这一段已经解压出来，位于@data。
+ *		如果这一段是通过@direct直接解压的，@data就是@direct返回的地址。
+ */
+struct lz4_stream_ops {
+	void *(*direct)(void *ctx, u64 offset, u64 len);
+	efi_status_t (*emit)(void *ctx, u64 offset, const void *data, u64 len);
+};
+
+/// @brief 检查缓冲区是否以LZ4帧头开始
+bool lz4_frame_check(const void *src, u64 src_size);
+
+/// @brief 获取帧头中记录的解压后大小，如果帧头中没有记录则返回0
+u64 lz4_frame_content_size(const void *src, u64 src_size);
+
+/**
+ * lz4_frame_decompress() - 流式解压一个LZ4帧
+ * @src:	压缩数据
+ * @src_size:	压缩数据的大小
+ * @limit:	只需要解压流中[0, limit)的部分，超过后提前停止；传入UINT64_MAX表示
+ *		解压整个帧，并检查解压后的大小与帧头中记录的一致
+ * @ops:	解压数据的去向
+ * @ctx:	传给@ops的参数
+ *
+ * Return:	status code. 如果数据在@limit之前就结束了，返回EFI_END_OF_FILE
+ */
+efi_status_t lz4_frame_decompress(const void *src, u64 src_size, u64 limit,
+				  const struct lz4_stream_ops *ops, void *ctx);
+
+/// @brief 把解压流中[offset, offset + size)的内容读到@buf中
+efi_status_t lz4_frame_read(const void *src, u64 src_size, u64 offset,
+			    void *buf, u64 size);
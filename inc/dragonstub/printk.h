@@ -1,29 +1,86 @@
 #pragma once
 
 #include <efi.h>
+#include "compiler_attributes.h"
 #include "linux/stdarg.h"
 
-#define efi_printk(__fmt, ...)                       \
-	({                                           \
-		static CHAR16 __mem[2048];           \
-		int i;                               \
-		for (i = 0; __fmt[i]; ++i)           \
-			__mem[i] = (CHAR16)__fmt[i]; \
-		__mem[i] = 0;                        \
-		Print(__mem, ##__VA_ARGS__);         \
-	})
+/// @brief 格式化并输出一条消息，格式字符串与vsnprintf相同（%s是char *）
+int efi_printk(const char *fmt, ...) __printf(1, 2);
+/// @brief 以指定的级别记录一条消息，efi_loglevel只决定它是否输出到控制台
+int efi_log_printk(int level, const char *fmt, ...) __printf(2, 3);
+/// @brief 直接把一个UTF-8字符串输出到控制台，换行符会被转换成\r\n
+void efi_puts(const char *str);
+/// @brief 把日志环形缓冲区中还没有输出的内容输出到控制台
+void efi_log_flush(void);
+/// @brief 即将退出boot services，之后的消息只写入日志环形缓冲区
+void efi_log_exit_boot_services(void);
+
+/*
+ * 日志环形缓冲区的大小。通过make LOG_BUF_SIZE=<n>设置
+ */
+#ifndef CONFIG_DRAGONSTUB_LOG_BUF_SIZE
+#define CONFIG_DRAGONSTUB_LOG_BUF_SIZE (32 * 1024)
+#endif
 
 #define efi_todo(__fmt)                                    \
 	({                                                 \
 		efi_printk("Not yet implemented: " __fmt); \
+		efi_log_flush();                           \
 		while (1)                                  \
 			;                                  \
 	})
 
-#define efi_info(fmt, ...) efi_printk("[INFO]: " fmt, ##__VA_ARGS__)
-#define efi_warn(fmt, ...) efi_printk("[WARNING]: " fmt, ##__VA_ARGS__)
-#define efi_err(fmt, ...) efi_printk("[ERROR]: " fmt, ##__VA_ARGS__)
-#define efi_debug(fmt, ...) efi_printk("[DEBUG]: " fmt, ##__VA_ARGS__)
+/*
+ * 日志级别，与Linux的KERN_*相同：数字越小越重要
+ */
+#define LOGLEVEL_EMERG 0
+#define LOGLEVEL_ALERT 1
+#define LOGLEVEL_CRIT 2
+#define LOGLEVEL_ERR 3
+#define LOGLEVEL_WARNING 4
+#define LOGLEVEL_NOTICE 5
+#define LOGLEVEL_INFO 6
+#define LOGLEVEL_DEBUG 7
+
+/*
+ * 运行时只把级别小于efi_loglevel的消息输出到控制台，efi_loglevel由命令行
+ * 设置：quiet、efi=debug、loglevel=<n>。日志环形缓冲区不受它影响，
+ * 总是记录所有编译进来的消息。
+ */
+#define CONSOLE_LOGLEVEL_QUIET 4 /* 只输出错误 */
+#define CONSOLE_LOGLEVEL_DEFAULT 7 /* 输出除调试信息之外的所有消息 */
+#define CONSOLE_LOGLEVEL_DEBUG 15 /* 输出所有消息 */
+
+/*
+ * 编译时保留的最不重要的日志级别。级别比它大的消息连同格式字符串一起
+ * 不会被编译进来。通过make LOG_LEVEL=<n>设置，默认保留所有消息。
+ */
+#ifndef CONFIG_DRAGONSTUB_LOG_LEVEL
+#define CONFIG_DRAGONSTUB_LOG_LEVEL LOGLEVEL_DEBUG
+#endif
+
+extern int efi_loglevel;
+
+/// @brief 判断某个级别的消息是否被编译进来（需要格式化并记录）
+#define efi_log_enabled(level) ((level) <= CONFIG_DRAGONSTUB_LOG_LEVEL)
+
+/// @brief 以指定的级别输出消息（不添加前缀），错误消息会立即输出到控制台
+#define efi_log(level, fmt, ...)                                    \
+	({                                                          \
+		if (efi_log_enabled(level)) {                       \
+			efi_log_printk(level, fmt, ##__VA_ARGS__); \
+			if ((level) <= LOGLEVEL_ERR)                \
+				efi_log_flush();                    \
+		}                                                   \
+	})
+
+#define efi_info(fmt, ...) \
+	efi_log(LOGLEVEL_INFO, "[INFO]: " fmt, ##__VA_ARGS__)
+#define efi_warn(fmt, ...) \
+	efi_log(LOGLEVEL_WARNING, "[WARNING]: " fmt, ##__VA_ARGS__)
+#define efi_err(fmt, ...) efi_log(LOGLEVEL_ERR, "[ERROR]: " fmt, ##__VA_ARGS__)
+#define efi_debug(fmt, ...) \
+	efi_log(LOGLEVEL_DEBUG, "[DEBUG]: " fmt, ##__VA_ARGS__)
 
 /**
  * snprintf - Format a string and place it in a buffer
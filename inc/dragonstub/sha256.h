@@ -0,0 +1,39 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * SHA-256（FIPS 180-4）
+ *
+ * 用于在加载内核时校验负载。除了常规的init/update/final接口之外，还提供
+ * sha256_copy()，在把数据复制到目标地址的同一个循环中计算摘要，
+ * 避免为了校验再把整个内核读一遍。
+ */
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+struct sha256_state {
+	u32 state[SHA256_DIGEST_SIZE / 4];
+	/// @brief 已经输入的总字节数
+	u64 count;
+	/// @brief 还不够一个块的数据
+	u8 buf[SHA256_BLOCK_SIZE];
+};
+
+void sha256_init(struct sha256_state *sctx);
+
+void sha256_update(struct sha256_state *sctx, const void *data, u64 len);
+
+/**
+ * sha256_copy() - 把@src的@len字节复制到@dst，同时计算它们的摘要
+ *
+ * 效果与memcpy(dst, src, len)之后再sha256_update(sctx, dst, len)相同，
+ * 但每复制一小段就马上计算它的摘要，这时数据还在缓存中，只需要从内存中
+ * 读一遍。
+ * @dst与@src相同时只计算摘要。
+ */
+void sha256_copy(struct sha256_state *sctx, void *dst, const void *src,
+		 u64 len);
+
+void sha256_final(struct sha256_state *sctx, u8 out[SHA256_DIGEST_SIZE]);
@@ -281,6 +281,13 @@ CalculateCrc (
     UINTN Size
     );
 
+UINT32
+UpdateCrc (
+    UINT32 Crc,
+    CONST VOID *Buf,
+    UINTN Size
+    );
+
 VOID
 ZeroMem (
     IN VOID     *Buffer,
@@ -91,6 +91,23 @@ extern EFI_UNICODE_COLLATION_INTERFACE  LibStubUnicodeInterface;
 extern EFI_RAISE_TPL                    LibRuntimeRaiseTPL;
 extern EFI_RESTORE_TPL                  LibRuntimeRestoreTPL;
 
+//
+// 内存操作可以使用的CPU扩展，见LibSetMemExtensions()
+//
+#define LIB_MEM_EXT_VECTOR  0x1     // RISC-V V扩展
+#define LIB_MEM_EXT_CBOZ    0x2     // RISC-V Zicboz扩展（cbo.zero）
+
+VOID LibSetMemExtensions(IN UINTN Extensions, IN UINTN CbozBlockSize);
+UINTN LibGetMemExtensions(VOID);
+
+//
+// CRC32可以使用的CPU扩展，见LibSetCrcExtensions()
+//
+#define LIB_CRC_EXT_CLMUL   0x1     // 无进位乘法：RISC-V Zbc扩展或x86 PCLMULQDQ
+
+VOID LibSetCrcExtensions(IN UINTN Extensions);
+UINTN LibGetCrcExtensions(VOID);
+
 void *memset(void *s, int c, __SIZE_TYPE__ n);
 
 void *memcpy(void *dest, const void *src, __SIZE_TYPE__ n);
@@ -198,21 +198,361 @@ Returns:
 }
 
 
+/*
+ * 按字节查表每次只处理一个字节，对于校验整个负载这样的大块数据太慢了。
+ * 下面的实现：
+ *
+ * - slicing-by-16/8：用CRCTable推导出16张表，每次处理16（或8）个字节。
+ * - 无进位乘法折叠：RISC-V的Zbc扩展（clmul/clmulh）或者x86的PCLMULQDQ，
+ *   每次把64字节折叠到4个128位的累加器中，最后用Barrett reduction得到CRC。
+ *   折叠常数与Linux的crc32-pclmul相同。
+ *
+ * 使用哪种实现在运行时选择：x86_64上用cpuid检测PCLMULQDQ；RISC-V上需要调用者
+ * 通过LibSetCrcExtensions()声明CPU支持Zbc扩展。
+ */
+
+#define CRC_SLICES 16
+
+// CrcSliceTable[0]就是CRCTable，CrcSliceTable[k][i]是i后面跟k个0字节的CRC
+static UINT32 CrcSliceTable[CRC_SLICES - 1][256];
+static BOOLEAN CrcSliceTableReady;
+
+static UINTN CrcExtensions;
+static BOOLEAN CrcExtensionsProbed;
+
+typedef UINT64 __attribute__((__may_alias__)) CRC_WORD;
+
+static inline UINT32 CrcTable(UINTN Slice, UINTN Index)
+{
+	return Slice ? CrcSliceTable[Slice - 1][Index] : CRCTable[Index];
+}
+
+static VOID CrcInitSliceTable(VOID)
+{
+	UINTN k, i;
+	UINT32 c;
+
+	for (i = 0; i < 256; i++) {
+		c = CRCTable[i];
+		for (k = 0; k < CRC_SLICES - 1; k++) {
+			c = (c >> 8) ^ CRCTable[(UINT8)c];
+			CrcSliceTable[k][i] = c;
+		}
+	}
+	CrcSliceTableReady = TRUE;
+}
+
+static inline UINT32 CrcBytes(UINT32 Crc, CONST UINT8 *p, UINTN Size)
+{
+	while (Size--)
+		Crc = (Crc >> 8) ^ CRCTable[(UINT8)Crc ^ *p++];
+	return Crc;
+}
+
+/// @brief 把一个64位的字（小端序）折叠到CRC中，Slice是这个字之后还有多少字节
+static inline UINT32 CrcWord(UINT64 w, UINTN Slice)
+{
+	return CrcTable(Slice + 7, (UINT8)w) ^
+	       CrcTable(Slice + 6, (UINT8)(w >> 8)) ^
+	       CrcTable(Slice + 5, (UINT8)(w >> 16)) ^
+	       CrcTable(Slice + 4, (UINT8)(w >> 24)) ^
+	       CrcTable(Slice + 3, (UINT8)(w >> 32)) ^
+	       CrcTable(Slice + 2, (UINT8)(w >> 40)) ^
+	       CrcTable(Slice + 1, (UINT8)(w >> 48)) ^
+	       CrcTable(Slice, (UINT8)(w >> 56));
+}
+
+/// @brief slicing-by-16，剩下不足16字节时用slicing-by-8和逐字节查表
+static UINT32 CrcSlicing(UINT32 Crc, CONST UINT8 *p, UINTN Size)
+{
+	UINTN head = -(UINTN)p & (sizeof(CRC_WORD) - 1);
+
+	if (!CrcSliceTableReady)
+		CrcInitSliceTable();
+
+	if (head > Size)
+		head = Size;
+	Crc = CrcBytes(Crc, p, head);
+	p += head;
+	Size -= head;
+
+	for (; Size >= 16; p += 16, Size -= 16) {
+		UINT64 a = ((CONST CRC_WORD *)p)[0] ^ Crc;
+		UINT64 b = ((CONST CRC_WORD *)p)[1];
+
+		Crc = CrcWord(a, 8) ^ CrcWord(b, 0);
+	}
+	if (Size >= 8) {
+		Crc = CrcWord(*(CONST CRC_WORD *)p ^ Crc, 0);
+		p += 8;
+		Size -= 8;
+	}
+	return CrcBytes(Crc, p, Size);
+}
+
+#if defined(CONFIG_riscv64) || defined(CONFIG_x86_64)
+#define CRC_HAVE_CLMUL
+
+// x^(4*128+32)、x^(4*128-32)：把64字节折叠到下一个64字节
+#define CRC_K1 0x154442bd4ULL
+#define CRC_K2 0x1c6e41596ULL
+// x^(128+32)、x^(128-32)：把16字节折叠到下一个16字节
+#define CRC_K3 0x1751997d0ULL
+#define CRC_K4 0x0ccaa009eULL
+// x^64
+#define CRC_K5 0x163cd6124ULL
+// Barrett reduction使用的多项式P(x)'和u'
+#define CRC_POLY 0x1db710641ULL
+#define CRC_MU 0x1f7011641ULL
+
+// 小于这个大小的数据不值得使用无进位乘法
+#define CRC_CLMUL_MIN 256
+
+#if defined(CONFIG_riscv64)
+
+#define CRC_CLMUL_TARGET
+
+typedef struct {
+	UINT64 Lo, Hi;
+} CRC_128;
+
+// clmul/clmulh，用.insn编码，以兼容不认识Zbc的汇编器
+static inline UINT64 CrcClmulLo(UINT64 a, UINT64 b)
+{
+	UINT64 r;
+
+	__asm__(".insn r 0x33, 1, 5, %0, %1, %2" : "=r"(r) : "r"(a), "r"(b));
+	return r;
+}
+
+static inline UINT64 CrcClmulHi(UINT64 a, UINT64 b)
+{
+	UINT64 r;
+
+	__asm__(".insn r 0x33, 3, 5, %0, %1, %2" : "=r"(r) : "r"(a), "r"(b));
+	return r;
+}
+
+/// @brief 读取16字节，p必须按CRC_WORD对齐（见UpdateCrc()）
+static inline CRC_128 CrcLoad(CONST UINT8 *p)
+{
+	return (CRC_128){ ((CONST CRC_WORD *)p)[0], ((CONST CRC_WORD *)p)[1] };
+}
+
+/// @brief 返回x.lo * KLo ^ x.hi * KHi ^ Next
+static inline CRC_128 CrcFold(CRC_128 x, UINT64 KLo, UINT64 KHi, CRC_128 Next)
+{
+	return (CRC_128){
+		CrcClmulLo(x.Lo, KLo) ^ CrcClmulLo(x.Hi, KHi) ^ Next.Lo,
+		CrcClmulHi(x.Lo, KLo) ^ CrcClmulHi(x.Hi, KHi) ^ Next.Hi,
+	};
+}
+
+static inline CRC_128 CrcMake(UINT64 Lo, UINT64 Hi)
+{
+	return (CRC_128){ Lo, Hi };
+}
+
+static inline UINT64 CrcLo(CRC_128 x)
+{
+	return x.Lo;
+}
+
+static inline UINT64 CrcHi(CRC_128 x)
+{
+	return x.Hi;
+}
+
+#else /* CONFIG_x86_64 */
+
+#define CRC_CLMUL_TARGET __attribute__((target("sse2,pclmul")))
+
+typedef long long CRC_128 __attribute__((vector_size(16)));
+typedef long long CRC_128_UNALIGNED
+	__attribute__((vector_size(16), aligned(1), __may_alias__));
+
+// Sel的第0位选择a的低/高64位，第4位选择b的低/高64位
+#define CrcClmul(a, b, Sel) __builtin_ia32_pclmulqdq128(a, b, Sel)
+
+static inline CRC_CLMUL_TARGET UINT64 CrcClmulLo(UINT64 a, UINT64 b)
+{
+	return CrcClmul(((CRC_128){ a, 0 }), ((CRC_128){ b, 0 }), 0x00)[0];
+}
+
+static inline CRC_CLMUL_TARGET UINT64 CrcClmulHi(UINT64 a, UINT64 b)
+{
+	return CrcClmul(((CRC_128){ a, 0 }), ((CRC_128){ b, 0 }), 0x00)[1];
+}
+
+static inline CRC_CLMUL_TARGET CRC_128 CrcLoad(CONST UINT8 *p)
+{
+	return *(CONST CRC_128_UNALIGNED *)p;
+}
+
+static inline CRC_CLMUL_TARGET CRC_128 CrcFold(CRC_128 x, UINT64 KLo, UINT64 KHi,
+						 CRC_128 Next)
+{
+	CRC_128 k = { KLo, KHi };
+
+	return CrcClmul(x, k, 0x00) ^ CrcClmul(x, k, 0x11) ^ Next;
+}
+
+static inline CRC_CLMUL_TARGET CRC_128 CrcMake(UINT64 Lo, UINT64 Hi)
+{
+	return (CRC_128){ Lo, Hi };
+}
+
+static inline CRC_CLMUL_TARGET UINT64 CrcLo(CRC_128 x)
+{
+	return x[0];
+}
+
+static inline CRC_CLMUL_TARGET UINT64 CrcHi(CRC_128 x)
+{
+	return x[1];
+}
+
+static BOOLEAN CrcCpuHasPclmul(VOID)
+{
+	UINT32 a = 1, b, c = 0, d;
+
+	__asm__("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+	return (c >> 1) & 1;
+}
+
+#endif
+
+/// @brief 把128位的余数约化成32位的CRC
+static CRC_CLMUL_TARGET UINT32 CrcReduce(UINT64 Lo, UINT64 Hi)
+{
+	UINT64 v, t;
+
+	// 128位 -> 96位
+	t = CrcClmulHi(Lo, CRC_K4);
+	Lo = Hi ^ CrcClmulLo(Lo, CRC_K4);
+	Hi = t;
+	// 96位 -> 64位
+	v = CrcClmulLo(Lo & 0xffffffff, CRC_K5) ^ (Lo >> 32) ^ (Hi << 32);
+	// Barrett reduction：64位 -> 32位
+	t = CrcClmulLo(v & 0xffffffff, CRC_MU) & 0xffffffff;
+	t = CrcClmulLo(t, CRC_POLY) ^ v;
+	return (UINT32)(t >> 32);
+}
+
+/**
+ * 用无进位乘法计算CRC
+ *
+ * 处理前(Size & ~15)个字节，要求Size >= 64，p按16字节对齐。Crc和返回值
+ * 都是CRC寄存器的值（即没有取反的中间结果）。
+ */
+static CRC_CLMUL_TARGET UINT32 CrcClmulFold(UINT32 Crc, CONST UINT8 *p,
+					    UINTN Size)
+{
+	CRC_128 x0, x1, x2, x3;
+
+	x0 = CrcLoad(p);
+	x0 = CrcMake(CrcLo(x0) ^ Crc, CrcHi(x0));
+	x1 = CrcLoad(p + 16);
+	x2 = CrcLoad(p + 32);
+	x3 = CrcLoad(p + 48);
+
+	for (p += 64, Size -= 64; Size >= 64; p += 64, Size -= 64) {
+		x0 = CrcFold(x0, CRC_K1, CRC_K2, CrcLoad(p));
+		x1 = CrcFold(x1, CRC_K1, CRC_K2, CrcLoad(p + 16));
+		x2 = CrcFold(x2, CRC_K1, CRC_K2, CrcLoad(p + 32));
+		x3 = CrcFold(x3, CRC_K1, CRC_K2, CrcLoad(p + 48));
+	}
+
+	// 把4个累加器折叠成1个，然后每次折叠16字节
+	x0 = CrcFold(x0, CRC_K3, CRC_K4, x1);
+	x0 = CrcFold(x0, CRC_K3, CRC_K4, x2);
+	x0 = CrcFold(x0, CRC_K3, CRC_K4, x3);
+	for (; Size >= 16; p += 16, Size -= 16)
+		x0 = CrcFold(x0, CRC_K3, CRC_K4, CrcLoad(p));
+
+	return CrcReduce(CrcLo(x0), CrcHi(x0));
+}
+
+#endif /* CRC_HAVE_CLMUL */
+
+/**
+ * @brief 声明CPU支持哪些可以加速CRC32计算的扩展
+ *
+ * @param Extensions LIB_CRC_EXT_*的组合
+ *
+ * 当前架构不支持的扩展会被忽略。x86_64上默认通过cpuid检测，
+ * 调用这个函数可以覆盖检测的结果。
+ */
+VOID LibSetCrcExtensions(IN UINTN Extensions)
+{
+#ifdef CRC_HAVE_CLMUL
+	CrcExtensions = Extensions & LIB_CRC_EXT_CLMUL;
+#else
+	(void)Extensions;
+	CrcExtensions = 0;
+#endif
+	CrcExtensionsProbed = TRUE;
+}
+
+/// @brief 获取当前CRC32计算使用的扩展（LIB_CRC_EXT_*的组合）
+UINTN LibGetCrcExtensions(VOID)
+{
+	if (!CrcExtensionsProbed) {
+#if defined(CONFIG_x86_64)
+		CrcExtensions = CrcCpuHasPclmul() ? LIB_CRC_EXT_CLMUL : 0;
+#endif
+		CrcExtensionsProbed = TRUE;
+	}
+	return CrcExtensions;
+}
+
+/**
+ * @brief 继续计算CRC32
+ *
+ * @param Crc 前面的数据的CRC32（第一次调用时为0）
+ * @param Buf 接下来的数据
+ * @param Size 数据的大小
+ *
+ * 大块的数据可以分成多次调用，UpdateCrc(UpdateCrc(0, a), b)等于a和b拼接起来
+ * 之后的CRC32。
+ *
+ * @return 到目前为止所有数据的CRC32
+ */
+UINT32
+UpdateCrc (
+    UINT32 Crc,
+    CONST VOID *Buf,
+    UINTN Size
+    )
+{
+	CONST UINT8 *p = Buf;
+
+	Crc = ~Crc;
+#ifdef CRC_HAVE_CLMUL
+	if (Size >= CRC_CLMUL_MIN &&
+	    (LibGetCrcExtensions() & LIB_CRC_EXT_CLMUL)) {
+		// 先逐字节处理到16字节对齐，RISC-V上CrcLoad()按CRC_WORD读取
+		UINTN n = -(UINTN)p & 15;
+
+		Crc = CrcBytes(Crc, p, n);
+		p += n;
+		Size -= n;
+
+		n = Size & ~(UINTN)15;
+		Crc = CrcClmulFold(Crc, p, n);
+		p += n;
+		Size -= n;
+	}
+#endif
+	Crc = CrcSlicing(Crc, p, Size);
+	return ~Crc;
+}
+
 UINT32
 CalculateCrc (
     UINT8 *pt,
     UINTN Size
     )
 {
-    UINTN Crc;
-
-    // compute crc
-    Crc = 0xffffffff;
-    while (Size) {
-        Crc = (Crc >> 8) ^ CRCTable[(UINT8) Crc ^ *pt];
-        pt += 1;
-        Size -= 1;
-    }
-    Crc = Crc ^ 0xffffffff;
-    return (UINT32)Crc;
+    return UpdateCrc(0, pt, Size);
 }
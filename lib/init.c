@@ -178,21 +178,177 @@ VOID EFIDebugVariable(VOID)
 #define __SIZE_TYPE__ UINTN
 #endif
 
+#define SS (sizeof(size_t))
+#define __ALIGN (sizeof(size_t)-1)
+#define ONES ((size_t)-1/UCHAR_MAX)
+#define HIGHS (ONES * (UCHAR_MAX/2+1))
+#define HASZERO(x) ((x)-ONES & ~(x) & HIGHS)
+
+typedef size_t __attribute__((__may_alias__)) word;
+
+/*
+ * 加载内核时要复制/清零几十上百MB的内存，逐字节操作太慢了。
+ * 下面的实现先逐字节处理到按字对齐，然后每次处理一个字（循环展开4次），
+ * 最后逐字节处理剩余的部分。
+ *
+ * 在RISC-V上，如果通过LibSetMemExtensions()声明了CPU支持V扩展或者Zicboz扩展，
+ * 大块的操作还会改用向量指令或cbo.zero完成。
+ */
+
+static UINTN LibMemExtensions;
+static UINTN LibCbozBlockSize;
+
+#if defined(CONFIG_riscv64)
+// lib/riscv64/memvec.S
+void *__memcpy_rvv(void *dest, const void *src, size_t n);
+void *__memmove_back_rvv(void *dest, const void *src, size_t n);
+void *__memset_rvv(void *s, int c, size_t n);
+int __memcmp_rvv(const void *vl, const void *vr, size_t n);
+
+// 小于这个大小的操作不值得使用向量指令
+#define MEM_VECTOR_MIN 128
+
+static inline void riscv_cbo_zero(void *p)
+{
+	// cbo.zero 0(p)，用.insn编码，以兼容不认识Zicboz的汇编器
+	__asm__ volatile(".insn i 0x0f, 2, x0, %0, 4" : : "r"(p) : "memory");
+}
+#endif
+
+/**
+ * @brief 声明CPU支持哪些可以加速内存操作的扩展
+ *
+ * @param Extensions LIB_MEM_EXT_*的组合
+ * @param CbozBlockSize cbo.zero每次清零的字节数（仅在使用LIB_MEM_EXT_CBOZ时有效）
+ *
+ * 调用者需要确保这些扩展已经可以使用（例如已经打开了sstatus.VS）。
+ * 当前架构不支持的扩展会被忽略。
+ */
+VOID LibSetMemExtensions(IN UINTN Extensions, IN UINTN CbozBlockSize)
+{
+#if defined(CONFIG_riscv64)
+	if ((Extensions & LIB_MEM_EXT_CBOZ) &&
+	    (CbozBlockSize < SS || (CbozBlockSize & (CbozBlockSize - 1))))
+		Extensions &= ~LIB_MEM_EXT_CBOZ;
+	LibMemExtensions = Extensions & (LIB_MEM_EXT_VECTOR | LIB_MEM_EXT_CBOZ);
+	LibCbozBlockSize = CbozBlockSize;
+#else
+	(void)Extensions;
+	(void)CbozBlockSize;
+	LibMemExtensions = 0;
+	LibCbozBlockSize = 0;
+#endif
+}
+
+/// @brief 获取当前内存操作使用的扩展（LIB_MEM_EXT_*的组合）
+UINTN LibGetMemExtensions(VOID)
+{
+	return LibMemExtensions;
+}
+
 void *memset(void *s, int c, __SIZE_TYPE__ n)
 {
 	unsigned char *p = s;
 
+#if defined(CONFIG_riscv64)
+	if (c == 0 && (LibMemExtensions & LIB_MEM_EXT_CBOZ) &&
+	    n >= 2 * LibCbozBlockSize) {
+		size_t blk = LibCbozBlockSize;
+		size_t head = -(uintptr_t)p & (blk - 1);
+
+		memset(p, 0, head);
+		p += head;
+		n -= head;
+		for (; n >= blk; n -= blk, p += blk)
+			riscv_cbo_zero(p);
+		memset(p, 0, n);
+		return s;
+	}
+	if (n >= MEM_VECTOR_MIN && (LibMemExtensions & LIB_MEM_EXT_VECTOR))
+		return __memset_rvv(s, c, n);
+#endif
+
+	for (; ((uintptr_t)p & __ALIGN) && n; n--)
+		*p++ = c;
+
+	if (n >= SS) {
+		word w = ONES * (unsigned char)c;
+		word *wp = (void *)p;
+
+		for (; n >= 4 * SS; n -= 4 * SS, wp += 4) {
+			wp[0] = w;
+			wp[1] = w;
+			wp[2] = w;
+			wp[3] = w;
+		}
+		for (; n >= SS; n -= SS)
+			*wp++ = w;
+		p = (void *)wp;
+	}
+
 	while (n--)
 		*p++ = c;
 
 	return s;
 }
 
+/**
+ * @brief 从前往后复制内存
+ *
+ * 目标地址不大于源地址时，即使两段内存重叠也能正确复制（memmove依赖这一点）：
+ * 每个字都是先读出来，再写到更低或相同的地址上。
+ */
 void *memcpy(void *dest, const void *src, __SIZE_TYPE__ n)
 {
 	const unsigned char *q = src;
 	unsigned char *p = dest;
 
+#if defined(CONFIG_riscv64)
+	if (n >= MEM_VECTOR_MIN && (LibMemExtensions & LIB_MEM_EXT_VECTOR))
+		return __memcpy_rvv(dest, src, n);
+#endif
+
+	for (; ((uintptr_t)p & __ALIGN) && n; n--)
+		*p++ = *q++;
+
+	if (n >= SS) {
+		word *wp = (void *)p;
+
+		if (((uintptr_t)q & __ALIGN) == 0) {
+			const word *wq = (const void *)q;
+
+			for (; n >= 4 * SS; n -= 4 * SS, wp += 4, wq += 4) {
+				wp[0] = wq[0];
+				wp[1] = wq[1];
+				wp[2] = wq[2];
+				wp[3] = wq[3];
+			}
+			for (; n >= SS; n -= SS)
+				*wp++ = *wq++;
+			q = (const void *)wq;
+		}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		else {
+			/*
+			 * 源地址和目标地址没有相同的对齐，并且有的架构不支持
+			 * （或者要陷入固件来模拟）非对齐访问。
+			 * 因此只做对齐的读，再把相邻的两个字拼起来写出去。
+			 * 多读出来的字节都和需要的字节位于同一个对齐的字中，不会越过页边界。
+			 */
+			size_t shift = ((uintptr_t)q & __ALIGN) * 8;
+			const word *wq = (const void *)((uintptr_t)q & ~__ALIGN);
+			word prev = *wq++;
+
+			for (; n >= SS; n -= SS, q += SS) {
+				word next = *wq++;
+				*wp++ = (prev >> shift) | (next << (SS * 8 - shift));
+				prev = next;
+			}
+		}
+#endif
+		p = (void *)wp;
+	}
+
 	while (n--)
 		*p++ = *q++;
 
@@ -212,17 +368,39 @@ void *memmove(void *dst, const void *src, uint64_t size)
 	const char *_src = src;
 	char *_dst = dst;
 
-	if (!size)
+	// 原地移动（例如fdt_open_into()扩大已经排好的树）什么也不用做
+	if (!size || dst == src)
 		return dst;
 
 	// 当源地址大于目标地址时，使用memcpy来完成
 	if (dst <= src)
 		return memcpy(dst, src, size);
 
+	// 两段内存不重叠
+	if (_src + size <= _dst)
+		return memcpy(dst, src, size);
+
+#if defined(CONFIG_riscv64)
+	if (size >= MEM_VECTOR_MIN && (LibMemExtensions & LIB_MEM_EXT_VECTOR))
+		return __memmove_back_rvv(dst, src, size);
+#endif
+
 	// 当源地址小于目标地址时，为防止重叠覆盖，因此从后往前拷贝
 	_src += size;
 	_dst += size;
 
+	if ((((uintptr_t)_src ^ (uintptr_t)_dst) & __ALIGN) == 0) {
+		for (; ((uintptr_t)_dst & __ALIGN) && size; size--)
+			*--_dst = *--_src;
+
+		word *wd = (void *)_dst;
+		const word *ws = (const void *)_src;
+		for (; size >= SS; size -= SS)
+			*--wd = *--ws;
+		_dst = (void *)wd;
+		_src = (const void *)ws;
+	}
+
 	// 逐字节拷贝
 	while (size--)
 		*--_dst = *--_src;
@@ -230,12 +408,6 @@ void *memmove(void *dst, const void *src, uint64_t size)
 	return dst;
 }
 
-#define SS (sizeof(size_t))
-#define __ALIGN (sizeof(size_t)-1)
-#define ONES ((size_t)-1/UCHAR_MAX)
-#define HIGHS (ONES * (UCHAR_MAX/2+1))
-#define HASZERO(x) ((x)-ONES & ~(x) & HIGHS)
-
 void *memchr(const void *src, int c, size_t n)
 {
 	const unsigned char *s = src;
@@ -257,6 +429,25 @@ void *memchr(const void *src, int c, size_t n)
 int memcmp(const void *vl, const void *vr, size_t n)
 {
 	const unsigned char *l = vl, *r = vr;
+
+#if defined(CONFIG_riscv64)
+	if (n >= MEM_VECTOR_MIN && (LibMemExtensions & LIB_MEM_EXT_VECTOR))
+		return __memcmp_rvv(vl, vr, n);
+#endif
+
+	if ((((uintptr_t)l ^ (uintptr_t)r) & __ALIGN) == 0) {
+		for (; ((uintptr_t)l & __ALIGN) && n && *l == *r; n--, l++, r++)
+			;
+		if (n && *l == *r) {
+			// 逐字比较，遇到不同的字再逐字节找出第一个不同的字节
+			const word *wl = (const void *)l, *wr = (const void *)r;
+			for (; n >= SS && *wl == *wr; n -= SS, wl++, wr++)
+				;
+			l = (const void *)wl;
+			r = (const void *)wr;
+		}
+	}
+
 	for (; n && *l == *r; n--, l++, r++)
 		;
 	return n ? *l - *r : 0;
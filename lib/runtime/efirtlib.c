@@ -20,6 +20,17 @@ Revision History
 #include "efilib.h"
 #include "efirtlib.h"
 
+//
+// The runtime copies work a word at a time once the destination is aligned.
+// They must stay self-contained (no calls into the boot-time memset/memcpy),
+// since they are also used after ExitBootServices().
+//
+
+typedef UINTN __attribute__((__may_alias__)) RT_WORD;
+
+#define RT_WORD_SIZE    sizeof(RT_WORD)
+#define RT_WORD_MASK    (RT_WORD_SIZE - 1)
+
 #ifndef __GNUC__
 #pragma RUNTIME_CODE(RtZeroMem)
 #endif
@@ -30,12 +41,7 @@ RtZeroMem (
     IN UINTN     Size
     )
 {
-    INT8        *pt;
-
-    pt = Buffer;
-    while (Size--) {
-        *(pt++) = 0;
-    }
+    RtSetMem (Buffer, Size, 0);
 }
 
 #ifndef __GNUC__
@@ -50,8 +56,21 @@ RtSetMem (
     )
 {
     INT8        *pt;
+    RT_WORD     *wp;
+    RT_WORD     w;
 
     pt = Buffer;
+    while (((UINTN)pt & RT_WORD_MASK) && Size) {
+        *(pt++) = Value;
+        Size--;
+    }
+
+    w = ((RT_WORD)-1 / 0xFF) * Value;
+    for (wp = (RT_WORD *)pt; Size >= RT_WORD_SIZE; Size -= RT_WORD_SIZE) {
+        *(wp++) = w;
+    }
+
+    pt = (INT8 *)wp;
     while (Size--) {
         *(pt++) = Value;
     }
@@ -70,17 +89,42 @@ RtCopyMem (
 {
     CHAR8 *d = (CHAR8*)Dest;
     CHAR8 *s = (CHAR8*)Src;
+    BOOLEAN aligned;
 
     if (d == NULL || s == NULL || s == d)
         return;
 
+    // Words can only be used when source and destination share the same
+    // alignment, unaligned accesses may trap on some architectures.
+    aligned = (((UINTN)d ^ (UINTN)s) & RT_WORD_MASK) == 0;
+
     // If the beginning of the destination range overlaps with the end of
     // the source range, make sure to start the copy from the end so that
     // we don't end up overwriting source data that we need for the copy.
     if ((d > s) && (d < s + len)) {
-        for (d += len, s += len; len--; )
+        d += len;
+        s += len;
+        if (aligned) {
+            for (; ((UINTN)d & RT_WORD_MASK) && len; len--)
+                *--d = *--s;
+            for (; len >= RT_WORD_SIZE; len -= RT_WORD_SIZE) {
+                d -= RT_WORD_SIZE;
+                s -= RT_WORD_SIZE;
+                *(RT_WORD *)d = *(RT_WORD *)s;
+            }
+        }
+        while (len--)
             *--d = *--s;
     } else {
+        if (aligned) {
+            for (; ((UINTN)d & RT_WORD_MASK) && len; len--)
+                *d++ = *s++;
+            for (; len >= RT_WORD_SIZE; len -= RT_WORD_SIZE) {
+                *(RT_WORD *)d = *(RT_WORD *)s;
+                d += RT_WORD_SIZE;
+                s += RT_WORD_SIZE;
+            }
+        }
         while (len--)
             *d++ = *s++;
     }
@@ -0,0 +1,912 @@
+#include "efi_mock.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * 被测代码（apps/下的代码）通过BS/ST/RT访问固件，这些全局变量在真实构建中由
+ * gnu-efi的lib/data.c提供。
+ */
+EFI_SYSTEM_TABLE *ST;
+EFI_BOOT_SERVICES *BS;
+EFI_RUNTIME_SERVICES *RT;
+
+/* 链接脚本提供的符号 */
+char _image_end[1];
+
+struct mock_stats mock_stats;
+EFI_LOADED_IMAGE mock_loaded_image;
+EFI_HANDLE mock_image_handle = &mock_loaded_image;
+
+#define MOCK_DESC_SIZE 48
+#define MOCK_MAX_REGIONS 65536
+#define MOCK_MAX_CONFIG_TABLES 64
+
+struct mock_region {
+	uint64_t start;
+	uint64_t pages;
+	uint32_t type;
+	uint64_t attr;
+};
+
+static struct mock_config config;
+static uint8_t *arena;
+static uint64_t arena_base;
+static uint64_t arena_pages;
+
+/* 已分配的区域，按地址排序 */
+static struct mock_region regions[MOCK_MAX_REGIONS];
+static uint32_t nr_regions;
+static uint64_t map_key = 1;
+static bool exited;
+static const void *fw_fdt;
+
+static EFI_SYSTEM_TABLE system_table;
+static EFI_BOOT_SERVICES boot_services;
+static EFI_RUNTIME_SERVICES runtime_services;
+static SIMPLE_TEXT_OUTPUT_INTERFACE con_out;
+static EFI_CONFIGURATION_TABLE config_tables[MOCK_MAX_CONFIG_TABLES];
+
+static void check_alive(const char *what)
+{
+	if (exited) {
+		fprintf(stderr, "mock-efi: %s called after ExitBootServices()\n",
+			what);
+		abort();
+	}
+}
+
+uint64_t mock_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * 模拟的辅助核（SBI HSM）：每个核是一个线程，线程函数返回就相当于核停了下来。
+ * ExitBootServices()时所有的核都必须已经停下。
+ */
+static int cpus_running;
+
+struct mock_cpu {
+	void (*fn)(void *);
+	void *arg;
+};
+
+static void *mock_cpu_thread(void *data)
+{
+	struct mock_cpu cpu = *(struct mock_cpu *)data;
+
+	free(data);
+	cpu.fn(cpu.arg);
+	__atomic_fetch_sub(&cpus_running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+unsigned int mock_secondary_cpus(void)
+{
+	return config.cpus > 1 ? config.cpus - 1 : 0;
+}
+
+bool mock_cpu_start(void (*fn)(void *), void *arg)
+{
+	struct mock_cpu *cpu = malloc(sizeof(*cpu));
+	pthread_t thread;
+
+	check_alive("HSM hart_start");
+	if (!cpu)
+		return false;
+	cpu->fn = fn;
+	cpu->arg = arg;
+	__atomic_fetch_add(&cpus_running, 1, __ATOMIC_RELAXED);
+	if (pthread_create(&thread, NULL, mock_cpu_thread, cpu)) {
+		__atomic_fetch_sub(&cpus_running, 1, __ATOMIC_RELAXED);
+		free(cpu);
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
+
+void mock_cpu_relax(void)
+{
+	sched_yield();
+}
+
+static EFI_STATUS EFIAPI mock_stall(UINTN us)
+{
+	check_alive("Stall");
+	usleep(us);
+	return EFI_SUCCESS;
+}
+
+static uint64_t region_end(const struct mock_region *r)
+{
+	return r->start + r->pages * EFI_PAGE_SIZE;
+}
+
+static bool range_free(uint64_t start, uint64_t pages)
+{
+	uint64_t end = start + pages * EFI_PAGE_SIZE;
+
+	if (start < arena_base || end > arena_base + arena_pages * EFI_PAGE_SIZE)
+		return false;
+	for (uint32_t i = 0; i < nr_regions; i++) {
+		if (regions[i].start < end && start < region_end(&regions[i]))
+			return false;
+	}
+	return true;
+}
+
+static EFI_STATUS insert_region(uint64_t start, uint64_t pages, uint32_t type,
+				uint64_t attr)
+{
+	uint32_t i;
+
+	if (nr_regions == MOCK_MAX_REGIONS)
+		return EFI_OUT_OF_RESOURCES;
+	for (i = 0; i < nr_regions && regions[i].start < start; i++)
+		;
+	memmove(&regions[i + 1], &regions[i],
+		(nr_regions - i) * sizeof(regions[0]));
+	regions[i] = (struct mock_region){ start, pages, type, attr };
+	nr_regions++;
+	map_key++;
+	return EFI_SUCCESS;
+}
+
+/// @brief 从高地址往低地址找一块不超过max的空闲区域（与EDK2的策略一致）
+static bool find_top_down(uint64_t pages, uint64_t max, uint64_t *ret)
+{
+	uint64_t limit = arena_base + arena_pages * EFI_PAGE_SIZE;
+	uint64_t size = pages * EFI_PAGE_SIZE;
+
+	if (max != UINT64_MAX && max + 1 < limit)
+		limit = (max + 1) & ~(uint64_t)(EFI_PAGE_SIZE - 1);
+
+	/* 依次检查每个已分配区域之间的空洞 */
+	for (int64_t i = nr_regions; i >= 0; i--) {
+		uint64_t hole_start = i > 0 ? region_end(&regions[i - 1]) :
+					      arena_base;
+		uint64_t hole_end = i < (int64_t)nr_regions ? regions[i].start :
+							  arena_base +
+								  arena_pages *
+									  EFI_PAGE_SIZE;
+
+		if (hole_end > limit)
+			hole_end = limit;
+		if (hole_end <= hole_start || hole_end - hole_start < size)
+			continue;
+		*ret = hole_end - size;
+		return true;
+	}
+	return false;
+}
+
+static EFI_STATUS EFIAPI mock_allocate_pages(EFI_ALLOCATE_TYPE type,
+					     EFI_MEMORY_TYPE memtype,
+					     UINTN pages,
+					     EFI_PHYSICAL_ADDRESS *memory)
+{
+	uint64_t addr;
+
+	check_alive("AllocatePages");
+	mock_stats.allocate_pages_calls++;
+	if (!pages)
+		return EFI_INVALID_PARAMETER;
+
+	switch (type) {
+	case AllocateAnyPages:
+		if (!find_top_down(pages, UINT64_MAX, &addr))
+			return EFI_OUT_OF_RESOURCES;
+		break;
+	case AllocateMaxAddress:
+		if (!find_top_down(pages, *memory, &addr))
+			return EFI_OUT_OF_RESOURCES;
+		break;
+	case AllocateAddress:
+		addr = *memory;
+		if (addr & (EFI_PAGE_SIZE - 1))
+			return EFI_INVALID_PARAMETER;
+		if (!range_free(addr, pages))
+			return EFI_NOT_FOUND;
+		break;
+	default:
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (insert_region(addr, pages, memtype, EFI_MEMORY_WB) != EFI_SUCCESS)
+		return EFI_OUT_OF_RESOURCES;
+	mock_stats.allocate_pages_bytes += pages * EFI_PAGE_SIZE;
+	*memory = addr;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_free_pages(EFI_PHYSICAL_ADDRESS memory,
+					 UINTN pages)
+{
+	uint64_t end = memory + pages * EFI_PAGE_SIZE;
+
+	check_alive("FreePages");
+	mock_stats.free_pages_calls++;
+
+	/* 允许释放某个分配的头部或者尾部（efi_allocate_pages_aligned会这么做） */
+	for (uint32_t i = 0; i < nr_regions; i++) {
+		struct mock_region *r = &regions[i];
+
+		if (memory < r->start || end > region_end(r))
+			continue;
+
+		if (memory == r->start && end == region_end(r)) {
+			memmove(r, r + 1, (nr_regions - i - 1) * sizeof(*r));
+			nr_regions--;
+		} else if (memory == r->start) {
+			r->start = end;
+			r->pages -= pages;
+		} else if (end == region_end(r)) {
+			r->pages -= pages;
+		} else {
+			struct mock_region tail = *r;
+
+			tail.start = end;
+			tail.pages = (region_end(r) - end) / EFI_PAGE_SIZE;
+			r->pages = (memory - r->start) / EFI_PAGE_SIZE;
+			insert_region(tail.start, tail.pages, tail.type, tail.attr);
+		}
+		map_key++;
+		return EFI_SUCCESS;
+	}
+	return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI mock_allocate_pool(EFI_MEMORY_TYPE type, UINTN size,
+					    VOID **buffer)
+{
+	check_alive("AllocatePool");
+	(void)type;
+	mock_stats.allocate_pool_calls++;
+	mock_stats.allocate_pool_bytes += size;
+	*buffer = malloc(size ? size : 1);
+	if (!*buffer)
+		return EFI_OUT_OF_RESOURCES;
+	/* 真实的固件在池分配时有可能需要新的页，从而改变内存映射 */
+	map_key++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_free_pool(VOID *buffer)
+{
+	check_alive("FreePool");
+	mock_stats.free_pool_calls++;
+	free(buffer);
+	map_key++;
+	return EFI_SUCCESS;
+}
+
+static void put_desc(EFI_MEMORY_DESCRIPTOR *d, uint32_t type, uint64_t start,
+		     uint64_t pages, uint64_t attr)
+{
+	memset(d, 0, MOCK_DESC_SIZE);
+	d->Type = type;
+	d->PhysicalStart = start;
+	d->NumberOfPages = pages;
+	d->Attribute = attr;
+}
+
+/// @brief 计算当前内存映射中描述符的数量
+static uint64_t count_descs(void)
+{
+	uint64_t n = config.fw_descs;
+	uint64_t cursor = arena_base;
+
+	for (uint32_t i = 0; i < nr_regions; i++) {
+		if (regions[i].start > cursor)
+			n++;
+		n++;
+		cursor = region_end(&regions[i]);
+	}
+	if (cursor < arena_base + arena_pages * EFI_PAGE_SIZE)
+		n++;
+	return n;
+}
+
+static EFI_STATUS EFIAPI mock_get_memory_map(UINTN *size,
+					     EFI_MEMORY_DESCRIPTOR *map,
+					     UINTN *key, UINTN *desc_size,
+					     UINT32 *desc_ver)
+{
+	uint64_t need = count_descs() * MOCK_DESC_SIZE;
+	uint64_t cursor = arena_base;
+	uint8_t *p = (uint8_t *)map;
+
+	mock_stats.get_memory_map_calls++;
+	if (desc_size)
+		*desc_size = MOCK_DESC_SIZE;
+	if (desc_ver)
+		*desc_ver = EFI_MEMORY_DESCRIPTOR_VERSION;
+	if (*size < need || !map) {
+		*size = need;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	/*
+	 * 伪造的固件描述符放在arena下方，模拟MMIO和运行时服务区域。
+	 * 描述符故意不按地址排序，与一些真实固件的行为一致。
+	 */
+	for (uint32_t i = 0; i < config.fw_descs; i++) {
+		uint64_t start = 0x1000ull * (config.fw_descs - i);
+		uint64_t attr = EFI_MEMORY_UC;
+		uint32_t type = EfiMemoryMappedIO;
+
+		if (i % 8 == 0) {
+			type = EfiRuntimeServicesData;
+			attr = EFI_MEMORY_WB | EFI_MEMORY_RUNTIME;
+		} else if (i % 3 == 0) {
+			type = EfiReservedMemoryType;
+			attr = EFI_MEMORY_WB;
+		}
+		put_desc((EFI_MEMORY_DESCRIPTOR *)p, type, start, 1, attr);
+		p += MOCK_DESC_SIZE;
+	}
+
+	for (uint32_t i = 0; i < nr_regions; i++) {
+		if (regions[i].start > cursor) {
+			put_desc((EFI_MEMORY_DESCRIPTOR *)p,
+				 EfiConventionalMemory, cursor,
+				 (regions[i].start - cursor) / EFI_PAGE_SIZE,
+				 EFI_MEMORY_WB);
+			p += MOCK_DESC_SIZE;
+		}
+		put_desc((EFI_MEMORY_DESCRIPTOR *)p, regions[i].type,
+			 regions[i].start, regions[i].pages, regions[i].attr);
+		p += MOCK_DESC_SIZE;
+		cursor = region_end(&regions[i]);
+	}
+	if (cursor < arena_base + arena_pages * EFI_PAGE_SIZE) {
+		put_desc((EFI_MEMORY_DESCRIPTOR *)p, EfiConventionalMemory,
+			 cursor,
+			 (arena_base + arena_pages * EFI_PAGE_SIZE - cursor) /
+				 EFI_PAGE_SIZE,
+			 EFI_MEMORY_WB);
+		p += MOCK_DESC_SIZE;
+	}
+
+	*size = need;
+	*key = map_key;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_install_configuration_table(EFI_GUID *guid,
+							  VOID *table)
+{
+	UINTN i, n = system_table.NumberOfTableEntries;
+
+	check_alive("InstallConfigurationTable");
+	mock_stats.install_config_table_calls++;
+	for (i = 0; i < n; i++) {
+		if (!memcmp(&config_tables[i].VendorGuid, guid, sizeof(*guid)))
+			break;
+	}
+
+	if (!table) {
+		if (i == n)
+			return EFI_NOT_FOUND;
+		memmove(&config_tables[i], &config_tables[i + 1],
+			(n - i - 1) * sizeof(config_tables[0]));
+		system_table.NumberOfTableEntries--;
+	} else if (i < n) {
+		config_tables[i].VendorTable = table;
+	} else {
+		if (n == MOCK_MAX_CONFIG_TABLES)
+			return EFI_OUT_OF_RESOURCES;
+		config_tables[n].VendorGuid = *guid;
+		config_tables[n].VendorTable = table;
+		system_table.NumberOfTableEntries++;
+	}
+	map_key++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_exit_boot_services(EFI_HANDLE image, UINTN key)
+{
+	(void)image;
+	check_alive("ExitBootServices");
+	mock_stats.exit_boot_services_calls++;
+	if (__atomic_load_n(&cpus_running, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "mock-efi: ExitBootServices() called with secondary harts running\n");
+		abort();
+	}
+	if (key != map_key)
+		return EFI_INVALID_PARAMETER;
+	exited = true;
+	return EFI_SUCCESS;
+}
+
+/*
+ * 模拟的TCG2 protocol（EFI_TCG2_PROTOCOL），只实现HashLogExtendEvent()，
+ * 记录固件需要计算摘要的数据量。
+ */
+static EFI_GUID tcg2_guid = { 0x607f766c, 0x7455, 0x42be,
+			      { 0x93, 0x0b, 0xe4, 0xd7, 0x6d, 0xb2, 0x72,
+				0x0f } };
+
+struct mock_tcg2 {
+	void *get_capability;
+	void *get_event_log;
+	EFI_STATUS(EFIAPI *hash_log_extend_event)
+	(struct mock_tcg2 *this, uint64_t flags, EFI_PHYSICAL_ADDRESS data,
+	 uint64_t size, const void *event);
+	void *submit_command;
+	void *get_active_pcr_banks;
+	void *set_active_pcr_banks;
+	void *get_result_of_set_active_pcr_banks;
+};
+
+static EFI_STATUS EFIAPI mock_tcg2_hash_log_extend_event(
+	struct mock_tcg2 *this, uint64_t flags, EFI_PHYSICAL_ADDRESS data,
+	uint64_t size, const void *event)
+{
+	check_alive("HashLogExtendEvent");
+	if (!data || !event)
+		return EFI_INVALID_PARAMETER;
+	mock_stats.tcg2_extend_calls++;
+	mock_stats.tcg2_extend_bytes += size;
+	return EFI_SUCCESS;
+}
+
+static struct mock_tcg2 mock_tcg2 = {
+	.hash_log_extend_event = mock_tcg2_hash_log_extend_event,
+};
+
+static EFI_STATUS EFIAPI mock_locate_protocol(EFI_GUID *protocol,
+					      VOID *registration,
+					      VOID **interface)
+{
+	(void)registration;
+	check_alive("LocateProtocol");
+	mock_stats.locate_protocol_calls++;
+	if (config.tcg2 && !memcmp(protocol, &tcg2_guid, sizeof(tcg2_guid))) {
+		*interface = &mock_tcg2;
+		return EFI_SUCCESS;
+	}
+	*interface = NULL;
+	return EFI_NOT_FOUND;
+}
+
+/*
+ * 模拟启动卷上的文件系统（EFI_SIMPLE_FILE_SYSTEM_PROTOCOL），文件内容来自
+ * mock_fs_add()，只支持读取。
+ */
+#define MOCK_MAX_FILES 80
+
+struct mock_fs_entry {
+	char name[256];
+	const uint8_t *data;
+	uint64_t size;
+};
+
+struct mock_file {
+	EFI_FILE_PROTOCOL proto;
+	const struct mock_fs_entry *entry;
+	uint64_t pos;
+};
+
+static struct mock_fs_entry fs_entries[MOCK_MAX_FILES];
+static int nr_fs_entries;
+static EFI_FILE_IO_INTERFACE mock_volume;
+static struct mock_file mock_root;
+static int mock_device;
+
+void *mock_image_load(const void *data, uint64_t size, uint64_t offset,
+		      uint64_t align)
+{
+	struct mock_region *image = &regions[0];
+	uint64_t addr = (region_end(image) + offset + align - 1) & ~(align - 1);
+	uint64_t end = (addr - offset + size + EFI_PAGE_SIZE - 1) &
+		       ~(EFI_PAGE_SIZE - 1);
+
+	/* 映像是arena中的第一个区域，stub从高端分配内存，它后面保持空闲 */
+	if (image->start != arena_base ||
+	    !range_free(region_end(image),
+			(end - region_end(image)) / EFI_PAGE_SIZE)) {
+		fprintf(stderr, "mock-efi: no room for the image\n");
+		abort();
+	}
+	image->pages = (end - arena_base) / EFI_PAGE_SIZE;
+	mock_loaded_image.ImageSize = end - arena_base;
+	map_key++;
+	memcpy((void *)(addr - offset), data, size);
+	return (void *)(addr - offset);
+}
+
+void mock_fs_add(const char *name, const void *data, uint64_t size)
+{
+	struct mock_fs_entry *e;
+
+	if (nr_fs_entries == MOCK_MAX_FILES) {
+		fprintf(stderr, "mock-efi: too many files\n");
+		abort();
+	}
+	e = &fs_entries[nr_fs_entries++];
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	e->data = data;
+	e->size = size;
+}
+
+static EFI_STATUS EFIAPI mock_file_close(EFI_FILE_PROTOCOL *this)
+{
+	check_alive("File->Close");
+	if (this != &mock_root.proto)
+		free(this);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_read(EFI_FILE_PROTOCOL *this, UINTN *size,
+					VOID *buf)
+{
+	struct mock_file *f = (struct mock_file *)this;
+	uint64_t n;
+
+	check_alive("File->Read");
+	if (!f->entry)
+		return EFI_UNSUPPORTED;
+	n = f->pos >= f->entry->size ? 0 : f->entry->size - f->pos;
+	if (n > *size)
+		n = *size;
+	memcpy(buf, f->entry->data + f->pos, n);
+	f->pos += n;
+	*size = n;
+	mock_stats.file_read_calls++;
+	mock_stats.file_read_bytes += n;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_set_position(EFI_FILE_PROTOCOL *this,
+						UINT64 pos)
+{
+	struct mock_file *f = (struct mock_file *)this;
+
+	check_alive("File->SetPosition");
+	if (!f->entry || pos > f->entry->size)
+		return EFI_UNSUPPORTED;
+	f->pos = pos;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_open(EFI_FILE_PROTOCOL *this,
+					EFI_FILE_PROTOCOL **new,
+					CHAR16 *name, UINT64 mode, UINT64 attr)
+{
+	char path[256];
+	size_t i;
+
+	(void)this;
+	(void)attr;
+	check_alive("File->Open");
+	if (mode != EFI_FILE_MODE_READ)
+		return EFI_WRITE_PROTECTED;
+
+	while (*name == L'\\')
+		name++;
+	for (i = 0; name[i] && i < sizeof(path) - 1; i++)
+		path[i] = name[i] == L'\\' ? '/' : (char)name[i];
+	path[i] = 0;
+
+	for (int k = 0; k < nr_fs_entries; k++) {
+		if (strcmp(fs_entries[k].name, path))
+			continue;
+		struct mock_file *f = calloc(1, sizeof(*f));
+		f->proto = mock_root.proto;
+		f->entry = &fs_entries[k];
+		*new = &f->proto;
+		return EFI_SUCCESS;
+	}
+	return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI mock_open_volume(EFI_FILE_IO_INTERFACE *this,
+					  EFI_FILE_PROTOCOL **root)
+{
+	(void)this;
+	check_alive("OpenVolume");
+	*root = &mock_root.proto;
+	return EFI_SUCCESS;
+}
+
+/* gnu-efi的lib/hand.c中的函数，真实构建中由libefi提供 */
+EFI_FILE_HANDLE LibOpenRoot(EFI_HANDLE device)
+{
+	EFI_FILE_IO_INTERFACE *volume;
+	EFI_FILE_HANDLE root;
+	EFI_GUID guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+
+	if (BS->HandleProtocol(device, &guid, (void **)&volume) != EFI_SUCCESS)
+		return NULL;
+	if (volume->OpenVolume(volume, &root) != EFI_SUCCESS)
+		return NULL;
+	return root;
+}
+
+EFI_FILE_INFO *LibFileInfo(EFI_FILE_HANDLE fh)
+{
+	struct mock_file *f = (struct mock_file *)fh;
+	EFI_FILE_INFO *info;
+
+	if (BS->AllocatePool(EfiBootServicesData, sizeof(*info) + 256,
+			     (void **)&info) != EFI_SUCCESS)
+		return NULL;
+	memset(info, 0, sizeof(*info));
+	info->Size = sizeof(*info);
+	info->FileSize = f->entry ? f->entry->size : 0;
+	info->PhysicalSize = info->FileSize;
+	return info;
+}
+
+/* LINUX_EFI_INITRD_MEDIA_GUID设备路径上的LoadFile2协议 */
+static const void *mock_initrd_data;
+static uint64_t mock_initrd_size;
+static char mock_initrd_device;
+static EFI_LOAD_FILE_PROTOCOL mock_lf2;
+static const EFI_GUID mock_lf2_guid = { 0x4006c0c1, 0xfcb3, 0x403e,
+					{ 0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24,
+					  0xe0, 0x6d } };
+static const EFI_GUID mock_initrd_media_guid = {
+	0x5568e427, 0x68fc, 0x4f3d,
+	{ 0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68 }
+};
+
+void mock_initrd_set(const void *data, uint64_t size)
+{
+	mock_initrd_data = data;
+	mock_initrd_size = size;
+}
+
+static EFI_STATUS EFIAPI mock_load_file2(EFI_LOAD_FILE_PROTOCOL *this,
+					 EFI_DEVICE_PATH *path, BOOLEAN boot,
+					 UINTN *size, VOID *buf)
+{
+	(void)this;
+	(void)path;
+	check_alive("LoadFile2");
+	if (boot)
+		return EFI_UNSUPPORTED;
+	if (!buf || *size < mock_initrd_size) {
+		*size = mock_initrd_size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	memcpy(buf, mock_initrd_data, mock_initrd_size);
+	*size = mock_initrd_size;
+	mock_stats.file_read_calls++;
+	mock_stats.file_read_bytes += mock_initrd_size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_locate_device_path(EFI_GUID *protocol,
+						 EFI_DEVICE_PATH **path,
+						 EFI_HANDLE *device)
+{
+	const uint8_t *dp = (const uint8_t *)*path;
+
+	check_alive("LocateDevicePath");
+	if (!mock_initrd_data || memcmp(protocol, &mock_lf2_guid, 16) ||
+	    dp[0] != 4 || dp[1] != 3 ||
+	    memcmp(dp + 4, &mock_initrd_media_guid, 16))
+		return EFI_NOT_FOUND;
+	/* 指向剩下的（结尾）节点 */
+	*path = (EFI_DEVICE_PATH *)(dp + (dp[2] | dp[3] << 8));
+	*device = &mock_initrd_device;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_handle_protocol(EFI_HANDLE handle,
+					      EFI_GUID *protocol,
+					      VOID **interface)
+{
+	EFI_GUID loaded_image = LOADED_IMAGE_PROTOCOL;
+
+	check_alive("HandleProtocol");
+	if (handle == mock_image_handle &&
+	    !memcmp(protocol, &loaded_image, sizeof(*protocol))) {
+		*interface = &mock_loaded_image;
+		return EFI_SUCCESS;
+	}
+	EFI_GUID fs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+	if (handle == &mock_device &&
+	    !memcmp(protocol, &fs_guid, sizeof(*protocol))) {
+		*interface = &mock_volume;
+		return EFI_SUCCESS;
+	}
+	if (handle == &mock_initrd_device &&
+	    !memcmp(protocol, &mock_lf2_guid, sizeof(*protocol))) {
+		*interface = &mock_lf2;
+		return EFI_SUCCESS;
+	}
+	*interface = NULL;
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_output_string(SIMPLE_TEXT_OUTPUT_INTERFACE *this,
+					    CHAR16 *str)
+{
+	(void)this;
+	check_alive("ConOut->OutputString");
+	/* 有的固件输出时会分配内存（比如滚屏），内存映射随之改变 */
+	map_key++;
+	for (; *str; str++) {
+		mock_stats.console_chars++;
+		if (config.console && *str != '\r')
+			putchar(*str < 0x80 ? (char)*str : '?');
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_get_variable(CHAR16 *name, EFI_GUID *vendor,
+					   UINT32 *attr, UINTN *size,
+					   VOID *data)
+{
+	(void)name;
+	(void)vendor;
+	(void)attr;
+	(void)size;
+	(void)data;
+	return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI mock_set_virtual_address_map(
+	UINTN size, UINTN desc_size, UINT32 desc_ver,
+	EFI_MEMORY_DESCRIPTOR *map)
+{
+	(void)size;
+	(void)desc_size;
+	(void)desc_ver;
+	(void)map;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_unsupported(void)
+{
+	return EFI_UNSUPPORTED;
+}
+
+void mock_efi_reset(void)
+{
+	nr_regions = 0;
+	map_key = 1;
+	exited = false;
+	memset(&mock_stats, 0, sizeof(mock_stats));
+	system_table.NumberOfTableEntries = 0;
+
+	if (config.fdt) {
+		EFI_GUID dt_guid = { 0xb1b621d5,
+				     0xf19c,
+				     0x41a5,
+				     { 0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa,
+				       0xe0 } };
+
+		config_tables[0].VendorGuid = dt_guid;
+		config_tables[0].VendorTable = config.fdt;
+		system_table.NumberOfTableEntries = 1;
+	}
+
+	/* 模拟DragonStub自己的镜像所占用的内存 */
+	insert_region(arena_base, 16, EfiLoaderCode, EFI_MEMORY_WB);
+
+	if (config.fdt && config.fdt_pad) {
+		const uint8_t *hdr = config.fdt;
+		uint32_t size = (uint32_t)hdr[4] << 24 | hdr[5] << 16 |
+				hdr[6] << 8 | hdr[7];
+		uint32_t total = size + config.fdt_pad;
+		uint64_t pages = (total + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE;
+		uint64_t addr;
+		uint8_t *copy;
+
+		if (!find_top_down(pages, UINT64_MAX, &addr)) {
+			fprintf(stderr, "no room for the DTB\n");
+			exit(1);
+		}
+		insert_region(addr, pages, EfiACPIReclaimMemory, EFI_MEMORY_WB);
+		copy = (uint8_t *)addr;
+		memcpy(copy, config.fdt, size);
+		memset(copy + size, 0, config.fdt_pad);
+		copy[4] = total >> 24;
+		copy[5] = total >> 16;
+		copy[6] = total >> 8;
+		copy[7] = total;
+		config_tables[0].VendorTable = copy;
+	}
+	fw_fdt = config.fdt ? config_tables[0].VendorTable : NULL;
+	mock_loaded_image.ImageBase = (void *)arena_base;
+	mock_loaded_image.ImageSize = 16 * EFI_PAGE_SIZE;
+	mock_stats.allocate_pages_calls = 0;
+}
+
+void mock_efi_init(const struct mock_config *cfg)
+{
+	config = *cfg;
+	if (!config.mem_size)
+		config.mem_size = 4ull << 30;
+
+	/* 多留2MB用于对齐 */
+	arena = mmap(NULL, config.mem_size + (2 << 20), PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	arena_base = ((uint64_t)arena + (2 << 20) - 1) & ~((uint64_t)(2 << 20) - 1);
+	arena_pages = config.mem_size / EFI_PAGE_SIZE;
+	/* 用垃圾数据填满内存，既能发现漏掉的清零，也能提前触发缺页 */
+	if (config.dirty)
+		memset((void *)arena_base, 0xa5, config.mem_size);
+
+	con_out.OutputString = (void *)mock_output_string;
+
+	mock_volume.OpenVolume = mock_open_volume;
+	mock_root.proto.Open = mock_file_open;
+	mock_root.proto.Close = mock_file_close;
+	mock_root.proto.Read = mock_file_read;
+	mock_root.proto.SetPosition = mock_file_set_position;
+	mock_loaded_image.DeviceHandle = &mock_device;
+	mock_lf2.LoadFile = mock_load_file2;
+
+	boot_services.AllocatePages = mock_allocate_pages;
+	boot_services.FreePages = mock_free_pages;
+	boot_services.GetMemoryMap = mock_get_memory_map;
+	boot_services.AllocatePool = mock_allocate_pool;
+	boot_services.FreePool = mock_free_pool;
+	boot_services.InstallConfigurationTable =
+		mock_install_configuration_table;
+	boot_services.ExitBootServices = mock_exit_boot_services;
+	boot_services.Stall = mock_stall;
+	boot_services.LocateProtocol = mock_locate_protocol;
+	boot_services.HandleProtocol = mock_handle_protocol;
+	boot_services.LocateDevicePath = mock_locate_device_path;
+	boot_services.LocateHandleBuffer = (void *)mock_unsupported;
+	boot_services.OpenProtocol = (void *)mock_unsupported;
+
+	runtime_services.GetVariable = mock_get_variable;
+	runtime_services.SetVirtualAddressMap = mock_set_virtual_address_map;
+
+	system_table.ConOut = &con_out;
+	system_table.BootServices = &boot_services;
+	system_table.RuntimeServices = &runtime_services;
+	system_table.ConfigurationTable = config_tables;
+
+	ST = &system_table;
+	BS = &boot_services;
+	RT = &runtime_services;
+
+	mock_efi_reset();
+}
+
+bool mock_efi_exited(void)
+{
+	return exited;
+}
+
+const void *mock_efi_fdt(void)
+{
+	return fw_fdt;
+}
+
+uint64_t mock_mem_base(void)
+{
+	return arena_base;
+}
+
+uint64_t mock_efi_allocated_pages(void)
+{
+	uint64_t pages = 0;
+
+	for (uint32_t i = 0; i < nr_regions; i++)
+		pages += regions[i].pages;
+	return pages;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+/*
+ * 在Linux上模拟EFI Boot Services，用于在宿主机上运行DragonStub的加载器代码。
+ *
+ * "物理地址"就是宿主进程中一块mmap出来的arena里的地址，因此被测试的代码可以
+ * 直接对分配到的内存进行读写。
+ */
+
+#include <efi.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct mock_stats {
+	uint64_t allocate_pages_calls;
+	uint64_t allocate_pages_bytes;
+	uint64_t free_pages_calls;
+	uint64_t allocate_pool_calls;
+	uint64_t allocate_pool_bytes;
+	uint64_t free_pool_calls;
+	uint64_t get_memory_map_calls;
+	uint64_t install_config_table_calls;
+	uint64_t exit_boot_services_calls;
+	uint64_t console_chars;
+	uint64_t file_read_calls;
+	uint64_t file_read_bytes;
+	uint64_t locate_protocol_calls;
+	/// @brief TCG2 HashLogExtendEvent()的调用次数和固件需要计算摘要的字节数
+	uint64_t tcg2_extend_calls;
+	uint64_t tcg2_extend_bytes;
+};
+
+struct mock_config {
+	/// @brief 模拟的物理内存大小
+	uint64_t mem_size;
+	/// @brief 额外伪造的固件内存描述符数量，用来模拟大机器上的内存映射
+	uint32_t fw_descs;
+	/// @brief 是否把控制台输出打印到stdout
+	bool console;
+	/// @brief 是否在初始化时用垃圾数据填满内存
+	bool dirty;
+	/// @brief 传给加载器的DTB（可以为NULL）
+	void *fdt;
+	/// @brief 不为0时像U-Boot那样把DTB复制到模拟内存中（EfiACPIReclaimMemory），
+	/// 并在totalsize中留出这么多字节的空闲空间
+	uint32_t fdt_pad;
+	/// @brief 是否提供TCG2 protocol（只记录调用，不做真正的度量）
+	bool tcg2;
+	/// @brief 模拟的核数（包括启动核），大于1时可以通过SBI HSM启动辅助核
+	uint32_t cpus;
+};
+
+extern struct mock_stats mock_stats;
+
+/// @brief 初始化模拟固件，设置ST/BS/RT
+void mock_efi_init(const struct mock_config *cfg);
+
+/// @brief 释放所有分配，恢复到初始状态（不重新mmap）
+void mock_efi_reset(void);
+
+/// @brief ExitBootServices()是否已经被成功调用
+bool mock_efi_exited(void);
+
+/// @brief 固件通过配置表提供的DTB（-P时是复制到模拟内存中的那一份）
+const void *mock_efi_fdt(void);
+
+/// @brief 模拟的物理内存的起始地址（2MB对齐）
+uint64_t mock_mem_base(void);
+
+/// @brief 当前被分配出去的页数
+uint64_t mock_efi_allocated_pages(void);
+
+/// @brief 单调时钟，单位为纳秒
+uint64_t mock_now_ns(void);
+
+/**
+ * mock_image_load() - 把数据追加到模拟的DragonStub映像的末尾
+ * @offset:	数据中的这个偏移处会被放到@align对齐的地址上
+ *
+ * 映像占用的内存（EfiLoaderCode）扩大到数据之后的页边界，后面的内存是空闲的，
+ * 相当于链接在映像末尾的.payload节。返回数据被放到的地址。
+ */
+void *mock_image_load(const void *data, uint64_t size, uint64_t offset,
+		      uint64_t align);
+
+/// @brief 在模拟的启动卷上添加一个文件（路径用'/'分隔，不以'/'开头）
+void mock_fs_add(const char *name, const void *data, uint64_t size);
+
+/// @brief 通过LINUX_EFI_INITRD_MEDIA_GUID设备路径提供initrd（NULL表示不提供）
+void mock_initrd_set(const void *data, uint64_t size);
+
+/// @brief 可以启动的辅助核的数量
+unsigned int mock_secondary_cpus(void);
+
+/// @brief 启动一个辅助核（宿主机上的线程）运行@fn(@arg)，@fn返回时核停下
+bool mock_cpu_start(void (*fn)(void *), void *arg);
+
+/// @brief 辅助核自旋等待时让出宿主机的CPU
+void mock_cpu_relax(void);
+
+extern EFI_LOADED_IMAGE mock_loaded_image;
+extern EFI_HANDLE mock_image_handle;
@@ -0,0 +1,650 @@
+/*
+ * DragonStub加载器的宿主机benchmark
+ *
+ * 生成有很多PT_LOAD段的ELF负载，在模拟的固件上运行从寻找负载到跳转到内核的
+ * 整个流程，检查加载结果，并输出各阶段的耗时和固件调用次数。
+ * 每种情况在单独的子进程中运行，这样stub的全局状态不会互相影响。
+ */
+
+#include "efi_mock.h"
+#include "hostbench.h"
+
+#include <elf.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define KERNEL_PADDR 0x200000ull
+/* -X时内核链接在模拟内存中的这个偏移处，stub可以把它放在链接时的地址 */
+#define KERNEL_EXACT_OFFSET (32ull << 20)
+#define KERNEL_VADDR 0xffffffc000200000ull
+/* 生成的DTB中每个设备节点最多占用的字节数 */
+#define FDT_DEVICE_SIZE 256
+/* 生成的每个overlay最多占用的字节数 */
+#define DTBO_SIZE 1024
+
+enum mode {
+	/// @brief 负载在内存中（相当于链接在stub中的.payload段）
+	MODE_MEM,
+	/// @brief 先用lz4命令压缩，再从内存中加载
+	MODE_LZ4,
+	/// @brief 通过kernel=从模拟的启动卷上加载
+	MODE_FILE,
+	/// @brief 按make PAYLOAD_INPLACE=1的方式放在映像末尾，原地运行
+	MODE_INPLACE,
+	MODE_MAX,
+};
+
+static const char *const mode_names[] = { "mem", "lz4", "file", "inplace" };
+
+struct options {
+	enum mode mode;
+	int nsegs;
+	int fdt_devices;
+	unsigned int fw_descs;
+	/// @brief 固件DTB中留出的空闲空间（stub仍然要复制它，不能原地修改）
+	unsigned int fdt_pad;
+	/// @brief 用efi=fdtrebuild启动，遍历一次FDT来重建
+	bool fdt_rebuild;
+	/// @brief 用efi=fdtprune启动，另外用fdtprune=删除第一个设备
+	bool fdt_prune;
+	/// @brief 用dtbo=从模拟的启动卷上加载并应用的overlay数
+	int overlays;
+	/// @brief 固件不提供DTB，用dtb=从模拟的启动卷上加载
+	bool dtb_file;
+	/// @brief MODE_INPLACE：段的内容所在位置的对齐（相当于PAYLOAD_ALIGN）
+	uint64_t inplace_align;
+	/// @brief 加载时校验各个段的SHA-256（相当于make PAYLOAD_VERIFY=1）
+	bool verify_digest;
+	/// @brief 提供TCG2 protocol，让stub度量内核和FDT
+	bool tcg2;
+	/// @brief 最后一个段之前的物理地址空洞，以及是否用efi=sparse分别加载
+	uint64_t gap;
+	bool sparse;
+	/// @brief 把内核链接到模拟内存中空闲的地址，测试放在链接时地址的情况
+	bool exact;
+	/// @brief 用efi=mmu启动，检查stub建立的页表
+	bool mmu;
+	/// @brief 模拟的核数，大于1时用efi=smp启动
+	unsigned int cpus;
+	bool verbose;
+};
+
+/**
+ * 生成一个有@nsegs个PT_LOAD段的ELF，总大小约为@total字节
+ *
+ * 各段的filesz和memsz略有不同（带有BSS），段之间有时留有空洞，和真实内核
+ * 的布局类似。@text为真时用类似汇编文本的数据填充，便于压缩。
+ * 最后一个段之前再空出@gap字节，模拟放在远处的per-CPU或者早期启动的段。
+ */
+static uint8_t *make_elf(uint64_t total, int nsegs, bool text, uint64_t gap,
+			 uint64_t link_paddr, uint64_t *ret_size)
+{
+	uint64_t seg = total / nsegs;
+	/* ELF头和程序头表占用的空间，按页对齐 */
+	uint64_t hdr = (sizeof(Elf64_Ehdr) + nsegs * sizeof(Elf64_Phdr) +
+			4095) & ~4095ull;
+	uint64_t size = hdr + (uint64_t)nsegs * seg;
+	uint64_t paddr = link_paddr, vaddr = KERNEL_VADDR;
+	static const char asm_text[] = "addi a0, a0, 1\nld t0, 8(sp)\n";
+	uint8_t *buf;
+	Elf64_Ehdr *eh;
+	Elf64_Phdr *ph;
+
+	buf = calloc(1, size);
+	if (!buf) {
+		perror("calloc");
+		exit(2);
+	}
+
+	eh = (Elf64_Ehdr *)buf;
+	memcpy(eh->e_ident, ELFMAG, SELFMAG);
+	eh->e_ident[EI_CLASS] = ELFCLASS64;
+	eh->e_ident[EI_DATA] = ELFDATA2LSB;
+	eh->e_ident[EI_VERSION] = EV_CURRENT;
+	eh->e_type = ET_EXEC;
+	eh->e_machine = EM_RISCV;
+	eh->e_version = EV_CURRENT;
+	eh->e_entry = KERNEL_VADDR + 0x40;
+	eh->e_phoff = sizeof(*eh);
+	eh->e_ehsize = sizeof(*eh);
+	eh->e_phentsize = sizeof(*ph);
+	eh->e_phnum = nsegs;
+
+	ph = (Elf64_Phdr *)(buf + eh->e_phoff);
+	for (int i = 0; i < nsegs; i++) {
+		uint64_t off = hdr + i * seg;
+		uint64_t filesz = seg - (i % 3) * 1000;
+		uint64_t adv;
+
+		if (i == nsegs - 1 && i > 0) {
+			paddr += gap;
+			vaddr += gap;
+		}
+		ph[i].p_type = PT_LOAD;
+		ph[i].p_offset = off;
+		ph[i].p_filesz = filesz;
+		ph[i].p_memsz = seg + (i % 2) * 8192;
+		ph[i].p_paddr = paddr;
+		ph[i].p_vaddr = vaddr;
+		ph[i].p_align = 4096;
+
+		if (text) {
+			for (uint64_t j = 0; j < filesz; j++)
+				buf[off + j] = asm_text[(j * 7 + (j >> 12)) %
+							(sizeof(asm_text) - 1)] ^
+					       (j % 4093 == 0);
+		} else {
+			for (uint64_t j = 0; j + 8 <= filesz; j += 8)
+				*(uint64_t *)(buf + off + j) =
+					off + j * 2654435761ull;
+		}
+
+		adv = (ph[i].p_memsz + 4095 + (i % 4 == 1 ? 65536 : 0)) &
+		      ~4095ull;
+		paddr += adv;
+		vaddr += adv;
+	}
+
+	*ret_size = size;
+	return buf;
+}
+
+/**
+ * 检查每个段的数据都被复制了，BSS都被清零了
+ *
+ * 段的位置取自stub安装的配置表。不是稀疏加载时，它们必须保持链接时的布局。
+ */
+static int verify(const uint8_t *elf, uint64_t loaded, bool sparse)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)elf;
+	const Elf64_Phdr *ph = (const Elf64_Phdr *)(elf + eh->e_phoff);
+	uint64_t link_paddr = ph[0].p_paddr;
+
+	if (hostbench_nr_segments() != eh->e_phnum) {
+		fprintf(stderr, "%u segments in the configuration table, expected %u\n",
+			hostbench_nr_segments(), eh->e_phnum);
+		return -1;
+	}
+	for (int i = 0; i < eh->e_phnum; i++) {
+		uint64_t paddr = hostbench_segment_paddr(i);
+		const uint8_t *d = (const uint8_t *)paddr;
+
+		if (!sparse && paddr != loaded + ph[i].p_paddr - link_paddr) {
+			fprintf(stderr, "segment %d: placed at %#llx\n", i,
+				(unsigned long long)paddr);
+			return -1;
+		}
+
+		if (memcmp(d, elf + ph[i].p_offset, ph[i].p_filesz)) {
+			fprintf(stderr, "segment %d: data mismatch\n", i);
+			return -1;
+		}
+		for (uint64_t j = ph[i].p_filesz; j < ph[i].p_memsz; j++) {
+			if (d[j]) {
+				fprintf(stderr, "segment %d: bss not zeroed\n",
+					i);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * convert_payload() - 用外部命令转换负载
+ * @cmd_fmt:	命令，其中的两个%s依次是输入文件和输出文件
+ */
+static uint8_t *convert_payload(const uint8_t *data, uint64_t size,
+				const char *cmd_fmt, uint64_t *ret_size)
+{
+	char in[] = "/tmp/hostbench-XXXXXX";
+	char out[sizeof(in) + 4], cmd[512];
+	uint8_t *buf = NULL;
+	FILE *f;
+	long n;
+	int fd;
+
+	fd = mkstemp(in);
+	if (fd < 0 || write(fd, data, size) != (ssize_t)size) {
+		perror("write");
+		exit(2);
+	}
+	close(fd);
+	snprintf(out, sizeof(out), "%s.out", in);
+	snprintf(cmd, sizeof(cmd), cmd_fmt, in, out);
+	if (system(cmd)) {
+		fprintf(stderr, "'%s' failed\n", cmd);
+		unlink(in);
+		exit(2);
+	}
+	unlink(in);
+
+	f = fopen(out, "rb");
+	if (!f) {
+		perror(out);
+		exit(2);
+	}
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(n);
+	if (!buf || fread(buf, 1, n, f) != (size_t)n) {
+		perror(out);
+		exit(2);
+	}
+	fclose(f);
+	unlink(out);
+
+	*ret_size = n;
+	return buf;
+}
+
+/// @brief 用PATH中的lz4命令压缩负载
+static uint8_t *lz4_compress(const uint8_t *data, uint64_t size,
+			     uint64_t *ret_size)
+{
+	return convert_payload(
+		data, size,
+		"lz4 -q -9 -B6 --content-size --no-frame-crc -f %s %s",
+		ret_size);
+}
+
+/// @brief 用tools/payload-inplace.py把负载排布成可以原地运行的形式
+static uint8_t *inplace_layout(const uint8_t *data, uint64_t size,
+			       uint64_t align, uint64_t *ret_size)
+{
+	char cmd_fmt[512];
+
+	snprintf(cmd_fmt, sizeof(cmd_fmt),
+		 "python3 %s --align %llu %%s %%s /dev/null",
+		 PAYLOAD_INPLACE_TOOL, (unsigned long long)align);
+	return convert_payload(data, size, cmd_fmt, ret_size);
+}
+
+/// @brief 用tools/payload-digest.py计算各个段的SHA-256，与编译时的做法相同
+static void payload_digest(const uint8_t *elf, uint64_t size,
+			   unsigned char digest[32])
+{
+	char in[] = "/tmp/hostbench-XXXXXX";
+	char out[sizeof(in) + 7], cmd[512];
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(in);
+	if (fd < 0 || write(fd, elf, size) != (ssize_t)size) {
+		perror("write");
+		exit(2);
+	}
+	close(fd);
+	snprintf(out, sizeof(out), "%s.sha256", in);
+	snprintf(cmd, sizeof(cmd), "python3 %s %s %s", PAYLOAD_DIGEST_TOOL, in,
+		 out);
+	if (system(cmd)) {
+		fprintf(stderr, "'%s' failed\n", cmd);
+		unlink(in);
+		exit(2);
+	}
+	unlink(in);
+
+	f = fopen(out, "rb");
+	if (!f || fread(digest, 1, 32, f) != 32) {
+		perror(out);
+		exit(2);
+	}
+	fclose(f);
+	unlink(out);
+}
+
+static int run_one(uint64_t total, const struct options *opts)
+{
+	static uint8_t *fdt;
+	static size_t fdt_buf_size;
+	struct mock_config cfg = {
+		/* 内核本身，加上FDT、内存映射等，再留出一些余量 */
+		.mem_size = ((total + total / 4 + (64 << 20)) + (2 << 20) - 1) &
+			    ~((2ull << 20) - 1),
+		.fw_descs = opts->fw_descs,
+		.console = opts->verbose,
+		.dirty = true,
+		.tcg2 = opts->tcg2,
+		.fdt_pad = opts->fdt_pad,
+		.cpus = opts->cpus,
+	};
+	static uint8_t dtbos[HOSTBENCH_MAX_OVERLAYS][DTBO_SIZE];
+	char cmdline[1024], dtbo_args[1024] = "";
+	struct hostbench_result res;
+	unsigned char digest[32];
+	uint64_t elf_size, payload_size;
+	uint8_t *elf, *payload;
+	unsigned int nr_raw, nr_entries;
+	uint32_t fdt_total;
+	const char *err_msg;
+	int err;
+
+	if (fdt_buf_size < (size_t)opts->fdt_devices * FDT_DEVICE_SIZE + 4096) {
+		free(fdt);
+		fdt_buf_size = (size_t)opts->fdt_devices * FDT_DEVICE_SIZE + 4096;
+		fdt = malloc(fdt_buf_size);
+	}
+	cfg.fdt = opts->dtb_file ? NULL : fdt;
+	err = hostbench_make_fdt(fdt, fdt_buf_size, opts->fdt_devices);
+	if (err) {
+		fprintf(stderr, "failed to build the FDT: %d\n", err);
+		return -1;
+	}
+
+	/* 不是稀疏加载时空洞也要分配，原地运行时空洞就在映像中 */
+	if (!opts->sparse || opts->mode == MODE_INPLACE)
+		cfg.mem_size += opts->gap;
+	mock_efi_init(&cfg);
+
+	elf = make_elf(total, opts->nsegs, opts->mode == MODE_LZ4, opts->gap,
+		       opts->exact ? mock_mem_base() + KERNEL_EXACT_OFFSET :
+				     KERNEL_PADDR,
+		       &elf_size);
+	payload = elf;
+	payload_size = elf_size;
+	if (opts->mode == MODE_INPLACE)
+		payload = inplace_layout(elf, elf_size, opts->inplace_align,
+					 &payload_size);
+	/* 原地运行时程序头已经被改写，摘要按重新排布后的ELF文件计算 */
+	if (opts->verify_digest)
+		payload_digest(payload, payload_size, digest);
+	if (opts->mode == MODE_LZ4)
+		payload = lz4_compress(elf, elf_size, &payload_size);
+
+	if (opts->mode == MODE_INPLACE) {
+		/* 第一个段（p_paddr最小）的内容从对齐的地址开始 */
+		const Elf64_Ehdr *eh = (const Elf64_Ehdr *)payload;
+		const Elf64_Phdr *ph =
+			(const Elf64_Phdr *)(payload + eh->e_phoff);
+
+		payload = mock_image_load(payload, payload_size, ph->p_offset,
+					  opts->inplace_align);
+	}
+	if (opts->mode == MODE_FILE)
+		mock_fs_add("EFI/DragonOS/kernel.elf", elf, elf_size);
+	/* FDT头中的totalsize是大端的 */
+	fdt_total = (uint32_t)fdt[4] << 24 | fdt[5] << 16 | fdt[6] << 8 |
+		    fdt[7];
+	if (opts->dtb_file)
+		mock_fs_add("board.dtb", fdt, fdt_total);
+	for (int k = 0, len = 0; k < opts->overlays; k++) {
+		char name[16];
+
+		err = hostbench_make_dtbo(dtbos[k], DTBO_SIZE, k);
+		if (err < 0) {
+			fprintf(stderr, "failed to build overlay %d: %d\n", k,
+				err);
+			return -1;
+		}
+		snprintf(name, sizeof(name), "%d.dtbo", k);
+		mock_fs_add(name, dtbos[k], err);
+		len += snprintf(dtbo_args + len, sizeof(dtbo_args) - len,
+				" dtbo=%s", name);
+	}
+	snprintf(cmdline, sizeof(cmdline),
+		 "console=ttyS0 root=/dev/vda%s%s%s%s%s%s%s%s",
+		 opts->mode == MODE_FILE ? " kernel=/EFI/DragonOS/kernel.elf" :
+					   "",
+		 opts->sparse ? " efi=sparse" : "", opts->mmu ? " efi=mmu" : "",
+		 opts->cpus > 1 ? " efi=smp" : "", opts->fdt_rebuild ? " efi=fdtrebuild" : "",
+		 opts->fdt_prune ?
+			 " efi=fdtprune fdtprune=/soc/device@10000000" :
+			 "",
+		 opts->dtb_file ? " dtb=board.dtb" : "", dtbo_args);
+
+	hostbench_boot(cmdline, payload, payload_size,
+		       opts->verify_digest ? digest : NULL,
+		       opts->mode == MODE_INPLACE ? opts->inplace_align : 0,
+		       &res);
+	if (res.status) {
+		fprintf(stderr, "boot failed: %#llx\n", res.status);
+		return -1;
+	}
+	if (!mock_efi_exited()) {
+		fprintf(stderr, "ExitBootServices() was not called\n");
+		return -1;
+	}
+	/* 获取内存映射之后stub不应该再改变它（比如输出到控制台） */
+	if (res.ebs_attempts != 1) {
+		fprintf(stderr, "ExitBootServices() called %u times\n",
+			res.ebs_attempts);
+		return -1;
+	}
+	if (verify(elf, res.loaded_paddr, opts->sparse))
+		return -1;
+	/* 固件的DTB要复制一份再修改，原来的树不能变（跳过totalsize） */
+	if (cfg.fdt) {
+		const uint8_t *fw = mock_efi_fdt();
+
+		if (res.fdt_addr == (uintptr_t)fw ||
+		    memcmp(fw + 8, fdt + 8, fdt_total - 8)) {
+			fprintf(stderr, "the firmware's DTB was modified\n");
+			return -1;
+		}
+	}
+	err_msg = hostbench_check_fdt(cmdline, opts->fdt_devices,
+				      opts->fdt_prune, opts->overlays);
+	if (err_msg) {
+		fprintf(stderr, "FDT: %s\n", err_msg);
+		return -1;
+	}
+	err_msg = hostbench_check_memmap(&nr_raw, &nr_entries);
+	if (err_msg) {
+		fprintf(stderr, "compact memory map: %s\n", err_msg);
+		return -1;
+	}
+	if (opts->verbose)
+		printf("compact memory map: %u descriptors merged into %u entries\n",
+		       nr_raw, nr_entries);
+	if (opts->mmu) {
+		const char *err = hostbench_check_pgtable();
+
+		if (err) {
+			fprintf(stderr, "page tables: %s\n", err);
+			return -1;
+		}
+	}
+
+	printf("%8llu %5d %7s%c %9.3f %8.1f %8.1f %7llu %8.1f %8.1f %3u %6llu %6llu %5llu %6llu %6llu %5llu %8llu %7.1f %5u\n",
+	       (unsigned long long)(total >> 10), opts->nsegs,
+	       mode_names[opts->mode], opts->verify_digest ? 'V' : ' ',
+	       res.load_ns / 1e6,
+	       total / 1e6 / (res.load_ns / 1e9), res.fdt_ns / 1e3,
+	       res.fdt_size, res.memmap_ns / 1e3, res.total_ns / 1e6,
+	       res.ebs_attempts,
+	       (unsigned long long)mock_stats.allocate_pages_calls,
+	       (unsigned long long)mock_stats.allocate_pool_calls,
+	       (unsigned long long)mock_stats.get_memory_map_calls,
+	       (unsigned long long)mock_stats.file_read_calls,
+	       (unsigned long long)mock_stats.locate_protocol_calls,
+	       (unsigned long long)mock_stats.tcg2_extend_bytes,
+	       (unsigned long long)(mock_stats.allocate_pages_bytes >> 10),
+	       res.pgtable_ns / 1e3, res.pgtable_pages);
+	return 0;
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		v <<= 10;
+		/* fallthrough */
+	case 'm':
+	case 'M':
+		v <<= 10;
+		/* fallthrough */
+	case 'k':
+	case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+static int check_crc(void)
+{
+	unsigned int nr_cases, ext;
+	const char *err = hostbench_check_crc(&nr_cases, &ext);
+
+	printf("crc32: %u cases, extensions %#x: %s\n", nr_cases, ext,
+	       err ? err : "ok");
+	return err ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s size[K|M|G]]... [-n nsegs] [-m mem|lz4|file|inplace]\n"
+		"          [-a align] [-d fdt_devices] [-f fw_descs] [-g gap] [-P pad] [-H harts] [-o overlays] [-C] [-D] [-W] [-p] [-S] [-X] [-M] [-V] [-T] [-v]\n"
+		"\n"
+		"Without -s, payloads from 1M to 1G are benchmarked.\n"
+		"-V verifies the SHA-256 of the segments while loading them.\n"
+		"-T provides a TCG2 protocol, so the kernel and the FDT are measured.\n"
+		"-g leaves a physical gap before the last segment, -S loads with efi=sparse.\n"
+		"-X links the kernel at a free address, so it can be loaded there.\n"
+		"-M boots with efi=mmu and checks the page tables built by the stub.\n"
+		"-P puts the firmware DTB in memory with pad bytes of free space, like U-Boot;\n"
+		"   the stub must still copy it rather than edit it in place.\n"
+		"-D loads the DTB with dtb= from the boot volume instead of the firmware.\n"
+		"-W boots with efi=fdtrebuild, rebuilding the FDT in one pass with fdt_sw.\n"
+		"-p boots with efi=fdtprune and prunes the first device with fdtprune=.\n"
+		"-o applies that many device tree overlays (at most 64) with dtbo=;\n"
+		"   overlay k targets device 8k+3, so -d must be larger than 8 * overlays.\n"
+		"-H boots with efi=smp on that many simulated harts (threads).\n"
+		"-C checks CalculateCrc()/UpdateCrc() against a bitwise CRC32 and exits.\n"
+		"-a sets the alignment of the inplace payload (default 2M).\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static const uint64_t default_sizes[] = { 1 << 20,   4 << 20,
+						  16 << 20,  64 << 20,
+						  256 << 20, 1024 << 20 };
+	struct options opts = { .mode = MODE_MEM, .nsegs = 64,
+				.fdt_devices = 256, .inplace_align = 2 << 20 };
+	uint64_t sizes[32];
+	int nr_sizes = 0, failed = 0, opt;
+
+	while ((opt = getopt(argc, argv, "s:n:m:a:d:f:g:P:H:o:CDSWpXMVTv")) != -1) {
+		switch (opt) {
+		case 's':
+			if (nr_sizes == 32)
+				usage(argv[0]);
+			sizes[nr_sizes++] = parse_size(optarg);
+			break;
+		case 'n':
+			opts.nsegs = atoi(optarg);
+			break;
+		case 'm':
+			for (opts.mode = 0; opts.mode < MODE_MAX; opts.mode++)
+				if (!strcmp(optarg, mode_names[opts.mode]))
+					break;
+			if (opts.mode == MODE_MAX)
+				usage(argv[0]);
+			break;
+		case 'a':
+			opts.inplace_align = parse_size(optarg);
+			break;
+		case 'd':
+			opts.fdt_devices = atoi(optarg);
+			break;
+		case 'f':
+			opts.fw_descs = atoi(optarg);
+			break;
+		case 'W':
+			opts.fdt_rebuild = true;
+			break;
+		case 'p':
+			opts.fdt_prune = true;
+			break;
+		case 'o':
+			opts.overlays = atoi(optarg);
+			break;
+		case 'D':
+			opts.dtb_file = true;
+			break;
+		case 'P':
+			opts.fdt_pad = parse_size(optarg);
+			break;
+		case 'V':
+			opts.verify_digest = true;
+			break;
+		case 'g':
+			opts.gap = parse_size(optarg);
+			break;
+		case 'H':
+			opts.cpus = atoi(optarg);
+			break;
+		case 'S':
+			opts.sparse = true;
+			break;
+		case 'X':
+			opts.exact = true;
+			break;
+		case 'M':
+			opts.mmu = true;
+			break;
+		case 'T':
+			opts.tcg2 = true;
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		case 'C':
+			return check_crc();
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.nsegs < 1 || opts.overlays < 0 ||
+	    opts.overlays > HOSTBENCH_MAX_OVERLAYS ||
+	    (opts.overlays && opts.fdt_devices <= 8 * opts.overlays) ||
+	    (opts.dtb_file && opts.fdt_pad))
+		usage(argv[0]);
+	if (!nr_sizes) {
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+		nr_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	}
+
+	printf("# load: load_elf() (mode V: including SHA-256 verification); fdt: update_fdt(); memmap: final GetMemoryMap();\n"
+	       "# total: efi_stub_common() to the kernel jump; ebs: ExitBootServices() attempts;\n"
+	       "# pages/pool/mmap/reads/locate: AllocatePages/AllocatePool/GetMemoryMap/File->Read/LocateProtocol calls\n"
+	       "# tpm: bytes the firmware hashed in HashLogExtendEvent() (with -T); alloc(K): memory allocated with AllocatePages\n"
+	       "# pt(us)/ptpg: time to build the kernel's page tables and table pages used (with -M)\n");
+	printf("%8s %5s %8s %9s %8s %8s %7s %8s %8s %3s %6s %6s %5s %6s %6s %5s %8s %7s %5s\n",
+	       "size(K)", "segs", "mode", "load(ms)", "MB/s", "fdt(us)",
+	       "fdtsize", "mmap(us)", "total", "ebs", "pages", "pool",
+	       "mmap", "reads", "locate", "tpm", "alloc(K)", "pt(us)", "ptpg");
+	fflush(stdout);
+
+	for (int i = 0; i < nr_sizes; i++) {
+		pid_t pid = fork();
+		int status;
+
+		if (pid < 0) {
+			perror("fork");
+			return 2;
+		}
+		if (pid == 0)
+			exit(run_one(sizes[i], &opts) ? 1 : 0);
+
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%llu bytes: FAILED\n",
+				(unsigned long long)sizes[i]);
+			failed++;
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+ * hostbench.c（宿主机的头文件）与platform.c（DragonStub的头文件）之间的接口，
+ * 因此这里只使用基本类型。
+ */
+
+/// @brief 一次启动的结果
+struct hostbench_result {
+	unsigned long long status;
+	/// @brief 内核被加载到的地址和大小
+	unsigned long long loaded_paddr;
+	unsigned long long loaded_size;
+	/// @brief 交给内核的FDT
+	unsigned long long fdt_addr;
+	unsigned long long fdt_size;
+	/// @brief 各阶段的耗时（纳秒），来自启动时间戳表
+	unsigned long long find_payload_ns;
+	unsigned long long load_ns;
+	unsigned long long fdt_ns;
+	unsigned long long memmap_ns;
+	unsigned long long ebs_ns;
+	unsigned long long pgtable_ns;
+	/// @brief 从efi_stub_common()开始到跳转到内核的总耗时
+	unsigned long long total_ns;
+	unsigned int ebs_attempts;
+	/// @brief efi=mmu时stub建立的页表用掉的页数
+	unsigned int pgtable_pages;
+};
+
+/**
+ * hostbench_make_fdt() - 生成一个类似真实机器的FDT，作为固件提供的DTB
+ * @nr_devices:	/soc下的设备节点数量
+ *
+ * Return:	0表示成功，否则是libfdt的错误码
+ */
+int hostbench_make_fdt(void *buf, int size, int nr_devices);
+
+/// @brief 最多生成的overlay数量，与DragonStub的EFI_DTBO_MAX相同
+#define HOSTBENCH_MAX_OVERLAYS 64
+
+/**
+ * hostbench_make_dtbo() - 生成第@k个设备树overlay，像dtc -@生成的那样
+ *
+ * 它给第8 * @k + 3个设备（有phandle，并在/__symbols__中有标签）加上
+ * overlay-id，并增加一个带标签的子节点。子节点引用这个设备、自己以及
+ * 前一个overlay增加的子节点，分别要通过__fixups__、__local_fixups__和
+ * 前一个overlay合并进来的标签解析。
+ * Return:	overlay的大小，负数是libfdt的错误码
+ */
+int hostbench_make_dtbo(void *buf, int size, int k);
+
+/**
+ * hostbench_boot() - 模拟efi_main()，从寻找负载一直运行到跳转到内核
+ * @cmdline:	命令行，其中的kernel=选项表示从模拟的启动卷上加载内核
+ * @payload:	没有kernel=选项时，内存中的负载（ELF或者LZ4 frame）
+ * @digest:	相当于编译时嵌入的各个段的SHA-256，NULL表示不校验
+ * @inplace_align:	不为0表示@payload是按make PAYLOAD_INPLACE=1的方式
+ *			放在映像末尾的
+ */
+void hostbench_boot(const char *cmdline, const void *payload,
+		    unsigned long long size, const unsigned char *digest,
+		    unsigned long long inplace_align,
+		    struct hostbench_result *res);
+
+/// @brief 启动之后，配置表中记录的PT_LOAD段的数量和第@i个段被加载到的地址
+unsigned int hostbench_nr_segments(void);
+unsigned long long hostbench_segment_paddr(unsigned int i);
+
+/**
+ * hostbench_check_pgtable() - 按stub建立的页表（efi=mmu）检查各种映射
+ *
+ * 内核的每一页、内核入口，以及FDT的恒等映射和线性映射都要翻译到正确的地址。
+ * Return:	NULL表示正确，否则是错误的描述
+ */
+const char *hostbench_check_pgtable(void);
+
+/**
+ * hostbench_check_memmap() - 对照交给内核的UEFI内存映射检查紧凑内存映射
+ *
+ * 各项要按地址排好、互不重叠，每个原始的描述符都要被类型和属性相同的一项
+ * 覆盖，两者的总页数也要相同。
+ * Return:	NULL表示正确，否则是错误的描述
+ */
+const char *hostbench_check_memmap(unsigned int *nr_raw,
+				   unsigned int *nr_entries);
+
+/**
+ * hostbench_check_fdt() - 检查交给内核的FDT
+ *
+ * 内存保留表要被清空，/chosen中要有@cmdline和stub设置的属性，
+ * 固件DTB中原有的属性和@nr_devices个设备节点也都要在。@prune为真时
+ * （efi=fdtprune fdtprune=/soc/device@10000000），被禁用且不再被引用的设备、
+ * 第一个设备以及指向它们的别名要被删除，其余的都要保留。
+ * 前@nr_overlays个overlay的内容要合并进来，其中的引用都要指向正确的节点。
+ * Return:	NULL表示正确，否则是错误的描述
+ */
+const char *hostbench_check_fdt(const char *cmdline, int nr_devices,
+				bool prune, int nr_overlays);
+
+/**
+ * hostbench_check_crc() - 对照逐位计算的CRC32检查gnu-efi库的CalculateCrc()
+ * 和UpdateCrc()
+ *
+ * 覆盖各种长度、起始地址的对齐以及分两次计算的情况，先用查表的实现，
+ * 再用CPU支持的扩展。@nr_cases返回检查的次数，@ext返回使用的扩展。
+ * Return:	NULL表示正确，否则是错误的描述
+ */
+const char *hostbench_check_crc(unsigned int *nr_cases, unsigned int *ext);
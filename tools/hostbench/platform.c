@@ -0,0 +1,733 @@
+#include <dragonstub/dragonstub.h>
+#include <dragonstub/lz4.h>
+#include <libfdt.h>
+#include <lib.h>
+#include "hostbench.h"
+
+/*
+ * 在宿主机上代替riscv-stub.c中与架构相关的函数，以及需要DragonStub的类型
+ * 才能完成的工作（这个文件和apps/下的代码使用相同的编译选项）。
+ */
+
+extern EFI_LOADED_IMAGE mock_loaded_image;
+extern EFI_HANDLE mock_image_handle;
+extern unsigned long long mock_now_ns(void);
+
+/* efi_enter_kernel()通过它回到hostbench_boot() */
+static void *kernel_jmp[5];
+static unsigned long kernel_fdt, kernel_fdt_size, kernel_entry;
+
+efi_status_t check_platform_features(void)
+{
+	return EFI_SUCCESS;
+}
+
+u64 efi_arch_read_timestamp(void)
+{
+	return mock_now_ns();
+}
+
+/* 模拟内存的"物理地址"是宿主机上的用户态地址（低于2^47），只有Sv48能恒等映射 */
+u32 efi_arch_pgtable_levels(void)
+{
+	return 4;
+}
+
+/* 辅助核是模拟固件中的线程，编号从1开始（0是启动核） */
+extern unsigned int mock_secondary_cpus(void);
+extern bool mock_cpu_start(void (*fn)(void *), void *arg);
+extern void mock_cpu_relax(void);
+
+u32 efi_arch_smp_harts(u64 *hartids, u32 max)
+{
+	u32 nr = min(mock_secondary_cpus(), max);
+
+	for (u32 i = 0; i < nr; i++)
+		hartids[i] = i + 1;
+	return nr;
+}
+
+static void smp_secondary(void *arg)
+{
+	struct efi_smp_worker *worker = arg;
+
+	efi_smp_worker_main(worker);
+	__atomic_store_n(&worker->parked, 1, __ATOMIC_RELEASE);
+}
+
+efi_status_t efi_arch_smp_start(struct efi_smp_worker *worker)
+{
+	return mock_cpu_start(smp_secondary, worker) ? EFI_SUCCESS :
+							EFI_DEVICE_ERROR;
+}
+
+bool efi_arch_smp_parked(struct efi_smp_worker *worker)
+{
+	return __atomic_load_n(&worker->parked, __ATOMIC_ACQUIRE);
+}
+
+/* 宿主机上的核可能比模拟的核少，等待时让出CPU */
+void efi_arch_cpu_relax(void)
+{
+	mock_cpu_relax();
+}
+
+void __noreturn efi_enter_kernel(struct payload_info *payload_info,
+				 unsigned long fdt, unsigned long fdt_size)
+{
+	kernel_fdt = fdt;
+	kernel_fdt_size = fdt_size;
+	kernel_entry = payload_info->kernel_entry;
+	__builtin_longjmp(kernel_jmp, 1);
+}
+
+/// @brief 写出一个u32属性（fdt_sw）
+static int sw_u32(void *fdt, const char *name, u32 val)
+{
+	fdt32_t v = cpu_to_fdt32(val);
+
+	return fdt_property(fdt, name, &v, sizeof(v));
+}
+
+/// @brief 写出reg = <addr size>（各两个cell）
+static int sw_reg(void *fdt, u64 addr, u64 size)
+{
+	fdt64_t reg[2] = { cpu_to_fdt64(addr), cpu_to_fdt64(size) };
+
+	return fdt_property(fdt, "reg", reg, sizeof(reg));
+}
+
+/// @brief 第@i个设备节点的路径
+static void device_path(char *buf, size_t size, int i)
+{
+	snprintf(buf, size, "/soc/device@%llx", 0x10000000 + (u64)i * 0x1000);
+}
+
+/// @brief 被禁用、但仍然被下一个设备的dmas引用的设备的phandle
+static u32 device_phandle(int i)
+{
+	return 0x100 + i;
+}
+
+/// @brief efi=fdtprune应当删除第@i个设备（共@nr_devices个）
+static bool device_pruned(int i, int nr_devices)
+{
+	if (i % 8 == 7)
+		return true;
+	return i % 8 == 3 && i + 1 >= nr_devices;
+}
+
+/// @brief 第@i个设备不应出现在交给内核的FDT中，第一个设备由fdtprune=删除
+static bool device_skipped(int i, int nr_devices, bool prune)
+{
+	return prune && (i == 0 || device_pruned(i, nr_devices));
+}
+
+int hostbench_make_fdt(void *buf, int size, int nr_devices)
+{
+	/*
+	 * 每4个设备中有一个像板级DTS中常见的那样被禁用，其中一半还被下一个
+	 * 设备的dmas引用着
+	 */
+	static const char *const status[] = { "okay", "okay", "okay",
+					      "disabled" };
+	static const char *const aliases[] = { "serial0", NULL, NULL,
+					       "ethernet3", NULL, NULL,
+					       NULL, "disk7" };
+	static const char clock_names[] = "apb\0core";
+	char name[32];
+	fdt32_t clocks[2], dmas[2];
+	int err, i;
+
+	/* 用顺序写入的接口生成，很大的树也只需要线性的时间 */
+	err = fdt_create(buf, size);
+	err = err ?: fdt_add_reservemap_entry(buf, 0x80000000, 0x200000);
+	err = err ?: fdt_finish_reservemap(buf);
+	err = err ?: fdt_begin_node(buf, "");
+	err = err ?: sw_u32(buf, "#address-cells", 2);
+	err = err ?: sw_u32(buf, "#size-cells", 2);
+	err = err ?: fdt_property_string(buf, "compatible", "riscv-virtio");
+	err = err ?: fdt_property_string(buf, "model", "riscv-virtio,qemu");
+
+	err = err ?: fdt_begin_node(buf, "chosen");
+	err = err ?: fdt_property_string(buf, "stdout-path",
+					 "/soc/serial@10000000");
+	/* 像U-Boot那样在/chosen中放一个子节点，stub的属性不能写在它之后 */
+	err = err ?: fdt_begin_node(buf, "framebuffer@0");
+	err = err ?: fdt_property_string(buf, "compatible",
+					 "simple-framebuffer");
+	err = err ?: sw_reg(buf, 0x88000000, 0x300000);
+	err = err ?: fdt_end_node(buf);
+	/* 被禁用的子节点，efi=fdtprune要删除它，同时保留/chosen的属性 */
+	err = err ?: fdt_begin_node(buf, "framebuffer@1");
+	err = err ?: fdt_property_string(buf, "compatible",
+					 "simple-framebuffer");
+	err = err ?: sw_reg(buf, 0x88300000, 0x300000);
+	err = err ?: fdt_property_string(buf, "status", "disabled");
+	err = err ?: fdt_end_node(buf);
+	err = err ?: fdt_end_node(buf);
+
+	err = err ?: fdt_begin_node(buf, "aliases");
+	for (i = 0; i < nr_devices && i < 8; i++) {
+		if (!aliases[i])
+			continue;
+		device_path(name, sizeof(name), i);
+		err = err ?: fdt_property_string(buf, aliases[i], name);
+	}
+	err = err ?: fdt_end_node(buf);
+
+	err = err ?: fdt_begin_node(buf, "memory@80000000");
+	err = err ?: fdt_property_string(buf, "device_type", "memory");
+	err = err ?: sw_reg(buf, 0x80000000, 0x80000000);
+	err = err ?: fdt_end_node(buf);
+
+	err = err ?: fdt_begin_node(buf, "cpus");
+	/* 与efi_arch_read_timestamp()一致，时间戳的单位是纳秒 */
+	err = err ?: sw_u32(buf, "timebase-frequency", 1000000000);
+	err = err ?: fdt_end_node(buf);
+
+	err = err ?: fdt_begin_node(buf, "soc");
+	err = err ?: fdt_property_string(buf, "compatible", "simple-bus");
+	err = err ?: fdt_property(buf, "ranges", NULL, 0);
+	err = err ?: fdt_begin_node(buf, "interrupt-controller@c000000");
+	err = err ?: fdt_property(buf, "interrupt-controller", NULL, 0);
+	err = err ?: sw_u32(buf, "#interrupt-cells", 1);
+	err = err ?: sw_u32(buf, "phandle", 2);
+	err = err ?: fdt_end_node(buf);
+	err = err ?: fdt_begin_node(buf, "clock-controller@1000");
+	err = err ?: sw_u32(buf, "#clock-cells", 1);
+	err = err ?: sw_u32(buf, "phandle", 1);
+	err = err ?: fdt_end_node(buf);
+	if (err)
+		return err;
+
+	for (i = 0; i < nr_devices; i++) {
+		u64 addr = 0x10000000 + (u64)i * 0x1000;
+
+		snprintf(name, sizeof(name), "device@%llx", addr);
+		clocks[0] = cpu_to_fdt32(1);
+		clocks[1] = cpu_to_fdt32(i);
+
+		err = fdt_begin_node(buf, name);
+		err = err ?: fdt_property_string(buf, "compatible",
+						 "virtio,mmio");
+		err = err ?: sw_reg(buf, addr, 0x1000);
+		err = err ?: sw_u32(buf, "interrupts", i + 1);
+		err = err ?: sw_u32(buf, "interrupt-parent", 2);
+		err = err ?: fdt_property(buf, "clocks", clocks,
+					  sizeof(clocks));
+		err = err ?: fdt_property(buf, "clock-names", clock_names,
+					  sizeof(clock_names));
+		err = err ?: fdt_property_string(buf, "status", status[i % 4]);
+		if (i % 8 == 3)
+			err = err ?: sw_u32(buf, "phandle", device_phandle(i));
+		if (i % 8 == 4) {
+			dmas[0] = cpu_to_fdt32(device_phandle(i - 1));
+			dmas[1] = cpu_to_fdt32(0);
+			err = err ?: fdt_property(buf, "dmas", dmas,
+						  sizeof(dmas));
+		}
+		err = err ?: fdt_end_node(buf);
+		if (err)
+			return err;
+	}
+
+	err = fdt_end_node(buf);	/* soc */
+
+	/*
+	 * 像dtc -@那样给有phandle的设备加上标签，overlay通过它们引用设备。
+	 * 只给overlay会用到的设备加，免得fdt_sw的字符串表太大
+	 */
+	err = err ?: fdt_begin_node(buf, "__symbols__");
+	for (i = 3; i < nr_devices && i < 8 * HOSTBENCH_MAX_OVERLAYS; i += 8) {
+		char label[16];
+
+		snprintf(label, sizeof(label), "dev%d", i);
+		device_path(name, sizeof(name), i);
+		err = err ?: fdt_property_string(buf, label, name);
+	}
+	err = err ?: fdt_end_node(buf);
+
+	err = err ?: fdt_end_node(buf);	/* / */
+	return err ?: fdt_finish(buf);
+}
+
+int hostbench_make_dtbo(void *buf, int size, int k)
+{
+	char node[32], path[64], label[16], fixup[128];
+	int err, len;
+
+	snprintf(node, sizeof(node), "overlay@%x", k);
+	snprintf(path, sizeof(path), "/fragment@0/__overlay__/%s", node);
+
+	err = fdt_create(buf, size);
+	err = err ?: fdt_finish_reservemap(buf);
+	err = err ?: fdt_begin_node(buf, "");
+
+	err = err ?: fdt_begin_node(buf, "fragment@0");
+	err = err ?: sw_u32(buf, "target", 0xffffffff);
+	err = err ?: fdt_begin_node(buf, "__overlay__");
+	err = err ?: sw_u32(buf, "overlay-id", k);
+	err = err ?: fdt_begin_node(buf, node);
+	err = err ?: fdt_property_string(buf, "compatible",
+					 "hostbench,overlay");
+	err = err ?: sw_u32(buf, "ref", 0xffffffff);
+	err = err ?: sw_u32(buf, "self", 1);
+	if (k)
+		err = err ?: sw_u32(buf, "prev", 0xffffffff);
+	err = err ?: sw_u32(buf, "phandle", 1);
+	err = err ?: fdt_end_node(buf);	/* overlay@k */
+	err = err ?: fdt_end_node(buf);	/* __overlay__ */
+	err = err ?: fdt_end_node(buf);	/* fragment@0 */
+
+	err = err ?: fdt_begin_node(buf, "__symbols__");
+	snprintf(label, sizeof(label), "ovl%d", k);
+	err = err ?: fdt_property_string(buf, label, path);
+	err = err ?: fdt_end_node(buf);
+
+	/* 对同一个标签的多处引用以\0分隔，每一处是“路径:属性:偏移” */
+	err = err ?: fdt_begin_node(buf, "__fixups__");
+	snprintf(label, sizeof(label), "dev%d", 8 * k + 3);
+	len = snprintf(fixup, sizeof(fixup), "/fragment@0:target:0");
+	len += snprintf(fixup + len + 1, sizeof(fixup) - len - 1, "%s:ref:0",
+			path) + 1;
+	err = err ?: fdt_property(buf, label, fixup, len + 1);
+	if (k) {
+		snprintf(label, sizeof(label), "ovl%d", k - 1);
+		snprintf(fixup, sizeof(fixup), "%s:prev:0", path);
+		err = err ?: fdt_property_string(buf, label, fixup);
+	}
+	err = err ?: fdt_end_node(buf);
+
+	err = err ?: fdt_begin_node(buf, "__local_fixups__");
+	err = err ?: fdt_begin_node(buf, "fragment@0");
+	err = err ?: fdt_begin_node(buf, "__overlay__");
+	err = err ?: fdt_begin_node(buf, node);
+	err = err ?: sw_u32(buf, "self", 0);
+	err = err ?: fdt_end_node(buf);
+	err = err ?: fdt_end_node(buf);
+	err = err ?: fdt_end_node(buf);
+	err = err ?: fdt_end_node(buf);
+
+	err = err ?: fdt_end_node(buf);	/* / */
+	err = err ?: fdt_finish(buf);
+	return err ?: (int)fdt_totalsize(buf);
+}
+
+static u64 phase_ns(struct dragonstub_boot_timestamps *ts,
+		    enum dragonstub_boot_phase phase)
+{
+	return ts->phases[phase].end - ts->phases[phase].start;
+}
+
+void hostbench_boot(const char *cmdline, const void *payload,
+		    unsigned long long size, const unsigned char *digest,
+		    unsigned long long inplace_align,
+		    struct hostbench_result *res)
+{
+	/* __builtin_longjmp回来之后，局部变量的值不可靠 */
+	static struct payload_info info;
+	static struct hostbench_result *result;
+	static char *cmdline_ptr;
+	static u64 start;
+	struct dragonstub_boot_timestamps *ts;
+
+	memset(&info, 0, sizeof(info));
+	memset(res, 0, sizeof(*res));
+	result = res;
+	cmdline_ptr = (char *)cmdline;
+
+	/* efi_main()在寻找负载之前就解析了命令行中的选项 */
+	res->status = efi_parse_options(cmdline);
+	if (res->status != EFI_SUCCESS)
+		return;
+
+	if (strstr(cmdline, "kernel=")) {
+		boot_ts_begin(DRAGONSTUB_PHASE_FIND_PAYLOAD);
+		res->status = find_payload(mock_image_handle, &mock_loaded_image,
+					   cmdline, &info);
+		boot_ts_end(DRAGONSTUB_PHASE_FIND_PAYLOAD);
+		if (res->status != EFI_SUCCESS)
+			return;
+	} else {
+		info.payload_addr = (u64)payload;
+		info.payload_size = size;
+		info.payload_type = lz4_frame_check(payload, size) ?
+					    PAYLOAD_TYPE_LZ4 :
+					    PAYLOAD_TYPE_ELF;
+	}
+	info.digest = digest;
+	info.inplace_align = inplace_align;
+
+	start = efi_arch_read_timestamp();
+	if (__builtin_setjmp(kernel_jmp) == 0) {
+		/* 只有失败的时候才会返回 */
+		result->status = efi_stub_common(mock_image_handle,
+						 &mock_loaded_image, &info,
+						 cmdline_ptr);
+		return;
+	}
+
+	res = result;
+	res->total_ns = efi_arch_read_timestamp() - start;
+	res->status = EFI_SUCCESS;
+	res->loaded_paddr = info.loaded_paddr;
+	res->loaded_size = info.loaded_size;
+	res->fdt_addr = kernel_fdt;
+	res->fdt_size = kernel_fdt_size;
+
+	ts = boot_ts_table();
+	if (!ts)
+		return;
+	res->find_payload_ns = phase_ns(ts, DRAGONSTUB_PHASE_FIND_PAYLOAD);
+	res->load_ns = phase_ns(ts, DRAGONSTUB_PHASE_LOAD_ELF);
+	res->fdt_ns = phase_ns(ts, DRAGONSTUB_PHASE_FDT);
+	res->memmap_ns = phase_ns(ts, DRAGONSTUB_PHASE_GET_MEMORY_MAP);
+	res->ebs_ns = phase_ns(ts, DRAGONSTUB_PHASE_EXIT_BOOT_SERVICES);
+	res->pgtable_ns = phase_ns(ts, DRAGONSTUB_PHASE_PGTABLE);
+	res->ebs_attempts = ts->ebs_attempts;
+	if (efi_pgtable())
+		res->pgtable_pages = efi_pgtable()->nr_pages;
+}
+
+/// @brief stub安装的DRAGONSTUB_EFI_PAYLOAD_EFI_GUID配置表
+static struct dragonstub_payload_efi *payload_table(void)
+{
+	return get_efi_config_table(DRAGONSTUB_EFI_PAYLOAD_EFI_GUID);
+}
+
+unsigned int hostbench_nr_segments(void)
+{
+	struct dragonstub_payload_efi *tbl = payload_table();
+
+	return tbl ? tbl->nr_segments : 0;
+}
+
+unsigned long long hostbench_segment_paddr(unsigned int i)
+{
+	return payload_table()->segments[i].paddr;
+}
+
+/// @brief 按@pt翻译@vaddr，没有映射时返回~0
+static u64 translate(const struct dragonstub_pgtable *pt, u64 vaddr)
+{
+	const u64 *table = (const u64 *)pt->root;
+
+	for (int l = pt->levels - 1; l >= 0; l--) {
+		u64 shift = 12 + 9 * l;
+		u64 pte = table[(vaddr >> shift) & 511];
+		u64 paddr = (pte >> 10) << 12;
+
+		if (!(pte & 1))
+			break;
+		/* R、W、X中有一位被设置就是叶子 */
+		if (pte & 0xe)
+			return paddr + (vaddr & ((1ULL << shift) - 1));
+		table = (const u64 *)paddr;
+	}
+	return ~0ULL;
+}
+
+const char *hostbench_check_pgtable(void)
+{
+	const struct dragonstub_pgtable *pt = efi_pgtable();
+	const struct dragonstub_payload_efi *tbl = payload_table();
+
+	if (!pt)
+		return "no page tables";
+	if (pt != get_efi_config_table(DRAGONSTUB_EFI_PGTABLE_GUID))
+		return "page table configuration table not installed";
+	if (!(pt->flags & DRAGONSTUB_PGTABLE_RUNTIME))
+		return "EFI runtime regions not mapped";
+
+	for (u32 i = 0; i < tbl->nr_segments; i++) {
+		const struct dragonstub_payload_segment *seg = &tbl->segments[i];
+
+		for (u64 off = 0; off < seg->size; off += 4096) {
+			if (translate(pt, seg->vaddr + off) != seg->paddr + off)
+				return "kernel segment mapped at the wrong address";
+		}
+		if (translate(pt, seg->vaddr + seg->size - 1) !=
+		    seg->paddr + seg->size - 1)
+			return "kernel segment mapped at the wrong address";
+	}
+	if (translate(pt, pt->kernel_entry) != kernel_entry)
+		return "wrong kernel entry";
+	if (translate(pt, kernel_fdt) != kernel_fdt)
+		return "FDT not identity mapped";
+	if (translate(pt, pt->linear_virt + kernel_fdt - pt->linear_phys) !=
+	    kernel_fdt)
+		return "FDT not in the linear map";
+	return NULL;
+}
+
+/// @brief 读取/chosen中的一个u64或u32属性，没有时返回0
+static u64 chosen_prop(const void *fdt, const char *name)
+{
+	int node = fdt_subnode_offset(fdt, 0, "chosen");
+	int len;
+	const void *prop;
+
+	if (node < 0)
+		return 0;
+	prop = fdt_getprop(fdt, node, name, &len);
+	if (len == sizeof(fdt64_t))
+		return fdt64_to_cpu(*(const fdt64_t *)prop);
+	if (len == sizeof(fdt32_t))
+		return fdt32_to_cpu(*(const fdt32_t *)prop);
+	return 0;
+}
+
+/// @brief @e中是否完整包含原始的描述符@md
+static bool memmap_covers(const struct dragonstub_memmap_entry *e,
+			  const efi_memory_desc_t *md)
+{
+	u64 end = e->phys_start + e->num_pages * EFI_PAGE_SIZE;
+
+	if (e->type != md->Type || e->attribute != md->Attribute ||
+	    md->PhysicalStart < e->phys_start ||
+	    md->PhysicalStart + md->NumberOfPages * EFI_PAGE_SIZE > end)
+		return false;
+	return !(md->Attribute & EFI_MEMORY_RUNTIME) ||
+	       md->VirtualStart - md->PhysicalStart ==
+		       e->virt_start - e->phys_start;
+}
+
+const char *hostbench_check_memmap(unsigned int *nr_raw,
+				   unsigned int *nr_entries)
+{
+	const void *fdt = (const void *)kernel_fdt;
+	const struct dragonstub_memmap *tbl = efi_compact_memmap();
+	u64 map = chosen_prop(fdt, "linux,uefi-mmap-start");
+	u64 map_size = chosen_prop(fdt, "linux,uefi-mmap-size");
+	u64 desc_size = chosen_prop(fdt, "linux,uefi-mmap-desc-size");
+	u64 raw_pages = 0, pages = 0;
+
+	if (!tbl)
+		return "no compact memory map";
+	if (tbl != get_efi_config_table(DRAGONSTUB_EFI_MEMMAP_GUID))
+		return "compact memory map configuration table not installed";
+	if (chosen_prop(fdt, "dragonstub,memmap") != (u64)(unsigned long)tbl)
+		return "dragonstub,memmap does not point to the table";
+	if (!map || !desc_size || tbl->nr_raw != map_size / desc_size)
+		return "wrong number of raw descriptors";
+	if (!tbl->nr_entries || tbl->nr_entries > tbl->nr_raw ||
+	    tbl->entry_size != sizeof(tbl->entries[0]))
+		return "compact memory map not built";
+
+	for (u32 i = 0; i < tbl->nr_entries; i++) {
+		const struct dragonstub_memmap_entry *e = &tbl->entries[i];
+
+		pages += e->num_pages;
+		if (i && e->phys_start < tbl->entries[i - 1].phys_start +
+						 tbl->entries[i - 1].num_pages *
+							 EFI_PAGE_SIZE)
+			return "entries unsorted or overlapping";
+	}
+
+	/* 每个原始的描述符都要落在某一项中，二分查找包含它的那一项 */
+	for (u64 off = 0; off < map_size; off += desc_size) {
+		const efi_memory_desc_t *md = (const void *)(map + off);
+		u32 lo = 0, hi = tbl->nr_entries;
+
+		raw_pages += md->NumberOfPages;
+		while (hi - lo > 1) {
+			u32 mid = (lo + hi) / 2;
+
+			if (tbl->entries[mid].phys_start <= md->PhysicalStart)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		if (!memmap_covers(&tbl->entries[lo], md))
+			return "raw descriptor not covered by a matching entry";
+	}
+	if (pages != raw_pages)
+		return "compact memory map covers a different number of pages";
+
+	*nr_raw = tbl->nr_raw;
+	*nr_entries = tbl->nr_entries;
+	return NULL;
+}
+
+/**
+ * check_overlay() - 检查第@k个overlay合并到设备节点@node中的内容
+ * @symbols:	/__symbols__的偏移
+ * @base_max:	固件DTB中最大的phandle，第@k个overlay的节点的phandle在它之后
+ */
+static const char *check_overlay(const void *fdt, int node, int symbols,
+				 int k, u32 base_max)
+{
+	u32 phandle = base_max + k + 1;
+	const fdt32_t *val;
+	const char *sym;
+	char name[32], path[64], label[16];
+	int sub;
+
+	val = fdt_getprop(fdt, node, "overlay-id", NULL);
+	if (!val || fdt32_to_cpu(*val) != (u32)k)
+		return "overlay property not merged into its target";
+	snprintf(name, sizeof(name), "overlay@%x", k);
+	sub = fdt_subnode_offset(fdt, node, name);
+	if (sub < 0)
+		return "overlay node not added to its target";
+	if (fdt_get_phandle(fdt, sub) != phandle)
+		return "overlay phandle not renumbered";
+	val = fdt_getprop(fdt, sub, "self", NULL);
+	if (!val || fdt32_to_cpu(*val) != phandle)
+		return "local fixup not applied";
+	val = fdt_getprop(fdt, sub, "ref", NULL);
+	if (!val || fdt32_to_cpu(*val) != device_phandle(8 * k + 3))
+		return "fixup to the base tree not applied";
+	val = fdt_getprop(fdt, sub, "prev", NULL);
+	if (k && (!val || fdt32_to_cpu(*val) != phandle - 1))
+		return "fixup to the previous overlay not applied";
+
+	device_path(path, sizeof(path), 8 * k + 3);
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s",
+		 name);
+	snprintf(label, sizeof(label), "ovl%d", k);
+	sym = fdt_getprop(fdt, symbols, label, NULL);
+	if (!sym || strcmp(sym, path))
+		return "overlay label not added to /__symbols__";
+	return NULL;
+}
+
+const char *hostbench_check_fdt(const char *cmdline, int nr_devices,
+				bool prune, int nr_overlays)
+{
+	const void *fdt = (const void *)kernel_fdt;
+	const char *bootargs, *err;
+	int node, symbols, n = 0, i = 0;
+	char path[32];
+	u32 base_max = 2;
+
+	if (fdt_check_header(fdt) || fdt_totalsize(fdt) != kernel_fdt_size)
+		return "bad header";
+	if (fdt_num_mem_rsv(fdt) != 0)
+		return "memory reserve map not emptied";
+
+	node = fdt_path_offset(fdt, "/chosen");
+	bootargs = fdt_getprop(fdt, node, "bootargs", NULL);
+	if (node < 0 || !bootargs || strcmp(bootargs, cmdline))
+		return "wrong bootargs";
+	if (!fdt_getprop(fdt, node, "stdout-path", NULL) ||
+	    fdt_subnode_offset(fdt, node, "framebuffer@0") < 0)
+		return "firmware /chosen properties lost";
+	if ((fdt_subnode_offset(fdt, node, "framebuffer@1") >= 0) == prune)
+		return "disabled /chosen subnode not pruned";
+	if (chosen_prop(fdt, "linux,uefi-system-table") != (u64)(unsigned long)ST)
+		return "wrong linux,uefi-system-table";
+
+	/* 有phandle的设备中最后一个是第(nr_devices - 4) / 8 * 8 + 3个 */
+	if (nr_devices > 3)
+		base_max = device_phandle((nr_devices - 4) / 8 * 8 + 3);
+	symbols = fdt_path_offset(fdt, "/__symbols__");
+
+	/*
+	 * 两个控制器之后是没有被删除的设备，按原来的顺序排列。被禁用但还被
+	 * 下一个设备的dmas引用着的设备（i % 8 == 3）必须保留，前@nr_overlays
+	 * 个这样的设备各自合并了一个overlay
+	 */
+	node = fdt_path_offset(fdt, "/soc");
+	for (node = fdt_first_subnode(fdt, node); node >= 0;
+	     node = fdt_next_subnode(fdt, node)) {
+		if (n++ < 2)
+			continue;
+		while (i < nr_devices && device_skipped(i, nr_devices, prune))
+			i++;
+		if (i == nr_devices)
+			return "wrong number of device nodes";
+		device_path(path, sizeof(path), i);
+		if (strcmp(fdt_get_name(fdt, node, NULL),
+			   path + strlen("/soc/")))
+			return "wrong device nodes pruned";
+		if (i % 8 == 3 && i / 8 < nr_overlays) {
+			err = check_overlay(fdt, node, symbols, i / 8,
+					    base_max);
+			if (err)
+				return err;
+		}
+		i++;
+	}
+	while (i < nr_devices && device_skipped(i, nr_devices, prune))
+		i++;
+	if (i != nr_devices)
+		return "wrong number of device nodes";
+
+	if (!prune)
+		return NULL;
+	node = fdt_path_offset(fdt, "/aliases");
+	if (node < 0 || fdt_getprop(fdt, node, "serial0", NULL) ||
+	    fdt_getprop(fdt, node, "disk7", NULL))
+		return "aliases of pruned nodes not removed";
+	if (nr_devices > 4 && !fdt_getprop(fdt, node, "ethernet3", NULL))
+		return "alias of a kept node removed";
+	return NULL;
+}
+
+/* 逐位计算的CRC32，作为检查CalculateCrc()和UpdateCrc()的参照 */
+static u32 crc32_bitwise(u32 crc, const u8 *p, size_t size)
+{
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/* 一次算完和分成两次算（第一次的长度覆盖各种余数）都要与参照相同 */
+static const char *check_crc_one(const u8 *p, u32 size,
+				 unsigned int *nr_cases)
+{
+	u32 want = crc32_bitwise(0, p, size), crc;
+
+	if (CalculateCrc((u8 *)p, size) != want)
+		return "CalculateCrc() is wrong";
+	++*nr_cases;
+	for (u32 split = 1; split < size; split = split * 3 + 2) {
+		crc = UpdateCrc(0, p, split);
+		crc = UpdateCrc(crc, p + split, size - split);
+		if (crc != want)
+			return "UpdateCrc() is wrong";
+		++*nr_cases;
+	}
+	return NULL;
+}
+
+#define CRC_CHECK_MAX 8192
+
+const char *hostbench_check_crc(unsigned int *nr_cases, unsigned int *ext)
+{
+	static const u32 sizes[] = { 0,   1,   7,   8,   15,   16,
+				     17,  63,  64,  255, 256,  257,
+				     300, 1000, 4096, CRC_CHECK_MAX - 1 };
+	static u8 buf[CRC_CHECK_MAX + 16];
+	UINTN exts[2] = { 0, LibGetCrcExtensions() };
+	const char *err;
+	u32 seed = 1;
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	*nr_cases = 0;
+	*ext = exts[1];
+	// 先用查表的实现，再用CPU支持的扩展（如果有的话）
+	for (int e = 0; e < (exts[1] ? 2 : 1); e++) {
+		LibSetCrcExtensions(exts[e]);
+		for (u32 off = 0; off < 16; off++) {
+			for (size_t i = 0;
+			     i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+				err = check_crc_one(buf + off, sizes[i],
+						    nr_cases);
+				if (err)
+					return err;
+			}
+		}
+	}
+	return NULL;
+}
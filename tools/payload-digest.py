@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+#
+# 计算ELF文件头、程序头表和各个PT_LOAD段的文件内容（按程序头表的顺序）
+# 拼接在一起的SHA-256，也就是DragonStub加载内核时一边复制各个段一边计算的
+# 那个摘要。文件头和程序头表决定了入口和各个段被加载到哪里，所以也要校验。
+#
+#   payload-digest.py kernel.elf payload.sha256     写入32字节的二进制摘要
+#   payload-digest.py kernel.elf                    打印十六进制的摘要
+#   payload-digest.py --event kernel.elf            打印TPM事件日志中SHA-256 bank的
+#                                                   摘要（DragonStub度量的是这个摘要本身）
+#
+# apps/Makefile把输出的文件链接到DragonStub中（PAYLOAD_VERIFY=1）。
+# PAYLOAD_INPLACE=1时程序头被payload-inplace.py改写过，要对它输出的
+# payload.inplace计算摘要。
+
+import hashlib
+import struct
+import sys
+
+PT_LOAD = 1
+PN_XNUM = 0xFFFF
+EHDR_SIZE = 64
+
+
+def segments_digest(data):
+    if data[:4] != b"\x7fELF" or data[4] != 2 or data[5] != 1:
+        raise ValueError("not a little-endian ELF64 file")
+
+    (phoff, shoff) = struct.unpack_from("<QQ", data, 0x20)
+    (phentsize, phnum) = struct.unpack_from("<HH", data, 0x36)
+    if phnum == PN_XNUM:
+        # 真正的程序头数量在第0个节头的sh_info中
+        (phnum,) = struct.unpack_from("<I", data, shoff + 0x2C)
+
+    if phoff + phnum * phentsize > len(data):
+        raise ValueError("program header table is out of range")
+
+    sha = hashlib.sha256()
+    sha.update(data[:EHDR_SIZE])
+    sha.update(data[phoff:phoff + phnum * phentsize])
+    loaded = 0
+    for i in range(phnum):
+        (p_type, _, p_offset, _, _, p_filesz) = struct.unpack_from(
+            "<IIQQQQ", data, phoff + i * phentsize)
+        if p_type != PT_LOAD or p_filesz == 0:
+            continue
+        if p_offset + p_filesz > len(data):
+            raise ValueError("segment %d is out of range" % i)
+        sha.update(data[p_offset:p_offset + p_filesz])
+        loaded += p_filesz
+
+    if loaded == 0:
+        raise ValueError("no PT_LOAD segment")
+    return sha.digest()
+
+
+def main():
+    args = sys.argv[1:]
+    event = bool(args) and args[0] == "--event"
+    if event:
+        args = args[1:]
+    if len(args) not in (1, 2) or (event and len(args) != 1):
+        sys.exit("usage: %s [--event] <elf> [output]" % sys.argv[0])
+
+    with open(args[0], "rb") as f:
+        data = f.read()
+    try:
+        digest = segments_digest(data)
+    except (ValueError, struct.error) as e:
+        sys.exit("%s: %s" % (args[0], e))
+
+    if event:
+        print(hashlib.sha256(digest).hexdigest())
+    elif len(args) == 2:
+        with open(args[1], "wb") as f:
+            f.write(digest)
+    else:
+        print(digest.hex())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#
+# 把ELF文件重新排布成可以原地执行的负载（apps/Makefile中的PAYLOAD_INPLACE=1）。
+#
+#   payload-inplace.py --align 2M kernel.elf payload.inplace payload_inplace.S
+#
+# 输出的payload.inplace仍然是一个ELF文件：ELF文件头和程序头表之后紧跟着
+# 各个PT_LOAD段按内存布局（p_paddr - 最小的p_paddr）排好的内容，段之间的空隙
+# 和段内的BSS填0，最后补齐到页的整数倍。程序头中的p_offset被改写为段在这个
+# 文件中的位置，节头表被丢弃。
+#
+# payload_inplace.S把它放到.payload节中，并在前面填充，使段的内容正好从
+# --align对齐的地址开始。链接脚本把.payload放在DragonStub映像的末尾，
+# DragonStub被加载到满足对齐的地址时，内核可以直接在原地运行，只需要在映像
+# 之后分配并清零剩下的BSS。
+
+import struct
+import sys
+
+PT_LOAD = 1
+PN_XNUM = 0xFFFF
+PAGE_SIZE = 4096
+EHDR_SIZE = 64
+
+
+def parse_size(s):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    s = s.strip().upper()
+    if s and s[-1] in units:
+        return int(s[:-1], 0) * units[s[-1]]
+    return int(s, 0)
+
+
+def align_up(x, a):
+    return (x + a - 1) & ~(a - 1)
+
+
+def layout(data, align):
+    if data[:4] != b"\x7fELF" or data[4] != 2 or data[5] != 1:
+        raise ValueError("not a little-endian ELF64 file")
+
+    (phoff,) = struct.unpack_from("<Q", data, 0x20)
+    (phentsize, phnum) = struct.unpack_from("<HH", data, 0x36)
+    if phnum == PN_XNUM:
+        raise ValueError("too many program headers (PN_XNUM)")
+
+    phdrs = [list(struct.unpack_from("<IIQQQQQQ", data, phoff + i * phentsize))
+             for i in range(phnum)]
+    loads = [p for p in phdrs if p[0] == PT_LOAD]
+    if not loads:
+        raise ValueError("no PT_LOAD segment")
+
+    # p_type, p_flags, p_offset, p_vaddr, p_paddr, p_filesz, p_memsz, p_align
+    min_paddr = min(p[4] for p in loads)
+    file_end = 0
+    for p in sorted(loads, key=lambda p: p[4]):
+        if p[5] > p[6]:
+            raise ValueError("segment at %#x: p_filesz > p_memsz" % p[4])
+        if p[2] + p[5] > len(data):
+            raise ValueError("segment at %#x is out of range" % p[4])
+        if p[4] - min_paddr < file_end and p[5]:
+            raise ValueError("segment at %#x overlaps the previous one" % p[4])
+        if p[5]:
+            file_end = p[4] - min_paddr + p[5]
+
+    hdr_size = align_up(EHDR_SIZE + phnum * phentsize, 8)
+    image = bytearray(align_up(file_end, PAGE_SIZE))
+    for p in loads:
+        dst = p[4] - min_paddr
+        image[dst:dst + p[5]] = data[p[2]:p[2] + p[5]]
+
+    # 其他类型的段（PT_NOTE等）如果落在某个PT_LOAD段的文件内容中，就跟着它移动
+    old = [p[:] for p in phdrs]
+    for p in phdrs:
+        if p[0] == PT_LOAD:
+            p[2] = hdr_size + p[4] - min_paddr
+            continue
+        owner = next((o for o in old if o[0] == PT_LOAD and
+                      o[2] <= p[2] and p[2] + p[5] <= o[2] + o[5]), None)
+        if owner:
+            p[2] = hdr_size + owner[4] - min_paddr + (p[2] - owner[2])
+        else:
+            p[2] = p[5] = 0
+
+    ehdr = bytearray(data[:EHDR_SIZE])
+    struct.pack_into("<QQ", ehdr, 0x20, EHDR_SIZE, 0)   # e_phoff, e_shoff
+    struct.pack_into("<HH", ehdr, 0x3C, 0, 0)           # e_shnum, e_shstrndx
+    out = bytearray(ehdr)
+    for p in phdrs:
+        entry = struct.pack("<IIQQQQQQ", *p)
+        out += entry + bytes(phentsize - len(entry))
+    out += bytes(hdr_size - len(out))
+
+    # 段的内容之前需要填充的字节数，使它正好落在对齐的地址上
+    skip = align_up(hdr_size, align) - hdr_size
+    return out + image, skip
+
+
+def main():
+    args = sys.argv[1:]
+    align = 2 << 20
+    if len(args) >= 2 and args[0] == "--align":
+        align = parse_size(args[1])
+        args = args[2:]
+    if len(args) != 3 or align < PAGE_SIZE or align & (align - 1):
+        sys.exit("usage: %s [--align 4K|2M] <elf> <output> <output.S>"
+                 % sys.argv[0])
+
+    with open(args[0], "rb") as f:
+        data = f.read()
+    try:
+        payload, skip = layout(data, align)
+    except (ValueError, struct.error) as e:
+        sys.exit("%s: %s" % (args[0], e))
+
+    with open(args[1], "wb") as f:
+        f.write(payload)
+    with open(args[2], "w") as f:
+        f.write("/* 由tools/payload-inplace.py生成，不要手动修改 */\n"
+                "\t.section .rodata\n"
+                "\t.balign 8\n"
+                "\t.globl _binary_payload_inplace_align\n"
+                "_binary_payload_inplace_align:\n"
+                "\t.quad %d\n"
+                "\n"
+                "\t.section .payload, \"a\", @progbits\n"
+                "\t.balign %d\n"
+                "\t.skip %d\n"
+                "\t.globl _binary_payload_start\n"
+                "_binary_payload_start:\n"
+                "\t.incbin \"%s\"\n"
+                "\t.globl _binary_payload_end\n"
+                "_binary_payload_end:\n"
+                % (align, align, skip, args[1]))
+
+
+if __name__ == "__main__":
+    main()
@@ -12,7 +12,8 @@ DISK_NAME="disk-${ARCH}.img"
 
 QEMU=qemu-system-${ARCH}
 QEMU_MEMORY="512M"
-QEMU_SMP="2,cores=2,threads=1,sockets=1"
+# 可以用环境变量覆盖，例如QEMU_SMP=4测试efi=smp
+QEMU_SMP=${QEMU_SMP:="2,cores=2,threads=1,sockets=1"}
 QEMU_ACCELARATE=""
 QEMU_DISK_IMAGE="../output/${DISK_NAME}"
 QEMU_DRIVE="-drive id=disk,file=${QEMU_DISK_IMAGE},if=none"